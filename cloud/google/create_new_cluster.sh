@@ -38,7 +38,7 @@ function PopulateEtcdForLog() {
       --command "\
     ${PUT} ${ETCD}/v2/keys/root/serving_sth && \
     ${PUT} ${ETCD}/v2/keys/root/cluster_config && \
-    ${PUT} ${ETCD}/v2/keys/root/sequence_mapping && \
+    ${PUT} ${ETCD}/v2/keys/root/sequence_mapping/ -d dir=true && \
     ${PUT} ${ETCD}/v2/keys/root/entries/ -d dir=true && \
     ${PUT} ${ETCD}/v2/keys/root/nodes/ -d dir=true"
 
@@ -3,15 +3,20 @@
 
 #include "log/cluster_state_controller.h"
 
+#include <chrono>
 #include <functional>
+#include <gflags/gflags.h>
 #include <stdint.h>
 
 #include "fetcher/peer.h"
 #include "log/database.h"
 #include "log/etcd_consistent_store.h"
+#include "log/merge_delay_tracker.h"
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
+#include "util/util.h"
 
+DECLARE_int32(cluster_state_coalesce_ms);
 
 namespace cert_trans {
 
@@ -99,7 +104,9 @@ ClusterStateController<Logged>::ClusterStateController(
       watch_config_task_(CHECK_NOTNULL(executor)),
       watch_node_states_task_(CHECK_NOTNULL(executor)),
       watch_serving_sth_task_(CHECK_NOTNULL(executor)),
+      merge_delay_tracker_(nullptr),
       exiting_(false),
+      calculation_required_(false),
       update_required_(false),
       cluster_serving_sth_update_thread_(
           std::bind(&ClusterStateController<Logged>::ClusterServingSTHUpdater,
@@ -140,10 +147,12 @@ ClusterStateController<Logged>::~ClusterStateController() {
 template <class Logged>
 void ClusterStateController<Logged>::NewTreeHead(
     const ct::SignedTreeHead& sth) {
-  std::unique_lock<std::mutex> lock(mutex_);
+  // The database does its own locking, no need to hold ours while
+  // reading from it.
   ct::SignedTreeHead db_sth;
   const typename Database<Logged>::LookupResult result(
       database_->LatestTreeHead(&db_sth));
+  std::unique_lock<std::mutex> lock(mutex_);
 
   const bool serving_sth_newer_than_db_sth(
       actual_serving_sth_ &&
@@ -221,6 +230,14 @@ void ClusterStateController<Logged>::RefreshNodeState() {
 }
 
 
+template <class Logged>
+void ClusterStateController<Logged>::SetMergeDelayTracker(
+    MergeDelayTracker* tracker) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  merge_delay_tracker_ = CHECK_NOTNULL(tracker);
+}
+
+
 template <class Logged>
 bool ClusterStateController<Logged>::NodeIsStale() const {
   std::lock_guard<std::mutex> lock(mutex_);
@@ -286,6 +303,7 @@ void ClusterStateController<Logged>::OnClusterStateUpdated(
         it = all_peers_.end();
       }
 
+      serving_sth_calculator_.SetNode(node_id, update.handle_.Entry());
       if (it != all_peers_.end()) {
         it->second->UpdateClusterNodeState(update.handle_.Entry());
       } else {
@@ -302,11 +320,12 @@ void ClusterStateController<Logged>::OnClusterStateUpdated(
     } else {
       VLOG(1) << "Node left: " << node_id;
       CHECK_EQ(static_cast<size_t>(1), all_peers_.erase(node_id));
+      serving_sth_calculator_.RemoveNode(node_id);
       fetcher_->RemovePeer(node_id);
     }
   }
 
-  CalculateServingSTH(lock);
+  ScheduleCalculateServingSTH(lock);
 }
 
 
@@ -325,7 +344,7 @@ void ClusterStateController<Logged>::OnClusterConfigUpdated(
 
   // May need to re-calculate the servingSTH since the ClusterConfig has
   // changed:
-  CalculateServingSTH(lock);
+  ScheduleCalculateServingSTH(lock);
 }
 
 
@@ -352,6 +371,10 @@ void ClusterStateController<Logged>::OnServingSthUpdated(
               << actual_serving_sth_->ShortDebugString();
     serving_tree_size->Set(actual_serving_sth_->tree_size());
     serving_tree_timestamp->Set(actual_serving_sth_->timestamp());
+    if (merge_delay_tracker_) {
+      merge_delay_tracker_->TreeServed(actual_serving_sth_->tree_size(),
+                                       util::TimeInMilliseconds());
+    }
 
     // Double check this STH is newer than, or idential to, what we have in
     // the database. (It definitely should be!)
@@ -408,78 +431,42 @@ void ClusterStateController<Logged>::OnServingSthUpdated(
 }
 
 
+template <class Logged>
+void ClusterStateController<Logged>::ScheduleCalculateServingSTH(
+    const std::unique_lock<std::mutex>& lock) {
+  CHECK(lock.owns_lock());
+  calculation_required_ = true;
+  update_required_cv_.notify_all();
+}
+
+
 template <class Logged>
 void ClusterStateController<Logged>::CalculateServingSTH(
     const std::unique_lock<std::mutex>& lock) {
   VLOG(1) << "Calculating new ServingSTH...";
   CHECK(lock.owns_lock());
+  CHECK_EQ(static_cast<size_t>(serving_sth_calculator_.NumNodes()),
+           all_peers_.size());
 
-  // First, create a mapping of tree size to number of nodes at that size, and
-  // a mapping of the newst STH for any given size:
-  std::map<int64_t, ct::SignedTreeHead> sth_by_size;
-  std::map<int64_t, int> num_nodes_by_sth_size;
-  for (const auto& node : all_peers_) {
-    const ct::ClusterNodeState node_state(node.second->state());
-    if (node_state.has_newest_sth()) {
-      const int64_t tree_size(node_state.newest_sth().tree_size());
-      CHECK_LE(0, tree_size);
-      const int64_t timestamp(node_state.newest_sth().timestamp());
-      CHECK_LE(0, timestamp);
-
-      num_nodes_by_sth_size[tree_size]++;
-
-      // Default timestamp (first call in here) will be 0
-      if (node_state.newest_sth().timestamp() >
-          sth_by_size[tree_size].timestamp()) {
-        sth_by_size[tree_size] = node_state.newest_sth();
-      }
-    }
-  }
-
-  // Next calculate the newest STH we've seen which satisfies the following
-  // criteria:
+  // The newest STH we've seen which satisfies the following criteria:
   //   - at least minimum_serving_nodes have an STH at least as large
   //   - at least minimum_serving_fraction have an STH at least as large
   //   - not smaller than the current serving STH
   //   - has a timestamp higher than the current serving STH
-  int num_nodes_seen(0);
-  const int current_tree_size(
+  const int64_t current_tree_size(
       calculated_serving_sth_ ? calculated_serving_sth_->tree_size() : 0);
-  CHECK_LE(0, current_tree_size);
-
-  bool candidates_include_current(false);
-  // Work backwards (from largest STH size) until we see that there's enough
-  // coverage (according to the criteria above) to serve an STH (or determine
-  // that there are insufficient nodes to serve anything.)
-  for (auto it = num_nodes_by_sth_size.rbegin();
-       it != num_nodes_by_sth_size.rend() && it->first >= current_tree_size;
-       ++it) {
-    // num_nodes_seen keeps track of the number of nodes we've seen so far (and
-    // since we're working from larger to smaller size STH, they should all be
-    // able to serve this [and smaller] STHs.)
-    num_nodes_seen += it->second;
-    const double serving_fraction(static_cast<double>(num_nodes_seen) /
-                                  all_peers_.size());
-    if (serving_fraction >= cluster_config_.minimum_serving_fraction() &&
-        num_nodes_seen >= cluster_config_.minimum_serving_nodes()) {
-      const ct::SignedTreeHead& candidate_sth(sth_by_size[it->first]);
-
-      // This STH isn't a viable candidate unless its timestamp is strictly
-      // newer than any current serving STH:
-      if (actual_serving_sth_ &&
-          candidate_sth.timestamp() <= actual_serving_sth_->timestamp()) {
-        VLOG(1) << "Discarding candidate STH:\n" << candidate_sth.DebugString()
-                << "\nbecause its timestamp is <= current serving STH "
-                << "timestamp (" << actual_serving_sth_->timestamp() << ")";
-        candidates_include_current |= candidate_sth.SerializeAsString() ==
-                                      actual_serving_sth_->SerializeAsString();
-        continue;
-      }
-
-      LOG(INFO) << "Can serve @" << it->first << " with " << num_nodes_seen
-                << " nodes (" << (serving_fraction * 100) << "% of cluster)";
-      calculated_serving_sth_.reset(
-          new ct::SignedTreeHead(sth_by_size[it->first]));
+  ct::SignedTreeHead sth;
+  int num_nodes(0);
+  switch (serving_sth_calculator_.Calculate(cluster_config_,
+                                            current_tree_size,
+                                            actual_serving_sth_.get(), &sth,
+                                            &num_nodes)) {
+    case ServingSTHCalculator::NEW_STH:
+      LOG(INFO) << "Can serve @" << sth.tree_size() << " with " << num_nodes
+                << " nodes ("
+                << (100.0 * num_nodes / serving_sth_calculator_.NumNodes())
+                << "% of cluster)";
+      calculated_serving_sth_.reset(new ct::SignedTreeHead(sth));
       // Push this STH out to the cluster if we're master:
       if (election_->IsMaster()) {
         VLOG(1) << "Pushing new STH out to cluster";
@@ -488,15 +475,15 @@ void ClusterStateController<Logged>::CalculateServingSTH(
       } else {
         VLOG(1) << "Not pushing new STH to cluster since we're not the master";
       }
-      return;
-    }
-  }
-  // TODO(alcutter): Add a mechanism to take the cluster off-line until we have
-  // sufficient nodes able to serve.
-  if (!candidates_include_current) {
-    LOG(WARNING) << "Failed to determine suitable serving STH.";
-  } else {
-    VLOG(1) << "Continuing to serve previous STH.";
+      break;
+    case ServingSTHCalculator::SERVING_STH:
+      VLOG(1) << "Continuing to serve previous STH.";
+      break;
+    case ServingSTHCalculator::NO_STH:
+      // TODO(alcutter): Add a mechanism to take the cluster off-line until
+      // we have sufficient nodes able to serve.
+      LOG(WARNING) << "Failed to determine suitable serving STH.";
+      break;
   }
 }
 
@@ -508,14 +495,27 @@ void ClusterStateController<Logged>::ClusterServingSTHUpdater() {
     VLOG(1) << "ClusterServingSTHUpdater going again.";
     std::unique_lock<std::mutex> lock(mutex_);
     update_required_cv_.wait(lock, [this]() {
-      return update_required_ || exiting_;
+      return calculation_required_ || update_required_ || exiting_;
     });
     VLOG(1) << "ClusterServingSTHUpdater got ping.";
+    if (calculation_required_ && !exiting_) {
+      // Let a burst of node state changes (e.g. all the nodes
+      // refreshing at around the same time) pile up.
+      update_required_cv_.wait_for(
+          lock, std::chrono::milliseconds(FLAGS_cluster_state_coalesce_ms),
+          [this]() { return exiting_; });
+      calculation_required_ = false;
+      if (!exiting_) {
+        CalculateServingSTH(lock);
+      }
+    }
     if (exiting_) {
       VLOG(1) << "ClusterServingSTHUpdater thread returning.";
       return;
     }
-    CHECK(update_required_);
+    if (!update_required_) {
+      continue;
+    }
     CHECK_NOTNULL(calculated_serving_sth_.get());
     const ct::SignedTreeHead local_sth(*calculated_serving_sth_);
 
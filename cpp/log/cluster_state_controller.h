@@ -10,6 +10,7 @@
 
 #include "fetcher/continuous_fetcher.h"
 #include "log/etcd_consistent_store.h"
+#include "log/serving_sth_calculator.h"
 #include "proto/ct.pb.h"
 #include "util/libevent_wrapper.h"
 #include "util/masterelection.h"
@@ -20,6 +21,7 @@ class Database;
 
 namespace cert_trans {
 
+class MergeDelayTracker;
 
 // A class which updates & maintains the states of the individual cluster
 // member nodes, and uses this information to determine the overall serving
@@ -62,6 +64,9 @@ class ClusterStateController {
 
   void RefreshNodeState();
 
+  // Reports every new serving STH to "tracker".
+  void SetMergeDelayTracker(MergeDelayTracker* tracker);
+
   bool NodeIsStale() const;
 
   // Returns a vector of the other nodes in the cluster which are able to serve
@@ -76,7 +81,9 @@ class ClusterStateController {
   void PushLocalNodeState(const std::unique_lock<std::mutex>& lock);
 
   // Entry point for the watcher callback.
-  // Called whenever a node changes its node state.
+  // Called whenever a node changes its node state. The serving STH is
+  // recalculated later, on the serving STH updater thread, along with
+  // other changes arriving within --cluster_state_coalesce_ms.
   void OnClusterStateUpdated(
       const std::vector<Update<ct::ClusterNodeState>>& updates);
 
@@ -88,6 +95,9 @@ class ClusterStateController {
   // Called whenever the ClusterConfig is changed.
   void OnServingSthUpdated(const Update<ct::SignedTreeHead>& update);
 
+  // Has the serving STH updater thread call CalculateServingSTH().
+  void ScheduleCalculateServingSTH(const std::unique_lock<std::mutex>& lock);
+
   // Calculates the STH which should be served by the cluster, given the
   // current state of the nodes.
   // If this node is the cluster master then the calculated serving STH is
@@ -116,9 +126,12 @@ class ClusterStateController {
   mutable std::mutex mutex_;  // covers the members below:
   ct::ClusterNodeState local_node_state_;
   std::map<std::string, const std::shared_ptr<ClusterPeer>> all_peers_;
+  ServingSTHCalculator serving_sth_calculator_;
   std::unique_ptr<ct::SignedTreeHead> calculated_serving_sth_;
   std::unique_ptr<ct::SignedTreeHead> actual_serving_sth_;
+  MergeDelayTracker* merge_delay_tracker_;
   bool exiting_;
+  bool calculation_required_;
   bool update_required_;
   std::condition_variable update_required_cv_;
   std::thread cluster_serving_sth_update_thread_;
@@ -1,6 +1,13 @@
+#include <gflags/gflags.h>
+
 #include "log/cluster_state_controller-inl.h"
 #include "log/logged_certificate.h"
 
+DEFINE_int32(cluster_state_coalesce_ms, 100,
+             "Number of milliseconds to wait for more cluster node state "
+             "changes before recalculating the serving STH, so that bursts "
+             "of them only cause one recalculation.");
+
 namespace cert_trans {
 template class ClusterStateController<LoggedCertificate>;
 }  // namespace cert_trans
@@ -1,7 +1,9 @@
 #ifndef CERT_TRANS_LOG_CONSISTENT_STORE_H_
 #define CERT_TRANS_LOG_CONSISTENT_STORE_H_
 
+#include <glog/logging.h>
 #include <stdint.h>
+#include <memory>
 #include <mutex>
 #include <vector>
 
@@ -17,6 +19,8 @@ namespace cert_trans {
 
 template <class Logged>
 class EtcdConsistentStore;
+template <class Logged>
+class LocalConsistentStore;
 
 
 // Wraps an instance of |T| and associates it with a versioning handle
@@ -86,6 +90,8 @@ class EntryHandle {
 
   template <class Logged>
   friend class EtcdConsistentStore;
+  template <class Logged>
+  friend class LocalConsistentStore;
   friend class EtcdConsistentStoreTest;
 };
 
@@ -103,6 +109,26 @@ struct Update {
 };
 
 
+// Whether two entries with the same hash really are for the same
+// certificate (they might have been submitted with different chains.)
+template <class Logged>
+bool LeafEntriesMatch(const Logged& a, const Logged& b) {
+  CHECK_EQ(a.entry().type(), b.entry().type());
+  switch (a.entry().type()) {
+    case ct::X509_ENTRY:
+      return a.entry().x509_entry().leaf_certificate() ==
+             b.entry().x509_entry().leaf_certificate();
+    case ct::PRECERT_ENTRY:
+      return a.entry().precert_entry().pre_certificate() ==
+             b.entry().precert_entry().pre_certificate();
+    case ct::UNKNOWN_ENTRY_TYPE:
+      // Handle it below.
+      break;
+  }
+  LOG(FATAL) << "Encountered UNKNOWN_ENTRY_TYPE:\n" << a.entry().DebugString();
+}
+
+
 template <class Logged>
 class ConsistentStore {
  public:
@@ -125,12 +151,36 @@ class ConsistentStore {
 
   virtual util::Status AddPendingEntry(Logged* entry) = 0;
 
+  // Asynchronous version of the above, |entry| must remain valid
+  // until |task| is done. Implementations may coalesce concurrent
+  // calls into batches.
+  virtual void AddPendingEntry(Logged* entry, util::Task* task) {
+    task->Return(AddPendingEntry(entry));
+  }
+
   virtual util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<Logged>* entry) const = 0;
 
   virtual util::Status GetPendingEntries(
       std::vector<EntryHandle<Logged>>* entries) const = 0;
 
+  // Like GetPendingEntries(), but the entries may be shared with the
+  // store instead of being copied, so they cannot be modified. This
+  // version copies them.
+  virtual util::Status GetSharedPendingEntries(
+      std::vector<std::shared_ptr<const EntryHandle<Logged>>>* entries)
+      const {
+    CHECK_NOTNULL(entries);
+    std::vector<EntryHandle<Logged>> copies;
+    const util::Status status(GetPendingEntries(&copies));
+    entries->reserve(entries->size() + copies.size());
+    for (auto& copy : copies) {
+      entries->emplace_back(
+          std::make_shared<const EntryHandle<Logged>>(std::move(copy)));
+    }
+    return status;
+  }
+
   virtual util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const = 0;
 
@@ -158,6 +208,13 @@ class ConsistentStore {
   // the error.
   virtual util::StatusOr<int64_t> CleanupOldEntries() = 0;
 
+  // Called periodically on nodes which are not the master, so that
+  // whatever only the sequencer needs (e.g. a cache of the pending
+  // entries) is ready if they take over. Should be cheap when there
+  // is nothing to do.
+  virtual void PrepareToSequence() {
+  }
+
  private:
   DISALLOW_COPY_AND_ASSIGN(ConsistentStore);
 };
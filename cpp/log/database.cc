@@ -1,8 +1,148 @@
 #include "log/database.h"
 
+#include <algorithm>
+#include <gflags/gflags.h>
+
+DEFINE_bool(db_intern_chain_certs, false,
+            "Store each distinct chain certificate only once in the "
+            "database, with entries referring to it by hash. Entries "
+            "written either way can always be read back.");
+DEFINE_int32(db_hash_filter_bits_per_entry, 10,
+             "bits per entry of the in-memory filter used to skip lookups "
+             "of hashes that are not in the database (about 1% of false "
+             "positives with 10 bits), 0 to disable it");
+DEFINE_int32(db_io_threads, 4,
+             "number of threads each database uses for its asynchronous "
+             "lookups");
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
 namespace cert_trans {
 
 
+DatabaseIOExecutor::DatabaseIOExecutor()
+    : shutting_down_(false), num_outstanding_(0) {
+}
+
+
+DatabaseIOExecutor::~DatabaseIOExecutor() {
+  CHECK(!pool_) << "database destroyed without calling ShutdownIO()";
+}
+
+
+void DatabaseIOExecutor::Add(const std::function<void()>& closure) {
+  ThreadPool* pool;
+  {
+    lock_guard<mutex> lock(lock_);
+    CHECK(!shutting_down_.load()) << "database used after ShutdownIO()";
+    if (!pool_) {
+      CHECK_GT(FLAGS_db_io_threads, 0);
+      pool_.reset(new ThreadPool(FLAGS_db_io_threads));
+    }
+    ++num_outstanding_;
+    // The pool stays around at least until this closure has run.
+    pool = pool_.get();
+  }
+
+  pool->Add(std::bind(&DatabaseIOExecutor::Run, this, closure));
+}
+
+
+void DatabaseIOExecutor::Shutdown() {
+  std::unique_ptr<ThreadPool> pool;
+  {
+    std::unique_lock<mutex> lock(lock_);
+    shutting_down_.store(true);
+    idle_.wait(lock, [this]() { return num_outstanding_ == 0; });
+    pool = std::move(pool_);
+  }
+  // The threads are joined outside of the lock, as they might still
+  // be on their way out of Run().
+}
+
+
+void DatabaseIOExecutor::Run(const std::function<void()>& closure) {
+  closure();
+
+  lock_guard<mutex> lock(lock_);
+  CHECK_GT(num_outstanding_, 0);
+  if (--num_outstanding_ == 0) {
+    idle_.notify_all();
+  }
+}
+
+
+namespace {
+
+
+// The filter is sized with some headroom, as it gets less accurate
+// when it holds more entries than it was sized for.
+const int64_t kMinHashFilterEntries = 1 << 20;
+
+
+}  // namespace
+
+
+EntryHashFilter::EntryHashFilter()
+    : build_started_(false),
+      ready_(false),
+      filter_(nullptr),
+      num_inserted_(0) {
+}
+
+
+bool EntryHashFilter::enabled() const {
+  return FLAGS_db_hash_filter_bits_per_entry > 0;
+}
+
+
+bool EntryHashFilter::StartBuild() {
+  return !build_started_.exchange(true);
+}
+
+
+void EntryHashFilter::Init(int64_t num_entries) {
+  CHECK(!filter_.load());
+  filter_storage_.reset(
+      new BloomFilter(std::max(kMinHashFilterEntries, 2 * num_entries),
+                      FLAGS_db_hash_filter_bits_per_entry));
+  filter_.store(filter_storage_.get());
+}
+
+
+void EntryHashFilter::MarkReady() {
+  CHECK(filter_.load());
+  LOG(INFO) << "Entry hash filter ready with " << num_inserted_.load()
+            << " entries";
+  ready_.store(true);
+}
+
+
+void EntryHashFilter::Insert(const string& hash) {
+  BloomFilter* const filter(filter_.load());
+  if (!filter) {
+    return;
+  }
+
+  filter->Insert(hash);
+  if (static_cast<size_t>(++num_inserted_) == filter->num_keys()) {
+    LOG(WARNING) << "Entry hash filter is now over capacity, and will get "
+                 << "less accurate until the next restart";
+  }
+}
+
+
+bool EntryHashFilter::MayContain(const string& hash) const {
+  if (!ready_.load()) {
+    return true;
+  }
+
+  return filter_.load()->MayContain(hash);
+}
+
+
 DatabaseNotifierHelper::~DatabaseNotifierHelper() {
   CHECK(callbacks_.empty());
 }
@@ -29,4 +169,29 @@ void DatabaseNotifierHelper::Call(const ct::SignedTreeHead& sth) const {
 }
 
 
+bool ChainCertCache::Contains(const string& hash) const {
+  lock_guard<mutex> lock(lock_);
+  return certs_.find(hash) != certs_.end();
+}
+
+
+bool ChainCertCache::Lookup(const string& hash, string* cert) const {
+  CHECK_NOTNULL(cert);
+  lock_guard<mutex> lock(lock_);
+  const auto it(certs_.find(hash));
+  if (it == certs_.end()) {
+    return false;
+  }
+
+  *cert = it->second;
+  return true;
+}
+
+
+void ChainCertCache::Insert(const string& hash, const string& cert) {
+  lock_guard<mutex> lock(lock_);
+  certs_.insert(std::make_pair(hash, cert));
+}
+
+
 }  // namespace cert_trans
@@ -2,14 +2,24 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <glog/logging.h>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "base/macros.h"
 #include "proto/ct.pb.h"
+#include "util/bloom_filter.h"
+#include "util/status.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
 
 // The |Logged| class needs to provide this interface:
 // class Logged {
@@ -41,6 +51,13 @@
 //   // clients would hash over).
 //   bool SerializeForLeaf(std::string *dst) const;
 //
+//   // Move the certificate chain out of the entry (keyed by SHA-256
+//   // hash), leaving references behind, and put it back. Databases
+//   // use this to store each distinct chain certificate only once.
+//   void InternChain(std::map<std::string, std::string>* chain_certs);
+//   bool RestoreChain(
+//       const std::function<bool(const std::string&, std::string*)>&);
+//
 //   // Debugging.
 //   std::string DebugString() const;
 //
@@ -58,6 +75,87 @@
 // exhibit this behavour the mirror must permit it too.
 
 
+namespace cert_trans {
+
+
+// Runs the asynchronous operations of a database on a fixed number of
+// threads of its own, so that slow disk reads do not hold up the
+// threads of the caller. The threads are only started on first use.
+//
+// The operations call virtual methods of the database, so the
+// database implementation has to call Shutdown() before it goes away,
+// the base class destructor is too late.
+class DatabaseIOExecutor {
+ public:
+  DatabaseIOExecutor();
+  ~DatabaseIOExecutor();
+
+  // It is an error to add more work once Shutdown() has been called.
+  void Add(const std::function<void()>& closure);
+
+  // Whether Shutdown() has been called. Work that has not started
+  // yet (or takes long) should give up when this is true.
+  bool shutting_down() const {
+    return shutting_down_.load();
+  }
+
+  // Waits for all the work added to be done, and stops the threads.
+  void Shutdown();
+
+ private:
+  void Run(const std::function<void()>& closure);
+
+  std::atomic<bool> shutting_down_;
+  std::mutex lock_;
+  std::condition_variable idle_;
+  int64_t num_outstanding_;
+  std::unique_ptr<ThreadPool> pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(DatabaseIOExecutor);
+};
+
+
+// An in-memory filter over the hashes of the entries of a database,
+// used to answer most lookups of hashes that are not in the database
+// without going to storage. It is built in the background from a scan
+// of the database, and until it is ready, every hash "may" be
+// present. This class is thread-safe.
+class EntryHashFilter {
+ public:
+  EntryHashFilter();
+
+  // Whether the filter is enabled with --db_hash_filter_bits_per_entry.
+  bool enabled() const;
+
+  // Returns true only the first time it is called, to the caller that
+  // should build the filter.
+  bool StartBuild();
+
+  // Allocates the filter for the database's current size. Hashes can
+  // be inserted from then on, and the filter is ready once
+  // MarkReady() is called.
+  void Init(int64_t num_entries);
+  void MarkReady();
+
+  void Insert(const std::string& hash);
+
+  // Returns false only if there is definitely no such entry.
+  bool MayContain(const std::string& hash) const;
+
+ private:
+  std::atomic<bool> build_started_;
+  std::atomic<bool> ready_;
+  std::unique_ptr<BloomFilter> filter_storage_;
+  std::atomic<BloomFilter*> filter_;
+  std::atomic<int64_t> num_inserted_;
+
+  DISALLOW_COPY_AND_ASSIGN(EntryHashFilter);
+};
+
+
+}  // namespace cert_trans
+
+
 template <class Logged>
 class ReadOnlyDatabase {
  public:
@@ -92,12 +190,35 @@ class ReadOnlyDatabase {
   virtual LookupResult LookupByIndex(int64_t sequence_number,
                                      Logged* result) const = 0;
 
+  // Returns false if there is definitely no entry with this hash,
+  // answered from memory, so that LookupByHash() can be skipped. The
+  // first call starts building the filter in the background, on the
+  // I/O threads (so that destroying the database stops it), and until
+  // it is ready (or if it is disabled), this always returns true.
+  bool MayContainHash(const std::string& hash) const;
+
   // Return the tree head with the freshest timestamp.
   virtual LookupResult LatestTreeHead(ct::SignedTreeHead* result) const = 0;
 
   // Scan the entries, starting with the given index.
   virtual std::unique_ptr<Iterator> ScanEntries(int64_t start_index) const = 0;
 
+  // Asynchronous versions of the above, run on the database's own I/O
+  // threads. The "task" is returned once "result" is filled in, with
+  // util::error::NOT_FOUND if there is no such entry. The caller
+  // keeps ownership of the task, and the task's executor runs the
+  // done callback. Operations which have not started by the time the
+  // database is destroyed are returned with util::error::CANCELLED.
+  void AsyncLookupByHash(const std::string& hash, Logged* result,
+                         util::Task* task) const;
+  void AsyncLookupByIndex(int64_t sequence_number, Logged* result,
+                          util::Task* task) const;
+
+  // Fetches the entries from "start_index" to "end_index" (inclusive)
+  // into "entries", stopping early at the first missing one.
+  void AsyncScanEntries(int64_t start_index, int64_t end_index,
+                        std::vector<Logged>* entries, util::Task* task) const;
+
   // Return the number of entries of contiguous entries (what could be
   // put in a signed tree head). This can be greater than the tree
   // size returned by LatestTreeHead.
@@ -121,11 +242,171 @@ class ReadOnlyDatabase {
  protected:
   ReadOnlyDatabase() = default;
 
+  // Implementations must call this first thing in their destructor:
+  // it waits for the asynchronous operations, which use their virtual
+  // methods, to be done or cancelled.
+  void ShutdownIO() {
+    io_executor_.Shutdown();
+  }
+
+  // Implementations of Database call this when an entry is added.
+  void AddToHashFilter(const std::string& hash) const {
+    hash_filter_.Insert(hash);
+  }
+
  private:
+  void BuildHashFilter() const;
+  void RunLookupByHash(const std::string& hash, Logged* result,
+                       util::Task* task) const;
+  void RunLookupByIndex(int64_t sequence_number, Logged* result,
+                        util::Task* task) const;
+  void RunScanEntries(int64_t start_index, int64_t end_index,
+                      std::vector<Logged>* entries, util::Task* task) const;
+
+  mutable cert_trans::DatabaseIOExecutor io_executor_;
+  mutable cert_trans::EntryHashFilter hash_filter_;
+
   DISALLOW_COPY_AND_ASSIGN(ReadOnlyDatabase);
 };
 
 
+template <class Logged>
+bool ReadOnlyDatabase<Logged>::MayContainHash(const std::string& hash) const {
+  if (!hash_filter_.enabled()) {
+    return true;
+  }
+
+  if (hash_filter_.StartBuild()) {
+    io_executor_.Add(
+        std::bind(&ReadOnlyDatabase<Logged>::BuildHashFilter, this));
+  }
+
+  return hash_filter_.MayContain(hash);
+}
+
+
+template <class Logged>
+void ReadOnlyDatabase<Logged>::BuildHashFilter() const {
+  // The scan can take a while on a large database, so stop if the
+  // database is being destroyed. The filter is then never ready, and
+  // every hash "may" be present, which is always correct.
+  if (io_executor_.shutting_down()) {
+    return;
+  }
+
+  // Entries added from now on are inserted as they are created, and
+  // those added before are all seen by the scan.
+  hash_filter_.Init(TreeSize());
+  std::unique_ptr<Iterator> it(ScanEntries(0));
+  Logged logged;
+  while (it->GetNextEntry(&logged)) {
+    if (io_executor_.shutting_down()) {
+      return;
+    }
+    hash_filter_.Insert(logged.Hash());
+  }
+  hash_filter_.MarkReady();
+}
+
+
+template <class Logged>
+void ReadOnlyDatabase<Logged>::AsyncLookupByHash(const std::string& hash,
+                                                 Logged* result,
+                                                 util::Task* task) const {
+  CHECK_NOTNULL(result);
+  CHECK_NOTNULL(task);
+  io_executor_.Add(
+      std::bind(&ReadOnlyDatabase<Logged>::RunLookupByHash, this, hash,
+                result, task));
+}
+
+
+template <class Logged>
+void ReadOnlyDatabase<Logged>::AsyncLookupByIndex(int64_t sequence_number,
+                                                  Logged* result,
+                                                  util::Task* task) const {
+  CHECK_GE(sequence_number, 0);
+  CHECK_NOTNULL(result);
+  CHECK_NOTNULL(task);
+  io_executor_.Add(
+      std::bind(&ReadOnlyDatabase<Logged>::RunLookupByIndex, this,
+                sequence_number, result, task));
+}
+
+
+template <class Logged>
+void ReadOnlyDatabase<Logged>::AsyncScanEntries(int64_t start_index,
+                                                int64_t end_index,
+                                                std::vector<Logged>* entries,
+                                                util::Task* task) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  CHECK_NOTNULL(task);
+  io_executor_.Add(
+      std::bind(&ReadOnlyDatabase<Logged>::RunScanEntries, this, start_index,
+                end_index, entries, task));
+}
+
+
+template <class Logged>
+void ReadOnlyDatabase<Logged>::RunLookupByHash(const std::string& hash,
+                                               Logged* result,
+                                               util::Task* task) const {
+  if (task->CancelRequested() || io_executor_.shutting_down()) {
+    task->Return(util::Status::CANCELLED);
+    return;
+  }
+
+  if (LookupByHash(hash, result) != LOOKUP_OK) {
+    task->Return(util::Status(util::error::NOT_FOUND, "entry not found"));
+    return;
+  }
+
+  task->Return();
+}
+
+
+template <class Logged>
+void ReadOnlyDatabase<Logged>::RunLookupByIndex(int64_t sequence_number,
+                                                Logged* result,
+                                                util::Task* task) const {
+  if (task->CancelRequested() || io_executor_.shutting_down()) {
+    task->Return(util::Status::CANCELLED);
+    return;
+  }
+
+  if (LookupByIndex(sequence_number, result) != LOOKUP_OK) {
+    task->Return(util::Status(util::error::NOT_FOUND, "entry not found"));
+    return;
+  }
+
+  task->Return();
+}
+
+
+template <class Logged>
+void ReadOnlyDatabase<Logged>::RunScanEntries(int64_t start_index,
+                                              int64_t end_index,
+                                              std::vector<Logged>* entries,
+                                              util::Task* task) const {
+  if (task->CancelRequested() || io_executor_.shutting_down()) {
+    task->Return(util::Status::CANCELLED);
+    return;
+  }
+
+  std::unique_ptr<Iterator> it(ScanEntries(start_index));
+  for (int64_t i = start_index; i <= end_index; ++i) {
+    Logged logged;
+    if (!it->GetNextEntry(&logged) || logged.sequence_number() != i) {
+      break;
+    }
+    entries->emplace_back(std::move(logged));
+  }
+
+  task->Return();
+}
+
+
 template <class Logged>
 class Database : public ReadOnlyDatabase<Logged> {
  public:
@@ -151,7 +432,11 @@ class Database : public ReadOnlyDatabase<Logged> {
   WriteResult CreateSequencedEntry(const Logged& logged) {
     CHECK(logged.has_sequence_number());
     CHECK_GE(logged.sequence_number(), 0);
-    return CreateSequencedEntry_(logged);
+    const WriteResult result(CreateSequencedEntry_(logged));
+    if (result == OK) {
+      this->AddToHashFilter(logged.Hash());
+    }
+    return result;
   }
 
   // Attempt to write a tree head. Fails only if a tree head with this
@@ -199,6 +484,26 @@ class DatabaseNotifierHelper {
 };
 
 
+// Keeps the chain certificates interned by a database in memory,
+// keyed by their SHA-256 hash. There are only a few hundred distinct
+// intermediates and roots, so they are never evicted. This class is
+// thread-safe.
+class ChainCertCache {
+ public:
+  ChainCertCache() = default;
+
+  bool Contains(const std::string& hash) const;
+  bool Lookup(const std::string& hash, std::string* cert) const;
+  void Insert(const std::string& hash, const std::string& cert);
+
+ private:
+  mutable std::mutex lock_;
+  std::unordered_map<std::string, std::string> certs_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChainCertCache);
+};
+
+
 }  // namespace cert_trans
 
 #endif  // DATABASE_H
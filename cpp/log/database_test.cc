@@ -1,7 +1,11 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <chrono>
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
@@ -11,17 +15,29 @@
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_bool(db_intern_chain_certs);
+DECLARE_bool(leveldb_compress_entries);
+DECLARE_int32(leveldb_compression_dictionary_samples);
+DECLARE_bool(leveldb_retrain_compression_dictionary);
+
 // TODO(benl): Introduce a test |Logged| type.
 
 namespace {
 
 using cert_trans::LoggedCertificate;
+using cert_trans::ThreadPool;
 using ct::SignedTreeHead;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+using util::testing::StatusIs;
 
 
 template <class T>
@@ -54,6 +70,8 @@ class DBTestDeathTest : public DBTest<T> {
 TYPED_TEST_CASE(DBTest, Databases);
 TYPED_TEST_CASE(DBTestDeathTest, Databases);
 
+typedef DBTest<LevelDB<cert_trans::LoggedCertificate>> LevelDBTest;
+
 
 TYPED_TEST(DBTest, CreateSequenced) {
   LoggedCertificate logged_cert, lookup_cert;
@@ -428,6 +446,248 @@ TYPED_TEST(DBTest, Iterator) {
 }
 
 
+TYPED_TEST(DBTest, InternedChain) {
+  FLAGS_db_intern_chain_certs = true;
+  LoggedCertificate logged_cert1, logged_cert2, logged_cert3, lookup_cert;
+  this->test_signer_.CreateUnique(&logged_cert1);
+  logged_cert1.set_sequence_number(0);
+  logged_cert1.mutable_entry()->set_type(ct::X509_ENTRY);
+  logged_cert1.mutable_entry()->clear_precert_entry();
+  ct::X509ChainEntry* const x509_entry(
+      logged_cert1.mutable_entry()->mutable_x509_entry());
+  x509_entry->set_leaf_certificate("leaf");
+  x509_entry->clear_certificate_chain();
+  x509_entry->add_certificate_chain("intermediate");
+  x509_entry->add_certificate_chain("root");
+
+  // Shares the same chain.
+  this->test_signer_.CreateUnique(&logged_cert2);
+  logged_cert2.set_sequence_number(1);
+  logged_cert2.mutable_entry()->CopyFrom(logged_cert1.entry());
+  logged_cert2.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(
+      "another leaf");
+
+  // Written without interning, must still be readable.
+  FLAGS_db_intern_chain_certs = false;
+  this->test_signer_.CreateUnique(&logged_cert3);
+  logged_cert3.set_sequence_number(2);
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert3));
+  FLAGS_db_intern_chain_certs = true;
+
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert1));
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert2));
+  // Writing the same entry again is not a conflict.
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert1));
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert3));
+
+  EXPECT_EQ(DB::LOOKUP_OK,
+            this->db()->LookupByHash(logged_cert2.Hash(), &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(logged_cert2, lookup_cert);
+  EXPECT_EQ(0, lookup_cert.contents().chain_cert_sha256_size());
+
+  lookup_cert.Clear();
+  EXPECT_EQ(DB::LOOKUP_OK, this->db()->LookupByIndex(0, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(logged_cert1, lookup_cert);
+
+  unique_ptr<Database<LoggedCertificate>::Iterator> it(
+      this->db()->ScanEntries(0));
+  LoggedCertificate it_cert;
+  ASSERT_TRUE(it->GetNextEntry(&it_cert));
+  TestSigner::TestEqualLoggedCerts(logged_cert1, it_cert);
+  ASSERT_TRUE(it->GetNextEntry(&it_cert));
+  TestSigner::TestEqualLoggedCerts(logged_cert2, it_cert);
+  ASSERT_TRUE(it->GetNextEntry(&it_cert));
+  TestSigner::TestEqualLoggedCerts(logged_cert3, it_cert);
+  EXPECT_FALSE(it->GetNextEntry(&it_cert));
+  it.reset();
+
+  // The chain certificates must be found again after a restart.
+  unique_ptr<DB> db2(this->test_db_.SecondDB());
+  lookup_cert.Clear();
+  EXPECT_EQ(DB::LOOKUP_OK, db2->LookupByIndex(1, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(logged_cert2, lookup_cert);
+  FLAGS_db_intern_chain_certs = false;
+}
+
+
+TYPED_TEST(DBTest, AsyncLookups) {
+  LoggedCertificate logged_cert0, logged_cert1, lookup_cert;
+  this->test_signer_.CreateUnique(&logged_cert0);
+  logged_cert0.set_sequence_number(0);
+  this->test_signer_.CreateUnique(&logged_cert1);
+  logged_cert1.set_sequence_number(1);
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert0));
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert1));
+
+  ThreadPool pool(1);
+  {
+    SyncTask task(&pool);
+    this->db()->AsyncLookupByHash(logged_cert1.Hash(), &lookup_cert,
+                                  task.task());
+    task.Wait();
+    EXPECT_OK(task.status());
+    TestSigner::TestEqualLoggedCerts(logged_cert1, lookup_cert);
+  }
+  {
+    SyncTask task(&pool);
+    this->db()->AsyncLookupByIndex(0, &lookup_cert, task.task());
+    task.Wait();
+    EXPECT_OK(task.status());
+    TestSigner::TestEqualLoggedCerts(logged_cert0, lookup_cert);
+  }
+  {
+    SyncTask task(&pool);
+    this->db()->AsyncLookupByIndex(2, &lookup_cert, task.task());
+    task.Wait();
+    EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+  }
+  {
+    SyncTask task(&pool);
+    vector<LoggedCertificate> entries;
+    this->db()->AsyncScanEntries(0, 5, &entries, task.task());
+    task.Wait();
+    EXPECT_OK(task.status());
+    ASSERT_EQ(2U, entries.size());
+    TestSigner::TestEqualLoggedCerts(logged_cert0, entries[0]);
+    TestSigner::TestEqualLoggedCerts(logged_cert1, entries[1]);
+  }
+}
+
+
+TYPED_TEST(DBTest, DestroyedWithPendingLookups) {
+  LoggedCertificate logged_cert0, logged_cert1;
+  this->test_signer_.CreateUnique(&logged_cert0);
+  logged_cert0.set_sequence_number(0);
+  this->test_signer_.CreateUnique(&logged_cert1);
+  logged_cert1.set_sequence_number(1);
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert0));
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert1));
+
+  const int kNumLookups(200);
+  ThreadPool pool(1);
+  vector<LoggedCertificate> results(kNumLookups);
+  vector<unique_ptr<SyncTask>> tasks;
+  {
+    unique_ptr<DB> db2(this->test_db_.SecondDB());
+    for (int i = 0; i < kNumLookups; ++i) {
+      tasks.emplace_back(new SyncTask(&pool));
+      db2->AsyncLookupByIndex(i % 2, &results[i], tasks.back()->task());
+    }
+  }
+
+  // Every lookup has either been done, or cancelled.
+  for (int i = 0; i < kNumLookups; ++i) {
+    tasks[i]->Wait();
+    if (tasks[i]->status().ok()) {
+      EXPECT_EQ(i % 2, results[i].sequence_number());
+    } else {
+      EXPECT_THAT(tasks[i]->status(), StatusIs(util::error::CANCELLED));
+    }
+  }
+}
+
+
+TYPED_TEST(DBTest, HashFilter) {
+  LoggedCertificate logged_cert0, logged_cert1;
+  this->test_signer_.CreateUnique(&logged_cert0);
+  logged_cert0.set_sequence_number(0);
+  this->test_signer_.CreateUnique(&logged_cert1);
+  logged_cert1.set_sequence_number(1);
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert0));
+
+  // The filter is built in the background, until then, any hash may
+  // be present.
+  for (int i = 0;
+       i < 500 && this->db()->MayContainHash(logged_cert1.Hash()); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_FALSE(this->db()->MayContainHash(logged_cert1.Hash()));
+  EXPECT_TRUE(this->db()->MayContainHash(logged_cert0.Hash()));
+
+  // New entries are added to the filter as they are created.
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert1));
+  EXPECT_TRUE(this->db()->MayContainHash(logged_cert1.Hash()));
+}
+
+
+TYPED_TEST(DBTest, DestroyedWhileBuildingHashFilter) {
+  for (int i = 0; i < 1000; ++i) {
+    LoggedCertificate logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    logged_cert.set_sequence_number(i);
+    EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_cert));
+  }
+
+  // Start building the filter of a database, and destroy it right
+  // away, while the scan is most likely still running.
+  unique_ptr<DB> db2(this->test_db_.SecondDB());
+  EXPECT_TRUE(db2->MayContainHash(this->test_signer_.UniqueHash()));
+  db2.reset();
+}
+
+
+TEST_F(LevelDBTest, CompressedEntries) {
+  FLAGS_leveldb_compress_entries = true;
+  FLAGS_leveldb_compression_dictionary_samples = 10;
+  // Like real certificates, give the entries a lot in common.
+  const string common_structure(
+      "CN=Example Intermediate CA,O=Example Org,C=US,"
+      "http://crl.example.com/intermediate.crl,"
+      "http://ocsp.example.com,2.23.140.1.2.1");
+  std::vector<LoggedCertificate> logged_certs(30);
+  for (size_t i = 0; i < logged_certs.size(); ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    logged_certs[i].set_sequence_number(i);
+    logged_certs[i].mutable_entry()->set_type(ct::X509_ENTRY);
+    logged_certs[i].mutable_entry()->clear_precert_entry();
+    logged_certs[i]
+        .mutable_entry()
+        ->mutable_x509_entry()
+        ->set_leaf_certificate(common_structure + std::to_string(i) +
+                               common_structure);
+  }
+
+  // Entries before the dictionary is trained are stored uncompressed.
+  for (size_t i = 0; i < 20; ++i) {
+    EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_certs[i]));
+  }
+  // Writing the same entry again is not a conflict.
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged_certs[15]));
+
+  LoggedCertificate lookup_cert;
+  for (size_t i = 0; i < 20; ++i) {
+    EXPECT_EQ(DB::LOOKUP_OK, this->db()->LookupByIndex(i, &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_certs[i], lookup_cert);
+    EXPECT_EQ(DB::LOOKUP_OK,
+              this->db()->LookupByHash(logged_certs[i].Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_certs[i], lookup_cert);
+  }
+
+  // Entries compressed with the first dictionary must still be
+  // readable with a new one.
+  FLAGS_leveldb_retrain_compression_dictionary = true;
+  unique_ptr<DB> db2(this->test_db_.SecondDB());
+  FLAGS_leveldb_retrain_compression_dictionary = false;
+  for (size_t i = 20; i < logged_certs.size(); ++i) {
+    EXPECT_EQ(DB::OK, db2->CreateSequencedEntry(logged_certs[i]));
+  }
+  EXPECT_EQ(DB::OK, db2->CreateSequencedEntry(logged_certs[15]));
+
+  // Reading does not depend on the flag.
+  FLAGS_leveldb_compress_entries = false;
+  db2.reset();
+  db2.reset(this->test_db_.SecondDB());
+  EXPECT_EQ(static_cast<int64_t>(logged_certs.size()), db2->TreeSize());
+  unique_ptr<Database<LoggedCertificate>::Iterator> it(db2->ScanEntries(0));
+  for (const auto& logged_cert : logged_certs) {
+    ASSERT_TRUE(it->GetNextEntry(&lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+    EXPECT_EQ(DB::LOOKUP_OK, db2->LookupByHash(logged_cert.Hash(), nullptr));
+  }
+  EXPECT_FALSE(it->GetNextEntry(&lookup_cert));
+}
+
+
 }  // namespace
 
 
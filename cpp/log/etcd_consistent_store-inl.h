@@ -1,14 +1,19 @@
 #ifndef CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_INL_H_
 #define CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_INL_H_
 
+#include <algorithm>
 #include <chrono>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <iomanip>
+#include <sstream>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 #include "base/notification.h"
 #include "log/etcd_consistent_store.h"
+#include "log/etcd_value.h"
 #include "log/logged_certificate.h"
 #include "monitoring/event_metric.h"
 #include "monitoring/latency.h"
@@ -22,16 +27,35 @@ DECLARE_int32(etcd_stats_collection_interval_seconds);
 
 DECLARE_int32(node_state_ttl_seconds);
 
+DECLARE_int32(etcd_sequence_mapping_chunk_size);
+
+DECLARE_int32(etcd_add_pending_entry_batch_window_ms);
+
+DECLARE_int32(etcd_add_pending_entry_max_batch_size);
+
+DECLARE_int32(etcd_pending_entries_resync_seconds);
+
+DECLARE_int32(etcd_cleanup_batch_size);
+
 namespace cert_trans {
 namespace {
 
 // etcd path constants.
+const char kCleanupProgressFile[] = "/cleanup_progress";
 const char kClusterConfigFile[] = "/cluster_config";
 const char kEntriesDir[] = "/entries/";
-const char kSequenceFile[] = "/sequence_mapping";
+const char kSequenceDir[] = "/sequence_mapping/";
+// Where older versions kept the whole sequence mapping, in one file.
+const char kLegacySequenceFile[] = "/sequence_mapping";
+// Holds the mapping while it is moved from the legacy file to chunks.
+const char kSequenceMigrationFile[] = "/sequence_mapping_migration";
 const char kServingSthFile[] = "/serving_sth";
 const char kNodesDir[] = "/nodes/";
 
+// How long GetPendingEntries() waits for the watch to deliver our own
+// changes, before giving up and reading the whole directory.
+const std::chrono::seconds kPendingEntriesCatchUpTimeout(5);
+
 
 static Gauge<std::string>* etcd_total_entries =
     Gauge<std::string>::New("etcd_total_entries", "type",
@@ -51,6 +75,20 @@ static Counter<std::string>* etcd_rejected_requests =
                               "Total number of requests rejected due to "
                               "overload, broken down by request type.");
 
+static Gauge<>* etcd_cleanup_backlog =
+    Gauge<>::New("etcd_cleanup_backlog",
+                 "Number of entries covered by the serving STH still waiting "
+                 "to be deleted from etcd, as of the last cleanup.");
+
+static Gauge<>* etcd_cleaned_up_to =
+    Gauge<>::New("etcd_cleaned_up_to",
+                 "Sequence number up to which old entries have been deleted "
+                 "from etcd.");
+
+static Counter<>* etcd_cleaned_up_entries =
+    Counter<>::New("etcd_cleaned_up_entries",
+                   "Total number of old entries deleted from etcd.");
+
 static Latency<std::chrono::milliseconds, std::string> etcd_latency_by_op_ms(
     "etcd_latency_by_op_ms", "operation",
     "Etcd latency in ms broken down by operation.");
@@ -67,6 +105,12 @@ void CheckMappingIsOrdered(const ct::SequenceMapping& mapping) {
 }
 
 
+bool LessThanBySequenceNumber(const ct::SequenceMapping::Mapping& lhs,
+                              const ct::SequenceMapping::Mapping& rhs) {
+  return lhs.sequence_number() < rhs.sequence_number();
+}
+
+
 util::StatusOr<int64_t> GetStat(const std::map<std::string, int64_t>& stats,
                                 const std::string& name) {
   const auto& it(stats.find(name));
@@ -122,9 +166,17 @@ EtcdConsistentStore<Logged>::EtcdConsistentStore(
       serving_sth_watch_task_(CHECK_NOTNULL(executor)),
       cluster_config_watch_task_(CHECK_NOTNULL(executor)),
       etcd_stats_task_(executor_),
+      add_pending_task_(executor_),
       received_initial_sth_(false),
+      value_encoding_(ct::ETCD_VALUE_BASE64),
       exiting_(false),
-      num_etcd_entries_(0) {
+      num_etcd_entries_(0),
+      add_pending_flush_scheduled_(false),
+      sequence_mapping_migrated_(false),
+      sequence_mapping_written_(false),
+      pending_entries_synced_(false),
+      pending_entries_index_(-1),
+      pending_entries_required_index_(-1) {
   // Set up watches on things we're interested in...
   WatchServingSTH(
       std::bind(&EtcdConsistentStore<Logged>::OnEtcdServingSTHUpdated, this,
@@ -148,6 +200,11 @@ EtcdConsistentStore<Logged>::EtcdConsistentStore(
 
 template <class Logged>
 EtcdConsistentStore<Logged>::~EtcdConsistentStore() {
+  if (pending_entries_watch_task_) {
+    VLOG(1) << "Cancelling pending entries watch.";
+    pending_entries_watch_task_->Cancel();
+    pending_entries_watch_task_->Wait();
+  }
   VLOG(1) << "Cancelling watch tasks.";
   serving_sth_watch_task_.Cancel();
   cluster_config_watch_task_.Cancel();
@@ -157,6 +214,9 @@ EtcdConsistentStore<Logged>::~EtcdConsistentStore() {
   VLOG(1) << "Cancelling stats task.";
   etcd_stats_task_.Cancel();
   etcd_stats_task_.Wait();
+  VLOG(1) << "Cancelling pending entry writes.";
+  add_pending_task_.task()->Return(util::Status::CANCELLED);
+  add_pending_task_.Wait();
   VLOG(1) << "Joining cleanup thread";
   {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -266,60 +326,143 @@ util::StatusOr<ct::SignedTreeHead> EtcdConsistentStore<Logged>::GetServingSTH()
 }
 
 
-template <class Logged>
-bool LeafEntriesMatch(const Logged& a, const Logged& b) {
-  CHECK_EQ(a.entry().type(), b.entry().type());
-  switch (a.entry().type()) {
-    case ct::X509_ENTRY:
-      return a.entry().x509_entry().leaf_certificate() ==
-             b.entry().x509_entry().leaf_certificate();
-    case ct::PRECERT_ENTRY:
-      return a.entry().precert_entry().pre_certificate() ==
-             b.entry().precert_entry().pre_certificate();
-    case ct::UNKNOWN_ENTRY_TYPE:
-      // Handle it below.
-      break;
-  }
-  LOG(FATAL) << "Encountered UNKNOWN_ENTRY_TYPE:\n" << a.entry().DebugString();
-}
-
-
 template <class Logged>
 util::Status EtcdConsistentStore<Logged>::AddPendingEntry(Logged* entry) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("add_pending_entry"));
 
+  util::SyncTask task(executor_);
+  AddPendingEntry(entry, task.task());
+  task.Wait();
+  return task.status();
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::AddPendingEntry(Logged* entry,
+                                                  util::Task* task) {
   CHECK_NOTNULL(entry);
+  CHECK_NOTNULL(task);
   CHECK(!entry->has_sequence_number());
 
-  util::Status status(MaybeReject("add_pending_entry"));
+  const util::Status status(MaybeReject("add_pending_entry"));
   if (!status.ok()) {
-    return status;
+    task->Return(status);
+    return;
   }
 
-  const std::string full_path(GetEntryPath(*entry));
-  EntryHandle<Logged> handle(full_path, *entry);
-  status = CreateEntry(&handle);
-  if (status.CanonicalCode() == util::error::FAILED_PRECONDITION) {
-    // Entry with that hash already exists.
-    EntryHandle<Logged> preexisting_entry;
-    status = GetEntry(full_path, &preexisting_entry);
-    if (!status.ok()) {
-      LOG(ERROR) << "Couldn't create or fetch " << full_path << " : "
-                 << status;
-      return status;
+  std::vector<std::pair<Logged*, util::Task*>> batch;
+  std::unique_lock<std::mutex> lock(add_pending_mutex_);
+  add_pending_batch_.emplace_back(entry, task);
+  if (FLAGS_etcd_add_pending_entry_batch_window_ms <= 0 ||
+      add_pending_batch_.size() >=
+          static_cast<size_t>(FLAGS_etcd_add_pending_entry_max_batch_size)) {
+    batch.swap(add_pending_batch_);
+  } else if (!add_pending_flush_scheduled_) {
+    add_pending_flush_scheduled_ = true;
+    base_->Delay(
+        std::chrono::milliseconds(
+            FLAGS_etcd_add_pending_entry_batch_window_ms),
+        add_pending_task_.task()->AddChild(
+            std::bind(&EtcdConsistentStore<Logged>::FlushPendingEntries, this,
+                      std::placeholders::_1)));
+  }
+  lock.unlock();
+
+  WritePendingEntries(batch);
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::FlushPendingEntries(
+    util::Task* timer_task) {
+  std::vector<std::pair<Logged*, util::Task*>> batch;
+  {
+    std::lock_guard<std::mutex> lock(add_pending_mutex_);
+    add_pending_flush_scheduled_ = false;
+    batch.swap(add_pending_batch_);
+  }
+
+  if (!timer_task->status().ok()) {
+    // We're shutting down.
+    for (const auto& add : batch) {
+      add.second->Return(timer_task->status());
     }
+    return;
+  }
+
+  WritePendingEntries(batch);
+}
 
-    // Check the leaf certs are the same (we might be seeing the same cert
-    // submitted with a different chain.)
-    CHECK(LeafEntriesMatch(preexisting_entry.Entry(), *entry));
-    *entry->mutable_sct() = preexisting_entry.Entry().sct();
-    return util::Status(util::error::ALREADY_EXISTS,
-                        "Pending entry already exists.");
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::WritePendingEntries(
+    const std::vector<std::pair<Logged*, util::Task*>>& batch) {
+  if (batch.empty()) {
+    return;
+  }
+  VLOG(1) << "Writing " << batch.size() << " pending entr"
+          << (batch.size() == 1 ? "y" : "ies");
+
+  // etcd has no multi-key operations, but the requests can all be in
+  // flight at the same time.
+  for (const auto& add : batch) {
+    EtcdClient::Response* const resp(new EtcdClient::Response);
+    util::Task* const create_task(add_pending_task_.task()->AddChild(
+        std::bind(&EtcdConsistentStore<Logged>::CreatePendingEntryDone, this,
+                  add.first, resp, add.second, std::placeholders::_1)));
+    create_task->DeleteWhenDone(resp);
+    client_->Create(GetEntryPath(*add.first), EncodeEntry(*add.first), resp,
+                    create_task);
   }
-  return status;
 }
 
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::CreatePendingEntryDone(
+    Logged* entry, const EtcdClient::Response* resp, util::Task* task,
+    util::Task* create_task) {
+  if (create_task->status().ok()) {
+    ExpectPendingEntryUpdate(GetEntryPath(*entry), resp->etcd_index);
+  }
+  if (create_task->status().CanonicalCode() !=
+      util::error::FAILED_PRECONDITION) {
+    task->Return(create_task->status());
+    return;
+  }
+
+  // Entry with that hash already exists.
+  EtcdClient::GetResponse* const get_resp(new EtcdClient::GetResponse);
+  util::Task* const get_task(add_pending_task_.task()->AddChild(
+      std::bind(&EtcdConsistentStore<Logged>::GetPreexistingEntryDone, this,
+                entry, get_resp, task, std::placeholders::_1)));
+  get_task->DeleteWhenDone(get_resp);
+  client_->Get(GetEntryPath(*entry), get_resp, get_task);
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::GetPreexistingEntryDone(
+    Logged* entry, const EtcdClient::GetResponse* resp, util::Task* task,
+    util::Task* get_task) {
+  if (!get_task->status().ok()) {
+    LOG(ERROR) << "Couldn't create or fetch " << GetEntryPath(*entry) << " : "
+               << get_task->status();
+    task->Return(get_task->status());
+    return;
+  }
+
+  Logged preexisting_entry;
+  DecodeEntry(resp->node.value_, &preexisting_entry);
+  // Check the leaf certs are the same (we might be seeing the same cert
+  // submitted with a different chain.)
+  CHECK(LeafEntriesMatch(preexisting_entry, *entry));
+  *entry->mutable_sct() = preexisting_entry.sct();
+  task->Return(util::Status(util::error::ALREADY_EXISTS,
+                            "Pending entry already exists."));
+}
+
+
 template <class Logged>
 util::Status EtcdConsistentStore<Logged>::GetPendingEntryForHash(
     const std::string& hash, EntryHandle<Logged>* entry) const {
@@ -338,13 +481,90 @@ util::Status EtcdConsistentStore<Logged>::GetPendingEntryForHash(
 template <class Logged>
 util::Status EtcdConsistentStore<Logged>::GetPendingEntries(
     std::vector<EntryHandle<Logged>>* entries) const {
+  CHECK_NOTNULL(entries);
+  std::vector<std::shared_ptr<const EntryHandle<Logged>>> shared;
+  const util::Status status(GetSharedPendingEntries(&shared));
+  entries->reserve(entries->size() + shared.size());
+  for (const auto& entry : shared) {
+    entries->emplace_back(*entry);
+  }
+  return status;
+}
+
+
+template <class Logged>
+util::Status EtcdConsistentStore<Logged>::GetSharedPendingEntries(
+    std::vector<std::shared_ptr<const EntryHandle<Logged>>>* entries) const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_pending_entries"));
 
-  util::Status status(GetAllEntriesInDir(GetFullPath(kEntriesDir), entries));
+  CHECK_NOTNULL(entries);
+  std::unique_lock<std::mutex> lock(pending_entries_mutex_);
+  if (!pending_entries_watch_task_) {
+    StartPendingEntriesWatch(lock);
+  }
+
+  bool use_cache(pending_entries_synced_ &&
+                 std::chrono::steady_clock::now() -
+                         pending_entries_resync_time_ <
+                     std::chrono::seconds(
+                         FLAGS_etcd_pending_entries_resync_seconds));
+  if (use_cache &&
+      pending_entries_index_ < pending_entries_required_index_) {
+    // The watch might not have delivered the changes that went with
+    // the latest sequence mapping yet, such as entries sequenced or
+    // cleaned up by a previous master.
+    VLOG(1) << "Pending entries cache is at index " << pending_entries_index_
+            << ", listing them to catch up with "
+            << pending_entries_required_index_;
+    use_cache = false;
+  }
+  if (use_cache &&
+      !pending_entries_cv_.wait_for(lock, kPendingEntriesCatchUpTimeout,
+                                    [this]() {
+                                      return pending_entry_expected_.empty();
+                                    })) {
+    LOG(WARNING) << "Pending entries watch is lagging, "
+                 << pending_entry_expected_.size()
+                 << " change(s) not delivered yet.";
+    use_cache = false;
+  }
+
+  if (use_cache) {
+    CHECK_EQ(static_cast<size_t>(0), entries->size());
+    entries->reserve(pending_entries_.size());
+    for (const auto& entry : pending_entries_) {
+      entries->emplace_back(entry.second);
+    }
+    lock.unlock();
+    etcd_total_entries->Set("entries", entries->size());
+    return util::Status::OK;
+  }
+  lock.unlock();
+
+  int64_t listing_index(-1);
+  std::vector<EntryHandle<Logged>> listing;
+  util::Status status(
+      GetAllEntriesInDir(GetFullPath(kEntriesDir), &listing, &listing_index));
   if (status.ok()) {
-    for (const auto& entry : *entries) {
+    entries->reserve(listing.size());
+    for (auto& entry : listing) {
       CHECK(!entry.Entry().has_sequence_number());
+      entries->emplace_back(
+          std::make_shared<const EntryHandle<Logged>>(std::move(entry)));
+    }
+    std::sort(entries->begin(), entries->end(),
+              [](const std::shared_ptr<const EntryHandle<Logged>>& a,
+                 const std::shared_ptr<const EntryHandle<Logged>>& b) {
+                return PendingEntryOrder(a->Entry().timestamp(),
+                                         a->Entry().Hash()) <
+                       PendingEntryOrder(b->Entry().timestamp(),
+                                         b->Entry().Hash());
+              });
+
+    lock.lock();
+    if (pending_entries_synced_) {
+      ResyncPendingEntries(lock, *entries, listing_index);
     }
   }
   etcd_total_entries->Set("entries", entries->size());
@@ -352,6 +572,192 @@ util::Status EtcdConsistentStore<Logged>::GetPendingEntries(
 }
 
 
+template <class Logged>
+void EtcdConsistentStore<Logged>::PrepareToSequence() {
+  std::unique_lock<std::mutex> lock(pending_entries_mutex_);
+  if (!pending_entries_watch_task_) {
+    StartPendingEntriesWatch(lock);
+    return;
+  }
+  if (!pending_entries_synced_ ||
+      std::chrono::steady_clock::now() - pending_entries_resync_time_ <
+          std::chrono::seconds(FLAGS_etcd_pending_entries_resync_seconds)) {
+    return;
+  }
+  lock.unlock();
+
+  // Resyncs the cache, if the listing succeeds.
+  std::vector<std::shared_ptr<const EntryHandle<Logged>>> entries;
+  const util::Status status(GetSharedPendingEntries(&entries));
+  LOG_IF(WARNING, !status.ok()) << "Problem resyncing pending entries: "
+                                << status;
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::StartPendingEntriesWatch(
+    const std::unique_lock<std::mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  CHECK(!pending_entries_watch_task_);
+  VLOG(1) << "Starting pending entries watch.";
+  pending_entries_watch_task_.reset(new util::SyncTask(executor_));
+  client_->Watch(
+      GetFullPath(kEntriesDir),
+      std::bind(&EtcdConsistentStore<Logged>::OnPendingEntriesUpdated, this,
+                std::placeholders::_1),
+      pending_entries_watch_task_->task());
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::CachePendingEntry(
+    const std::unique_lock<std::mutex>& lock,
+    const std::shared_ptr<const EntryHandle<Logged>>& entry) const {
+  CHECK(!entry->Entry().has_sequence_number());
+  UncachePendingEntry(lock, entry->Key());
+  const PendingEntryOrder order(entry->Entry().timestamp(),
+                                entry->Entry().Hash());
+  pending_entries_[order] = entry;
+  pending_entry_orders_[entry->Key()] = order;
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::UncachePendingEntry(
+    const std::unique_lock<std::mutex>& lock, const std::string& path) const {
+  CHECK(lock.owns_lock());
+  const auto it(pending_entry_orders_.find(path));
+  if (it != pending_entry_orders_.end()) {
+    pending_entries_.erase(it->second);
+    pending_entry_orders_.erase(it);
+  }
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::ResyncPendingEntries(
+    const std::unique_lock<std::mutex>& lock,
+    const std::vector<std::shared_ptr<const EntryHandle<Logged>>>& listing,
+    int64_t listing_index) const {
+  CHECK(lock.owns_lock());
+  std::map<PendingEntryOrder, std::shared_ptr<const EntryHandle<Logged>>>
+      watched;
+  watched.swap(pending_entries_);
+  pending_entry_orders_.clear();
+
+  for (const auto& entry : listing) {
+    const auto deletion(pending_entry_deletions_.find(entry->Key()));
+    if (deletion == pending_entry_deletions_.end() ||
+        (deletion->second >= 0 && deletion->second <= listing_index)) {
+      CachePendingEntry(lock, entry);
+    }
+  }
+
+  // Keep the changes the watch delivered after the listing was done.
+  int num_missed(0);
+  for (const auto& entry : watched) {
+    if (entry.second->Handle() > listing_index) {
+      CachePendingEntry(lock, entry.second);
+    } else if (pending_entries_.find(entry.first) == pending_entries_.end()) {
+      ++num_missed;
+    }
+  }
+  for (const auto& entry : pending_entries_) {
+    if (watched.find(entry.first) == watched.end()) {
+      ++num_missed;
+    }
+  }
+  LOG_IF(WARNING, num_missed > 0)
+      << "Pending entries watch was out of sync, " << num_missed
+      << " change(s) missed.";
+
+  pending_entry_deletions_.clear();
+  pending_entry_expected_.clear();
+  pending_entries_index_ = std::max(pending_entries_index_, listing_index);
+  pending_entries_resync_time_ = std::chrono::steady_clock::now();
+  pending_entries_cv_.notify_all();
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::OnPendingEntriesUpdated(
+    const std::vector<EtcdClient::Node>& updates) const {
+  std::unique_lock<std::mutex> lock(pending_entries_mutex_);
+  for (const auto& node : updates) {
+    // The watch delivers changes in order.
+    pending_entries_index_ =
+        std::max(pending_entries_index_, node.modified_index_);
+    const auto order(pending_entry_orders_.find(node.key_));
+    if (node.deleted_) {
+      if (order != pending_entry_orders_.end() &&
+          (node.modified_index_ < 0 ||
+           pending_entries_.at(order->second)->Handle() <=
+               node.modified_index_)) {
+        UncachePendingEntry(lock, node.key_);
+      }
+      pending_entry_deletions_[node.key_] = node.modified_index_;
+    } else {
+      if (order == pending_entry_orders_.end() ||
+          pending_entries_.at(order->second)->Handle() <
+              node.modified_index_) {
+        Logged entry;
+        DecodeEntry(node.value_, &entry);
+        CachePendingEntry(lock, std::make_shared<const EntryHandle<Logged>>(
+                                    EntryHandle<Logged>(node.key_, entry,
+                                                        node.modified_index_)));
+      }
+      pending_entry_deletions_.erase(node.key_);
+    }
+
+    const auto expected(pending_entry_expected_.find(node.key_));
+    if (expected != pending_entry_expected_.end() &&
+        (node.deleted_ ? expected->second < 0
+                       : expected->second >= 0 &&
+                             node.modified_index_ >= expected->second)) {
+      pending_entry_expected_.erase(expected);
+    }
+  }
+
+  if (!pending_entries_synced_) {
+    // The first update has the whole directory.
+    VLOG(1) << "Pending entries watch synced, " << pending_entries_.size()
+            << " entries.";
+    pending_entries_synced_ = true;
+    pending_entries_resync_time_ = std::chrono::steady_clock::now();
+  }
+  etcd_total_entries->Set("entries", pending_entries_.size());
+  lock.unlock();
+  pending_entries_cv_.notify_all();
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::RequirePendingEntriesIndex(
+    int64_t index) const {
+  std::lock_guard<std::mutex> lock(pending_entries_mutex_);
+  pending_entries_required_index_ =
+      std::max(pending_entries_required_index_, index);
+}
+
+
+template <class Logged>
+void EtcdConsistentStore<Logged>::ExpectPendingEntryUpdate(
+    const std::string& path, int64_t index) {
+  std::lock_guard<std::mutex> lock(pending_entries_mutex_);
+  if (!pending_entries_watch_task_) {
+    return;
+  }
+  const auto order(pending_entry_orders_.find(path));
+  if (index < 0 ? order == pending_entry_orders_.end()
+                : order != pending_entry_orders_.end() &&
+                      pending_entries_.at(order->second)->Handle() >= index) {
+    // The watch already delivered it.
+    return;
+  }
+  pending_entry_expected_[path] = index;
+}
+
+
 template <class Logged>
 bool LessBySequenceNumber(const EntryHandle<Logged>& lhs,
                           const EntryHandle<Logged>& rhs) {
@@ -367,11 +773,114 @@ util::Status EtcdConsistentStore<Logged>::GetSequenceMapping(
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_sequence_mapping"));
 
-  util::Status status(GetEntry(GetFullPath(kSequenceFile), sequence_mapping));
-  if (!status.ok()) {
-    return status;
+  CHECK_NOTNULL(sequence_mapping);
+
+  // Until the mapping has been seen in chunks with no migration from
+  // the legacy file under way, look for one. This is read before the
+  // chunks, so that a migration completing in between is not missed.
+  std::unique_ptr<EntryHandle<ct::SequenceMapping>> migration;
+  if (!sequence_mapping_migrated_.load()) {
+    migration.reset(new EntryHandle<ct::SequenceMapping>);
+    const util::Status status(
+        GetEntry(GetFullPath(kSequenceMigrationFile), migration.get()));
+    if (status.CanonicalCode() == util::error::NOT_FOUND) {
+      migration.reset();
+    } else if (!status.ok()) {
+      return status;
+    }
   }
-  CheckMappingIsOrdered(sequence_mapping->Entry());
+
+  const std::string dir(GetFullPath(kSequenceDir));
+  util::SyncTask task(executor_);
+  EtcdClient::GetResponse resp;
+  client_->Get(dir, &resp, task.task());
+  task.Wait();
+  if (task.status().CanonicalCode() == util::error::NOT_FOUND) {
+    // Nothing has been sequenced yet.
+    resp.node.nodes_.clear();
+  } else if (!task.status().ok()) {
+    return task.status();
+  } else if (!resp.node.is_dir_) {
+    // Written by an older version. It is used as it is, until the next
+    // UpdateSequenceMapping() moves it to chunks.
+    ct::SequenceMapping mapping;
+    DecodeEntry(resp.node.value_, &mapping);
+    CheckMappingIsOrdered(mapping);
+    {
+      std::lock_guard<std::mutex> lock(sequence_mapping_mutex_);
+      sequence_mapping_chunks_.clear();
+      sequence_mapping_migration_.reset();
+      legacy_sequence_mapping_.reset(new EntryHandle<ct::SequenceMapping>(
+          GetFullPath(kLegacySequenceFile), mapping,
+          resp.node.modified_index_));
+      sequence_mapping_written_ = false;
+    }
+    RequirePendingEntriesIndex(resp.etcd_index);
+    sequence_mapping->Set(dir, mapping, resp.node.modified_index_);
+    CheckMappingIsContiguousWithServingTree(sequence_mapping->Entry());
+    etcd_total_entries->Set("sequenced",
+                            sequence_mapping->Entry().mapping_size());
+    return util::Status::OK;
+  }
+
+  ct::SequenceMapping mapping;
+  int64_t handle(resp.etcd_index);
+  bool written;
+  {
+    std::lock_guard<std::mutex> lock(sequence_mapping_mutex_);
+    legacy_sequence_mapping_.reset();
+    written = sequence_mapping_written_ && !migration &&
+              resp.node.nodes_.size() == sequence_mapping_chunks_.size();
+    std::map<std::string, EntryHandle<ct::SequenceMapping>> chunks;
+    for (const auto& node : resp.node.nodes_) {
+      auto it(sequence_mapping_chunks_.find(node.key_));
+      if (it != sequence_mapping_chunks_.end() &&
+          it->second.Handle() == node.modified_index_) {
+        // Unchanged since we last saw it, no need to parse it again.
+        chunks.emplace(it->first, std::move(it->second));
+      } else {
+        ct::SequenceMapping chunk;
+        DecodeEntry(node.value_, &chunk);
+        CheckMappingIsOrdered(chunk);
+        chunks[node.key_].Set(node.key_, chunk, node.modified_index_);
+        written = false;
+      }
+      handle = std::max(handle, node.modified_index_);
+    }
+    sequence_mapping_chunks_.swap(chunks);
+
+    // The chunk paths sort in the same order as their sequence numbers.
+    int64_t last_sequence_number(-1);
+    for (const auto& chunk : sequence_mapping_chunks_) {
+      const ct::SequenceMapping& entry(chunk.second.Entry());
+      if (entry.mapping_size() > 0) {
+        CHECK_LT(last_sequence_number, entry.mapping(0).sequence_number());
+        last_sequence_number =
+            entry.mapping(entry.mapping_size() - 1).sequence_number();
+        mapping.mutable_mapping()->MergeFrom(entry.mapping());
+      }
+    }
+
+    if (migration) {
+      // The chunks might not all have been written yet, the migration
+      // file has the whole mapping.
+      LOG(INFO) << "Sequence mapping migration to chunks under way";
+      mapping.CopyFrom(migration->Entry());
+      handle = std::max<int64_t>(handle, migration->Handle());
+      sequence_mapping_migration_ = std::move(migration);
+    } else {
+      sequence_mapping_migration_.reset();
+      sequence_mapping_migrated_.store(true);
+    }
+    sequence_mapping_written_ = written;
+  }
+  if (!written) {
+    // Changes made by others, which the pending entries watch has to
+    // catch up with.
+    RequirePendingEntriesIndex(resp.etcd_index);
+  }
+
+  sequence_mapping->Set(dir, mapping, std::max<int64_t>(0, handle));
   CheckMappingIsContiguousWithServingTree(sequence_mapping->Entry());
   etcd_total_entries->Set("sequenced",
                           sequence_mapping->Entry().mapping_size());
@@ -388,7 +897,100 @@ util::Status EtcdConsistentStore<Logged>::UpdateSequenceMapping(
   CHECK(entry->HasHandle());
   CheckMappingIsOrdered(entry->Entry());
   CheckMappingIsContiguousWithServingTree(entry->Entry());
-  return UpdateEntry(entry);
+
+  std::map<std::string, ct::SequenceMapping> chunks;
+  for (const auto& m : entry->Entry().mapping()) {
+    *chunks[GetSequenceMappingChunkPath(m.sequence_number())].add_mapping() =
+        m;
+  }
+
+  std::lock_guard<std::mutex> lock(sequence_mapping_mutex_);
+  // Until this succeeds.
+  sequence_mapping_written_ = false;
+  if (legacy_sequence_mapping_) {
+    // The mapping was read from the legacy file, which has to go
+    // before the chunks can be written at the same path. Save the new
+    // mapping where GetSequenceMapping() will find it until all the
+    // chunks are written, then delete the legacy file, which fails if
+    // it changed since it was read.
+    LOG(INFO) << "Moving the sequence mapping to chunks";
+    std::unique_ptr<EntryHandle<ct::SequenceMapping>> migration(
+        new EntryHandle<ct::SequenceMapping>(
+            GetFullPath(kSequenceMigrationFile), entry->Entry()));
+    util::Status status(ForceSetEntry(migration.get()));
+    if (!status.ok()) {
+      return status;
+    }
+    status = DeleteEntry(legacy_sequence_mapping_.get());
+    if (!status.ok()) {
+      return status;
+    }
+    legacy_sequence_mapping_.reset();
+    sequence_mapping_migration_ = std::move(migration);
+  }
+
+  for (const auto& cached : sequence_mapping_chunks_) {
+    if (cached.second.Handle() > entry->Handle()) {
+      return util::Status(util::error::FAILED_PRECONDITION,
+                          "sequence mapping chunk modified since read: " +
+                              cached.first);
+    }
+  }
+
+  int64_t new_handle(entry->Handle());
+  std::string flat_chunk;
+  std::string flat_cached;
+  for (const auto& chunk : chunks) {
+    EntryHandle<ct::SequenceMapping> handle(chunk.first, chunk.second);
+    const auto cached(sequence_mapping_chunks_.find(chunk.first));
+    util::Status status;
+    if (cached == sequence_mapping_chunks_.end()) {
+      status = CreateEntry(&handle);
+    } else {
+      CHECK(chunk.second.SerializeToString(&flat_chunk));
+      CHECK(cached->second.Entry().SerializeToString(&flat_cached));
+      if (flat_chunk == flat_cached) {
+        continue;
+      }
+      handle.SetHandle(cached->second.Handle());
+      status = UpdateEntry(&handle);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+    new_handle = std::max<int64_t>(new_handle, handle.Handle());
+    sequence_mapping_chunks_[chunk.first] = std::move(handle);
+  }
+
+  // Chunks which no longer have any mappings (all their entries have
+  // been cleaned up).
+  for (auto it(sequence_mapping_chunks_.begin());
+       it != sequence_mapping_chunks_.end();) {
+    if (chunks.find(it->first) != chunks.end()) {
+      ++it;
+      continue;
+    }
+    const util::Status status(DeleteEntry(&it->second));
+    if (!status.ok()) {
+      return status;
+    }
+    it = sequence_mapping_chunks_.erase(it);
+  }
+
+  if (sequence_mapping_migration_) {
+    // All the chunks are there now.
+    const util::Status status(DeleteEntry(sequence_mapping_migration_.get()));
+    if (!status.ok()) {
+      return status;
+    }
+    sequence_mapping_migration_.reset();
+    sequence_mapping_migrated_.store(true);
+    LOG(INFO) << "Sequence mapping moved to chunks";
+  }
+
+  sequence_mapping_written_ = true;
+  entry->SetHandle(new_handle);
+  return util::Status::OK;
 }
 
 
@@ -526,7 +1128,7 @@ util::Status EtcdConsistentStore<Logged>::GetEntry(
     return task.status();
   }
   T t;
-  CHECK(t.ParseFromString(util::FromBase64(resp.node.value_.c_str())));
+  DecodeEntry(resp.node.value_, &t);
   entry->Set(path, t, resp.node.modified_index_);
   return util::Status::OK;
 }
@@ -535,7 +1137,8 @@ util::Status EtcdConsistentStore<Logged>::GetEntry(
 template <class Logged>
 template <class T>
 util::Status EtcdConsistentStore<Logged>::GetAllEntriesInDir(
-    const std::string& dir, std::vector<EntryHandle<T>>* entries) const {
+    const std::string& dir, std::vector<EntryHandle<T>>* entries,
+    int64_t* etcd_index) const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_all_entries_in_dir"));
 
@@ -552,9 +1155,12 @@ util::Status EtcdConsistentStore<Logged>::GetAllEntriesInDir(
     return util::Status(util::error::FAILED_PRECONDITION,
                         "node is not a directory: " + dir);
   }
+  if (etcd_index) {
+    *etcd_index = resp.etcd_index;
+  }
   for (const auto& node : resp.node.nodes_) {
     T t;
-    CHECK(t.ParseFromString(util::FromBase64(node.value_.c_str())));
+    DecodeEntry(node.value_, &t);
     entries->emplace_back(
         EntryHandle<Logged>(node.key_, t, node.modified_index_));
   }
@@ -571,11 +1177,9 @@ util::Status EtcdConsistentStore<Logged>::UpdateEntry(EntryHandle<T>* t) {
   CHECK_NOTNULL(t);
   CHECK(t->HasHandle());
   CHECK(t->HasKey());
-  std::string flat_entry;
-  CHECK(t->Entry().SerializeToString(&flat_entry));
   util::SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->Update(t->Key(), util::ToBase64(flat_entry), t->Handle(), &resp,
+  client_->Update(t->Key(), EncodeEntry(t->Entry()), t->Handle(), &resp,
                   task.task());
   task.Wait();
   if (task.status().ok()) {
@@ -594,11 +1198,9 @@ util::Status EtcdConsistentStore<Logged>::CreateEntry(EntryHandle<T>* t) {
   CHECK_NOTNULL(t);
   CHECK(!t->HasHandle());
   CHECK(t->HasKey());
-  std::string flat_entry;
-  CHECK(t->Entry().SerializeToString(&flat_entry));
   util::SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->Create(t->Key(), util::ToBase64(flat_entry), &resp, task.task());
+  client_->Create(t->Key(), EncodeEntry(t->Entry()), &resp, task.task());
   task.Wait();
   if (task.status().ok()) {
     t->SetHandle(resp.etcd_index);
@@ -620,11 +1222,9 @@ util::Status EtcdConsistentStore<Logged>::ForceSetEntry(EntryHandle<T>* t) {
   // calling code should be doing an UpdateEntry() here since they have the
   // handle.
   CHECK(!t->HasHandle());
-  std::string flat_entry;
-  CHECK(t->Entry().SerializeToString(&flat_entry));
   util::SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->ForceSet(t->Key(), util::ToBase64(flat_entry), &resp, task.task());
+  client_->ForceSet(t->Key(), EncodeEntry(t->Entry()), &resp, task.task());
   task.Wait();
   if (task.status().ok()) {
     t->SetHandle(resp.etcd_index);
@@ -648,11 +1248,9 @@ util::Status EtcdConsistentStore<Logged>::ForceSetEntryWithTTL(
   // the handle.
   CHECK(!t->HasHandle());
   CHECK_LE(0, ttl.count());
-  std::string flat_entry;
-  CHECK(t->Entry().SerializeToString(&flat_entry));
   util::SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->ForceSetWithTTL(t->Key(), util::ToBase64(flat_entry), ttl, &resp,
+  client_->ForceSetWithTTL(t->Key(), EncodeEntry(t->Entry()), ttl, &resp,
                            task.task());
   task.Wait();
   if (task.status().ok()) {
@@ -671,6 +1269,10 @@ util::Status EtcdConsistentStore<Logged>::DeleteEntry(EntryHandle<T>* entry) {
   CHECK_NOTNULL(entry);
   CHECK(entry->HasHandle());
   CHECK(entry->HasKey());
+  const std::string entries_dir(GetFullPath(kEntriesDir));
+  if (entry->Key().compare(0, entries_dir.size(), entries_dir) == 0) {
+    ExpectPendingEntryUpdate(entry->Key(), -1);
+  }
   util::SyncTask task(executor_);
   client_->Delete(entry->Key(), entry->Handle(), task.task());
   task.Wait();
@@ -708,6 +1310,20 @@ std::string EtcdConsistentStore<Logged>::GetFullPath(
 }
 
 
+template <class Logged>
+std::string EtcdConsistentStore<Logged>::GetSequenceMappingChunkPath(
+    int64_t sequence_number) const {
+  const int64_t chunk_size(FLAGS_etcd_sequence_mapping_chunk_size);
+  CHECK_GT(chunk_size, 0);
+  CHECK_GE(sequence_number, 0);
+  // Zero-padded, so that the paths sort in sequence number order.
+  std::ostringstream path;
+  path << kSequenceDir << std::setw(20) << std::setfill('0')
+       << sequence_number - sequence_number % chunk_size;
+  return GetFullPath(path.str());
+}
+
+
 template <class Logged>
 void EtcdConsistentStore<Logged>::CheckMappingIsContiguousWithServingTree(
     const ct::SequenceMapping& mapping) const {
@@ -725,29 +1341,55 @@ void EtcdConsistentStore<Logged>::CheckMappingIsContiguousWithServingTree(
     CHECK_LE(lowest_sequence_number, tree_size);
     // It must also be contiguous for all entries not yet included in the
     // serving tree. (Note that entries below that may not be contiguous
-    // because the clean-up operation may not remove them in order.)
-    bool above_sth(false);
-    for (int i(0); i < mapping.mapping_size() - 1; ++i) {
+    // because the clean-up operation may not remove them in order.) The
+    // mapping is ordered, so skip straight to those.
+    ct::SequenceMapping::Mapping first_above_sth;
+    first_above_sth.set_sequence_number(tree_size);
+    for (int i(std::lower_bound(mapping.mapping().begin(),
+                                mapping.mapping().end(), first_above_sth,
+                                LessThanBySequenceNumber) -
+               mapping.mapping().begin());
+         i < mapping.mapping_size() - 1; ++i) {
       const int64_t mapped_seq(mapping.mapping(i).sequence_number());
-      if (mapped_seq >= tree_size) {
-        CHECK_EQ(mapped_seq + 1, mapping.mapping(i + 1).sequence_number());
-        above_sth = true;
-      } else {
-        CHECK(!above_sth);
-      }
+      CHECK_EQ(mapped_seq + 1, mapping.mapping(i + 1).sequence_number());
     }
   }
 }
 
 
+template <class Logged>
+template <class T>
+std::string EtcdConsistentStore<Logged>::EncodeEntry(const T& entry) const {
+  std::string flat_entry;
+  CHECK(entry.SerializeToString(&flat_entry));
+  if (std::is_same<T, ct::ClusterConfig>::value) {
+    // Nodes which do not know about other encodings must still be
+    // able to read the config telling them about it.
+    return EncodeEtcdValue(flat_entry, ct::ETCD_VALUE_BASE64);
+  }
+  return EncodeEtcdValue(flat_entry, static_cast<ct::EtcdValueEncoding>(
+                                         value_encoding_.load()));
+}
+
+
+// static
+template <class Logged>
+template <class T>
+void EtcdConsistentStore<Logged>::DecodeEntry(const std::string& value,
+                                              T* entry) {
+  std::string flat_entry;
+  CHECK(DecodeEtcdValue(value, &flat_entry)) << value;
+  CHECK(entry->ParseFromString(flat_entry)) << value;
+}
+
+
 // static
 template <class Logged>
 template <class T>
 Update<T> EtcdConsistentStore<Logged>::TypedUpdateFromNode(
     const EtcdClient::Node& node) {
-  const std::string raw_value(util::FromBase64(node.value_.c_str()));
   T thing;
-  CHECK(thing.ParseFromString(raw_value)) << raw_value;
+  DecodeEntry(node.value_, &thing);
   EntryHandle<T> handle(node.key_, thing);
   if (!node.deleted_) {
     handle.SetHandle(node.modified_index_);
@@ -797,6 +1439,7 @@ void EtcdConsistentStore<Logged>::OnClusterConfigUpdated(
             << update.handle_.Entry().DebugString();
     std::lock_guard<std::mutex> lock(mutex_);
     cluster_config_.reset(new ct::ClusterConfig(update.handle_.Entry()));
+    value_encoding_ = cluster_config_->etcd_value_encoding();
   } else {
     LOG(WARNING) << "ClusterConfig non-existent/deleted.";
     // TODO(alcutter): What to do here?
@@ -834,26 +1477,71 @@ util::StatusOr<int64_t> EtcdConsistentStore<Logged>::CleanupOldEntries() {
     return status;
   }
 
+  // Carry on from where the last cleanup got to, even if it was done
+  // by another node.
+  EntryHandle<ct::CleanupProgress> progress;
+  status = GetEntry(GetFullPath(kCleanupProgressFile), &progress);
+  if (!status.ok() && status.CanonicalCode() != util::error::NOT_FOUND) {
+    LOG(WARNING) << "Couldn't get cleanup progress: " << status;
+    return status;
+  }
+  const int64_t cleaned_up_to(
+      status.ok() ? progress.Entry().cleaned_up_to_sequence_number() : -1);
+
+  CHECK_GT(FLAGS_etcd_cleanup_batch_size, 0);
   std::vector<std::string> keys_to_delete;
+  int64_t backlog(0);
+  int64_t batch_end(cleaned_up_to);
   for (int mapping_index = 0;
        mapping_index < sequence_mapping.Entry().mapping_size() &&
        sequence_mapping.Entry().mapping(mapping_index).sequence_number() <=
            clean_up_to_sequence_number;
        ++mapping_index) {
-    // Delete the entry from /entries.
-    keys_to_delete.emplace_back(GetEntryPath(
-        sequence_mapping.Entry().mapping(mapping_index).entry_hash()));
+    const ct::SequenceMapping::Mapping& mapping(
+        sequence_mapping.Entry().mapping(mapping_index));
+    if (mapping.sequence_number() <= cleaned_up_to) {
+      continue;
+    }
+    ++backlog;
+    if (static_cast<int64_t>(keys_to_delete.size()) <
+        FLAGS_etcd_cleanup_batch_size) {
+      // Delete the entry from /entries.
+      keys_to_delete.emplace_back(GetEntryPath(mapping.entry_hash()));
+      batch_end = mapping.sequence_number();
+    }
   }
+  etcd_cleanup_backlog->Set(backlog);
 
+  if (keys_to_delete.empty()) {
+    return 0;
+  }
 
   const int64_t num_entries_cleaned(keys_to_delete.size());
+  for (const auto& key : keys_to_delete) {
+    ExpectPendingEntryUpdate(key, -1);
+  }
   util::SyncTask task(executor_);
   EtcdForceDeleteKeys(client_, std::move(keys_to_delete), task.task());
   task.Wait();
   status = task.status();
   if (!status.ok()) {
     LOG(WARNING) << "EtcdDeleteKeys failed: " << task.status();
+    return status;
   }
+  etcd_cleaned_up_entries->IncrementBy(num_entries_cleaned);
+  etcd_cleanup_backlog->Set(backlog - num_entries_cleaned);
+
+  // If this fails, the next cleanup will just delete this batch again.
+  EntryHandle<ct::CleanupProgress> new_progress(
+      GetFullPath(kCleanupProgressFile), ct::CleanupProgress());
+  new_progress.MutableEntry()->set_cleaned_up_to_sequence_number(batch_end);
+  status = ForceSetEntry(&new_progress);
+  if (!status.ok()) {
+    LOG(WARNING) << "Couldn't record cleanup progress: " << status;
+  } else {
+    etcd_cleaned_up_to->Set(batch_end);
+  }
+
   return num_entries_cleaned;
 }
 
@@ -1,9 +1,15 @@
 #ifndef CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_H_
 #define CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <stdint.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "base/macros.h"
@@ -39,15 +45,44 @@ class EtcdConsistentStore : public ConsistentStore<Logged> {
 
   util::Status AddPendingEntry(Logged* entry) override;
 
+  // Entries added concurrently are collected for up to
+  // --etcd_add_pending_entry_batch_window_ms, and then written to etcd
+  // together, with parallel requests.
+  void AddPendingEntry(Logged* entry, util::Task* task) override;
+
   util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<Logged>* entry) const override;
 
+  // The first call starts a watch on the pending entries, after which
+  // they are served from memory, ordered by SCT timestamp and then
+  // hash. Changes made through this object are waited for, others
+  // show up as soon as the watch delivers them. The whole directory
+  // is still read every --etcd_pending_entries_resync_seconds, in
+  // case the watch missed something, and whenever the sequence mapping
+  // last read was changed by someone else (another master), until the
+  // cache is known to have caught up with it.
   util::Status GetPendingEntries(
       std::vector<EntryHandle<Logged>>* entries) const override;
 
+  // Same as the above, but hands out the cached entries themselves
+  // rather than copies of them.
+  util::Status GetSharedPendingEntries(
+      std::vector<std::shared_ptr<const EntryHandle<Logged>>>* entries)
+      const override;
+
+  // The sequence mapping is stored in etcd as a directory of chunks,
+  // each covering a fixed range of sequence numbers, which are
+  // concatenated by GetSequenceMapping(). The handle returned is the
+  // etcd index the chunks were read at.
   util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const override;
 
+  // Only writes the chunks which differ from what was last read, each
+  // with a compare-and-swap on its own index, so the cost of a
+  // sequencing run is proportional to the number of new (or cleaned
+  // up) mappings, rather than to the size of the whole mapping.
+  // Chunks are written in order, so if this fails part of the way
+  // through, what was written is still a valid mapping.
   util::Status UpdateSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) override;
 
@@ -73,6 +108,11 @@ class EtcdConsistentStore : public ConsistentStore<Logged> {
   // serving STH.
   util::StatusOr<int64_t> CleanupOldEntries() override;
 
+  // Starts the pending entries watch, and does its periodic resync,
+  // so that a node taking over as master does not have to read the
+  // whole directory first.
+  void PrepareToSequence() override;
+
  private:
   void WaitForServingSTHVersion(std::unique_lock<std::mutex>* lock,
                                 const int version);
@@ -82,7 +122,8 @@ class EtcdConsistentStore : public ConsistentStore<Logged> {
 
   template <class T>
   util::Status GetAllEntriesInDir(const std::string& dir,
-                                  std::vector<EntryHandle<T>>* entries) const;
+                                  std::vector<EntryHandle<T>>* entries,
+                                  int64_t* etcd_index = nullptr) const;
 
   template <class T>
   util::Status UpdateEntry(EntryHandle<T>* entry);
@@ -108,6 +149,10 @@ class EtcdConsistentStore : public ConsistentStore<Logged> {
 
   std::string GetFullPath(const std::string& key) const;
 
+  // Returns the path of the sequence mapping chunk which holds the
+  // mapping for |sequence_number|.
+  std::string GetSequenceMappingChunkPath(int64_t sequence_number) const;
+
   void CheckMappingIsContiguousWithServingTree(
       const ct::SequenceMapping& mapping) const;
 
@@ -128,6 +173,15 @@ class EtcdConsistentStore : public ConsistentStore<Logged> {
   static void ConvertMultipleUpdate(
       const CB& callback, const std::vector<EtcdClient::Node>& updates);
 
+  // Encodes |entry| for etcd as the ClusterConfig says (the
+  // ClusterConfig itself is always in the legacy encoding).
+  template <class T>
+  std::string EncodeEntry(const T& entry) const;
+
+  // Decodes a value read from etcd, in any encoding.
+  template <class T>
+  static void DecodeEntry(const std::string& value, T* entry);
+
   // Converts a generic Node to an Update<T>.
   // T must implement ParseFromString().
   template <class T>
@@ -140,6 +194,41 @@ class EtcdConsistentStore : public ConsistentStore<Logged> {
 
   void OnClusterConfigUpdated(const Update<ct::ClusterConfig>& update);
 
+  // The following methods require |pending_entries_mutex_| to be held.
+  void StartPendingEntriesWatch(
+      const std::unique_lock<std::mutex>& lock) const;
+  void CachePendingEntry(const std::unique_lock<std::mutex>& lock,
+                         const std::shared_ptr<const EntryHandle<Logged>>&
+                             entry) const;
+  void UncachePendingEntry(const std::unique_lock<std::mutex>& lock,
+                           const std::string& path) const;
+  void ResyncPendingEntries(
+      const std::unique_lock<std::mutex>& lock,
+      const std::vector<std::shared_ptr<const EntryHandle<Logged>>>& listing,
+      int64_t listing_index) const;
+
+  void OnPendingEntriesUpdated(
+      const std::vector<EtcdClient::Node>& updates) const;
+
+  // Makes GetPendingEntries() list the entries, unless the cache is
+  // known to have all the changes made up to |index|.
+  void RequirePendingEntriesIndex(int64_t index) const;
+
+  // Makes GetPendingEntries() wait for the watch to deliver a change
+  // made to the entry at |path|, either its creation at |index|, or
+  // its deletion if |index| is negative.
+  void ExpectPendingEntryUpdate(const std::string& path, int64_t index);
+
+  void FlushPendingEntries(util::Task* timer_task);
+  void WritePendingEntries(
+      const std::vector<std::pair<Logged*, util::Task*>>& batch);
+  void CreatePendingEntryDone(Logged* entry,
+                              const EtcdClient::Response* resp,
+                              util::Task* task, util::Task* create_task);
+  void GetPreexistingEntryDone(Logged* entry,
+                               const EtcdClient::GetResponse* resp,
+                               util::Task* task, util::Task* get_task);
+
   void StartEtcdStatsFetch();
   void EtcdStatsFetchDone(EtcdClient::StatsResponse* response,
                           util::Task* task);
@@ -156,14 +245,66 @@ class EtcdConsistentStore : public ConsistentStore<Logged> {
   util::SyncTask serving_sth_watch_task_;
   util::SyncTask cluster_config_watch_task_;
   util::SyncTask etcd_stats_task_;
+  // Parent of the batch timers and pending entry writes.
+  util::SyncTask add_pending_task_;
 
   mutable std::mutex mutex_;
   bool received_initial_sth_;
   std::unique_ptr<EntryHandle<ct::SignedTreeHead>> serving_sth_;
   std::unique_ptr<ct::ClusterConfig> cluster_config_;
+  // From |cluster_config_|, but read without holding |mutex_|.
+  std::atomic<int> value_encoding_;
   bool exiting_;
   int64_t num_etcd_entries_;
 
+  std::mutex add_pending_mutex_;
+  std::vector<std::pair<Logged*, util::Task*>> add_pending_batch_;
+  bool add_pending_flush_scheduled_;
+
+  // Sequence mapping chunks, by path, as last read from or written to
+  // etcd, with their modified index as the handle.
+  mutable std::mutex sequence_mapping_mutex_;
+  mutable std::map<std::string, EntryHandle<ct::SequenceMapping>>
+      sequence_mapping_chunks_;
+  // Set when the mapping was last read from the single file written by
+  // older versions, or from the file holding it while it is moved to
+  // chunks.
+  mutable std::unique_ptr<EntryHandle<ct::SequenceMapping>>
+      legacy_sequence_mapping_;
+  mutable std::unique_ptr<EntryHandle<ct::SequenceMapping>>
+      sequence_mapping_migration_;
+  // Once set, there is no need to look for the above any more.
+  mutable std::atomic<bool> sequence_mapping_migrated_;
+  // Whether the chunks in etcd are as the last UpdateSequenceMapping()
+  // left them, as far as the last read could tell.
+  mutable bool sequence_mapping_written_;
+
+  // Pending entries as seen by the watch on /entries/, ordered by SCT
+  // timestamp and hash, and the order of each of them by path. The
+  // entries are never modified once cached, only replaced, so they can
+  // be handed out without copying them.
+  typedef std::pair<uint64_t, std::string> PendingEntryOrder;
+  mutable std::mutex pending_entries_mutex_;
+  mutable std::condition_variable pending_entries_cv_;
+  mutable std::unique_ptr<util::SyncTask> pending_entries_watch_task_;
+  mutable bool pending_entries_synced_;
+  mutable std::chrono::steady_clock::time_point pending_entries_resync_time_;
+  // The etcd index up to which all the changes to /entries/ are known
+  // to be in the cache, and the one it has to reach before the cache
+  // can be used, set when the sequence mapping was changed by someone
+  // else.
+  mutable int64_t pending_entries_index_;
+  mutable int64_t pending_entries_required_index_;
+  mutable std::map<PendingEntryOrder,
+                   std::shared_ptr<const EntryHandle<Logged>>>
+      pending_entries_;
+  mutable std::unordered_map<std::string, PendingEntryOrder>
+      pending_entry_orders_;
+  // Deletions seen by the watch since the last resync, and changes
+  // made by us that the watch has not delivered yet, by path.
+  mutable std::unordered_map<std::string, int64_t> pending_entry_deletions_;
+  mutable std::unordered_map<std::string, int64_t> pending_entry_expected_;
+
   friend class EtcdConsistentStoreTest;
   template <class T>
   friend class TreeSignerTest;
@@ -9,6 +9,21 @@ DEFINE_int32(etcd_stats_collection_interval_seconds, 2,
              "Number of seconds between fetches of etcd stats.");
 DEFINE_int32(node_state_ttl_seconds, 60,
              "TTL in seconds on the node state files.");
+DEFINE_int32(etcd_add_pending_entry_batch_window_ms, 2,
+             "Maximum number of milliseconds to wait for more pending "
+             "entries to write to etcd along with the first one, 0 writes "
+             "each one immediately.");
+DEFINE_int32(etcd_add_pending_entry_max_batch_size, 256,
+             "Maximum number of pending entries written to etcd at once.");
+DEFINE_int32(etcd_pending_entries_resync_seconds, 300,
+             "Number of seconds between full reads of the pending entries, "
+             "to make sure the watch on them did not miss anything.");
+DEFINE_int32(etcd_sequence_mapping_chunk_size, 1024,
+             "Number of sequence numbers covered by each chunk of the "
+             "sequence mapping in etcd.");
+DEFINE_int32(etcd_cleanup_batch_size, 10000,
+             "Maximum number of old entries deleted from etcd by each call "
+             "to CleanupOldEntries().");
 
 namespace cert_trans {
 template class EtcdConsistentStore<LoggedCertificate>;
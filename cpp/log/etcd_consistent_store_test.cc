@@ -7,6 +7,7 @@
 #include <gtest/gtest.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -24,6 +25,8 @@
 
 DECLARE_int32(node_state_ttl_seconds);
 DECLARE_int32(etcd_stats_collection_interval_seconds);
+DECLARE_int32(etcd_sequence_mapping_chunk_size);
+DECLARE_int32(etcd_cleanup_batch_size);
 
 namespace cert_trans {
 
@@ -59,6 +62,8 @@ using util::testing::StatusIs;
 
 
 const char kRoot[] = "/root";
+const char kFirstSequenceMappingChunk[] =
+    "/root/sequence_mapping/00000000000000000000";
 const char kNodeId[] = "node_id";
 const int kTimestamp = 9000;
 
@@ -77,7 +82,6 @@ class EtcdConsistentStoreTest : public ::testing::Test {
     FLAGS_etcd_stats_collection_interval_seconds = 1;
     store_.reset(new EtcdConsistentStore<LoggedCertificate>(
         base_.get(), &executor_, &client_, &election_, kRoot, kNodeId));
-    InsertEntry("/root/sequence_mapping", SequenceMapping());
   }
 
   LoggedCertificate DefaultCert() {
@@ -209,6 +213,20 @@ class EtcdConsistentStoreTest : public ::testing::Test {
     return store_->num_etcd_entries_;
   }
 
+  int ValueEncoding() const {
+    return store_->value_encoding_;
+  }
+
+  bool PendingEntriesSynced() const {
+    std::lock_guard<std::mutex> lock(store_->pending_entries_mutex_);
+    return store_->pending_entries_synced_;
+  }
+
+  std::chrono::steady_clock::time_point PendingEntriesResyncTime() const {
+    std::lock_guard<std::mutex> lock(store_->pending_entries_mutex_);
+    return store_->pending_entries_resync_time_;
+  }
+
 
   shared_ptr<libevent::Base> base_;
   ThreadPool executor_;
@@ -318,6 +336,36 @@ TEST_F(EtcdConsistentStoreTest, TestAddPendingEntryWorks) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestAddPendingEntryUsesConfiguredEncoding) {
+  ct::ClusterConfig config;
+  config.set_etcd_value_encoding(ct::ETCD_VALUE_DEFLATE);
+  ASSERT_OK(store_->SetClusterConfig(config));
+  for (int i = 0; i < 100 && ValueEncoding() != ct::ETCD_VALUE_DEFLATE; ++i) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+
+  // The config itself stays readable by nodes which only know base64.
+  ct::ClusterConfig stored_config;
+  PeekEntry(string(kRoot) + "/cluster_config", &stored_config);
+  EXPECT_EQ(ct::ETCD_VALUE_DEFLATE, stored_config.etcd_value_encoding());
+
+  LoggedCertificate cert(MakeCert(kTimestamp, string(1000, 'x')));
+  ASSERT_OK(store_->AddPendingEntry(&cert));
+  EtcdClient::GetResponse resp;
+  SyncTask task(base_.get());
+  client_.Get(string(kRoot) + "/entries/" + util::HexString(cert.Hash()),
+              &resp, task.task());
+  task.Wait();
+  ASSERT_OK(task.status());
+  EXPECT_EQ("~1", resp.node.value_.substr(0, 2));
+  EXPECT_LT(resp.node.value_.size(), Serialize(cert).size());
+
+  EntryHandle<LoggedCertificate> handle;
+  ASSERT_OK(store_->GetPendingEntryForHash(cert.Hash(), &handle));
+  EXPECT_EQ(cert, handle.Entry());
+}
+
+
 TEST_F(EtcdConsistentStoreTest,
        TestAddPendingEntryForExistingEntryReturnsSct) {
   LoggedCertificate cert(DefaultCert());
@@ -335,6 +383,40 @@ TEST_F(EtcdConsistentStoreTest,
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestAddPendingEntriesConcurrently) {
+  LoggedCertificate existing(MakeCert(55555, "existing"));
+  InsertEntry(string(kRoot) + "/entries/" + util::HexString(existing.Hash()),
+              existing);
+
+  // Submitted together, these get written as one batch.
+  const int kNumEntries(10);
+  vector<LoggedCertificate> certs;
+  for (int i = 0; i < kNumEntries; ++i) {
+    certs.emplace_back(MakeCert(kTimestamp, "leaf " + std::to_string(i)));
+  }
+  certs.emplace_back(MakeCert(kTimestamp, "existing"));
+
+  vector<unique_ptr<SyncTask>> tasks;
+  for (auto& cert : certs) {
+    tasks.emplace_back(new SyncTask(&executor_));
+    store_->AddPendingEntry(&cert, tasks.back()->task());
+  }
+  for (const auto& task : tasks) {
+    task->Wait();
+  }
+
+  for (int i = 0; i < kNumEntries; ++i) {
+    EXPECT_OK(tasks[i]->status());
+    LoggedCertificate stored;
+    PeekEntry(string(kRoot) + "/entries/" + util::HexString(certs[i].Hash()),
+              &stored);
+    EXPECT_EQ(certs[i].Hash(), stored.Hash());
+  }
+  EXPECT_THAT(tasks.back()->status(), StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(existing.timestamp(), certs.back().timestamp());
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestAddPendingEntryForExistingNonIdenticalEntry) {
   LoggedCertificate cert(DefaultCert());
@@ -399,6 +481,133 @@ TEST_F(EtcdConsistentStoreTest, TestGetPendingEntries) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestGetPendingEntriesFollowsChanges) {
+  vector<LoggedCertificate> certs{MakeCert(300, "three"),
+                                  MakeCert(100, "one"),
+                                  MakeCert(200, "two")};
+  for (auto& cert : certs) {
+    ASSERT_OK(store_->AddPendingEntry(&cert));
+  }
+
+  // The first call reads the whole directory, and starts the watch.
+  vector<EntryHandle<LoggedCertificate>> entries;
+  ASSERT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(3), entries.size());
+  EXPECT_EQ(100, entries[0].Entry().timestamp());
+  EXPECT_EQ(200, entries[1].Entry().timestamp());
+  EXPECT_EQ(300, entries[2].Entry().timestamp());
+
+  // Changes made through the store are seen straight away.
+  LoggedCertificate zero(MakeCert(50, "zero"));
+  ASSERT_OK(store_->AddPendingEntry(&zero));
+  entries.clear();
+  ASSERT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(4), entries.size());
+  EXPECT_EQ(zero, entries[0].Entry());
+
+  // Others, once the watch delivers them.
+  const LoggedCertificate four(MakeCert(400, "four"));
+  InsertEntry(string(kRoot) + "/entries/" + util::HexString(four.Hash()),
+              four);
+  for (int i = 0; i < 100 && entries.size() < 5; ++i) {
+    std::this_thread::sleep_for(milliseconds(10));
+    entries.clear();
+    ASSERT_OK(store_->GetPendingEntries(&entries));
+  }
+  ASSERT_EQ(static_cast<size_t>(5), entries.size());
+  EXPECT_EQ(four, entries[4].Entry());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestPrepareToSequenceStartsWatch) {
+  const LoggedCertificate one(MakeCert(100, "one"));
+  InsertEntry(string(kRoot) + "/entries/" + util::HexString(one.Hash()), one);
+  EXPECT_FALSE(PendingEntriesSynced());
+
+  // A standby node gets the watch going before it ever sequences.
+  store_->PrepareToSequence();
+  for (int i = 0; i < 100 && !PendingEntriesSynced(); ++i) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  ASSERT_TRUE(PendingEntriesSynced());
+  // Does nothing more until the next resync is due.
+  store_->PrepareToSequence();
+
+  vector<EntryHandle<LoggedCertificate>> entries;
+  ASSERT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(1), entries.size());
+  EXPECT_EQ(one, entries[0].Entry());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestGetSharedPendingEntriesDoesNotCopy) {
+  LoggedCertificate one(MakeCert(100, "one"));
+  LoggedCertificate two(MakeCert(200, "two"));
+  ASSERT_OK(store_->AddPendingEntry(&one));
+  ASSERT_OK(store_->AddPendingEntry(&two));
+  store_->PrepareToSequence();
+  for (int i = 0; i < 100 && !PendingEntriesSynced(); ++i) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  ASSERT_TRUE(PendingEntriesSynced());
+
+  vector<std::shared_ptr<const EntryHandle<LoggedCertificate>>> first;
+  ASSERT_OK(store_->GetSharedPendingEntries(&first));
+  ASSERT_EQ(static_cast<size_t>(2), first.size());
+  EXPECT_EQ(one, first[0]->Entry());
+  EXPECT_EQ(two, first[1]->Entry());
+
+  // Both calls hand out the cached entries themselves.
+  vector<std::shared_ptr<const EntryHandle<LoggedCertificate>>> second;
+  ASSERT_OK(store_->GetSharedPendingEntries(&second));
+  ASSERT_EQ(static_cast<size_t>(2), second.size());
+  EXPECT_EQ(first[0].get(), second[0].get());
+  EXPECT_EQ(first[1].get(), second[1].get());
+}
+
+
+TEST_F(EtcdConsistentStoreTest,
+       TestGetPendingEntriesCatchesUpWithOtherSequenceMapping) {
+  LoggedCertificate one(MakeCert(100, "one"));
+  ASSERT_OK(store_->AddPendingEntry(&one));
+  store_->PrepareToSequence();
+  for (int i = 0; i < 100 && !PendingEntriesSynced(); ++i) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  ASSERT_TRUE(PendingEntriesSynced());
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  vector<std::shared_ptr<const EntryHandle<LoggedCertificate>>> entries;
+  ASSERT_OK(store_->GetSharedPendingEntries(&entries));
+  const std::chrono::steady_clock::time_point synced_time(
+      PendingEntriesResyncTime());
+
+  // Another master sequences the entry. The watch on the entries has
+  // nothing to show for it, so they are listed again.
+  SequenceMapping other;
+  other.add_mapping()->set_sequence_number(0);
+  other.mutable_mapping(0)->set_entry_hash(one.Hash());
+  InsertEntry(kFirstSequenceMappingChunk, other);
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  std::this_thread::sleep_for(milliseconds(10));
+  entries.clear();
+  ASSERT_OK(store_->GetSharedPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(1), entries.size());
+  const std::chrono::steady_clock::time_point listed_time(
+      PendingEntriesResyncTime());
+  EXPECT_LT(synced_time, listed_time);
+
+  // Once this store wrote the mapping, the cache can be used again.
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  std::this_thread::sleep_for(milliseconds(10));
+  entries.clear();
+  ASSERT_OK(store_->GetSharedPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(1), entries.size());
+  EXPECT_EQ(listed_time, PendingEntriesResyncTime());
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestGetPendingEntriesBarfsWithSequencedEntry) {
   const string kPath(string(kRoot) + "/entries/");
@@ -433,7 +642,7 @@ TEST_F(EtcdConsistentStoreTest,
   SequenceMapping mapping;
   mapping.add_mapping()->set_sequence_number(0);
   mapping.add_mapping()->set_sequence_number(2);
-  ForceSetEntry("/root/sequence_mapping", mapping);
+  InsertEntry(kFirstSequenceMappingChunk, mapping);
   EntryHandle<SequenceMapping> entry;
   EXPECT_OK(store_->GetSequenceMapping(&entry));
 }
@@ -448,7 +657,7 @@ TEST_F(EtcdConsistentStoreDeathTest,
   SequenceMapping mapping;
   mapping.add_mapping()->set_sequence_number(0);
   mapping.add_mapping()->set_sequence_number(2);
-  ForceSetEntry("/root/sequence_mapping", mapping);
+  InsertEntry(kFirstSequenceMappingChunk, mapping);
   EntryHandle<SequenceMapping> entry;
   EXPECT_DEATH(store_->GetSequenceMapping(&entry), "mapped_seq \\+ 1");
 }
@@ -479,6 +688,174 @@ TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMapping) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMappingWritesOnlyTailChunk) {
+  // Fill the first chunk, and start the second one.
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  for (int i = 0; i <= FLAGS_etcd_sequence_mapping_chunk_size; ++i) {
+    SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+    m->set_sequence_number(i);
+    m->set_entry_hash("hash" + std::to_string(i));
+  }
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+
+  EtcdClient::GetResponse resp;
+  {
+    SyncTask task(base_.get());
+    client_.Get(string(kFirstSequenceMappingChunk), &resp, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  const int64_t first_chunk_index(resp.node.modified_index_);
+
+  AddSequenceMapping(FLAGS_etcd_sequence_mapping_chunk_size + 1, "tail");
+
+  {
+    SyncTask task(base_.get());
+    client_.Get(string(kFirstSequenceMappingChunk), &resp, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  EXPECT_EQ(first_chunk_index, resp.node.modified_index_);
+
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(FLAGS_etcd_sequence_mapping_chunk_size + 2,
+            mapping.Entry().mapping_size());
+  for (int i = 0; i < mapping.Entry().mapping_size(); ++i) {
+    EXPECT_EQ(i, mapping.Entry().mapping(i).sequence_number());
+  }
+  EXPECT_EQ("tail", mapping.Entry()
+                        .mapping(mapping.Entry().mapping_size() - 1)
+                        .entry_hash());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMappingRemovesEmptyChunks) {
+  SignedTreeHead sth;
+  sth.set_timestamp(123);
+  sth.set_tree_size(FLAGS_etcd_sequence_mapping_chunk_size + 1);
+  ASSERT_OK(store_->SetServingSTH(sth));
+
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+  m->set_sequence_number(0);
+  m->set_entry_hash("zero");
+  m = mapping.MutableEntry()->add_mapping();
+  m->set_sequence_number(FLAGS_etcd_sequence_mapping_chunk_size);
+  m->set_entry_hash("last");
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+
+  // Drop the only mapping in the first chunk.
+  mapping.MutableEntry()->mutable_mapping()->DeleteSubrange(0, 1);
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(string(kFirstSequenceMappingChunk), &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(1, mapping.Entry().mapping_size());
+  EXPECT_EQ("last", mapping.Entry().mapping(0).entry_hash());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestMigratesLegacySequenceMapping) {
+  // Written by an older version, in a single file.
+  SequenceMapping legacy;
+  for (int i = 0; i <= FLAGS_etcd_sequence_mapping_chunk_size; ++i) {
+    SequenceMapping::Mapping* m(legacy.add_mapping());
+    m->set_sequence_number(i);
+    m->set_entry_hash("hash" + std::to_string(i));
+  }
+  InsertEntry(string(kRoot) + "/sequence_mapping", legacy);
+
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(legacy.SerializeAsString(), mapping.Entry().SerializeAsString());
+
+  SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+  m->set_sequence_number(FLAGS_etcd_sequence_mapping_chunk_size + 1);
+  m->set_entry_hash("new");
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+
+  // It is now in chunks, and the files used to get there are gone.
+  SequenceMapping chunk;
+  PeekEntry(kFirstSequenceMappingChunk, &chunk);
+  EXPECT_EQ(FLAGS_etcd_sequence_mapping_chunk_size, chunk.mapping_size());
+  {
+    SyncTask task(base_.get());
+    EtcdClient::GetResponse resp;
+    client_.Get(string(kRoot) + "/sequence_mapping_migration", &resp,
+                task.task());
+    task.Wait();
+    EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+  }
+
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(FLAGS_etcd_sequence_mapping_chunk_size + 2,
+            mapping.Entry().mapping_size());
+  EXPECT_EQ("new", mapping.Entry()
+                       .mapping(mapping.Entry().mapping_size() - 1)
+                       .entry_hash());
+
+  // And sequencing carries on from there.
+  AddSequenceMapping(FLAGS_etcd_sequence_mapping_chunk_size + 2, "next");
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(FLAGS_etcd_sequence_mapping_chunk_size + 3,
+            mapping.Entry().mapping_size());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestResumesInterruptedSequenceMappingMigration) {
+  // The legacy file was deleted, but only some of the chunks were
+  // written before the master went away.
+  SequenceMapping whole;
+  for (int i = 0; i <= FLAGS_etcd_sequence_mapping_chunk_size; ++i) {
+    SequenceMapping::Mapping* m(whole.add_mapping());
+    m->set_sequence_number(i);
+    m->set_entry_hash("hash" + std::to_string(i));
+  }
+  SequenceMapping partial(whole);
+  partial.mutable_mapping()->DeleteSubrange(
+      FLAGS_etcd_sequence_mapping_chunk_size, 1);
+  InsertEntry(string(kRoot) + "/sequence_mapping_migration", whole);
+  InsertEntry(kFirstSequenceMappingChunk, partial);
+
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(whole.SerializeAsString(), mapping.Entry().SerializeAsString());
+
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(whole.SerializeAsString(), mapping.Entry().SerializeAsString());
+  {
+    SyncTask task(base_.get());
+    EtcdClient::GetResponse resp;
+    client_.Get(string(kRoot) + "/sequence_mapping_migration", &resp,
+                task.task());
+    task.Wait();
+    EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+  }
+}
+
+
+TEST_F(EtcdConsistentStoreTest,
+       TestUpdateSequenceMappingFailsOnStaleMapping) {
+  EntryHandle<SequenceMapping> stale;
+  ASSERT_OK(store_->GetSequenceMapping(&stale));
+  AddSequenceMapping(0, "zero");
+
+  SequenceMapping::Mapping* m(stale.MutableEntry()->add_mapping());
+  m->set_sequence_number(0);
+  m->set_entry_hash("other");
+  EXPECT_THAT(store_->UpdateSequenceMapping(&stale),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestUpdateSequenceMappingBarfsWithOutOfOrderSequenceNumber) {
   EntryHandle<SequenceMapping> mapping;
@@ -727,9 +1104,10 @@ TEST_F(EtcdConsistentStoreTest, TestCleansUpToNewSTH) {
   sth.set_tree_size(105);
   CHECK(store_->SetServingSTH(sth).ok());
   {
+    // Only the entries which were not already cleaned up.
     const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
     ASSERT_OK(num_cleaned.status());
-    EXPECT_EQ(5, num_cleaned.ValueOrDie());
+    EXPECT_EQ(2, num_cleaned.ValueOrDie());
   }
 
 
@@ -756,6 +1134,30 @@ TEST_F(EtcdConsistentStoreTest, TestCleansUpToNewSTH) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestCleansUpInBatches) {
+  FLAGS_etcd_cleanup_batch_size = 2;
+  PopulateForCleanupTests(5, 0, 100);
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(true));
+
+  SignedTreeHead sth;
+  sth.set_timestamp(345345);
+  sth.set_tree_size(105);
+  CHECK(store_->SetServingSTH(sth).ok());
+
+  for (const int64_t expected : {2, 2, 1, 0}) {
+    const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
+    ASSERT_OK(num_cleaned.status());
+    EXPECT_EQ(expected, num_cleaned.ValueOrDie());
+  }
+
+  // The progress is kept in etcd, for the next master to carry on.
+  ct::CleanupProgress progress;
+  PeekEntry(string(kRoot) + "/cleanup_progress", &progress);
+  EXPECT_EQ(104, progress.cleaned_up_to_sequence_number());
+  FLAGS_etcd_cleanup_batch_size = 10000;
+}
+
+
 TEST_F(EtcdConsistentStoreTest, TestStoreStatsFetcher) {
   EXPECT_EQ(0, GetNumEtcdEntries());
   PopulateForCleanupTests(100, 100, 100);
@@ -0,0 +1,63 @@
+#include "log/etcd_value.h"
+
+#include <glog/logging.h>
+
+#include "util/compression.h"
+#include "util/util.h"
+
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+const char kVersionMarker = '~';
+const char kDeflateVersion = '1';
+
+
+const DictionaryCompressor& Compressor() {
+  // No preset dictionary: the values are large enough (certificate
+  // chains, mostly) to compress well on their own.
+  static const DictionaryCompressor* const compressor(
+      new DictionaryCompressor(string()));
+  return *compressor;
+}
+
+
+}  // namespace
+
+
+string EncodeEtcdValue(const string& flat, ct::EtcdValueEncoding encoding) {
+  switch (encoding) {
+    case ct::ETCD_VALUE_BASE64:
+      break;
+    case ct::ETCD_VALUE_DEFLATE: {
+      string compressed;
+      if (Compressor().Compress(flat, &compressed) &&
+          compressed.size() < flat.size()) {
+        return string(1, kVersionMarker) + kDeflateVersion +
+               util::ToBase64(compressed);
+      }
+      break;
+    }
+  }
+  return util::ToBase64(flat);
+}
+
+
+bool DecodeEtcdValue(const string& value, string* flat) {
+  CHECK_NOTNULL(flat);
+  if (value.empty() || value[0] != kVersionMarker) {
+    *flat = util::FromBase64(value.c_str());
+    return true;
+  }
+
+  if (value.size() < 2 || value[1] != kDeflateVersion) {
+    LOG(WARNING) << "Unknown etcd value encoding: " << value.substr(0, 2);
+    return false;
+  }
+  return Compressor().Decompress(util::FromBase64(value.c_str() + 2), flat);
+}
+
+
+}  // namespace cert_trans
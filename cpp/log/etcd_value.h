@@ -0,0 +1,28 @@
+#ifndef CERT_TRANS_LOG_ETCD_VALUE_H_
+#define CERT_TRANS_LOG_ETCD_VALUE_H_
+
+#include <string>
+
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// Turns a serialized protobuf into a text value for etcd.
+//
+// Values in the legacy ETCD_VALUE_BASE64 encoding are plain base64.
+// Other encodings start with a '~' (which is not part of the base64
+// alphabet) followed by a version digit, so that both can be told
+// apart. If compressing does not make a value smaller, it is written
+// in the legacy encoding instead.
+std::string EncodeEtcdValue(const std::string& flat,
+                            ct::EtcdValueEncoding encoding);
+
+// Reverses EncodeEtcdValue(), whatever encoding it used. Returns
+// false if |value| is corrupt, or uses an unknown encoding.
+bool DecodeEtcdValue(const std::string& value, std::string* flat);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ETCD_VALUE_H_
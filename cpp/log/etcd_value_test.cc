@@ -0,0 +1,69 @@
+#include "log/etcd_value.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+// Compressible, like a chain of certificates from the same issuers.
+const string kFlat(
+    "certificate issued by Some CA, certificate issued by Some CA, "
+    "certificate issued by Some CA, certificate issued by Some CA");
+
+
+TEST(EtcdValueTest, Base64IsLegacy) {
+  EXPECT_EQ(util::ToBase64(kFlat),
+            EncodeEtcdValue(kFlat, ct::ETCD_VALUE_BASE64));
+}
+
+
+TEST(EtcdValueTest, DeflateRoundTrip) {
+  const string value(EncodeEtcdValue(kFlat, ct::ETCD_VALUE_DEFLATE));
+  EXPECT_EQ("~1", value.substr(0, 2));
+  EXPECT_LT(value.size(), util::ToBase64(kFlat).size());
+
+  string flat;
+  EXPECT_TRUE(DecodeEtcdValue(value, &flat));
+  EXPECT_EQ(kFlat, flat);
+}
+
+
+TEST(EtcdValueTest, DecodesLegacyValues) {
+  string flat;
+  EXPECT_TRUE(DecodeEtcdValue(util::ToBase64(kFlat), &flat));
+  EXPECT_EQ(kFlat, flat);
+
+  EXPECT_TRUE(DecodeEtcdValue("", &flat));
+  EXPECT_EQ("", flat);
+}
+
+
+TEST(EtcdValueTest, KeepsIncompressibleValuesLegacy) {
+  const string flat("\x01\x02\x03");
+  EXPECT_EQ(util::ToBase64(flat),
+            EncodeEtcdValue(flat, ct::ETCD_VALUE_DEFLATE));
+}
+
+
+TEST(EtcdValueTest, RejectsBadValues) {
+  string flat;
+  EXPECT_FALSE(DecodeEtcdValue("~9AAAA", &flat));
+  EXPECT_FALSE(DecodeEtcdValue("~1" + util::ToBase64("not deflate"), &flat));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -4,6 +4,8 @@
 
 #include "log/file_db.h"
 
+#include <functional>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <map>
 #include <set>
@@ -18,6 +20,7 @@
 #include "monitoring/latency.h"
 #include "util/util.h"
 
+DECLARE_bool(db_intern_chain_certs);
 
 namespace {
 
@@ -28,6 +31,7 @@ static cert_trans::Latency<std::chrono::milliseconds, std::string>
 
 
 const char kMetaNodeIdKey[] = "node_id";
+const char kMetaChainCertPrefix[] = "chaincert-";
 
 
 std::string FormatSequenceNumber(const int64_t seq) {
@@ -98,6 +102,7 @@ FileDB<Logged>::FileDB(cert_trans::FileStorage* cert_storage,
 
 template <class Logged>
 FileDB<Logged>::~FileDB() {
+  this->ShutdownIO();
 }
 
 
@@ -109,25 +114,47 @@ typename Database<Logged>::WriteResult FileDB<Logged>::CreateSequencedEntry_(
   cert_trans::ScopedLatency latency(
       latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
 
+  std::string full_data;
+  CHECK(logged.SerializeToString(&full_data));
+
   std::string data;
-  CHECK(logged.SerializeToString(&data));
+  std::map<std::string, std::string> chain_certs;
+  if (FLAGS_db_intern_chain_certs) {
+    Logged interned;
+    interned.CopyFrom(logged);
+    interned.InternChain(&chain_certs);
+    CHECK(interned.SerializeToString(&data));
+  } else {
+    data = full_data;
+  }
 
   const std::string seq_str(FormatSequenceNumber(logged.sequence_number()));
 
   std::unique_lock<std::mutex> lock(lock_);
 
-  // Try to create.
-  util::Status status(cert_storage_->CreateEntry(seq_str, data));
-  if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
-    std::string existing_data;
-    status = cert_storage_->LookupEntry(seq_str, &existing_data);
-    CHECK_EQ(status, util::Status::OK);
-    if (existing_data == data) {
+  std::string existing_data;
+  if (cert_storage_->LookupEntry(seq_str, &existing_data).ok()) {
+    if (existing_data == data || SameEntry(existing_data, full_data)) {
       return this->OK;
     }
     return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
   }
-  CHECK_EQ(status, util::Status::OK);
+
+  // The chain certificates have to be there before any entry refers to
+  // them.
+  for (const auto& cert : chain_certs) {
+    if (chain_certs_.Contains(cert.first)) {
+      continue;
+    }
+    const util::Status status(meta_storage_->CreateEntry(
+        kMetaChainCertPrefix + cert.first, cert.second));
+    CHECK(status.ok() ||
+          status.CanonicalCode() == util::error::ALREADY_EXISTS)
+        << status;
+    chain_certs_.Insert(cert.first, cert.second);
+  }
+
+  CHECK_EQ(cert_storage_->CreateEntry(seq_str, data), util::Status::OK);
 
   InsertEntryMapping(logged.sequence_number(), logged.Hash());
 
@@ -157,7 +184,7 @@ typename Database<Logged>::LookupResult FileDB<Logged>::LookupByHash(
   CHECK_EQ(status, util::Status::OK);
 
   Logged logged;
-  CHECK(logged.ParseFromString(cert_data));
+  CHECK(ParseEntry(cert_data, &logged));
   CHECK_EQ(logged.Hash(), hash);
 
   if (result) {
@@ -182,7 +209,7 @@ typename Database<Logged>::LookupResult FileDB<Logged>::LookupByIndex(
     return this->NOT_FOUND;
   }
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(ParseEntry(cert_data, result));
     CHECK_EQ(result->sequence_number(), sequence_number);
   }
   return this->LOOKUP_OK;
@@ -368,6 +395,47 @@ typename Database<Logged>::LookupResult FileDB<Logged>::LatestTreeHeadNoLock(
 }
 
 
+template <class Logged>
+bool FileDB<Logged>::ParseEntry(const std::string& data,
+                                Logged* entry) const {
+  using std::placeholders::_1;
+  using std::placeholders::_2;
+  return entry->ParseFromString(data) &&
+         entry->RestoreChain(
+             std::bind(&FileDB<Logged>::LookupChainCert, this, _1, _2));
+}
+
+
+template <class Logged>
+bool FileDB<Logged>::LookupChainCert(const std::string& hash,
+                                     std::string* cert) const {
+  if (chain_certs_.Lookup(hash, cert)) {
+    return true;
+  }
+
+  if (!meta_storage_->LookupEntry(kMetaChainCertPrefix + hash, cert).ok()) {
+    return false;
+  }
+  chain_certs_.Insert(hash, *cert);
+
+  return true;
+}
+
+
+// Compares the entries independently of whether their chains are
+// interned or not.
+template <class Logged>
+bool FileDB<Logged>::SameEntry(const std::string& stored_data,
+                               const std::string& full_data) const {
+  Logged stored;
+  CHECK(ParseEntry(stored_data, &stored));
+  std::string stored_full_data;
+  CHECK(stored.SerializeToString(&stored_full_data));
+
+  return stored_full_data == full_data;
+}
+
+
 // This must be called with "lock_" held.
 template <class Logged>
 void FileDB<Logged>::InsertEntryMapping(int64_t sequence_number,
@@ -81,6 +81,11 @@ class FileDB : public Database<Logged> {
   typename Database<Logged>::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
   void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  // Parses a stored entry, restoring its chain if it was interned.
+  bool ParseEntry(const std::string& data, Logged* entry) const;
+  bool LookupChainCert(const std::string& hash, std::string* cert) const;
+  bool SameEntry(const std::string& stored_data,
+                 const std::string& full_data) const;
 
   const std::unique_ptr<cert_trans::FileStorage> cert_storage_;
   // Store all tree heads, but currently only support looking up the latest
@@ -88,6 +93,7 @@ class FileDB : public Database<Logged> {
   // Other necessary lookup indices (by tree size, by timestamp range?) TBD.
   const std::unique_ptr<cert_trans::FileStorage> tree_storage_;
 
+  // Also holds the interned chain certificates.
   const std::unique_ptr<cert_trans::FileStorage> meta_storage_;
 
   mutable std::mutex lock_;
@@ -104,6 +110,7 @@ class FileDB : public Database<Logged> {
   // The same as a string;
   std::string latest_timestamp_key_;
   cert_trans::DatabaseNotifierHelper callbacks_;
+  mutable cert_trans::ChainCertCache chain_certs_;
 
   DISALLOW_COPY_AND_ASSIGN(FileDB);
 };
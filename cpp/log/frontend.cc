@@ -1,6 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/frontend.h"
 
+#include <functional>
 #include <glog/logging.h>
 
 #include "log/cert.h"
@@ -9,15 +10,19 @@
 #include "monitoring/event_metric.h"
 #include "proto/ct.pb.h"
 #include "util/status.h"
+#include "util/task.h"
 
 using cert_trans::CertChain;
 using cert_trans::PreCertChain;
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::bind;
+using std::placeholders::_1;
 using std::string;
 using std::lock_guard;
 using std::mutex;
 using util::Status;
+using util::Task;
 
 namespace {
 
@@ -37,6 +42,10 @@ Status UpdateStats(ct::LogEntryType type, const Status& status) {
   return status;
 }
 
+void QueueEntryDone(ct::LogEntryType type, Task* task, Task* queue_task) {
+  task->Return(UpdateStats(type, queue_task->status()));
+}
+
 }  // namespace
 
 Frontend::Frontend(CertSubmissionHandler* handler, FrontendSigner* signer)
@@ -73,3 +82,35 @@ Status Frontend::QueuePreCertEntry(PreCertChain* chain,
   return QueueProcessedEntry(handler_->ProcessPreCertSubmission(chain, &entry),
                              entry, sct);
 }
+
+void Frontend::QueueProcessedEntry(Status pre_status, const LogEntry& entry,
+                                   SignedCertificateTimestamp* sct,
+                                   Task* task) {
+  if (!pre_status.ok()) {
+    task->Return(UpdateStats(entry.type(), pre_status));
+    return;
+  }
+
+  // Step 2. Submit to database.
+  signer_->QueueEntry(entry, sct, task->AddChild(bind(&QueueEntryDone,
+                                                      entry.type(), task,
+                                                      _1)));
+}
+
+void Frontend::QueueX509Entry(CertChain* chain,
+                              SignedCertificateTimestamp* sct, Task* task) {
+  LogEntry entry;
+  // Make sure the correct statistics get updated in case of error.
+  entry.set_type(ct::X509_ENTRY);
+  QueueProcessedEntry(handler_->ProcessX509Submission(chain, &entry), entry,
+                      sct, task);
+}
+
+void Frontend::QueuePreCertEntry(PreCertChain* chain,
+                                 SignedCertificateTimestamp* sct, Task* task) {
+  LogEntry entry;
+  // Make sure the correct statistics get updated in case of error.
+  entry.set_type(ct::PRECERT_ENTRY);
+  QueueProcessedEntry(handler_->ProcessPreCertSubmission(chain, &entry),
+                      entry, sct, task);
+}
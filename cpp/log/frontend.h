@@ -14,6 +14,7 @@ class FrontendSigner;
 
 namespace util {
 class Status;
+class Task;
 }  // namespace util
 
 // Frontend for accepting new submissions.
@@ -29,6 +30,15 @@ class Frontend {
   util::Status QueuePreCertEntry(cert_trans::PreCertChain* chain,
                                  ct::SignedCertificateTimestamp* sct);
 
+  // Asynchronous versions of the above. The chain is checked on the
+  // calling thread, but the database lookup is done asynchronously,
+  // with the status returned through "task".
+  void QueueX509Entry(cert_trans::CertChain* chain,
+                      ct::SignedCertificateTimestamp* sct, util::Task* task);
+  void QueuePreCertEntry(cert_trans::PreCertChain* chain,
+                         ct::SignedCertificateTimestamp* sct,
+                         util::Task* task);
+
   const std::multimap<std::string, const cert_trans::Cert*>& GetRoots() const {
     return handler_->GetRoots();
   }
@@ -40,6 +50,9 @@ class Frontend {
   util::Status QueueProcessedEntry(util::Status pre_status,
                                    const ct::LogEntry& entry,
                                    ct::SignedCertificateTimestamp* sct);
+  void QueueProcessedEntry(util::Status pre_status, const ct::LogEntry& entry,
+                           ct::SignedCertificateTimestamp* sct,
+                           util::Task* task);
 
   DISALLOW_COPY_AND_ASSIGN(Frontend);
 };
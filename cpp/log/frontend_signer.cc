@@ -1,6 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/frontend_signer.h"
 
+#include <functional>
 #include <glog/logging.h>
 
 #include "log/database.h"
@@ -9,6 +10,7 @@
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/status.h"
+#include "util/task.h"
 #include "util/util.h"
 
 
@@ -16,8 +18,11 @@ using cert_trans::ConsistentStore;
 using cert_trans::LoggedCertificate;
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::bind;
+using std::placeholders::_1;
 using std::string;
 using util::Status;
+using util::Task;
 
 FrontendSigner::FrontendSigner(Database<cert_trans::LoggedCertificate>* db,
                                ConsistentStore<LoggedCertificate>* store,
@@ -39,9 +44,13 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
   // a copy of this if the cert was added recently, but it's not fatal if the
   // same cert gets added twice.
   // TODO(ekasper): switch to using SignedEntryWithType as the DB key.
+  // Most submissions are new, and the hash filter usually spares us
+  // the lookup for those.
   cert_trans::LoggedCertificate logged;
   Database<cert_trans::LoggedCertificate>::LookupResult db_result =
-      db_->LookupByHash(sha256_hash, &logged);
+      db_->MayContainHash(sha256_hash)
+          ? db_->LookupByHash(sha256_hash, &logged)
+          : Database<cert_trans::LoggedCertificate>::NOT_FOUND;
 
   if (db_result == Database<cert_trans::LoggedCertificate>::LOOKUP_OK) {
     // If we did find a local copy, return the previously issued SCT.
@@ -53,14 +62,65 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
   }
   CHECK_EQ(Database<cert_trans::LoggedCertificate>::NOT_FOUND, db_result);
 
-  // Dont have the cert locally, so create an SCT and store it and the cert.
-  SignedCertificateTimestamp local_sct;
-  TimestampAndSign(entry, &local_sct);
+  return QueueNewEntry(entry, sha256_hash, sct);
+}
+
+
+void FrontendSigner::QueueEntry(const LogEntry& entry,
+                                SignedCertificateTimestamp* sct, Task* task) {
+  CHECK_NOTNULL(task);
+  const string sha256_hash(
+      Sha256Hasher::Sha256Digest(Serializer::LeafCertificate(entry)));
+  CHECK(!sha256_hash.empty());
+
+  if (!db_->MayContainHash(sha256_hash)) {
+    QueueNewEntry(entry, sha256_hash, sct, task);
+    return;
+  }
+
+  // The caller's entry might be gone by the time the lookup is done.
+  LogEntry* const entry_copy(new LogEntry(entry));
+  task->DeleteWhenDone(entry_copy);
+  LoggedCertificate* const logged(new LoggedCertificate);
+  task->DeleteWhenDone(logged);
+
+  db_->AsyncLookupByHash(sha256_hash, logged,
+                         task->AddChild(bind(&FrontendSigner::LookupDone,
+                                             this, entry_copy, sha256_hash,
+                                             logged, sct, task, _1)));
+}
+
+
+void FrontendSigner::LookupDone(const LogEntry* entry,
+                                const string& sha256_hash,
+                                const LoggedCertificate* logged,
+                                SignedCertificateTimestamp* sct, Task* task,
+                                Task* lookup_task) {
+  if (lookup_task->status().ok()) {
+    // Same as the synchronous version, return the previously issued
+    // SCT.
+    if (sct != nullptr) {
+      *sct = logged->sct();
+    }
+    task->Return(Status(util::error::ALREADY_EXISTS,
+                        "entry already exists in Database"));
+    return;
+  }
+
+  if (lookup_task->status().CanonicalCode() != util::error::NOT_FOUND) {
+    task->Return(lookup_task->status());
+    return;
+  }
 
+  QueueNewEntry(*entry, sha256_hash, sct, task);
+}
+
+
+Status FrontendSigner::QueueNewEntry(const LogEntry& entry,
+                                     const string& sha256_hash,
+                                     SignedCertificateTimestamp* sct) {
   cert_trans::LoggedCertificate new_logged;
-  new_logged.mutable_sct()->CopyFrom(local_sct);
-  new_logged.mutable_entry()->CopyFrom(entry);
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
+  CreateLogged(entry, sha256_hash, &new_logged);
 
   // If this cert has already been added (but not yet integrated into the
   // tree), then this call will update new_logged.sct with the previously
@@ -76,6 +136,47 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
 }
 
 
+void FrontendSigner::QueueNewEntry(const LogEntry& entry,
+                                   const string& sha256_hash,
+                                   SignedCertificateTimestamp* sct,
+                                   Task* task) {
+  LoggedCertificate* const new_logged(new LoggedCertificate);
+  task->DeleteWhenDone(new_logged);
+  CreateLogged(entry, sha256_hash, new_logged);
+
+  // The store may batch this with other submissions.
+  store_->AddPendingEntry(new_logged,
+                          task->AddChild(bind(
+                              &FrontendSigner::AddPendingEntryDone, this,
+                              new_logged, sct, task, _1)));
+}
+
+
+void FrontendSigner::AddPendingEntryDone(const LoggedCertificate* logged,
+                                         SignedCertificateTimestamp* sct,
+                                         Task* task, Task* add_task) {
+  // As with the synchronous version, this might be a previously
+  // issued SCT.
+  if (sct != nullptr) {
+    *sct = logged->sct();
+  }
+  task->Return(add_task->status());
+}
+
+
+void FrontendSigner::CreateLogged(const LogEntry& entry,
+                                  const string& sha256_hash,
+                                  LoggedCertificate* logged) const {
+  // Dont have the cert locally, so create an SCT and store it and the cert.
+  SignedCertificateTimestamp local_sct;
+  TimestampAndSign(entry, &local_sct);
+
+  logged->mutable_sct()->CopyFrom(local_sct);
+  logged->mutable_entry()->CopyFrom(entry);
+  CHECK_EQ(logged->Hash(), sha256_hash);
+}
+
+
 void FrontendSigner::TimestampAndSign(const LogEntry& entry,
                                       SignedCertificateTimestamp* sct) const {
   sct->set_version(ct::V1);
@@ -14,6 +14,7 @@ class LogSigner;
 
 namespace util {
 class Status;
+class Task;
 }  // namespace util
 
 
@@ -32,7 +33,28 @@ class FrontendSigner {
   util::Status QueueEntry(const ct::LogEntry& entry,
                           ct::SignedCertificateTimestamp* sct);
 
+  // Same as above, but uses the asynchronous database and consistent
+  // store APIs, and returns the status through "task".
+  void QueueEntry(const ct::LogEntry& entry,
+                  ct::SignedCertificateTimestamp* sct, util::Task* task);
+
  private:
+  void LookupDone(const ct::LogEntry* entry, const std::string& sha256_hash,
+                  const cert_trans::LoggedCertificate* logged,
+                  ct::SignedCertificateTimestamp* sct, util::Task* task,
+                  util::Task* lookup_task);
+  // Signs and stores an entry that is not in the database yet.
+  util::Status QueueNewEntry(const ct::LogEntry& entry,
+                             const std::string& sha256_hash,
+                             ct::SignedCertificateTimestamp* sct);
+  void QueueNewEntry(const ct::LogEntry& entry,
+                     const std::string& sha256_hash,
+                     ct::SignedCertificateTimestamp* sct, util::Task* task);
+  void AddPendingEntryDone(const cert_trans::LoggedCertificate* logged,
+                           ct::SignedCertificateTimestamp* sct,
+                           util::Task* task, util::Task* add_task);
+  void CreateLogged(const ct::LogEntry& entry, const std::string& sha256_hash,
+                    cert_trans::LoggedCertificate* logged) const;
   void TimestampAndSign(const ct::LogEntry& entry,
                         ct::SignedCertificateTimestamp* sct) const;
 
@@ -22,6 +22,7 @@
 #include "util/mock_masterelection.h"
 #include "util/status.h"
 #include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
@@ -46,6 +47,7 @@ using std::unique_ptr;
 using std::vector;
 using testing::_;
 using testing::NiceMock;
+using util::SyncTask;
 using util::testing::StatusIs;
 
 typedef Database<LoggedCertificate> DB;
@@ -193,6 +195,38 @@ TYPED_TEST(FrontendSignerTest, LogDuplicatesDifferentChain) {
   EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
 }
 
+TYPED_TEST(FrontendSignerTest, AsyncQueueEntry) {
+  LogEntry entry0, entry1;
+  this->test_signer_.CreateUnique(&entry0);
+  this->test_signer_.CreateUnique(&entry1);
+
+  SignedCertificateTimestamp sct0;
+  {
+    SyncTask task(&this->pool_);
+    this->frontend_.QueueEntry(entry0, &sct0, task.task());
+    task.Wait();
+    EXPECT_OK(task.status());
+  }
+  EXPECT_EQ(this->verifier_.VerifySignedCertificateTimestamp(entry0, sct0),
+            LogVerifier::VERIFY_OK);
+
+  // Once the entry is in the database, its SCT is returned.
+  LoggedCertificate logged;
+  logged.mutable_entry()->CopyFrom(entry1);
+  logged.mutable_sct()->set_timestamp(1234);
+  logged.set_sequence_number(0);
+  EXPECT_EQ(DB::OK, this->db()->CreateSequencedEntry(logged));
+
+  SignedCertificateTimestamp sct1;
+  {
+    SyncTask task(&this->pool_);
+    this->frontend_.QueueEntry(entry1, &sct1, task.task());
+    task.Wait();
+    EXPECT_THAT(task.status(), StatusIs(util::error::ALREADY_EXISTS, _));
+  }
+  EXPECT_EQ(logged.sct().timestamp(), sct1.timestamp());
+}
+
 TYPED_TEST(FrontendSignerTest, Verify) {
   LogEntry entry0, entry1;
   this->test_signer_.CreateUnique(&entry0);
@@ -3,22 +3,39 @@
 
 #include "log/leveldb_db.h"
 
+#include <functional>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <leveldb/write_batch.h>
 #include <map>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "monitoring/monitoring.h"
 #include "monitoring/latency.h"
+#include "util/compression.h"
 #include "util/util.h"
 
 DEFINE_int32(leveldb_max_open_files, 0,
              "number of open files that can be used by leveldb");
 DEFINE_int32(leveldb_bloom_filter_bits_per_key, 0,
              "number of open files that can be used by leveldb");
+DEFINE_bool(leveldb_compress_entries, false,
+            "Compress entries with a dictionary trained on the entries "
+            "already in the database. Compressed entries cannot be read by "
+            "older binaries.");
+DEFINE_int32(leveldb_compression_dictionary_samples, 1000,
+             "number of entries the compression dictionary is trained on, "
+             "no dictionary is trained until the database has that many "
+             "entries");
+DEFINE_bool(leveldb_retrain_compression_dictionary, false,
+            "train a new version of the compression dictionary when opening "
+            "the database, existing entries keep the version they were "
+            "compressed with");
+DECLARE_bool(db_intern_chain_certs);
 
 namespace {
 
@@ -32,6 +49,12 @@ const char kMetaNodeIdKey[] = "metadata";
 const char kEntryPrefix[] = "entry-";
 const char kTreeHeadPrefix[] = "sth-";
 const char kMetaPrefix[] = "meta-";
+const char kChainCertPrefix[] = "chaincert-";
+const char kDictionaryPrefix[] = "meta-dictionary-";
+const size_t kDictionaryVersionBytes = 4;
+// Serialized protobufs never start with a zero byte, as this would be
+// a field number of zero.
+const char kCompressedEntryMarker = '\0';
 
 
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
@@ -62,6 +85,12 @@ std::string IndexToKey(int64_t index) {
 }
 
 
+std::string DictionaryKey(uint32_t version) {
+  return kDictionaryPrefix +
+         Serializer::SerializeUint(version, kDictionaryVersionBytes);
+}
+
+
 int64_t KeyToIndex(leveldb::Slice key) {
   CHECK(key.starts_with(kEntryPrefix));
   key.remove_prefix(strlen(kEntryPrefix));
@@ -84,7 +113,8 @@ template <class Logged>
 class LevelDB<Logged>::Iterator : public Database<Logged>::Iterator {
  public:
   Iterator(const LevelDB<Logged>* db, int64_t start_index)
-      : it_(CHECK_NOTNULL(db)->db_->NewIterator(leveldb::ReadOptions())) {
+      : db_(CHECK_NOTNULL(db)),
+        it_(db_->db_->NewIterator(leveldb::ReadOptions())) {
     CHECK(it_);
     it_->Seek(IndexToKey(start_index));
   }
@@ -95,7 +125,7 @@ class LevelDB<Logged>::Iterator : public Database<Logged>::Iterator {
     }
 
     const int64_t seq(KeyToIndex(it_->key()));
-    CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
+    CHECK(db_->ParseEntry(it_->value(), entry))
         << "failed to parse entry for key " << it_->key().ToString();
     CHECK(entry->has_sequence_number())
         << "no sequence number for entry with expected sequence number "
@@ -108,6 +138,7 @@ class LevelDB<Logged>::Iterator : public Database<Logged>::Iterator {
   }
 
  private:
+  const LevelDB<Logged>* const db_;
   const std::unique_ptr<leveldb::Iterator> it_;
 };
 
@@ -146,6 +177,12 @@ LevelDB<Logged>::LevelDB(const std::string& dbfile)
 }
 
 
+template <class Logged>
+LevelDB<Logged>::~LevelDB() {
+  this->ShutdownIO();
+}
+
+
 template <class Logged>
 typename Database<Logged>::WriteResult LevelDB<Logged>::CreateSequencedEntry_(
     const Logged& logged) {
@@ -156,8 +193,20 @@ typename Database<Logged>::WriteResult LevelDB<Logged>::CreateSequencedEntry_(
 
   std::unique_lock<std::mutex> lock(lock_);
 
+  std::string full_data;
+  CHECK(logged.SerializeToString(&full_data));
+
   std::string data;
-  CHECK(logged.SerializeToString(&data));
+  std::map<std::string, std::string> chain_certs;
+  if (FLAGS_db_intern_chain_certs) {
+    Logged interned;
+    interned.CopyFrom(logged);
+    interned.InternChain(&chain_certs);
+    CHECK(interned.SerializeToString(&data));
+  } else {
+    data = full_data;
+  }
+  data = EncodeEntry(data);
 
   const std::string key(IndexToKey(logged.sequence_number()));
 
@@ -165,12 +214,24 @@ typename Database<Logged>::WriteResult LevelDB<Logged>::CreateSequencedEntry_(
   leveldb::Status status(
       db_->Get(leveldb::ReadOptions(), key, &existing_data));
   if (status.IsNotFound()) {
-    status = db_->Put(leveldb::WriteOptions(), key, data);
+    // Write the new chain certificates along with the entry, so that
+    // an entry never refers to a missing certificate.
+    leveldb::WriteBatch batch;
+    for (const auto& cert : chain_certs) {
+      if (!chain_certs_.Contains(cert.first)) {
+        batch.Put(kChainCertPrefix + cert.first, cert.second);
+      }
+    }
+    batch.Put(key, data);
+    status = db_->Write(leveldb::WriteOptions(), &batch);
     CHECK(status.ok()) << "Failed to write sequenced entry (seq: "
                        << logged.sequence_number()
                        << "): " << status.ToString();
+    for (const auto& cert : chain_certs) {
+      chain_certs_.Insert(cert.first, cert.second);
+    }
   } else {
-    if (existing_data == data) {
+    if (existing_data == data || SameEntry(existing_data, full_data)) {
       return this->OK;
     }
     return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
@@ -178,6 +239,15 @@ typename Database<Logged>::WriteResult LevelDB<Logged>::CreateSequencedEntry_(
 
   InsertEntryMapping(logged.sequence_number(), logged.Hash());
 
+  // Train the dictionary only once, when there are just enough
+  // entries, whether or not it is successful.
+  if (FLAGS_leveldb_compress_entries &&
+      static_cast<int64_t>(id_by_hash_.size()) ==
+          FLAGS_leveldb_compression_dictionary_samples &&
+      !HasCompressionDictionary()) {
+    TrainCompressionDictionary();
+  }
+
   return this->OK;
 }
 
@@ -205,7 +275,7 @@ typename Database<Logged>::LookupResult LevelDB<Logged>::LookupByHash(
                      << "): " << status.ToString();
 
   Logged logged;
-  CHECK(logged.ParseFromString(cert_data));
+  CHECK(ParseEntry(cert_data, &logged));
   CHECK_EQ(logged.Hash(), hash);
 
   if (result) {
@@ -233,7 +303,7 @@ typename Database<Logged>::LookupResult LevelDB<Logged>::LookupByIndex(
                      << sequence_number;
 
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(ParseEntry(cert_data, result));
     CHECK_EQ(result->sequence_number(), sequence_number);
   }
 
@@ -378,6 +448,8 @@ void LevelDB<Logged>::BuildIndex() {
   // this should not be necessarily, but just to be sure...
   std::lock_guard<std::mutex> lock(lock_);
 
+  LoadCompressionDictionaries();
+
   leveldb::ReadOptions options;
   options.fill_cache = false;
   std::unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
@@ -386,8 +458,10 @@ void LevelDB<Logged>::BuildIndex() {
 
   for (; it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
     const int64_t seq(KeyToIndex(it->key()));
+    std::string serialized;
     Logged logged;
-    CHECK(logged.ParseFromString(it->value().ToString()))
+    CHECK(DecodeEntry(it->value(), &serialized) &&
+          logged.ParseFromString(serialized))
         << "Failed to parse entry with sequence number " << seq;
     CHECK(logged.has_sequence_number())
         << "No sequence number for entry with sequence number " << seq;
@@ -408,6 +482,14 @@ void LevelDB<Logged>::BuildIndex() {
                  latest_timestamp_key_, LevelDB::kTimestampBytesIndexed,
                  &latest_tree_timestamp_));
   }
+
+  if (FLAGS_leveldb_compress_entries &&
+      static_cast<int64_t>(id_by_hash_.size()) >=
+          FLAGS_leveldb_compression_dictionary_samples &&
+      (FLAGS_leveldb_retrain_compression_dictionary ||
+       !HasCompressionDictionary())) {
+    TrainCompressionDictionary();
+  }
 }
 
 
@@ -432,6 +514,203 @@ typename Database<Logged>::LookupResult LevelDB<Logged>::LatestTreeHeadNoLock(
 }
 
 
+template <class Logged>
+bool LevelDB<Logged>::DecodeEntry(const leveldb::Slice& data,
+                                  std::string* serialized) const {
+  if (data.empty() || data[0] != kCompressedEntryMarker) {
+    serialized->assign(data.data(), data.size());
+    return true;
+  }
+
+  const size_t header_size(1 + kDictionaryVersionBytes);
+  uint32_t version;
+  if (data.size() < header_size ||
+      Deserializer::DeserializeUint<uint32_t>(
+          std::string(data.data() + 1, kDictionaryVersionBytes),
+          kDictionaryVersionBytes, &version) != Deserializer::OK) {
+    LOG(WARNING) << "Truncated compressed entry";
+    return false;
+  }
+
+  std::shared_ptr<const cert_trans::DictionaryCompressor> compressor;
+  {
+    std::lock_guard<std::mutex> lock(compressors_lock_);
+    const auto it(compressors_.find(version));
+    if (it == compressors_.end()) {
+      LOG(WARNING) << "Unknown compression dictionary version " << version;
+      return false;
+    }
+    compressor = it->second;
+  }
+
+  return compressor->Decompress(std::string(data.data() + header_size,
+                                            data.size() - header_size),
+                                serialized);
+}
+
+
+template <class Logged>
+std::string LevelDB<Logged>::EncodeEntry(const std::string& serialized) const {
+  if (!FLAGS_leveldb_compress_entries) {
+    return serialized;
+  }
+
+  uint32_t version;
+  std::shared_ptr<const cert_trans::DictionaryCompressor> compressor;
+  {
+    std::lock_guard<std::mutex> lock(compressors_lock_);
+    if (compressors_.empty()) {
+      return serialized;
+    }
+    version = compressors_.rbegin()->first;
+    compressor = compressors_.rbegin()->second;
+  }
+
+  std::string compressed;
+  if (!compressor->Compress(serialized, &compressed) ||
+      1 + kDictionaryVersionBytes + compressed.size() >= serialized.size()) {
+    return serialized;
+  }
+
+  return std::string(1, kCompressedEntryMarker) +
+         Serializer::SerializeUint(version, kDictionaryVersionBytes) +
+         compressed;
+}
+
+
+template <class Logged>
+bool LevelDB<Logged>::ParseEntry(const leveldb::Slice& data,
+                                 Logged* entry) const {
+  using std::placeholders::_1;
+  using std::placeholders::_2;
+  std::string serialized;
+  return DecodeEntry(data, &serialized) &&
+         entry->ParseFromString(serialized) &&
+         entry->RestoreChain(
+             std::bind(&LevelDB<Logged>::LookupChainCert, this, _1, _2));
+}
+
+
+template <class Logged>
+bool LevelDB<Logged>::LookupChainCert(const std::string& hash,
+                                      std::string* cert) const {
+  if (chain_certs_.Lookup(hash, cert)) {
+    return true;
+  }
+
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), kChainCertPrefix + hash, cert));
+  if (status.IsNotFound()) {
+    return false;
+  }
+  CHECK(status.ok()) << "Failed to get chain certificate "
+                     << util::HexString(hash) << ": " << status.ToString();
+  chain_certs_.Insert(hash, *cert);
+
+  return true;
+}
+
+
+// Compares the entries independently of whether their chains are
+// interned or not.
+template <class Logged>
+bool LevelDB<Logged>::SameEntry(const std::string& stored_data,
+                                const std::string& full_data) const {
+  Logged stored;
+  CHECK(ParseEntry(stored_data, &stored));
+  std::string stored_full_data;
+  CHECK(stored.SerializeToString(&stored_full_data));
+
+  return stored_full_data == full_data;
+}
+
+
+template <class Logged>
+bool LevelDB<Logged>::HasCompressionDictionary() const {
+  std::lock_guard<std::mutex> lock(compressors_lock_);
+  return !compressors_.empty();
+}
+
+
+template <class Logged>
+void LevelDB<Logged>::LoadCompressionDictionaries() {
+  std::unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  CHECK(it);
+
+  std::lock_guard<std::mutex> lock(compressors_lock_);
+  for (it->Seek(kDictionaryPrefix);
+       it->Valid() && it->key().starts_with(kDictionaryPrefix); it->Next()) {
+    leveldb::Slice key_slice(it->key());
+    key_slice.remove_prefix(strlen(kDictionaryPrefix));
+    uint32_t version;
+    CHECK_EQ(Deserializer::OK,
+             Deserializer::DeserializeUint<uint32_t>(key_slice.ToString(),
+                                                     kDictionaryVersionBytes,
+                                                     &version));
+    compressors_[version].reset(
+        new cert_trans::DictionaryCompressor(it->value().ToString()));
+  }
+}
+
+
+template <class Logged>
+void LevelDB<Logged>::TrainCompressionDictionary() {
+  CHECK_GT(FLAGS_leveldb_compression_dictionary_samples, 0);
+  cert_trans::ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("train_compression_dictionary"));
+
+  // Spread the samples over the whole log.
+  const size_t max_samples(FLAGS_leveldb_compression_dictionary_samples);
+  const int64_t stride(
+      std::max<int64_t>(1, id_by_hash_.size() / max_samples));
+
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  std::unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  std::vector<std::string> samples;
+  int64_t i(0);
+  for (it->Seek(kEntryPrefix); it->Valid() &&
+                               it->key().starts_with(kEntryPrefix) &&
+                               samples.size() < max_samples;
+       it->Next(), ++i) {
+    if (i % stride != 0) {
+      continue;
+    }
+    std::string serialized;
+    CHECK(DecodeEntry(it->value(), &serialized))
+        << "Failed to decode entry for key " << it->key().ToString();
+    samples.emplace_back(std::move(serialized));
+  }
+
+  const std::string dictionary(cert_trans::TrainCompressionDictionary(
+      samples, cert_trans::DictionaryCompressor::kMaxDictionarySize));
+  if (dictionary.empty()) {
+    LOG(WARNING) << "Entries have too little in common for a compression "
+                 << "dictionary";
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(compressors_lock_);
+  const uint32_t version(
+      compressors_.empty() ? 1 : compressors_.rbegin()->first + 1);
+  // The dictionary must be on disk before any entry refers to it.
+  leveldb::WriteOptions opts;
+  opts.sync = true;
+  const leveldb::Status status(
+      db_->Put(opts, DictionaryKey(version), dictionary));
+  CHECK(status.ok()) << "Failed to write compression dictionary: "
+                     << status.ToString();
+  compressors_[version].reset(
+      new cert_trans::DictionaryCompressor(dictionary));
+
+  LOG(INFO) << "Trained compression dictionary version " << version << " ("
+            << dictionary.size() << " bytes) on " << samples.size()
+            << " entries";
+}
+
+
 // This must be called with "lock_" held.
 template <class Logged>
 void LevelDB<Logged>::InsertEntryMapping(int64_t sequence_number,
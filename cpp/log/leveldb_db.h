@@ -21,6 +21,7 @@
 #include "util/statusor.h"
 
 namespace cert_trans {
+class DictionaryCompressor;
 class FileStorage;
 }
 
@@ -30,7 +31,7 @@ class LevelDB : public Database<Logged> {
   static const size_t kTimestampBytesIndexed;
 
   explicit LevelDB(const std::string& dbfile);
-  ~LevelDB() = default;
+  ~LevelDB();
 
   // Implement abstract functions, see database.h for comments.
   typename Database<Logged>::WriteResult CreateSequencedEntry_(
@@ -71,6 +72,22 @@ class LevelDB : public Database<Logged> {
   typename Database<Logged>::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
   void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  // Returns the serialized entry, decompressing it if needed.
+  bool DecodeEntry(const leveldb::Slice& data, std::string* serialized) const;
+  // Compresses with the latest dictionary, if there is one, and it
+  // actually saves space.
+  std::string EncodeEntry(const std::string& serialized) const;
+  // Parses a stored entry, restoring its chain if it was interned.
+  bool ParseEntry(const leveldb::Slice& data, Logged* entry) const;
+  bool LookupChainCert(const std::string& hash, std::string* cert) const;
+  bool SameEntry(const std::string& stored_data,
+                 const std::string& full_data) const;
+  bool HasCompressionDictionary() const;
+  void LoadCompressionDictionaries();
+  // Trains and stores a new version of the compression dictionary
+  // from a sample of the entries. This must be called with "lock_"
+  // held.
+  void TrainCompressionDictionary();
 
   mutable std::mutex lock_;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
@@ -91,6 +108,14 @@ class LevelDB : public Database<Logged> {
   uint64_t latest_tree_timestamp_;
   std::string latest_timestamp_key_;
   cert_trans::DatabaseNotifierHelper callbacks_;
+  mutable cert_trans::ChainCertCache chain_certs_;
+
+  // Compression dictionaries, by version. Entries keep the version
+  // they were compressed with, and new ones use the latest.
+  mutable std::mutex compressors_lock_;
+  std::map<uint32_t,
+           std::shared_ptr<const cert_trans::DictionaryCompressor>>
+      compressors_;
 
   DISALLOW_COPY_AND_ASSIGN(LevelDB);
 };
@@ -0,0 +1,969 @@
+#ifndef CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_INL_H_
+#define CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_INL_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+
+#include "log/local_consistent_store.h"
+#include "monitoring/monitoring.h"
+#include "util/util.h"
+
+DECLARE_int32(local_store_compaction_records);
+
+namespace cert_trans {
+namespace {
+
+// Keys of the entries, as returned by EntryHandle::Key(). They are the
+// same as the etcd paths used by EtcdConsistentStore.
+const char kLocalClusterConfigKey[] = "/cluster_config";
+const char kLocalEntriesDir[] = "/entries/";
+const char kLocalSequenceMappingKey[] = "/sequence_mapping";
+const char kLocalServingSthKey[] = "/serving_sth";
+const char kLocalNodesDir[] = "/nodes/";
+
+// Each record is framed by its length, the CRC32 of that length, and
+// the CRC32 of the record, all as 4 bytes in network byte order. The
+// length having its own checksum tells a corrupted one apart from a
+// record cut short by a crash.
+const size_t kLocalRecordHeaderSize = 12;
+
+
+static Counter<>* local_store_syncs =
+    Counter<>::New("local_store_syncs",
+                   "Number of times the local store's write-ahead log was "
+                   "written to and fsync()ed.");
+
+static Counter<>* local_store_records =
+    Counter<>::New("local_store_records",
+                   "Number of records written to the local store's "
+                   "write-ahead log, excluding compactions.");
+
+static Counter<>* local_store_rejected_requests =
+    Counter<>::New("local_store_rejected_requests",
+                   "Number of pending entries rejected due to the number of "
+                   "pending entries in the local store.");
+
+
+void PutUint32(uint32_t value, std::string* out) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out->push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+
+uint32_t GetUint32(const std::string& in, size_t offset) {
+  uint32_t value(0);
+  for (size_t i = 0; i < 4; ++i) {
+    value = (value << 8) | static_cast<uint8_t>(in[offset + i]);
+  }
+  return value;
+}
+
+
+uint32_t RecordCrc(const char* data, size_t size) {
+  return crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(data),
+               size);
+}
+
+
+void AppendFramedRecord(const ct::LocalStoreRecord& record, std::string* out) {
+  std::string flat;
+  CHECK(record.SerializeToString(&flat));
+  const size_t start(out->size());
+  PutUint32(flat.size(), out);
+  PutUint32(RecordCrc(out->data() + start, 4), out);
+  PutUint32(RecordCrc(flat.data(), flat.size()), out);
+  out->append(flat);
+}
+
+
+void WriteFully(int fd, const std::string& data) {
+  size_t written(0);
+  while (written < data.size()) {
+    const ssize_t ret(
+        write(fd, data.data() + written, data.size() - written));
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    // The in-memory state already has the changes, there is no way to
+    // carry on safely.
+    PCHECK(ret > 0) << "Writing to the local store log failed";
+    written += ret;
+  }
+}
+
+
+void SyncParentDirectory(const std::string& file_name) {
+  const size_t slash(file_name.rfind('/'));
+  const std::string dir(slash == std::string::npos
+                            ? "."
+                            : slash == 0 ? "/" : file_name.substr(0, slash));
+  const int fd(open(dir.c_str(), O_RDONLY));
+  PCHECK(fd >= 0) << "Couldn't open " << dir;
+  PCHECK(fsync(fd) == 0) << "Couldn't fsync " << dir;
+  PCHECK(close(fd) == 0);
+}
+
+
+template <class Watches>
+bool RemoveWatch(util::Task* task, Watches* watches) {
+  for (auto it(watches->begin()); it != watches->end(); ++it) {
+    if (it->second == task) {
+      watches->erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+}  // namespace
+
+
+template <class Logged>
+LocalConsistentStore<Logged>::LocalConsistentStore(
+    const std::string& file_name, const std::string& node_id)
+    : file_name_(file_name),
+      node_id_(node_id),
+      exiting_(false),
+      fd_(-1),
+      index_(0),
+      records_in_log_(0),
+      num_appended_(0),
+      num_durable_(0),
+      sequence_mapping_(kLocalSequenceMappingKey, ct::SequenceMapping(), 0) {
+  CHECK(!file_name_.empty());
+  Replay();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Compact(&lock);
+  }
+  commit_thread_ =
+      std::thread(&LocalConsistentStore<Logged>::CommitLoop, this);
+}
+
+
+template <class Logged>
+LocalConsistentStore<Logged>::~LocalConsistentStore() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exiting_ = true;
+  }
+  commit_cv_.notify_all();
+  commit_thread_.join();
+
+  std::vector<util::Task*> watches;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (const auto& watch : serving_sth_watches_) {
+      watches.push_back(watch.second);
+    }
+    for (const auto& watch : node_state_watches_) {
+      watches.push_back(watch.second);
+    }
+    for (const auto& watch : cluster_config_watches_) {
+      watches.push_back(watch.second);
+    }
+    serving_sth_watches_.clear();
+    node_state_watches_.clear();
+    cluster_config_watches_.clear();
+    watch_callbacks_cv_.wait(lock,
+                             [this]() { return watch_callbacks_.empty(); });
+  }
+  for (const auto& task : watches) {
+    task->Return(util::Status::CANCELLED);
+  }
+
+  PCHECK(close(fd_) == 0);
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::Replay() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (access(file_name_.c_str(), F_OK) != 0) {
+    PCHECK(errno == ENOENT) << "Couldn't access " << file_name_;
+    LOG(WARNING) << "Creating new local store " << file_name_;
+    return;
+  }
+
+  std::string contents;
+  CHECK(util::ReadBinaryFile(file_name_, &contents)) << "Couldn't read "
+                                                     << file_name_;
+  size_t offset(0);
+  int64_t num_records(0);
+  while (contents.size() - offset >= kLocalRecordHeaderSize) {
+    const uint32_t size(GetUint32(contents, offset));
+    // Anything but a record cut short at the end of the log is
+    // corruption, and dropping it (the compaction that follows would
+    // make that permanent) could lose acknowledged writes.
+    CHECK_EQ(RecordCrc(contents.data() + offset, 4),
+             GetUint32(contents, offset + 4))
+        << "Corrupt record length at offset " << offset << " of "
+        << file_name_;
+    const uint32_t crc(GetUint32(contents, offset + 8));
+    const char* const data(contents.data() + offset + kLocalRecordHeaderSize);
+    const size_t available(contents.size() - offset - kLocalRecordHeaderSize);
+    if (available < size) {
+      break;
+    }
+    if (RecordCrc(data, size) != crc) {
+      // The file can be extended before the data in it is, so a torn
+      // write can also be of the right length, at the very end.
+      CHECK_EQ(available, size) << "Corrupt record at offset " << offset
+                                << " of " << file_name_;
+      break;
+    }
+    ct::LocalStoreRecord record;
+    CHECK(record.ParseFromArray(data, size)) << "Corrupt record at offset "
+                                             << offset << " of "
+                                             << file_name_;
+    ApplyRecord(lock, record);
+    offset += kLocalRecordHeaderSize + size;
+    ++num_records;
+  }
+
+  // We crashed in the middle of a write, it was never acknowledged.
+  LOG_IF(WARNING, offset < contents.size())
+      << "Dropping " << contents.size() - offset
+      << " byte(s) of partially written record at the end of " << file_name_;
+  LOG(INFO) << "Replayed " << num_records << " record(s) from " << file_name_
+            << ", index is " << index_;
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::ApplyRecord(
+    const std::unique_lock<std::mutex>& lock,
+    const ct::LocalStoreRecord& record) {
+  CHECK(lock.owns_lock());
+  const int64_t index(record.index());
+  index_ = std::max(index_, index);
+
+  if (record.has_pending_entry()) {
+    Logged entry;
+    CHECK(entry.ParseFromString(record.pending_entry()));
+    CachePendingEntry(lock, EntryHandle<Logged>(kLocalEntriesDir +
+                                                    util::HexString(
+                                                        entry.Hash()),
+                                                entry, index));
+  }
+  for (const auto& hash : record.cleaned_up_entry_hash()) {
+    UncachePendingEntry(lock, hash);
+  }
+  if (record.has_sequence_mapping()) {
+    sequence_mapping_.Set(kLocalSequenceMappingKey, record.sequence_mapping(),
+                          index);
+  }
+  if (record.has_serving_sth()) {
+    serving_sth_.reset(new EntryHandle<ct::SignedTreeHead>(
+        kLocalServingSthKey, record.serving_sth(), index));
+  }
+  if (record.has_node_state()) {
+    const std::string key(kLocalNodesDir + record.node_state().node_id());
+    node_states_[key] =
+        EntryHandle<ct::ClusterNodeState>(key, record.node_state(), index);
+  }
+  if (record.has_cluster_config()) {
+    cluster_config_.reset(new EntryHandle<ct::ClusterConfig>(
+        kLocalClusterConfigKey, record.cluster_config(), index));
+  }
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::Compact(std::unique_lock<std::mutex>* lock) {
+  CHECK(lock->owns_lock());
+  CHECK(unwritten_.empty());
+  int64_t num_records(0);
+  const std::string snapshot(Snapshot(*lock, &num_records));
+
+  // Changes made while this is written are appended to the new log
+  // afterwards, by this same thread.
+  lock->unlock();
+  const std::string tmp_name(file_name_ + ".tmp");
+  const int tmp_fd(
+      open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  PCHECK(tmp_fd >= 0) << "Couldn't create " << tmp_name;
+  WriteFully(tmp_fd, snapshot);
+  PCHECK(fsync(tmp_fd) == 0) << "Couldn't fsync " << tmp_name;
+  PCHECK(close(tmp_fd) == 0);
+  PCHECK(rename(tmp_name.c_str(), file_name_.c_str()) == 0)
+      << "Couldn't rename " << tmp_name << " to " << file_name_;
+  SyncParentDirectory(file_name_);
+
+  if (fd_ >= 0) {
+    PCHECK(close(fd_) == 0);
+  }
+  fd_ = open(file_name_.c_str(), O_WRONLY | O_APPEND);
+  PCHECK(fd_ >= 0) << "Couldn't open " << file_name_;
+  lock->lock();
+
+  LOG(INFO) << "Compacted " << file_name_ << " from " << records_in_log_
+            << " to " << num_records << " record(s)";
+  records_in_log_ = num_records;
+}
+
+
+template <class Logged>
+std::string LocalConsistentStore<Logged>::Snapshot(
+    const std::unique_lock<std::mutex>& lock, int64_t* num_records) const {
+  CHECK(lock.owns_lock());
+  CHECK_NOTNULL(num_records);
+
+  // Every record keeps the handle of what it sets as its index.
+  std::string snapshot;
+  *num_records = 0;
+  ct::LocalStoreRecord record;
+  if (cluster_config_) {
+    record.set_index(cluster_config_->Handle());
+    *record.mutable_cluster_config() = cluster_config_->Entry();
+    AppendFramedRecord(record, &snapshot);
+    ++*num_records;
+  }
+  if (serving_sth_) {
+    record.Clear();
+    record.set_index(serving_sth_->Handle());
+    *record.mutable_serving_sth() = serving_sth_->Entry();
+    AppendFramedRecord(record, &snapshot);
+    ++*num_records;
+  }
+  record.Clear();
+  record.set_index(sequence_mapping_.Handle());
+  *record.mutable_sequence_mapping() = sequence_mapping_.Entry();
+  AppendFramedRecord(record, &snapshot);
+  ++*num_records;
+  for (const auto& state : node_states_) {
+    record.Clear();
+    record.set_index(state.second.Handle());
+    *record.mutable_node_state() = state.second.Entry();
+    AppendFramedRecord(record, &snapshot);
+    ++*num_records;
+  }
+  for (const auto& entry : pending_entries_) {
+    record.Clear();
+    record.set_index(entry.second.Handle());
+    CHECK(entry.second.Entry().SerializeToString(
+        record.mutable_pending_entry()));
+    AppendFramedRecord(record, &snapshot);
+    ++*num_records;
+  }
+  // So that handles are never reused, even those of deleted things.
+  record.Clear();
+  record.set_index(index_);
+  AppendFramedRecord(record, &snapshot);
+  ++*num_records;
+
+  return snapshot;
+}
+
+
+template <class Logged>
+bool LocalConsistentStore<Logged>::ShouldCompact(
+    const std::unique_lock<std::mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  const int64_t num_live(pending_entries_.size() + node_states_.size() + 4);
+  return unwritten_.empty() &&
+         records_in_log_ >= FLAGS_local_store_compaction_records &&
+         records_in_log_ > 2 * num_live;
+}
+
+
+template <class Logged>
+int64_t LocalConsistentStore<Logged>::Append(
+    const std::unique_lock<std::mutex>& lock,
+    const ct::LocalStoreRecord& record, const NotifyFunction& notify) {
+  CHECK(lock.owns_lock());
+  CHECK(!exiting_);
+  CHECK_EQ(index_, record.index());
+  Write write;
+  AppendFramedRecord(record, &write.framed_record);
+  write.notify = notify;
+  unwritten_.emplace_back(std::move(write));
+  commit_cv_.notify_one();
+  return ++num_appended_;
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::WaitUntilDurable(
+    std::unique_lock<std::mutex>* lock, int64_t write_number) {
+  CHECK(lock->owns_lock());
+  durable_cv_.wait(*lock, [this, write_number]() {
+    return num_durable_ >= write_number;
+  });
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::CommitLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    commit_cv_.wait(lock,
+                    [this]() { return exiting_ || !unwritten_.empty(); });
+    if (unwritten_.empty()) {
+      CHECK(exiting_);
+      return;
+    }
+
+    // Everything written since the last time goes in with a single
+    // fsync().
+    std::vector<Write> batch;
+    batch.swap(unwritten_);
+    lock.unlock();
+
+    std::string data;
+    for (const auto& write : batch) {
+      data.append(write.framed_record);
+    }
+    WriteFully(fd_, data);
+    PCHECK(fdatasync(fd_) == 0) << "Couldn't fsync " << file_name_;
+    local_store_syncs->Increment();
+    local_store_records->IncrementBy(batch.size());
+
+    lock.lock();
+    num_durable_ += batch.size();
+    records_in_log_ += batch.size();
+    for (const auto& write : batch) {
+      if (write.notify) {
+        write.notify(lock);
+      }
+    }
+    std::vector<WaitingTask> done;
+    while (!waiting_tasks_.empty() &&
+           waiting_tasks_.front().write_number <= num_durable_) {
+      done.emplace_back(std::move(waiting_tasks_.front()));
+      waiting_tasks_.pop_front();
+    }
+    lock.unlock();
+    durable_cv_.notify_all();
+    for (const auto& waiting : done) {
+      waiting.task->Return(waiting.status);
+    }
+    lock.lock();
+
+    if (ShouldCompact(lock)) {
+      Compact(&lock);
+    }
+  }
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::CachePendingEntry(
+    const std::unique_lock<std::mutex>& lock,
+    const EntryHandle<Logged>& entry) {
+  const std::string hash(entry.Entry().Hash());
+  UncachePendingEntry(lock, hash);
+  pending_entries_[PendingEntryOrder(entry.Entry().timestamp(), hash)] =
+      entry;
+  pending_entry_timestamps_[hash] = entry.Entry().timestamp();
+}
+
+
+template <class Logged>
+bool LocalConsistentStore<Logged>::UncachePendingEntry(
+    const std::unique_lock<std::mutex>& lock, const std::string& hash) {
+  CHECK(lock.owns_lock());
+  const auto it(pending_entry_timestamps_.find(hash));
+  if (it == pending_entry_timestamps_.end()) {
+    return false;
+  }
+  pending_entries_.erase(PendingEntryOrder(it->second, hash));
+  pending_entry_timestamps_.erase(it);
+  return true;
+}
+
+
+template <class Logged>
+util::StatusOr<int64_t>
+LocalConsistentStore<Logged>::NextAvailableSequenceNumber() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const ct::SequenceMapping& mapping(sequence_mapping_.Entry());
+  if (mapping.mapping_size() > 0) {
+    return mapping.mapping(mapping.mapping_size() - 1).sequence_number() + 1;
+  }
+
+  if (!serving_sth_) {
+    LOG(WARNING) << "Log has no Serving STH [new log?], returning 0";
+    return 0;
+  }
+
+  return serving_sth_->Entry().tree_size();
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::SetServingSTH(
+    const ct::SignedTreeHead& new_sth) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (serving_sth_) {
+    if (serving_sth_->Entry().timestamp() >= new_sth.timestamp()) {
+      return util::Status(util::error::OUT_OF_RANGE,
+                          "Tree head is not newer than existing head");
+    }
+    CHECK_LE(serving_sth_->Entry().tree_size(), new_sth.tree_size());
+  } else {
+    LOG(WARNING) << "Creating new " << kLocalServingSthKey;
+  }
+
+  ct::LocalStoreRecord record;
+  record.set_index(++index_);
+  *record.mutable_serving_sth() = new_sth;
+  serving_sth_.reset(new EntryHandle<ct::SignedTreeHead>(kLocalServingSthKey,
+                                                         new_sth, index_));
+  WaitUntilDurable(&lock,
+                   Append(lock, record,
+                          std::bind(
+                              &LocalConsistentStore<Logged>::NotifyServingSTH,
+                              this, std::placeholders::_1)));
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+util::StatusOr<ct::SignedTreeHead> LocalConsistentStore<Logged>::GetServingSTH()
+    const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (serving_sth_) {
+    return serving_sth_->Entry();
+  } else {
+    return util::Status(util::error::NOT_FOUND, "No current Serving STH.");
+  }
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::AddPendingEntry(Logged* entry) {
+  util::Status status;
+  std::unique_lock<std::mutex> lock(mutex_);
+  const int64_t write_number(AddPendingEntryLocked(lock, entry, &status));
+  if (write_number >= 0) {
+    WaitUntilDurable(&lock, write_number);
+  }
+  return status;
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::AddPendingEntry(Logged* entry,
+                                                   util::Task* task) {
+  CHECK_NOTNULL(task);
+  util::Status status;
+  std::unique_lock<std::mutex> lock(mutex_);
+  const int64_t write_number(AddPendingEntryLocked(lock, entry, &status));
+  if (write_number > num_durable_) {
+    waiting_tasks_.push_back(WaitingTask{write_number, task, status});
+    return;
+  }
+  lock.unlock();
+  task->Return(status);
+}
+
+
+template <class Logged>
+int64_t LocalConsistentStore<Logged>::AddPendingEntryLocked(
+    const std::unique_lock<std::mutex>& lock, Logged* entry,
+    util::Status* status) {
+  CHECK(lock.owns_lock());
+  CHECK_NOTNULL(entry);
+  CHECK(!entry->has_sequence_number());
+
+  *status = MaybeReject(lock);
+  if (!status->ok()) {
+    return -1;
+  }
+
+  const std::string hash(entry->Hash());
+  const auto existing(pending_entry_timestamps_.find(hash));
+  if (existing != pending_entry_timestamps_.end()) {
+    const Logged& preexisting_entry(
+        pending_entries_.at(PendingEntryOrder(existing->second, hash))
+            .Entry());
+    // Check the leaf certs are the same (we might be seeing the same cert
+    // submitted with a different chain.)
+    CHECK(LeafEntriesMatch(preexisting_entry, *entry));
+    *entry->mutable_sct() = preexisting_entry.sct();
+    *status = util::Status(util::error::ALREADY_EXISTS,
+                           "Pending entry already exists.");
+    // The SCT must not be handed out before the entry is durable.
+    return num_appended_;
+  }
+
+  ct::LocalStoreRecord record;
+  record.set_index(++index_);
+  CHECK(entry->SerializeToString(record.mutable_pending_entry()));
+  CachePendingEntry(lock, EntryHandle<Logged>(kLocalEntriesDir +
+                                                  util::HexString(hash),
+                                              *entry, index_));
+  return Append(lock, record, NotifyFunction());
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::MaybeReject(
+    const std::unique_lock<std::mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  if (cluster_config_ &&
+      pending_entries_.size() >=
+          cluster_config_->Entry().etcd_reject_add_pending_threshold()) {
+    local_store_rejected_requests->Increment();
+    return util::Status(util::error::RESOURCE_EXHAUSTED,
+                        "Rejected due to high number of pending entries.");
+  }
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::GetPendingEntryForHash(
+    const std::string& hash, EntryHandle<Logged>* entry) const {
+  CHECK_NOTNULL(entry);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it(pending_entry_timestamps_.find(hash));
+  if (it == pending_entry_timestamps_.end()) {
+    return util::Status(util::error::NOT_FOUND,
+                        "No pending entry for " + util::HexString(hash));
+  }
+  *entry = pending_entries_.at(PendingEntryOrder(it->second, hash));
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::GetPendingEntries(
+    std::vector<EntryHandle<Logged>>* entries) const {
+  CHECK_NOTNULL(entries);
+  CHECK_EQ(static_cast<size_t>(0), entries->size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries->reserve(pending_entries_.size());
+  for (const auto& entry : pending_entries_) {
+    entries->emplace_back(entry.second);
+  }
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::GetSequenceMapping(
+    EntryHandle<ct::SequenceMapping>* entry) const {
+  CHECK_NOTNULL(entry);
+  std::lock_guard<std::mutex> lock(mutex_);
+  *entry = sequence_mapping_;
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::UpdateSequenceMapping(
+    EntryHandle<ct::SequenceMapping>* entry) {
+  CHECK_NOTNULL(entry);
+  CHECK(entry->HasHandle());
+  std::unique_lock<std::mutex> lock(mutex_);
+  CheckMappingIsValid(lock, entry->Entry());
+  if (entry->Handle() != sequence_mapping_.Handle()) {
+    return util::Status(util::error::FAILED_PRECONDITION,
+                        "sequence mapping modified since read");
+  }
+
+  // This writes the whole mapping every time, which is fine as long as
+  // cleanups keep it small.
+  ct::LocalStoreRecord record;
+  record.set_index(++index_);
+  *record.mutable_sequence_mapping() = entry->Entry();
+  sequence_mapping_.Set(kLocalSequenceMappingKey, entry->Entry(), index_);
+  entry->SetHandle(index_);
+  WaitUntilDurable(&lock, Append(lock, record, NotifyFunction()));
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::CheckMappingIsValid(
+    const std::unique_lock<std::mutex>& lock,
+    const ct::SequenceMapping& mapping) const {
+  CHECK(lock.owns_lock());
+  for (int i = 1; i < mapping.mapping_size(); ++i) {
+    CHECK_LT(mapping.mapping(i - 1).sequence_number(),
+             mapping.mapping(i).sequence_number());
+  }
+  if (!serving_sth_ || mapping.mapping_size() == 0) {
+    return;
+  }
+
+  // Entries not yet in the serving tree must follow it without gaps
+  // (the ones below may not be contiguous, because the clean-up may
+  // not remove them in order.)
+  const int64_t tree_size(serving_sth_->Entry().tree_size());
+  CHECK_LE(mapping.mapping(0).sequence_number(), tree_size);
+  for (int i = 1; i < mapping.mapping_size(); ++i) {
+    if (mapping.mapping(i - 1).sequence_number() >= tree_size) {
+      CHECK_EQ(mapping.mapping(i - 1).sequence_number() + 1,
+               mapping.mapping(i).sequence_number());
+    }
+  }
+}
+
+
+template <class Logged>
+util::StatusOr<ct::ClusterNodeState>
+LocalConsistentStore<Logged>::GetClusterNodeState() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it(node_states_.find(kLocalNodesDir + node_id_));
+  if (it == node_states_.end()) {
+    return util::Status(util::error::NOT_FOUND,
+                        "No ClusterNodeState for " + node_id_);
+  }
+  return it->second.Entry();
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::SetClusterNodeState(
+    const ct::ClusterNodeState& state) {
+  ct::LocalStoreRecord record;
+  *record.mutable_node_state() = state;
+  record.mutable_node_state()->set_node_id(node_id_);
+  const std::string key(kLocalNodesDir + node_id_);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  record.set_index(++index_);
+  const EntryHandle<ct::ClusterNodeState> handle(key, record.node_state(),
+                                                 index_);
+  node_states_[key] = handle;
+  WaitUntilDurable(
+      &lock,
+      Append(lock, record,
+             std::bind(&LocalConsistentStore<Logged>::NotifyClusterNodeState,
+                       this, std::placeholders::_1, handle)));
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+util::Status LocalConsistentStore<Logged>::SetClusterConfig(
+    const ct::ClusterConfig& config) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ct::LocalStoreRecord record;
+  record.set_index(++index_);
+  *record.mutable_cluster_config() = config;
+  cluster_config_.reset(new EntryHandle<ct::ClusterConfig>(
+      kLocalClusterConfigKey, config, index_));
+  WaitUntilDurable(&lock,
+                   Append(lock, record,
+                          std::bind(&LocalConsistentStore<
+                                        Logged>::NotifyClusterConfig,
+                                    this, std::placeholders::_1)));
+  return util::Status::OK;
+}
+
+
+template <class Logged>
+util::StatusOr<int64_t> LocalConsistentStore<Logged>::CleanupOldEntries() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!serving_sth_) {
+    LOG(INFO) << "No current serving_sth, nothing to do.";
+    return 0;
+  }
+  const int64_t tree_size(serving_sth_->Entry().tree_size());
+
+  ct::LocalStoreRecord record;
+  for (const auto& mapping : sequence_mapping_.Entry().mapping()) {
+    if (mapping.sequence_number() >= tree_size) {
+      break;
+    }
+    if (UncachePendingEntry(lock, mapping.entry_hash())) {
+      record.add_cleaned_up_entry_hash(mapping.entry_hash());
+    }
+  }
+
+  const int64_t num_entries_cleaned(record.cleaned_up_entry_hash_size());
+  if (num_entries_cleaned > 0) {
+    record.set_index(++index_);
+    WaitUntilDurable(&lock, Append(lock, record, NotifyFunction()));
+  }
+  return num_entries_cleaned;
+}
+
+
+template <class Logged>
+Update<ct::SignedTreeHead> LocalConsistentStore<Logged>::ServingSTHUpdate(
+    const std::unique_lock<std::mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  if (serving_sth_) {
+    return Update<ct::SignedTreeHead>(*serving_sth_, true /* exists */);
+  }
+  EntryHandle<ct::SignedTreeHead> handle;
+  handle.SetKey(kLocalServingSthKey);
+  return Update<ct::SignedTreeHead>(handle, false /* exists */);
+}
+
+
+template <class Logged>
+Update<ct::ClusterConfig> LocalConsistentStore<Logged>::ClusterConfigUpdate(
+    const std::unique_lock<std::mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  if (cluster_config_) {
+    return Update<ct::ClusterConfig>(*cluster_config_, true /* exists */);
+  }
+  EntryHandle<ct::ClusterConfig> handle;
+  handle.SetKey(kLocalClusterConfigKey);
+  return Update<ct::ClusterConfig>(handle, false /* exists */);
+}
+
+
+// The notifications send the current value rather than the one which
+// was just made durable, which is fine, since the value it has been
+// replaced with will itself be notified once durable.
+template <class Logged>
+void LocalConsistentStore<Logged>::NotifyServingSTH(
+    const std::unique_lock<std::mutex>& lock) {
+  for (const auto& watch : serving_sth_watches_) {
+    ScheduleWatchCallback(lock, watch.second,
+                          std::bind(watch.first, ServingSTHUpdate(lock)));
+  }
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::NotifyClusterConfig(
+    const std::unique_lock<std::mutex>& lock) {
+  for (const auto& watch : cluster_config_watches_) {
+    ScheduleWatchCallback(lock, watch.second,
+                          std::bind(watch.first, ClusterConfigUpdate(lock)));
+  }
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::NotifyClusterNodeState(
+    const std::unique_lock<std::mutex>& lock,
+    const EntryHandle<ct::ClusterNodeState>& state) {
+  const std::vector<Update<ct::ClusterNodeState>> updates{
+      Update<ct::ClusterNodeState>(state, true /* exists */)};
+  for (const auto& watch : node_state_watches_) {
+    ScheduleWatchCallback(lock, watch.second, std::bind(watch.first, updates));
+  }
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::WatchServingSTH(
+    const typename ConsistentStore<Logged>::ServingSTHCallback& cb,
+    util::Task* task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ScheduleWatchCallback(lock, task, std::bind(cb, ServingSTHUpdate(lock)));
+  serving_sth_watches_.emplace_back(cb, task);
+  lock.unlock();
+  task->WhenCancelled(
+      std::bind(&LocalConsistentStore<Logged>::CancelWatch, this, task));
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::WatchClusterNodeStates(
+    const typename ConsistentStore<Logged>::ClusterNodeStateCallback& cb,
+    util::Task* task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::vector<Update<ct::ClusterNodeState>> updates;
+  for (const auto& state : node_states_) {
+    updates.emplace_back(state.second, true /* exists */);
+  }
+  ScheduleWatchCallback(lock, task, std::bind(cb, updates));
+  node_state_watches_.emplace_back(cb, task);
+  lock.unlock();
+  task->WhenCancelled(
+      std::bind(&LocalConsistentStore<Logged>::CancelWatch, this, task));
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::WatchClusterConfig(
+    const typename ConsistentStore<Logged>::ClusterConfigCallback& cb,
+    util::Task* task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ScheduleWatchCallback(lock, task, std::bind(cb, ClusterConfigUpdate(lock)));
+  cluster_config_watches_.emplace_back(cb, task);
+  lock.unlock();
+  task->WhenCancelled(
+      std::bind(&LocalConsistentStore<Logged>::CancelWatch, this, task));
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::CancelWatch(util::Task* task) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const bool found(RemoveWatch(task, &serving_sth_watches_) ||
+                   RemoveWatch(task, &node_state_watches_) ||
+                   RemoveWatch(task, &cluster_config_watches_));
+  if (found) {
+    // Outstanding notifications have a hold on this task, so they
+    // will all go through before the task actually completes.
+    task->Return(util::Status::CANCELLED);
+  }
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::ScheduleWatchCallback(
+    const std::unique_lock<std::mutex>& lock, util::Task* task,
+    const std::function<void()>& callback) {
+  CHECK(lock.owns_lock());
+  const bool already_running(!watch_callbacks_.empty());
+
+  task->AddHold();
+  watch_callbacks_.emplace_back(task, callback);
+
+  if (!already_running) {
+    watch_callbacks_.front().first->executor()->Add(
+        std::bind(&LocalConsistentStore<Logged>::RunWatchCallback, this));
+  }
+}
+
+
+template <class Logged>
+void LocalConsistentStore<Logged>::RunWatchCallback() {
+  util::Task* current(nullptr);
+  util::Task* next(nullptr);
+  std::function<void()> callback;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    CHECK(!watch_callbacks_.empty());
+    current = watch_callbacks_.front().first;
+    callback = std::move(watch_callbacks_.front().second);
+  }
+
+  callback();
+  current->RemoveHold();
+
+  {
+    // Only popped now, so that the destructor waits for the callback.
+    std::lock_guard<std::mutex> lock(mutex_);
+    watch_callbacks_.pop_front();
+    if (!watch_callbacks_.empty()) {
+      next = CHECK_NOTNULL(watch_callbacks_.front().first);
+    } else {
+      watch_callbacks_cv_.notify_all();
+    }
+  }
+
+  // If we have a next executor, schedule ourselves on it.
+  if (next) {
+    next->executor()->Add(
+        std::bind(&LocalConsistentStore<Logged>::RunWatchCallback, this));
+  }
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_INL_H_
@@ -0,0 +1,215 @@
+#ifndef CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
+#define CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "base/macros.h"
+#include "log/consistent_store.h"
+#include "proto/ct.pb.h"
+#include "util/status.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+
+// A ConsistentStore for a single-node log, which keeps its state in
+// memory and makes it durable with a write-ahead log in a local file,
+// instead of using etcd.
+//
+// Changes are applied in memory right away, and appended to the log
+// by a separate thread, which writes and fsync()s all the changes
+// made since its last write at once. Writers only return once their
+// change is durable, and watchers are only told about changes which
+// are durable. Since the log is written in order, what survives a
+// crash is always a consistent state, even if it includes some
+// changes visible to readers which had not been acknowledged yet.
+//
+// When opened, the log is replayed, and then rewritten with only the
+// current state. It is rewritten the same way once it has
+// accumulated --local_store_compaction_records records, if most of
+// them have been superseded.
+template <class Logged>
+class LocalConsistentStore : public ConsistentStore<Logged> {
+ public:
+  // Creates |file_name| if it doesn't exist.
+  LocalConsistentStore(const std::string& file_name,
+                       const std::string& node_id);
+
+  virtual ~LocalConsistentStore();
+
+  util::StatusOr<int64_t> NextAvailableSequenceNumber() const override;
+
+  util::Status SetServingSTH(const ct::SignedTreeHead& new_sth) override;
+
+  util::StatusOr<ct::SignedTreeHead> GetServingSTH() const override;
+
+  util::Status AddPendingEntry(Logged* entry) override;
+
+  // |task| is returned once the entry is durable, along with the
+  // entries added at the same time.
+  void AddPendingEntry(Logged* entry, util::Task* task) override;
+
+  util::Status GetPendingEntryForHash(
+      const std::string& hash, EntryHandle<Logged>* entry) const override;
+
+  // The entries are ordered by SCT timestamp and then hash.
+  util::Status GetPendingEntries(
+      std::vector<EntryHandle<Logged>>* entries) const override;
+
+  util::Status GetSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) const override;
+
+  util::Status UpdateSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) override;
+
+  util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override;
+
+  util::Status SetClusterNodeState(const ct::ClusterNodeState& state) override;
+
+  void WatchServingSTH(
+      const typename ConsistentStore<Logged>::ServingSTHCallback& cb,
+      util::Task* task) override;
+
+  void WatchClusterNodeStates(
+      const typename ConsistentStore<Logged>::ClusterNodeStateCallback& cb,
+      util::Task* task) override;
+
+  void WatchClusterConfig(
+      const typename ConsistentStore<Logged>::ClusterConfigCallback& cb,
+      util::Task* task) override;
+
+  util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
+
+  // Removes sequenced entries with sequence numbers covered by the current
+  // serving STH.
+  util::StatusOr<int64_t> CleanupOldEntries() override;
+
+ private:
+  typedef std::pair<uint64_t, std::string> PendingEntryOrder;
+  typedef std::function<void(const std::unique_lock<std::mutex>& lock)>
+      NotifyFunction;
+
+  struct Write {
+    std::string framed_record;
+    // Called once the record is durable, can be empty.
+    NotifyFunction notify;
+  };
+
+  struct WaitingTask {
+    int64_t write_number;
+    util::Task* task;
+    util::Status status;
+  };
+
+  // Reads back the records in the log, dropping a partially written
+  // one at the end if there is one, and failing on any other
+  // corruption.
+  void Replay();
+  void ApplyRecord(const std::unique_lock<std::mutex>& lock,
+                   const ct::LocalStoreRecord& record);
+
+  // Rewrites the log with a snapshot of the current state. Must only
+  // be called when no write is outstanding, and by the commit thread
+  // (or before it is started). |lock| is released while the snapshot
+  // is written out.
+  void Compact(std::unique_lock<std::mutex>* lock);
+  std::string Snapshot(const std::unique_lock<std::mutex>& lock,
+                       int64_t* num_records) const;
+  bool ShouldCompact(const std::unique_lock<std::mutex>& lock) const;
+
+  // Queues |record| (which must already have its index) to be
+  // written to the log, returning its write number.
+  int64_t Append(const std::unique_lock<std::mutex>& lock,
+                 const ct::LocalStoreRecord& record,
+                 const NotifyFunction& notify);
+  void WaitUntilDurable(std::unique_lock<std::mutex>* lock,
+                        int64_t write_number);
+  void CommitLoop();
+
+  void CachePendingEntry(const std::unique_lock<std::mutex>& lock,
+                         const EntryHandle<Logged>& entry);
+  bool UncachePendingEntry(const std::unique_lock<std::mutex>& lock,
+                           const std::string& hash);
+
+  // Checks (and, if successful, adds) |entry|. Returns the write
+  // number to wait for before returning |status|, or -1 if it can be
+  // returned right away.
+  int64_t AddPendingEntryLocked(const std::unique_lock<std::mutex>& lock,
+                                Logged* entry, util::Status* status);
+  util::Status MaybeReject(const std::unique_lock<std::mutex>& lock) const;
+
+  void CheckMappingIsValid(const std::unique_lock<std::mutex>& lock,
+                           const ct::SequenceMapping& mapping) const;
+
+  Update<ct::SignedTreeHead> ServingSTHUpdate(
+      const std::unique_lock<std::mutex>& lock) const;
+  Update<ct::ClusterConfig> ClusterConfigUpdate(
+      const std::unique_lock<std::mutex>& lock) const;
+  void NotifyServingSTH(const std::unique_lock<std::mutex>& lock);
+  void NotifyClusterConfig(const std::unique_lock<std::mutex>& lock);
+  void NotifyClusterNodeState(const std::unique_lock<std::mutex>& lock,
+                              const EntryHandle<ct::ClusterNodeState>& state);
+
+  // Watch callbacks are all run one after the other, each on the
+  // executor of its task.
+  void ScheduleWatchCallback(const std::unique_lock<std::mutex>& lock,
+                             util::Task* task,
+                             const std::function<void()>& callback);
+  void RunWatchCallback();
+  void CancelWatch(util::Task* task);
+
+  const std::string file_name_;
+  const std::string node_id_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable commit_cv_;
+  std::condition_variable durable_cv_;
+  std::condition_variable watch_callbacks_cv_;
+  bool exiting_;
+
+  // Only used by the commit thread, once started.
+  int fd_;
+
+  int64_t index_;
+  int64_t records_in_log_;
+  std::vector<Write> unwritten_;
+  int64_t num_appended_;
+  int64_t num_durable_;
+  std::deque<WaitingTask> waiting_tasks_;
+
+  std::unique_ptr<EntryHandle<ct::SignedTreeHead>> serving_sth_;
+  std::unique_ptr<EntryHandle<ct::ClusterConfig>> cluster_config_;
+  EntryHandle<ct::SequenceMapping> sequence_mapping_;
+  std::map<PendingEntryOrder, EntryHandle<Logged>> pending_entries_;
+  std::unordered_map<std::string, uint64_t> pending_entry_timestamps_;
+  std::map<std::string, EntryHandle<ct::ClusterNodeState>> node_states_;
+
+  std::vector<std::pair<typename ConsistentStore<Logged>::ServingSTHCallback,
+                        util::Task*>> serving_sth_watches_;
+  std::vector<
+      std::pair<typename ConsistentStore<Logged>::ClusterNodeStateCallback,
+                util::Task*>> node_state_watches_;
+  std::vector<std::pair<typename ConsistentStore<Logged>::ClusterConfigCallback,
+                        util::Task*>> cluster_config_watches_;
+  std::deque<std::pair<util::Task*, std::function<void()>>> watch_callbacks_;
+
+  std::thread commit_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(LocalConsistentStore);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
@@ -0,0 +1,12 @@
+#include <gflags/gflags.h>
+
+#include "log/local_consistent_store-inl.h"
+#include "log/logged_certificate.h"
+
+DEFINE_int32(local_store_compaction_records, 100000,
+             "Number of records in the local store's write-ahead log after "
+             "which it gets rewritten with only the current state.");
+
+namespace cert_trans {
+template class LocalConsistentStore<LoggedCertificate>;
+}  // namespace cert_trans
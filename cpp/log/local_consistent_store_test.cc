@@ -0,0 +1,439 @@
+#include "log/local_consistent_store.h"
+
+#include <chrono>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "base/notification.h"
+#include "log/logged_certificate.h"
+#include "proto/ct.pb.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DECLARE_int32(local_store_compaction_records);
+
+namespace cert_trans {
+namespace {
+
+using ct::SequenceMapping;
+using ct::SignedTreeHead;
+using std::chrono::milliseconds;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+using util::testing::StatusIs;
+
+
+const char kNodeId[] = "node_id";
+const int kTimestamp = 9000;
+
+
+class LocalConsistentStoreTest : public ::testing::Test {
+ protected:
+  LocalConsistentStoreTest()
+      : file_name_(tmp_.TmpStorageDir() + "/store"), executor_(2) {
+    Reopen();
+  }
+
+  void Reopen() {
+    store_.reset();
+    store_.reset(
+        new LocalConsistentStore<LoggedCertificate>(file_name_, kNodeId));
+  }
+
+  LoggedCertificate MakeCert(int timestamp, const string& body) {
+    LoggedCertificate cert;
+    cert.mutable_sct()->set_timestamp(timestamp);
+    cert.mutable_entry()->set_type(ct::X509_ENTRY);
+    cert.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(body);
+    return cert;
+  }
+
+  SignedTreeHead MakeSTH(int timestamp, int tree_size) {
+    SignedTreeHead sth;
+    sth.set_timestamp(timestamp);
+    sth.set_tree_size(tree_size);
+    return sth;
+  }
+
+  // The framing the store puts in front of a record of |length| bytes
+  // with checksum |crc|.
+  string FrameHeader(uint32_t length, uint32_t crc) {
+    string header;
+    PutUint32(length, &header);
+    PutUint32(crc32(crc32(0, Z_NULL, 0),
+                    reinterpret_cast<const Bytef*>(header.data()), 4),
+              &header);
+    PutUint32(crc, &header);
+    return header;
+  }
+
+  void PutUint32(uint32_t value, string* out) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out->push_back(static_cast<char>((value >> shift) & 0xff));
+    }
+  }
+
+  // Flips the high bit of the byte at |offset| in the log.
+  void FlipBit(size_t offset) {
+    string contents;
+    ASSERT_TRUE(util::ReadBinaryFile(file_name_, &contents));
+    ASSERT_LT(offset, contents.size());
+    contents[offset] ^= 0x80;
+    std::ofstream out(file_name_, std::ios::trunc | std::ios::binary);
+    out << contents;
+  }
+
+  // Sequences the pending entries, in order.
+  void SequenceAll() {
+    vector<EntryHandle<LoggedCertificate>> entries;
+    ASSERT_OK(store_->GetPendingEntries(&entries));
+    EntryHandle<SequenceMapping> mapping;
+    ASSERT_OK(store_->GetSequenceMapping(&mapping));
+    int64_t seq(store_->NextAvailableSequenceNumber().ValueOrDie());
+    for (const auto& entry : entries) {
+      SequenceMapping::Mapping* const m(
+          mapping.MutableEntry()->add_mapping());
+      m->set_entry_hash(entry.Entry().Hash());
+      m->set_sequence_number(seq++);
+    }
+    ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+  }
+
+  TmpStorage tmp_;
+  const string file_name_;
+  ThreadPool executor_;
+  unique_ptr<LocalConsistentStore<LoggedCertificate>> store_;
+};
+
+
+TEST_F(LocalConsistentStoreTest, AddsPendingEntries) {
+  LoggedCertificate later(MakeCert(kTimestamp + 1, "later"));
+  LoggedCertificate earlier(MakeCert(kTimestamp, "earlier"));
+  EXPECT_OK(store_->AddPendingEntry(&later));
+  EXPECT_OK(store_->AddPendingEntry(&earlier));
+
+  vector<EntryHandle<LoggedCertificate>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(2U, entries.size());
+  EXPECT_EQ("earlier",
+            entries[0].Entry().entry().x509_entry().leaf_certificate());
+  EXPECT_EQ("later",
+            entries[1].Entry().entry().x509_entry().leaf_certificate());
+  EXPECT_LT(entries[1].Handle(), entries[0].Handle());
+
+  EntryHandle<LoggedCertificate> entry;
+  EXPECT_OK(store_->GetPendingEntryForHash(earlier.Hash(), &entry));
+  EXPECT_EQ(entries[0].Handle(), entry.Handle());
+  EXPECT_THAT(store_->GetPendingEntryForHash("nope", &entry),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(LocalConsistentStoreTest, AddPendingEntryForExistingEntry) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+
+  LoggedCertificate again(MakeCert(kTimestamp + 1000, "leaf"));
+  EXPECT_THAT(store_->AddPendingEntry(&again),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(kTimestamp, again.timestamp());
+}
+
+
+TEST_F(LocalConsistentStoreTest, AddPendingEntryAsync) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  SyncTask task(&executor_);
+  store_->AddPendingEntry(&cert, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+
+  EntryHandle<LoggedCertificate> entry;
+  EXPECT_OK(store_->GetPendingEntryForHash(cert.Hash(), &entry));
+}
+
+
+TEST_F(LocalConsistentStoreTest, RejectsPendingEntriesOverThreshold) {
+  ct::ClusterConfig config;
+  config.set_etcd_reject_add_pending_threshold(1);
+  EXPECT_OK(store_->SetClusterConfig(config));
+
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+  LoggedCertificate other(MakeCert(kTimestamp, "other"));
+  EXPECT_THAT(store_->AddPendingEntry(&other),
+              StatusIs(util::error::RESOURCE_EXHAUSTED));
+}
+
+
+TEST_F(LocalConsistentStoreTest, ServingSTHMustBeNewer) {
+  EXPECT_THAT(store_->GetServingSTH().status(),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(store_->SetServingSTH(MakeSTH(kTimestamp, 10)));
+  EXPECT_THAT(store_->SetServingSTH(MakeSTH(kTimestamp, 10)),
+              StatusIs(util::error::OUT_OF_RANGE));
+  EXPECT_EQ(10U, store_->GetServingSTH().ValueOrDie().tree_size());
+  EXPECT_EQ(10, store_->NextAvailableSequenceNumber().ValueOrDie());
+}
+
+
+TEST_F(LocalConsistentStoreTest, UpdateSequenceMappingChecksHandle) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+
+  EntryHandle<SequenceMapping> stale;
+  EXPECT_OK(store_->GetSequenceMapping(&stale));
+  SequenceAll();
+  EXPECT_EQ(1, store_->NextAvailableSequenceNumber().ValueOrDie());
+
+  stale.MutableEntry()->add_mapping()->set_sequence_number(0);
+  EXPECT_THAT(store_->UpdateSequenceMapping(&stale),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+TEST_F(LocalConsistentStoreTest, CleansUpServedEntries) {
+  LoggedCertificate first(MakeCert(kTimestamp, "first"));
+  LoggedCertificate second(MakeCert(kTimestamp + 1, "second"));
+  EXPECT_OK(store_->AddPendingEntry(&first));
+  EXPECT_OK(store_->AddPendingEntry(&second));
+  SequenceAll();
+
+  EXPECT_OK(store_->SetServingSTH(MakeSTH(kTimestamp, 1)));
+  EXPECT_EQ(1, store_->CleanupOldEntries().ValueOrDie());
+  EXPECT_EQ(0, store_->CleanupOldEntries().ValueOrDie());
+
+  vector<EntryHandle<LoggedCertificate>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(1U, entries.size());
+  EXPECT_EQ(second.Hash(), entries[0].Entry().Hash());
+}
+
+
+TEST_F(LocalConsistentStoreTest, RecoversStateWhenReopened) {
+  LoggedCertificate first(MakeCert(kTimestamp, "first"));
+  LoggedCertificate second(MakeCert(kTimestamp + 1, "second"));
+  EXPECT_OK(store_->AddPendingEntry(&first));
+  EXPECT_OK(store_->AddPendingEntry(&second));
+  SequenceAll();
+  EXPECT_OK(store_->SetServingSTH(MakeSTH(kTimestamp, 1)));
+  EXPECT_EQ(1, store_->CleanupOldEntries().ValueOrDie());
+  ct::ClusterNodeState state;
+  state.set_hostname("host");
+  EXPECT_OK(store_->SetClusterNodeState(state));
+  EntryHandle<SequenceMapping> mapping;
+  EXPECT_OK(store_->GetSequenceMapping(&mapping));
+
+  Reopen();
+
+  vector<EntryHandle<LoggedCertificate>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(1U, entries.size());
+  EXPECT_EQ(second.Hash(), entries[0].Entry().Hash());
+  EXPECT_EQ(1U, store_->GetServingSTH().ValueOrDie().tree_size());
+  EXPECT_EQ(2, store_->NextAvailableSequenceNumber().ValueOrDie());
+  EXPECT_EQ("host", store_->GetClusterNodeState().ValueOrDie().hostname());
+  EXPECT_EQ(kNodeId, store_->GetClusterNodeState().ValueOrDie().node_id());
+
+  // Handles carry on from where they were.
+  EntryHandle<SequenceMapping> reopened_mapping;
+  EXPECT_OK(store_->GetSequenceMapping(&reopened_mapping));
+  EXPECT_EQ(mapping.Handle(), reopened_mapping.Handle());
+  EXPECT_OK(store_->UpdateSequenceMapping(&reopened_mapping));
+  EXPECT_LT(mapping.Handle(), reopened_mapping.Handle());
+}
+
+
+TEST_F(LocalConsistentStoreTest, RecoversAfterCompaction) {
+  const int saved_compaction_records(FLAGS_local_store_compaction_records);
+  FLAGS_local_store_compaction_records = 2;
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_OK(store_->SetServingSTH(MakeSTH(kTimestamp + i, i)));
+  }
+  Reopen();
+  EXPECT_EQ(9U, store_->GetServingSTH().ValueOrDie().tree_size());
+  FLAGS_local_store_compaction_records = saved_compaction_records;
+}
+
+
+TEST_F(LocalConsistentStoreTest, IgnoresPartialRecordAtTheEnd) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+  store_.reset();
+  {
+    std::ofstream out(file_name_, std::ios::app | std::ios::binary);
+    out << string("\x00\x00\x01\x00partial", 11);
+  }
+
+  Reopen();
+  vector<EntryHandle<LoggedCertificate>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  EXPECT_EQ(1U, entries.size());
+
+  // And it can still be written to.
+  LoggedCertificate other(MakeCert(kTimestamp, "other"));
+  EXPECT_OK(store_->AddPendingEntry(&other));
+  Reopen();
+  entries.clear();
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  EXPECT_EQ(2U, entries.size());
+}
+
+
+TEST_F(LocalConsistentStoreTest, IgnoresTruncatedRecordAtTheEnd) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+  store_.reset();
+  {
+    std::ofstream out(file_name_, std::ios::app | std::ios::binary);
+    out << FrameHeader(100, 0) << "partial";
+  }
+
+  Reopen();
+  vector<EntryHandle<LoggedCertificate>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  EXPECT_EQ(1U, entries.size());
+}
+
+
+TEST_F(LocalConsistentStoreTest, IgnoresCorruptRecordAtTheEnd) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+  store_.reset();
+  {
+    // Complete, but with the wrong checksum.
+    std::ofstream out(file_name_, std::ios::app | std::ios::binary);
+    out << FrameHeader(7, 0) << "garbage";
+  }
+
+  Reopen();
+  vector<EntryHandle<LoggedCertificate>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  EXPECT_EQ(1U, entries.size());
+}
+
+
+typedef class LocalConsistentStoreTest LocalConsistentStoreDeathTest;
+
+
+TEST_F(LocalConsistentStoreDeathTest, RefusesCorruptRecordInTheMiddle) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+  LoggedCertificate other(MakeCert(kTimestamp, "other"));
+  EXPECT_OK(store_->AddPendingEntry(&other));
+  store_.reset();
+
+  // Flip a bit in the first record's payload.
+  FlipBit(12);
+  EXPECT_DEATH(Reopen(), "Corrupt record at offset 0");
+}
+
+
+TEST_F(LocalConsistentStoreDeathTest, RefusesCorruptLengthInTheMiddle) {
+  LoggedCertificate cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+  store_.reset();
+
+  // Make the first record look longer than the whole log.
+  FlipBit(0);
+  EXPECT_DEATH(Reopen(), "Corrupt record length at offset 0");
+}
+
+
+TEST_F(LocalConsistentStoreTest, WatchServingSTH) {
+  Notification notify;
+  const SignedTreeHead sth(MakeSTH(kTimestamp, 5));
+
+  SyncTask task(&executor_);
+  int call_count(0);
+  store_->WatchServingSTH(
+      [&sth, &notify, &call_count](const Update<SignedTreeHead>& update) {
+        switch (call_count) {
+          case 0:
+            // initial empty state
+            EXPECT_FALSE(update.exists_);
+            break;
+          case 1:
+            // notification of update
+            EXPECT_TRUE(update.exists_);
+            EXPECT_EQ(sth.DebugString(), update.handle_.Entry().DebugString());
+            notify.Notify();
+            break;
+          default:
+            CHECK(false);
+        }
+        ++call_count;
+      },
+      task.task());
+
+  EXPECT_OK(store_->SetServingSTH(sth));
+  EXPECT_TRUE(notify.WaitForNotificationWithTimeout(milliseconds(5000)));
+  task.Cancel();
+  task.Wait();
+}
+
+
+TEST_F(LocalConsistentStoreTest, WatchClusterNodeStates) {
+  ct::ClusterNodeState state;
+  state.set_hostname("host");
+  EXPECT_OK(store_->SetClusterNodeState(state));
+  Notification notify;
+
+  SyncTask task(&executor_);
+  store_->WatchClusterNodeStates(
+      [&notify](const vector<Update<ct::ClusterNodeState>>& updates) {
+        ASSERT_EQ(1U, updates.size());
+        EXPECT_TRUE(updates[0].exists_);
+        EXPECT_EQ(string("/nodes/") + kNodeId, updates[0].handle_.Key());
+        EXPECT_EQ(kNodeId, updates[0].handle_.Entry().node_id());
+        notify.Notify();
+      },
+      task.task());
+  EXPECT_TRUE(notify.WaitForNotificationWithTimeout(milliseconds(5000)));
+  task.Cancel();
+  task.Wait();
+}
+
+
+TEST_F(LocalConsistentStoreTest, WatchClusterConfig) {
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(1);
+  config.set_minimum_serving_fraction(0.6);
+  Notification notify;
+
+  SyncTask task(&executor_);
+  store_->WatchClusterConfig(
+      [&config, &notify](const Update<ct::ClusterConfig>& update) {
+        if (!update.exists_) {
+          VLOG(1) << "Ignoring initial empty update.";
+          return;
+        }
+        EXPECT_EQ(config.DebugString(), update.handle_.Entry().DebugString());
+        notify.Notify();
+      },
+      task.task());
+  EXPECT_OK(store_->SetClusterConfig(config));
+  EXPECT_TRUE(notify.WaitForNotificationWithTimeout(milliseconds(5000)));
+  task.Cancel();
+  task.Wait();
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
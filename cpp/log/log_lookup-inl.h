@@ -40,15 +40,45 @@ LogLookup<Logged>::~LogLookup() {
 }
 
 
+template <class Logged>
+void LogLookup<Logged>::AddNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  std::lock_guard<std::mutex> lock(notify_lock_);
+  notify_sth_callbacks_.Add(callback);
+
+  const ct::SignedTreeHead sth(GetSTH());
+  if (sth.has_timestamp()) {
+    (*callback)(sth);
+  }
+}
+
+
+template <class Logged>
+void LogLookup<Logged>::RemoveNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  std::lock_guard<std::mutex> lock(notify_lock_);
+  notify_sth_callbacks_.Remove(callback);
+}
+
+
 template <class Logged>
 void LogLookup<Logged>::UpdateFromSTH(const ct::SignedTreeHead& sth) {
+  if (ApplySTH(sth)) {
+    std::lock_guard<std::mutex> lock(notify_lock_);
+    notify_sth_callbacks_.Call(sth);
+  }
+}
+
+
+template <class Logged>
+bool LogLookup<Logged>::ApplySTH(const ct::SignedTreeHead& sth) {
   std::lock_guard<std::mutex> lock(lock_);
 
   CHECK_EQ(ct::V1, sth.version())
       << "Tree head signed with an unknown version";
 
   if (sth.timestamp() == latest_tree_head_.timestamp())
-    return;
+    return false;
 
   CHECK_LE(0, sth.tree_size());
   if (sth.timestamp() <= latest_tree_head_.timestamp() ||
@@ -56,7 +86,7 @@ void LogLookup<Logged>::UpdateFromSTH(const ct::SignedTreeHead& sth) {
     LOG(WARNING) << "Database replied with an STH that is older than ours: "
                  << "Our STH:\n" << latest_tree_head_.DebugString()
                  << "Database STH:\n" << sth.DebugString();
-    return;
+    return false;
   }
 
   // Record the new hashes: append all of them, die on any error.
@@ -102,6 +132,7 @@ void LogLookup<Logged>::UpdateFromSTH(const ct::SignedTreeHead& sth) {
       latest_tree_head_.timestamp() / cert_trans::kNumMillisPerSecond));
   char buf[kCtimeBufSize];
   LOG(INFO) << "Tree successfully updated at " << ctime_r(&last_update, buf);
+  return true;
 }
 
 
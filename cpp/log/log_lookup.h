@@ -18,6 +18,9 @@
 template <class Logged>
 class LogLookup {
  public:
+  typedef typename ReadOnlyDatabase<Logged>::NotifySTHCallback
+      NotifySTHCallback;
+
   // The constructor loads the content from the database.
   explicit LogLookup(ReadOnlyDatabase<Logged>* db);
   ~LogLookup();
@@ -55,6 +58,12 @@ class LogLookup {
     return latest_tree_head_;
   }
 
+  // Like the database's, but the callbacks are called once the
+  // lookup has been updated with the new tree head, so proofs up to
+  // it can be served.
+  void AddNotifySTHCallback(const NotifySTHCallback* callback);
+  void RemoveNotifySTHCallback(const NotifySTHCallback* callback);
+
   std::string RootAtSnapshot(size_t tree_size);
 
   std::string LeafHash(const Logged& logged) const;
@@ -66,6 +75,8 @@ class LogLookup {
 
  private:
   void UpdateFromSTH(const ct::SignedTreeHead& sth);
+  // Returns whether the tree was updated.
+  bool ApplySTH(const ct::SignedTreeHead& sth);
   int64_t GetIndexInternal(const std::unique_lock<std::mutex>& lock,
                            const std::string& merkle_leaf_hash) const;
 
@@ -82,6 +93,9 @@ class LogLookup {
 
   const typename Database<Logged>::NotifySTHCallback update_from_sth_cb_;
 
+  std::mutex notify_lock_;
+  cert_trans::DatabaseNotifierHelper notify_sth_callbacks_;
+
   DISALLOW_COPY_AND_ASSIGN(LogLookup);
 };
 #endif
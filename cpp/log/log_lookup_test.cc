@@ -67,13 +67,6 @@ class LogLookupTest : public ::testing::Test {
                   new MerkleVerifier(new Sha256Hasher())) {
     // Set some noddy STH so that we can call UpdateTree on the Tree Signer.
     store_.SetServingSTH(ct::SignedTreeHead());
-    // Force an empty sequence mapping file:
-    {
-      util::SyncTask task(&pool_);
-      EtcdClient::Response r;
-      etcd_client_.ForceSet("/root/sequence_mapping", "", &r, task.task());
-      task.Wait();
-    }
   }
 
 
@@ -180,6 +173,43 @@ TYPED_TEST(LogLookupTest, Update) {
 }
 
 
+TYPED_TEST(LogLookupTest, NotifySTH) {
+  LL lookup(this->db());
+  LoggedCertificate logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->CreateSequencedEntry(&logged_cert, 0);
+
+  int num_calls(0);
+  const typename LL::NotifySTHCallback cb(
+      [&lookup, &logged_cert, &num_calls](const ct::SignedTreeHead& sth) {
+        ++num_calls;
+        EXPECT_EQ(1, sth.tree_size());
+        // The lookup has already been updated.
+        MerkleAuditProof proof;
+        EXPECT_EQ(LL::OK,
+                  lookup.AuditProof(logged_cert.merkle_leaf_hash(), &proof));
+      });
+  lookup.AddNotifySTHCallback(&cb);
+  EXPECT_EQ(0, num_calls);
+
+  this->UpdateTree();
+  EXPECT_EQ(1, num_calls);
+
+  // A new callback gets the current tree head straight away.
+  int num_late_calls(0);
+  const typename LL::NotifySTHCallback late_cb(
+      [&num_late_calls](const ct::SignedTreeHead& sth) {
+        ++num_late_calls;
+        EXPECT_EQ(1, sth.tree_size());
+      });
+  lookup.AddNotifySTHCallback(&late_cb);
+  EXPECT_EQ(1, num_late_calls);
+
+  lookup.RemoveNotifySTHCallback(&late_cb);
+  lookup.RemoveNotifySTHCallback(&cb);
+}
+
+
 // Verify that the audit proof constructed is correct (assuming the signer
 // operates correctly). TODO(ekasper): KAT tests.
 TYPED_TEST(LogLookupTest, Verify) {
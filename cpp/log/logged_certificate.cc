@@ -3,8 +3,70 @@
 using ct::LogEntry;
 using ct::PreCert;
 using ct::SignedCertificateTimestamp;
+using google::protobuf::RepeatedPtrField;
+using std::function;
+using std::map;
+using std::string;
 
 namespace cert_trans {
+namespace {
+
+
+RepeatedPtrField<string>* MutableChain(LogEntry* entry) {
+  switch (entry->type()) {
+    case ct::X509_ENTRY:
+      return entry->mutable_x509_entry()->mutable_certificate_chain();
+    case ct::PRECERT_ENTRY:
+      return entry->mutable_precert_entry()->mutable_precertificate_chain();
+    default:
+      return nullptr;
+  }
+}
+
+
+}  // namespace
+
+
+void LoggedCertificate::InternChain(map<string, string>* chain_certs) {
+  CHECK_NOTNULL(chain_certs);
+  CHECK_EQ(contents().chain_cert_sha256_size(), 0);
+  RepeatedPtrField<string>* const chain(MutableChain(mutable_entry()));
+  if (!chain) {
+    return;
+  }
+
+  for (string& cert : *chain) {
+    const string hash(Sha256Hasher::Sha256Digest(cert));
+    mutable_contents()->add_chain_cert_sha256(hash);
+    (*chain_certs)[hash].swap(cert);
+  }
+  chain->Clear();
+}
+
+
+bool LoggedCertificate::RestoreChain(
+    const function<bool(const string& sha256_hash, string* cert)>& lookup) {
+  if (contents().chain_cert_sha256_size() == 0) {
+    return true;
+  }
+
+  RepeatedPtrField<string>* const chain(MutableChain(mutable_entry()));
+  if (!chain) {
+    LOG(WARNING) << "interned chain on entry of unknown type";
+    return false;
+  }
+  CHECK_EQ(chain->size(), 0);
+
+  for (const string& hash : contents().chain_cert_sha256()) {
+    if (!lookup(hash, chain->Add())) {
+      LOG(WARNING) << "missing chain certificate " << util::HexString(hash);
+      return false;
+    }
+  }
+  mutable_contents()->clear_chain_cert_sha256();
+
+  return true;
+}
 
 
 bool LoggedCertificate::CopyFromClientLogEntry(
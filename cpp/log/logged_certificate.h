@@ -3,7 +3,10 @@
 #ifndef LOGGED_CERTIFICATE_H
 #define LOGGED_CERTIFICATE_H
 
+#include <functional>
 #include <glog/logging.h>
+#include <map>
+#include <string>
 
 #include "client/async_log_client.h"
 #include "merkletree/serial_hasher.h"
@@ -61,6 +64,18 @@ class LoggedCertificate : public ct::LoggedCertificatePB {
                                                     dst) == Serializer::OK;
   }
 
+  // Moves the certificates of the chain out of the entry into
+  // |chain_certs|, keyed by their SHA-256 hash, leaving only the
+  // hashes behind (in chain_cert_sha256). This lets the database store
+  // each distinct intermediate and root only once.
+  void InternChain(std::map<std::string, std::string>* chain_certs);
+
+  // Undoes InternChain(), fetching the certificates with |lookup|.
+  // Does nothing if the chain is not interned. Returns false if a
+  // certificate could not be found.
+  bool RestoreChain(const std::function<bool(const std::string& sha256_hash,
+                                             std::string* cert)>& lookup);
+
   // Note that this method will not fully populate the SCT.
   bool CopyFromClientLogEntry(const AsyncLogClient::Entry& entry);
 
@@ -0,0 +1,116 @@
+#include "log/merge_delay_tracker.h"
+
+#include <glog/logging.h>
+
+#include "monitoring/histogram.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+// Entries which never get served (because they are lost along with a
+// master, say) should not pile up forever.
+const size_t kMaxTracked = 100000;
+
+
+Histogram<string> merge_delay_ms(
+    "merge_delay_ms", "stage",
+    "Time taken by a sample of the entries to go through each stage from "
+    "their submission to being covered by the serving STH.",
+    {1000, 5000, 15000, 30000, 60000, 120000, 300000, 600000, 1800000,
+     3600000, 21600000, 86400000});
+
+
+void RecordDelay(const string& stage, uint64_t from_ms, uint64_t to_ms) {
+  // Clocks of different nodes can disagree a little.
+  merge_delay_ms.RecordValue(stage, to_ms > from_ms ? to_ms - from_ms : 0);
+}
+
+
+}  // namespace
+
+
+MergeDelayTracker::MergeDelayTracker(double sample_rate)
+    : sample_rate_(sample_rate) {
+  CHECK_GE(sample_rate_, 0);
+  CHECK_LE(sample_rate_, 1);
+}
+
+
+bool MergeDelayTracker::Sampled(const string& entry_hash) const {
+  if (sample_rate_ >= 1) {
+    return true;
+  }
+  if (entry_hash.size() < 4) {
+    return false;
+  }
+
+  // The hash is as good as random, and every node (and stage) picks
+  // the same entries.
+  uint32_t prefix(0);
+  for (int i = 0; i < 4; ++i) {
+    prefix = (prefix << 8) | static_cast<uint8_t>(entry_hash[i]);
+  }
+  return prefix < sample_rate_ * 4294967296.0;
+}
+
+
+void MergeDelayTracker::EntrySequenced(const string& entry_hash,
+                                       int64_t sequence_number,
+                                       uint64_t submitted_ms,
+                                       uint64_t sequenced_ms) {
+  CHECK_GE(sequence_number, 0);
+  if (!Sampled(entry_hash)) {
+    return;
+  }
+
+  RecordDelay("sequencing", submitted_ms, sequenced_ms);
+
+  lock_guard<mutex> lock(mutex_);
+  Stages& stages(tracked_[sequence_number]);
+  stages.submitted_ms = submitted_ms;
+  stages.sequenced_ms = sequenced_ms;
+  stages.signed_ms = 0;
+  if (tracked_.size() > kMaxTracked) {
+    tracked_.erase(tracked_.begin());
+  }
+}
+
+
+void MergeDelayTracker::TreeSigned(int64_t tree_size, uint64_t signed_ms) {
+  lock_guard<mutex> lock(mutex_);
+  for (auto it(tracked_.begin());
+       it != tracked_.end() && it->first < tree_size; ++it) {
+    if (it->second.signed_ms == 0) {
+      it->second.signed_ms = signed_ms;
+      RecordDelay("signing", it->second.sequenced_ms, signed_ms);
+    }
+  }
+}
+
+
+void MergeDelayTracker::TreeServed(int64_t tree_size, uint64_t served_ms) {
+  lock_guard<mutex> lock(mutex_);
+  auto it(tracked_.begin());
+  for (; it != tracked_.end() && it->first < tree_size; ++it) {
+    // The serving STH might not be one of ours.
+    if (it->second.signed_ms != 0) {
+      RecordDelay("serving", it->second.signed_ms, served_ms);
+    }
+    RecordDelay("total", it->second.submitted_ms, served_ms);
+  }
+  tracked_.erase(tracked_.begin(), it);
+}
+
+
+size_t MergeDelayTracker::NumTracked() const {
+  lock_guard<mutex> lock(mutex_);
+  return tracked_.size();
+}
+
+
+}  // namespace cert_trans
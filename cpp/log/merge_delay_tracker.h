@@ -0,0 +1,75 @@
+#ifndef CERT_TRANS_LOG_MERGE_DELAY_TRACKER_H_
+#define CERT_TRANS_LOG_MERGE_DELAY_TRACKER_H_
+
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Measures how long entries take to get from their submission (the
+// timestamp of their SCT) to being covered by the serving STH, which
+// is what the maximum merge delay of the log is about.
+//
+// A sample of the entries, chosen by their hash, is followed through
+// the stages, and the time spent in each of them is exported in the
+// "merge_delay_ms" histograms, with a "stage" label of:
+//
+//  - "sequencing": from submission to being sequenced,
+//  - "signing": from being sequenced to being covered by a local STH,
+//  - "serving": from being covered by a local STH to being covered by
+//    the serving STH,
+//  - "total": from submission to being covered by the serving STH.
+//
+// Only entries sequenced on this node are followed, so on a cluster,
+// the numbers come from the master (or masters, over time).
+//
+// All the times are in milliseconds since the epoch. This class is
+// thread-safe.
+class MergeDelayTracker {
+ public:
+  // Follows about a fraction "sample_rate" of the entries.
+  explicit MergeDelayTracker(double sample_rate);
+
+  // Whether the entry with this hash is part of the sample.
+  bool Sampled(const std::string& entry_hash) const;
+
+  // Called once the entry with the given hash, SCT timestamp and
+  // sequence number has been sequenced.
+  void EntrySequenced(const std::string& entry_hash, int64_t sequence_number,
+                      uint64_t submitted_ms, uint64_t sequenced_ms);
+
+  // Called once a local STH of "tree_size" entries has been signed.
+  void TreeSigned(int64_t tree_size, uint64_t signed_ms);
+
+  // Called once a serving STH of "tree_size" entries has been adopted
+  // by the cluster.
+  void TreeServed(int64_t tree_size, uint64_t served_ms);
+
+  // Number of entries sequenced but not served yet.
+  size_t NumTracked() const;
+
+ private:
+  struct Stages {
+    uint64_t submitted_ms;
+    uint64_t sequenced_ms;
+    uint64_t signed_ms;
+  };
+
+  const double sample_rate_;
+
+  mutable std::mutex mutex_;
+  // Keyed by sequence number.
+  std::map<int64_t, Stages> tracked_;
+
+  DISALLOW_COPY_AND_ASSIGN(MergeDelayTracker);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_MERGE_DELAY_TRACKER_H_
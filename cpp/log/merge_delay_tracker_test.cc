@@ -0,0 +1,61 @@
+#include "log/merge_delay_tracker.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+TEST(MergeDelayTrackerTest, SamplesByHash) {
+  MergeDelayTracker none(0);
+  MergeDelayTracker half(0.5);
+  MergeDelayTracker all(1);
+
+  const string low("\x10\x00\x00\x00 hash", 9);
+  const string high("\xf0\x00\x00\x00 hash", 9);
+  EXPECT_FALSE(none.Sampled(low));
+  EXPECT_TRUE(half.Sampled(low));
+  EXPECT_FALSE(half.Sampled(high));
+  EXPECT_TRUE(all.Sampled(high));
+}
+
+
+TEST(MergeDelayTrackerTest, IgnoresEntriesNotSampled) {
+  MergeDelayTracker tracker(0.5);
+  tracker.EntrySequenced(string("\xf0\x00\x00\x00", 4), 0, 1000, 2000);
+  EXPECT_EQ(0U, tracker.NumTracked());
+}
+
+
+TEST(MergeDelayTrackerTest, TracksEntriesUntilServed) {
+  MergeDelayTracker tracker(1);
+  tracker.EntrySequenced("hash 0", 0, 1000, 2000);
+  tracker.EntrySequenced("hash 1", 1, 1500, 2000);
+  tracker.EntrySequenced("hash 2", 2, 1500, 2500);
+  EXPECT_EQ(3U, tracker.NumTracked());
+
+  tracker.TreeSigned(2, 3000);
+  EXPECT_EQ(3U, tracker.NumTracked());
+
+  tracker.TreeServed(2, 4000);
+  EXPECT_EQ(1U, tracker.NumTracked());
+
+  // Served without having been signed locally.
+  tracker.TreeServed(3, 5000);
+  EXPECT_EQ(0U, tracker.NumTracked());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
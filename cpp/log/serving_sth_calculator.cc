@@ -0,0 +1,114 @@
+#include "log/serving_sth_calculator.h"
+
+#include <glog/logging.h>
+
+using ct::ClusterConfig;
+using ct::ClusterNodeState;
+using ct::SignedTreeHead;
+using std::make_pair;
+using std::string;
+
+namespace cert_trans {
+
+
+void ServingSTHCalculator::SetNode(const string& node_id,
+                                   const ClusterNodeState& state) {
+  auto it(node_sths_.find(node_id));
+  if (it == node_sths_.end()) {
+    it = node_sths_.emplace(node_id, make_pair(false, SignedTreeHead())).first;
+  } else if (it->second.first) {
+    if (state.has_newest_sth() &&
+        state.newest_sth().SerializeAsString() ==
+            it->second.second.SerializeAsString()) {
+      // Just a refresh, which is most of the updates.
+      return;
+    }
+    UnindexNode(node_id, it->second.second);
+  }
+
+  it->second.first = state.has_newest_sth();
+  if (!state.has_newest_sth()) {
+    it->second.second.Clear();
+    return;
+  }
+
+  const SignedTreeHead& sth(state.newest_sth());
+  CHECK_LE(0, sth.tree_size());
+  CHECK_LE(0, sth.timestamp());
+  it->second.second.CopyFrom(sth);
+  CHECK(nodes_by_size_[sth.tree_size()]
+            .emplace(make_pair(sth.timestamp(), node_id), &it->second.second)
+            .second);
+}
+
+
+void ServingSTHCalculator::RemoveNode(const string& node_id) {
+  const auto it(node_sths_.find(node_id));
+  if (it == node_sths_.end()) {
+    return;
+  }
+  if (it->second.first) {
+    UnindexNode(node_id, it->second.second);
+  }
+  node_sths_.erase(it);
+}
+
+
+ServingSTHCalculator::Result ServingSTHCalculator::Calculate(
+    const ClusterConfig& config, int64_t min_tree_size,
+    const SignedTreeHead* serving_sth, SignedTreeHead* sth,
+    int* num_nodes) const {
+  CHECK_NOTNULL(sth);
+  CHECK_LE(0, min_tree_size);
+
+  // Work backwards (from the largest tree size) until there are enough
+  // nodes to serve an STH: they can all serve the smaller ones too.
+  bool serving_is_candidate(false);
+  int num_nodes_seen(0);
+  for (const auto& size : nodes_by_size_) {
+    if (size.first < min_tree_size) {
+      break;
+    }
+    num_nodes_seen += size.second.size();
+    const double serving_fraction(static_cast<double>(num_nodes_seen) /
+                                  node_sths_.size());
+    if (serving_fraction < config.minimum_serving_fraction() ||
+        num_nodes_seen < config.minimum_serving_nodes()) {
+      continue;
+    }
+
+    // The newest STH at this size.
+    const SignedTreeHead& candidate(*size.second.rbegin()->second);
+    if (serving_sth && candidate.timestamp() <= serving_sth->timestamp()) {
+      VLOG(1) << "Discarding candidate STH:\n" << candidate.DebugString()
+              << "\nbecause its timestamp is <= current serving STH "
+              << "timestamp (" << serving_sth->timestamp() << ")";
+      serving_is_candidate |=
+          candidate.SerializeAsString() == serving_sth->SerializeAsString();
+      continue;
+    }
+
+    sth->CopyFrom(candidate);
+    if (num_nodes) {
+      *num_nodes = num_nodes_seen;
+    }
+    return NEW_STH;
+  }
+
+  return serving_is_candidate ? SERVING_STH : NO_STH;
+}
+
+
+void ServingSTHCalculator::UnindexNode(const string& node_id,
+                                       const SignedTreeHead& sth) {
+  const auto size(nodes_by_size_.find(sth.tree_size()));
+  CHECK(size != nodes_by_size_.end());
+  CHECK_EQ(static_cast<size_t>(1),
+           size->second.erase(make_pair(sth.timestamp(), node_id)));
+  if (size->second.empty()) {
+    nodes_by_size_.erase(size);
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,78 @@
+#ifndef CERT_TRANS_LOG_SERVING_STH_CALCULATOR_H_
+#define CERT_TRANS_LOG_SERVING_STH_CALCULATOR_H_
+
+#include <functional>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "base/macros.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// Keeps track of the newest STH of every node in the cluster, grouped
+// by tree size, so that the STH the cluster can serve is found
+// without going over all the nodes again every time one of them
+// changes.
+//
+// This class is not thread-safe.
+class ServingSTHCalculator {
+ public:
+  enum Result {
+    // A new STH can be served.
+    NEW_STH,
+    // Nothing newer than the current serving STH can be served, but
+    // it still can.
+    SERVING_STH,
+    // Not enough nodes can serve anything newer than the current
+    // serving STH (or than nothing, if there is none).
+    NO_STH,
+  };
+
+  ServingSTHCalculator() = default;
+
+  // Adds the node, or updates its state. A node without a newest STH
+  // still counts towards the size of the cluster.
+  void SetNode(const std::string& node_id, const ct::ClusterNodeState& state);
+
+  void RemoveNode(const std::string& node_id);
+
+  int NumNodes() const {
+    return node_sths_.size();
+  }
+
+  // Looks for the largest STH which enough nodes can serve according
+  // to "config", no smaller than "min_tree_size", and newer than
+  // "serving_sth" if it is not NULL. If NEW_STH is returned, "sth" is
+  // set to it, and "num_nodes" (if not NULL) to the number of nodes
+  // which can serve it.
+  Result Calculate(const ct::ClusterConfig& config, int64_t min_tree_size,
+                   const ct::SignedTreeHead* serving_sth,
+                   ct::SignedTreeHead* sth, int* num_nodes) const;
+
+ private:
+  // Nodes at a given tree size, by STH timestamp and then node ID,
+  // pointing at their STH in |node_sths_|.
+  typedef std::map<std::pair<uint64_t, std::string>,
+                   const ct::SignedTreeHead*> NodesAtSize;
+
+  void UnindexNode(const std::string& node_id,
+                   const ct::SignedTreeHead& sth);
+
+  // Every node, with its newest STH if it has one.
+  std::unordered_map<std::string, std::pair<bool, ct::SignedTreeHead>>
+      node_sths_;
+  // Only the nodes which have an STH, largest tree size first.
+  std::map<int64_t, NodesAtSize, std::greater<int64_t>> nodes_by_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(ServingSTHCalculator);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SERVING_STH_CALCULATOR_H_
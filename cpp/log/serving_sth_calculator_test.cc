@@ -0,0 +1,144 @@
+#include "log/serving_sth_calculator.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "proto/ct.pb.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::ClusterConfig;
+using ct::ClusterNodeState;
+using ct::SignedTreeHead;
+using std::string;
+
+
+ClusterNodeState NodeState(int64_t tree_size, uint64_t timestamp) {
+  ClusterNodeState state;
+  state.mutable_newest_sth()->set_tree_size(tree_size);
+  state.mutable_newest_sth()->set_timestamp(timestamp);
+  return state;
+}
+
+
+ClusterConfig Config(int min_nodes, double min_fraction) {
+  ClusterConfig config;
+  config.set_minimum_serving_nodes(min_nodes);
+  config.set_minimum_serving_fraction(min_fraction);
+  return config;
+}
+
+
+class ServingSTHCalculatorTest : public ::testing::Test {
+ protected:
+  ServingSTHCalculator::Result Calculate(const ClusterConfig& config,
+                                         int64_t min_tree_size = 0,
+                                         const SignedTreeHead* serving_sth =
+                                             nullptr) {
+    sth_.Clear();
+    num_nodes_ = 0;
+    return calculator_.Calculate(config, min_tree_size, serving_sth, &sth_,
+                                 &num_nodes_);
+  }
+
+  ServingSTHCalculator calculator_;
+  SignedTreeHead sth_;
+  int num_nodes_;
+};
+
+
+TEST_F(ServingSTHCalculatorTest, NoNodes) {
+  EXPECT_EQ(ServingSTHCalculator::NO_STH, Calculate(Config(1, 0.5)));
+}
+
+
+TEST_F(ServingSTHCalculatorTest, ServesWhatEnoughNodesCover) {
+  calculator_.SetNode("one", NodeState(100, 100));
+  calculator_.SetNode("two", NodeState(200, 200));
+  calculator_.SetNode("three", NodeState(300, 300));
+  EXPECT_EQ(3, calculator_.NumNodes());
+
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(1, 0.5)));
+  EXPECT_EQ(200, sth_.tree_size());
+  EXPECT_EQ(2, num_nodes_);
+
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(1, 0.3)));
+  EXPECT_EQ(300, sth_.tree_size());
+
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(3, 0)));
+  EXPECT_EQ(100, sth_.tree_size());
+  EXPECT_EQ(3, num_nodes_);
+
+  EXPECT_EQ(ServingSTHCalculator::NO_STH, Calculate(Config(4, 0)));
+}
+
+
+TEST_F(ServingSTHCalculatorTest, NodesWithoutSTHCount) {
+  calculator_.SetNode("one", NodeState(100, 100));
+  calculator_.SetNode("two", ClusterNodeState());
+  EXPECT_EQ(2, calculator_.NumNodes());
+  EXPECT_EQ(ServingSTHCalculator::NO_STH, Calculate(Config(1, 0.6)));
+
+  calculator_.SetNode("two", NodeState(100, 100));
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(1, 0.6)));
+  EXPECT_EQ(100, sth_.tree_size());
+  EXPECT_EQ(2, num_nodes_);
+}
+
+
+TEST_F(ServingSTHCalculatorTest, FollowsChanges) {
+  calculator_.SetNode("one", NodeState(100, 100));
+  calculator_.SetNode("two", NodeState(100, 100));
+  // A refresh without a new STH.
+  calculator_.SetNode("two", NodeState(100, 100));
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(2, 1)));
+  EXPECT_EQ(100, sth_.tree_size());
+
+  calculator_.SetNode("one", NodeState(200, 200));
+  calculator_.SetNode("two", NodeState(200, 210));
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(2, 1)));
+  EXPECT_EQ(200, sth_.tree_size());
+  // The newest STH at that size.
+  EXPECT_EQ(210, sth_.timestamp());
+
+  calculator_.RemoveNode("two");
+  EXPECT_EQ(1, calculator_.NumNodes());
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(1, 1)));
+  EXPECT_EQ(200, sth_.timestamp());
+  EXPECT_EQ(ServingSTHCalculator::NO_STH, Calculate(Config(2, 1)));
+
+  // Removing an unknown node does nothing.
+  calculator_.RemoveNode("two");
+  EXPECT_EQ(1, calculator_.NumNodes());
+}
+
+
+TEST_F(ServingSTHCalculatorTest, OnlyNewerThanServingSTH) {
+  calculator_.SetNode("one", NodeState(100, 100));
+  calculator_.SetNode("two", NodeState(200, 200));
+
+  SignedTreeHead serving(NodeState(200, 200).newest_sth());
+  EXPECT_EQ(ServingSTHCalculator::SERVING_STH,
+            Calculate(Config(1, 0.5), 0, &serving));
+
+  serving.set_timestamp(250);
+  EXPECT_EQ(ServingSTHCalculator::NO_STH,
+            Calculate(Config(1, 0.5), 0, &serving));
+
+  // Nothing smaller than the minimum tree size.
+  EXPECT_EQ(ServingSTHCalculator::NO_STH, Calculate(Config(2, 1), 150));
+  ASSERT_EQ(ServingSTHCalculator::NEW_STH, Calculate(Config(2, 1), 100));
+  EXPECT_EQ(100, sth_.tree_size());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,183 @@
+#include "log/signing_scheduler.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+#include <string>
+
+#include "monitoring/counter.h"
+#include "monitoring/gauge.h"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::make_pair;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+
+namespace cert_trans {
+namespace {
+
+
+// Keep at most this many of our STHs waiting to be served, in case
+// they never are (because the cluster picks the STHs of other nodes).
+const size_t kMaxUnserved = 64;
+
+
+Counter<string>* signing_scheduler_decisions =
+    Counter<string>::New("signing_scheduler_decisions", "reason",
+                         "Number of STHs signed, broken out by the reason "
+                         "the scheduler had for signing.");
+
+Gauge<>* signing_scheduler_backlog =
+    Gauge<>::New("signing_scheduler_backlog",
+                 "Number of entries in the local database which are not "
+                 "covered by an STH yet.");
+
+Gauge<>* signing_scheduler_oldest_unsigned_age_ms =
+    Gauge<>::New("signing_scheduler_oldest_unsigned_age_ms",
+                 "Time since the submission of the oldest entry which is "
+                 "not covered by an STH yet.");
+
+Gauge<>* signing_scheduler_signing_latency_ms =
+    Gauge<>::New("signing_scheduler_signing_latency_ms",
+                 "Moving average of the time taken to sign an STH.");
+
+Gauge<>* signing_scheduler_serving_latency_ms =
+    Gauge<>::New("signing_scheduler_serving_latency_ms",
+                 "Moving average of the time taken for a locally signed STH "
+                 "to be covered by the serving STH.");
+
+Gauge<>* signing_scheduler_next_signing_ms =
+    Gauge<>::New("signing_scheduler_next_signing_ms",
+                 "Time until the scheduler will sign the next STH.");
+
+
+string ReasonString(SigningScheduler::Reason reason) {
+  switch (reason) {
+    case SigningScheduler::REFRESH:
+      return "refresh";
+    case SigningScheduler::BACKLOG:
+      return "backlog";
+    case SigningScheduler::DEADLINE:
+      return "deadline";
+  }
+  LOG(FATAL) << "unknown reason: " << reason;
+}
+
+
+// Exponentially weighted moving average, starting with the first
+// sample.
+SigningScheduler::Clock::duration UpdateAverage(
+    SigningScheduler::Clock::duration average,
+    SigningScheduler::Clock::duration sample) {
+  if (average == SigningScheduler::Clock::duration::zero()) {
+    return sample;
+  }
+  return (average * 3 + sample) / 4;
+}
+
+
+}  // namespace
+
+
+SigningScheduler::SigningScheduler(const Options& options)
+    : options_(options),
+      last_signing_(),
+      signing_latency_(Clock::duration::zero()),
+      serving_latency_(Clock::duration::zero()) {
+  CHECK_GT(options_.min_interval.count(), 0);
+  CHECK_GE(options_.max_interval, options_.min_interval);
+  CHECK_GT(options_.merge_delay_target.count(), 0);
+  CHECK_GT(options_.backlog_threshold, 0);
+}
+
+
+SigningScheduler::Clock::time_point SigningScheduler::NextSigning(
+    Clock::time_point now, int64_t unsigned_entries,
+    milliseconds oldest_unsigned_age, Reason* reason) const {
+  CHECK_GE(unsigned_entries, 0);
+  CHECK_NOTNULL(reason);
+  unique_lock<mutex> lock(mutex_);
+
+  Clock::time_point next(last_signing_ + options_.max_interval);
+  *reason = REFRESH;
+  if (unsigned_entries >= options_.backlog_threshold) {
+    next = now;
+    *reason = BACKLOG;
+  } else if (unsigned_entries > 0) {
+    // Leave enough time for the signing and the serving.
+    const Clock::time_point deadline(now - oldest_unsigned_age +
+                                     options_.merge_delay_target -
+                                     ExpectedLatency(lock));
+    if (deadline < next) {
+      next = deadline;
+      *reason = DEADLINE;
+    }
+  }
+  next = max(next, last_signing_ + options_.min_interval);
+
+  signing_scheduler_backlog->Set(unsigned_entries);
+  signing_scheduler_oldest_unsigned_age_ms->Set(
+      unsigned_entries > 0 ? oldest_unsigned_age.count() : 0);
+  signing_scheduler_next_signing_ms->Set(
+      max<int64_t>(0, duration_cast<milliseconds>(next - now).count()));
+
+  return next;
+}
+
+
+void SigningScheduler::SigningDone(Clock::time_point start,
+                                   Clock::duration latency, int64_t tree_size,
+                                   Reason reason) {
+  CHECK_GE(tree_size, 0);
+  lock_guard<mutex> lock(mutex_);
+  last_signing_ = start;
+  signing_latency_ = UpdateAverage(signing_latency_, latency);
+  signing_scheduler_signing_latency_ms->Set(
+      duration_cast<milliseconds>(signing_latency_).count());
+  signing_scheduler_decisions->Increment(ReasonString(reason));
+
+  unserved_.emplace_back(make_pair(tree_size, start + latency));
+  if (unserved_.size() > kMaxUnserved) {
+    unserved_.pop_front();
+  }
+}
+
+
+void SigningScheduler::ServingTreeSizeUpdated(Clock::time_point now,
+                                              int64_t tree_size) {
+  lock_guard<mutex> lock(mutex_);
+  bool served(false);
+  Clock::time_point signed_time;
+  while (!unserved_.empty() && unserved_.front().first <= tree_size) {
+    served = true;
+    signed_time = unserved_.front().second;
+    unserved_.pop_front();
+  }
+
+  if (served) {
+    serving_latency_ = UpdateAverage(
+        serving_latency_, max(Clock::duration::zero(), now - signed_time));
+    signing_scheduler_serving_latency_ms->Set(
+        duration_cast<milliseconds>(serving_latency_).count());
+  }
+}
+
+
+SigningScheduler::Clock::duration SigningScheduler::ExpectedLatency() const {
+  unique_lock<mutex> lock(mutex_);
+  return ExpectedLatency(lock);
+}
+
+
+SigningScheduler::Clock::duration SigningScheduler::ExpectedLatency(
+    const unique_lock<mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  return signing_latency_ + serving_latency_;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,103 @@
+#ifndef CERT_TRANS_LOG_SIGNING_SCHEDULER_H_
+#define CERT_TRANS_LOG_SIGNING_SCHEDULER_H_
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <utility>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Decides when the tree signer should sign a new STH. Rather than
+// signing on a fixed timer, it signs:
+//
+//  - as soon as possible when many entries are waiting to be signed,
+//  - in time for the oldest waiting entry to be in a serving STH
+//    within the merge delay target, allowing for how long signing
+//    and getting the STH served took recently,
+//  - every so often when there is nothing new, to keep the STH fresh.
+//
+// This class is thread-safe.
+class SigningScheduler {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Options {
+    Options()
+        : min_interval(std::chrono::seconds(1)),
+          max_interval(std::chrono::seconds(600)),
+          merge_delay_target(std::chrono::seconds(120)),
+          backlog_threshold(1000) {
+    }
+
+    // Never sign more often than this.
+    Clock::duration min_interval;
+    // Sign at least this often, even with no new entries.
+    Clock::duration max_interval;
+    // How long after their submission we would like entries to be
+    // covered by the serving STH.
+    Clock::duration merge_delay_target;
+    // Sign as soon as possible once this many entries are waiting.
+    int64_t backlog_threshold;
+  };
+
+  enum Reason {
+    // Nothing new, but the STH is getting old.
+    REFRESH,
+    // Lots of entries are waiting.
+    BACKLOG,
+    // The oldest entry waiting is getting close to the target.
+    DEADLINE,
+  };
+
+  explicit SigningScheduler(const Options& options);
+
+  // Returns when the next STH should be signed (which can be in the
+  // past, meaning right away), given that "unsigned_entries" entries
+  // are in the local database without being covered by an STH yet,
+  // the oldest of which was submitted "oldest_unsigned_age" ago. The
+  // reason for signing at that time is stored in "reason".
+  Clock::time_point NextSigning(Clock::time_point now,
+                                int64_t unsigned_entries,
+                                std::chrono::milliseconds oldest_unsigned_age,
+                                Reason* reason) const;
+
+  // Records that signing an STH for "tree_size" entries was started
+  // at "start", for "reason", and took "latency".
+  void SigningDone(Clock::time_point start, Clock::duration latency,
+                   int64_t tree_size, Reason reason);
+
+  // Should be called with the tree size of every new serving STH, to
+  // keep track of how long it takes for our STHs to get served.
+  void ServingTreeSizeUpdated(Clock::time_point now, int64_t tree_size);
+
+  // How long it is expected to take from deciding to sign an STH to
+  // that STH being served.
+  Clock::duration ExpectedLatency() const;
+
+ private:
+  Clock::duration ExpectedLatency(
+      const std::unique_lock<std::mutex>& lock) const;
+
+  const Options options_;
+
+  mutable std::mutex mutex_;
+  Clock::time_point last_signing_;
+  // Moving averages, zero until there is a sample.
+  Clock::duration signing_latency_;
+  Clock::duration serving_latency_;
+  // Tree sizes of the STHs we signed which are not served yet, and
+  // when they were signed, oldest first.
+  std::deque<std::pair<int64_t, Clock::time_point>> unserved_;
+
+  DISALLOW_COPY_AND_ASSIGN(SigningScheduler);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SIGNING_SCHEDULER_H_
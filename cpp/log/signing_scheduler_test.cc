@@ -0,0 +1,118 @@
+#include "log/signing_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+typedef SigningScheduler::Clock Clock;
+
+
+class SigningSchedulerTest : public ::testing::Test {
+ protected:
+  SigningSchedulerTest() : scheduler_(Options()), now_(Clock::now()) {
+  }
+
+  static SigningScheduler::Options Options() {
+    SigningScheduler::Options options;
+    options.min_interval = seconds(1);
+    options.max_interval = seconds(600);
+    options.merge_delay_target = seconds(120);
+    options.backlog_threshold = 100;
+    return options;
+  }
+
+  // Signs right away, at "now_".
+  void Sign(int64_t tree_size, Clock::duration latency) {
+    scheduler_.SigningDone(now_, latency, tree_size,
+                           SigningScheduler::REFRESH);
+  }
+
+  SigningScheduler scheduler_;
+  const Clock::time_point now_;
+};
+
+
+TEST_F(SigningSchedulerTest, SignsRightAwayInitially) {
+  SigningScheduler::Reason reason;
+  EXPECT_GE(now_,
+            scheduler_.NextSigning(now_, 0, milliseconds(0), &reason));
+  EXPECT_EQ(SigningScheduler::REFRESH, reason);
+}
+
+
+TEST_F(SigningSchedulerTest, RefreshesWhenIdle) {
+  Sign(10, milliseconds(0));
+
+  SigningScheduler::Reason reason;
+  EXPECT_EQ(now_ + seconds(600),
+            scheduler_.NextSigning(now_, 0, milliseconds(0), &reason));
+  EXPECT_EQ(SigningScheduler::REFRESH, reason);
+}
+
+
+TEST_F(SigningSchedulerTest, SignsBacklogAfterMinInterval) {
+  Sign(10, milliseconds(0));
+
+  SigningScheduler::Reason reason;
+  EXPECT_EQ(now_ + seconds(1),
+            scheduler_.NextSigning(now_, 100, milliseconds(0), &reason));
+  EXPECT_EQ(SigningScheduler::BACKLOG, reason);
+
+  EXPECT_EQ(now_ + seconds(5),
+            scheduler_.NextSigning(now_ + seconds(5), 100, milliseconds(0),
+                                   &reason));
+  EXPECT_EQ(SigningScheduler::BACKLOG, reason);
+}
+
+
+TEST_F(SigningSchedulerTest, MeetsMergeDelayTarget) {
+  Sign(10, milliseconds(0));
+
+  SigningScheduler::Reason reason;
+  EXPECT_EQ(now_ + seconds(100),
+            scheduler_.NextSigning(now_, 1, seconds(20), &reason));
+  EXPECT_EQ(SigningScheduler::DEADLINE, reason);
+
+  // Already late, sign as soon as allowed.
+  EXPECT_EQ(now_ + seconds(1),
+            scheduler_.NextSigning(now_, 1, seconds(200), &reason));
+  EXPECT_EQ(SigningScheduler::DEADLINE, reason);
+}
+
+
+TEST_F(SigningSchedulerTest, AllowsForLatency) {
+  Sign(10, seconds(4));
+  scheduler_.ServingTreeSizeUpdated(now_ + seconds(10), 10);
+  EXPECT_EQ(seconds(10), scheduler_.ExpectedLatency());
+
+  SigningScheduler::Reason reason;
+  EXPECT_EQ(now_ + seconds(90),
+            scheduler_.NextSigning(now_, 1, seconds(20), &reason));
+  EXPECT_EQ(SigningScheduler::DEADLINE, reason);
+}
+
+
+TEST_F(SigningSchedulerTest, IgnoresSmallerServingTrees) {
+  Sign(10, seconds(1));
+  scheduler_.ServingTreeSizeUpdated(now_ + seconds(10), 9);
+  EXPECT_EQ(seconds(1), scheduler_.ExpectedLatency());
+
+  scheduler_.ServingTreeSizeUpdated(now_ + seconds(3), 11);
+  EXPECT_EQ(seconds(3), scheduler_.ExpectedLatency());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -4,8 +4,10 @@
 
 #include "log/sqlite_db.h"
 
+#include <functional>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <map>
 #include <sqlite3.h>
 
 #include "log/sqlite_statement.h"
@@ -38,6 +40,7 @@ DEFINE_bool(sqlite_batch_into_transactions, true,
             "scenes.");
 DEFINE_int32(sqlite_transaction_batch_size, 400,
              "Max number of operations to batch into one transaction.");
+DECLARE_bool(db_intern_chain_certs);
 
 
 namespace {
@@ -165,12 +168,22 @@ SQLiteDB<Logged>::SQLiteDB(const std::string& dbfile)
     CHECK_EQ(SQLITE_DONE, statement.Step());
   }
 
+  {
+    // Databases created before chain certificates could be interned
+    // do not have this table yet.
+    sqlite::Statement statement(db_,
+                                "CREATE TABLE IF NOT EXISTS "
+                                "chain_certs(hash BLOB UNIQUE, cert BLOB)");
+    CHECK_EQ(SQLITE_DONE, statement.Step());
+  }
+
   BeginTransaction(lock);
 }
 
 
 template <class Logged>
 SQLiteDB<Logged>::~SQLiteDB() {
+  this->ShutdownIO();
   CHECK_EQ(SQLITE_OK, sqlite3_close(db_));
 }
 
@@ -191,7 +204,15 @@ typename Database<Logged>::WriteResult SQLiteDB<Logged>::CreateSequencedEntry_(
   statement.BindBlob(0, hash);
 
   std::string data;
-  CHECK(logged.SerializeForDatabase(&data));
+  std::map<std::string, std::string> chain_certs;
+  if (FLAGS_db_intern_chain_certs) {
+    Logged interned;
+    interned.CopyFrom(logged);
+    interned.InternChain(&chain_certs);
+    CHECK(interned.SerializeForDatabase(&data));
+  } else {
+    CHECK(logged.SerializeForDatabase(&data));
+  }
   statement.BindBlob(1, data);
 
   CHECK(logged.has_sequence_number());
@@ -220,6 +241,21 @@ typename Database<Logged>::WriteResult SQLiteDB<Logged>::CreateSequencedEntry_(
   }
   CHECK_EQ(SQLITE_DONE, ret);
 
+  // This is in the same transaction as the entry, so an entry never
+  // refers to a missing certificate.
+  for (const auto& cert : chain_certs) {
+    if (chain_certs_.Contains(cert.first)) {
+      continue;
+    }
+    sqlite::Statement cert_statement(db_,
+                                     "INSERT OR IGNORE INTO "
+                                     "chain_certs(hash, cert) VALUES(?, ?)");
+    cert_statement.BindBlob(0, cert.first);
+    cert_statement.BindBlob(1, cert.second);
+    CHECK_EQ(SQLITE_DONE, cert_statement.Step());
+    chain_certs_.Insert(cert.first, cert.second);
+  }
+
   if (logged.sequence_number() == tree_size_) {
     ++tree_size_;
   }
@@ -235,7 +271,7 @@ typename Database<Logged>::LookupResult SQLiteDB<Logged>::LookupByHash(
   cert_trans::ScopedLatency latency(
       latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  std::lock_guard<std::mutex> lock(lock_);
+  std::unique_lock<std::mutex> lock(lock_);
 
   sqlite::Statement statement(db_,
                               "SELECT entry, sequence FROM leaves "
@@ -251,7 +287,7 @@ typename Database<Logged>::LookupResult SQLiteDB<Logged>::LookupByHash(
 
   std::string data;
   statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  CHECK(ParseEntry(lock, data, result));
 
   if (statement.GetType(1) == SQLITE_NULL) {
     result->clear_sequence_number();
@@ -295,7 +331,7 @@ typename Database<Logged>::LookupResult SQLiteDB<Logged>::LookupByIndex(
 
   std::string data;
   statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  CHECK(ParseEntry(lock, data, result));
 
   std::string hash;
   statement.GetBlob(1, &hash);
@@ -328,7 +364,7 @@ typename Database<Logged>::LookupResult SQLiteDB<Logged>::LookupNextIndex(
 
   std::string data;
   statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  CHECK(ParseEntry(lock, data, result));
 
   std::string hash;
   statement.GetBlob(1, &hash);
@@ -511,6 +547,47 @@ typename Database<Logged>::LookupResult SQLiteDB<Logged>::NodeId(
 }
 
 
+template <class Logged>
+bool SQLiteDB<Logged>::ParseEntry(const std::unique_lock<std::mutex>& lock,
+                                  const std::string& data,
+                                  Logged* entry) const {
+  using std::placeholders::_1;
+  using std::placeholders::_2;
+  CHECK(lock.owns_lock());
+  return entry->ParseFromDatabase(data) &&
+         entry->RestoreChain(std::bind(&SQLiteDB<Logged>::LookupChainCert,
+                                       this, std::cref(lock), _1, _2));
+}
+
+
+template <class Logged>
+bool SQLiteDB<Logged>::LookupChainCert(
+    const std::unique_lock<std::mutex>& lock, const std::string& hash,
+    std::string* cert) const {
+  CHECK(lock.owns_lock());
+  if (chain_certs_.Lookup(hash, cert)) {
+    return true;
+  }
+
+  // The database might be shared with another process (see
+  // ForceNotifySTH()), so this can find certificates we have never
+  // seen.
+  sqlite::Statement statement(db_,
+                              "SELECT cert FROM chain_certs WHERE hash = ?");
+  statement.BindBlob(0, hash);
+  const int ret(statement.Step());
+  if (ret == SQLITE_DONE) {
+    return false;
+  }
+  CHECK_EQ(SQLITE_ROW, ret);
+
+  statement.GetBlob(0, cert);
+  chain_certs_.Insert(hash, *cert);
+
+  return true;
+}
+
+
 template <class Logged>
 void SQLiteDB<Logged>::BeginTransaction(
     const std::unique_lock<std::mutex>& lock) {
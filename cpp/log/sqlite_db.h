@@ -64,6 +64,11 @@ class SQLiteDB : public Database<Logged> {
                                     ct::SignedTreeHead* result) const;
   LookupResult NodeId(const std::unique_lock<std::mutex>& lock,
                       std::string* node_id);
+  // Parses a stored entry, restoring its chain if it was interned.
+  bool ParseEntry(const std::unique_lock<std::mutex>& lock,
+                  const std::string& data, Logged* entry) const;
+  bool LookupChainCert(const std::unique_lock<std::mutex>& lock,
+                       const std::string& hash, std::string* cert) const;
 
   void BeginTransaction(const std::unique_lock<std::mutex>& lock);
 
@@ -77,6 +82,7 @@ class SQLiteDB : public Database<Logged> {
   // from some of the getters.
   mutable int64_t tree_size_;
   cert_trans::DatabaseNotifierHelper callbacks_;
+  mutable cert_trans::ChainCertCache chain_certs_;
   int64_t transaction_size_;
   bool in_transaction_;
 
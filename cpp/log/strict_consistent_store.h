@@ -14,6 +14,10 @@ namespace cert_trans {
 // action (especially a long running action, e.g. a signing run) with a check
 // to IsMaster(), it is still necessarily racy because etcd doesn't support
 // atomic updates across keys.)
+//
+// The check is cheap, and a master which cannot refresh its election
+// proposal fails it as soon as the proposal might have expired, which
+// is before any other node can become master.
 template <class Logged>
 class StrictConsistentStore : public ConsistentStore<Logged> {
  public:
@@ -46,6 +50,10 @@ class StrictConsistentStore : public ConsistentStore<Logged> {
     return peer_->AddPendingEntry(entry);
   }
 
+  void AddPendingEntry(Logged* entry, util::Task* task) override {
+    peer_->AddPendingEntry(entry, task);
+  }
+
   util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<Logged>* entry) const override {
     return peer_->GetPendingEntryForHash(hash, entry);
@@ -56,6 +64,12 @@ class StrictConsistentStore : public ConsistentStore<Logged> {
     return peer_->GetPendingEntries(entries);
   }
 
+  util::Status GetSharedPendingEntries(
+      std::vector<std::shared_ptr<const EntryHandle<Logged>>>* entries)
+      const override {
+    return peer_->GetSharedPendingEntries(entries);
+  }
+
   util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const override {
     return peer_->GetSequenceMapping(entry);
@@ -88,6 +102,10 @@ class StrictConsistentStore : public ConsistentStore<Logged> {
     return peer_->WatchClusterConfig(cb, task);
   }
 
+  void PrepareToSequence() override {
+    peer_->PrepareToSequence();
+  }
+
  private:
   const MasterElection* const election_;  // Not owned by us
   const std::unique_ptr<ConsistentStore<Logged>> peer_;
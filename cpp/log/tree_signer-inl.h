@@ -7,16 +7,20 @@
 #include <algorithm>
 #include <chrono>
 #include <glog/logging.h>
+#include <memory>
 #include <set>
 #include <stdint.h>
+#include <thread>
 #include <unordered_map>
 
 #include "log/database.h"
 #include "log/log_signer.h"
+#include "log/merge_delay_tracker.h"
 #include "proto/serializer.h"
+#include "third_party/cosi/cosi_batcher.h"
 #include "util/status.h"
+#include "util/sync_task.h"
 #include "util/util.h"
-#include "third_party/cosi/stamp_request.h"
 
 
 namespace cert_trans {
@@ -57,6 +61,12 @@ struct PendingEntriesOrder
     // Fallback to Hash as a final tie-breaker:
     return x.Entry().Hash() < y.Entry().Hash();
   }
+
+  bool operator()(
+      const std::shared_ptr<const cert_trans::EntryHandle<Logged>>& x,
+      const std::shared_ptr<const cert_trans::EntryHandle<Logged>>& y) const {
+    return (*this)(*x, *y);
+  }
 };
 
 
@@ -70,7 +80,14 @@ TreeSigner<Logged>::TreeSigner(
       consistent_store_(consistent_store),
       signer_(signer),
       cert_tree_(std::move(merkle_tree)),
-      latest_tree_head_() {
+      latest_tree_head_(),
+      cosi_batcher_(nullptr),
+      cosi_executor_(nullptr),
+      cosign_latest_timestamp_(0),
+      merge_delay_tracker_(nullptr),
+      pipeline_stopping_(false),
+      pipeline_sequenced_(false),
+      pipeline_signed_size_(0) {
   CHECK(cert_tree_);
   // Try to get any STH previously published by this node.
   const util::StatusOr<ct::ClusterNodeState> node_state(
@@ -85,6 +102,37 @@ TreeSigner<Logged>::TreeSigner(
 }
 
 
+template <class Logged>
+TreeSigner<Logged>::~TreeSigner() {
+  if (cosign_task_) {
+    // Cancels the outstanding cosigning requests.
+    cosign_task_->task()->Return();
+    cosign_task_->Wait();
+  }
+}
+
+
+template <class Logged>
+void TreeSigner<Logged>::EnableCosigning(
+    CosiBatcher* cosi_batcher, util::Executor* executor,
+    const std::function<void(const ct::SignedTreeHead&)>& cosigned) {
+  CHECK(!cosi_batcher_);
+  cosi_batcher_ = CHECK_NOTNULL(cosi_batcher);
+  cosi_executor_ = CHECK_NOTNULL(executor);
+  cosigned_ = cosigned;
+  if (cosigned_) {
+    cosign_task_.reset(new util::SyncTask(cosi_executor_));
+  }
+}
+
+
+template <class Logged>
+void TreeSigner<Logged>::SetMergeDelayTracker(MergeDelayTracker* tracker) {
+  CHECK(!merge_delay_tracker_);
+  merge_delay_tracker_ = CHECK_NOTNULL(tracker);
+}
+
+
 template <class Logged>
 uint64_t TreeSigner<Logged>::LastUpdateTime() const {
   return latest_tree_head_.timestamp();
@@ -93,8 +141,19 @@ uint64_t TreeSigner<Logged>::LastUpdateTime() const {
 
 template <class Logged>
 util::Status TreeSigner<Logged>::SequenceNewEntries() {
+  return SequenceNewEntries(INT64_MAX, nullptr);
+}
+
+
+template <class Logged>
+util::Status TreeSigner<Logged>::SequenceNewEntries(
+    int64_t max_new_entries,
+    std::chrono::system_clock::time_point* next_ready) {
+  CHECK_GT(max_new_entries, 0);
   const std::chrono::system_clock::time_point now(
       std::chrono::system_clock::now());
+  std::chrono::system_clock::time_point next_ready_time(
+      std::chrono::system_clock::time_point::max());
   util::StatusOr<int64_t> status_or_sequence_number(
       consistent_store_->NextAvailableSequenceNumber());
   if (!status_or_sequence_number.ok()) {
@@ -122,13 +181,20 @@ util::Status TreeSigner<Logged>::SequenceNewEntries() {
                                                            false))).second);
   }
 
-  std::vector<cert_trans::EntryHandle<Logged>> pending_entries;
-  status = consistent_store_->GetPendingEntries(&pending_entries);
+  // These are shared with the consistent store, and must not be
+  // modified.
+  std::vector<std::shared_ptr<const cert_trans::EntryHandle<Logged>>>
+      pending_entries;
+  status = consistent_store_->GetSharedPendingEntries(&pending_entries);
   if (!status.ok()) {
     return status;
   }
-  std::sort(pending_entries.begin(), pending_entries.end(),
-            PendingEntriesOrder<Logged>());
+  // The store usually returns them in this order already.
+  if (!std::is_sorted(pending_entries.begin(), pending_entries.end(),
+                      PendingEntriesOrder<Logged>())) {
+    std::sort(pending_entries.begin(), pending_entries.end(),
+              PendingEntriesOrder<Logged>());
+  }
 
   VLOG(1) << "Sequencing " << pending_entries.size() << " entr"
           << (pending_entries.size() == 1 ? "y" : "ies");
@@ -142,27 +208,44 @@ util::Status TreeSigner<Logged>::SequenceNewEntries() {
   //    removed from the sequence mapping file.
   google::protobuf::RepeatedPtrField<ct::SequenceMapping_Mapping> new_mapping;
   std::map<int64_t, const Logged*> seq_to_entry;
+  std::vector<std::pair<int64_t, const Logged*>> newly_sequenced;
   int num_sequenced(0);
-  for (auto& pending_entry : pending_entries) {
-    const std::string& pending_hash(pending_entry.Entry().Hash());
+  for (const auto& pending_handle : pending_entries) {
+    const Logged& pending_entry(pending_handle->Entry());
+    const std::string& pending_hash(pending_entry.Hash());
     const std::chrono::system_clock::time_point cert_time(
-        std::chrono::milliseconds(pending_entry.Entry().timestamp()));
+        std::chrono::milliseconds(pending_entry.timestamp()));
     if (now - cert_time < guard_window_) {
-      VLOG(1) << "Entry too recent: "
-              << util::ToBase64(pending_entry.Entry().Hash());
+      VLOG(1) << "Entry too recent: " << util::ToBase64(pending_hash);
+      next_ready_time =
+          std::min(next_ready_time,
+                   cert_time +
+                       std::chrono::duration_cast<
+                           std::chrono::system_clock::duration>(guard_window_));
       continue;
     }
     const auto seq_it(sequenced_hashes.find(pending_hash));
+    if (seq_it == sequenced_hashes.end() &&
+        num_sequenced >= max_new_entries) {
+      // Leave it for the next run, which can happen right away.
+      next_ready_time = now;
+      continue;
+    }
     ct::SequenceMapping::Mapping* const seq_mapping(new_mapping.Add());
+    CHECK(!pending_entry.has_sequence_number());
 
+    int64_t sequence_number;
     if (seq_it == sequenced_hashes.end()) {
       // Need to sequence this one.
       VLOG(1) << util::ToBase64(pending_hash) << " = " << next_sequence_number;
 
       // Record the sequence -> hash mapping
-      seq_mapping->set_sequence_number(next_sequence_number);
-      seq_mapping->set_entry_hash(pending_entry.Entry().Hash());
-      pending_entry.MutableEntry()->set_sequence_number(next_sequence_number);
+      sequence_number = next_sequence_number;
+      seq_mapping->set_sequence_number(sequence_number);
+      seq_mapping->set_entry_hash(pending_hash);
+      if (merge_delay_tracker_ && merge_delay_tracker_->Sampled(pending_hash)) {
+        newly_sequenced.emplace_back(sequence_number, &pending_entry);
+      }
       ++num_sequenced;
       ++next_sequence_number;
     } else {
@@ -170,16 +253,14 @@ util::Status TreeSigner<Logged>::SequenceNewEntries() {
               << " = " << seq_it->second.first;
       CHECK(!seq_it->second.second /*present*/)
           << "Saw same sequenced cert twice.";
-      CHECK(!pending_entry.Entry().has_sequence_number());
       seq_it->second.second = true;  // present
 
+      sequence_number = seq_it->second.first;
       seq_mapping->set_entry_hash(seq_it->first);
-      seq_mapping->set_sequence_number(seq_it->second.first);
-      pending_entry.MutableEntry()->set_sequence_number(seq_it->second.first);
+      seq_mapping->set_sequence_number(sequence_number);
     }
-    CHECK(seq_to_entry.insert(std::make_pair(
-                                  pending_entry.Entry().sequence_number(),
-                                  pending_entry.MutableEntry())).second);
+    CHECK(seq_to_entry.insert(std::make_pair(sequence_number, &pending_entry))
+              .second);
   }
 
   const util::StatusOr<ct::SignedTreeHead> serving_sth(
@@ -213,21 +294,196 @@ util::Status TreeSigner<Logged>::SequenceNewEntries() {
     return status;
   }
 
+  const uint64_t sequenced_ms(util::TimeInMilliseconds());
+  for (const auto& logged : newly_sequenced) {
+    merge_delay_tracker_->EntrySequenced(logged.second->Hash(), logged.first,
+                                         logged.second->timestamp(),
+                                         sequenced_ms);
+  }
+
   // Now add the sequenced entries to our local DB so that the local signer can
-  // incorporate them.
+  // incorporate them. Only those get copied, to give them their sequence
+  // number.
   for (auto it(seq_to_entry.find(db_->TreeSize())); it != seq_to_entry.end();
        ++it) {
     VLOG(1) << "Adding to local DB: " << it->first;
-    CHECK_EQ(it->first, it->second->sequence_number());
-    CHECK_EQ(Database<Logged>::OK, db_->CreateSequencedEntry(*(it->second)));
+    Logged sequenced_entry(*it->second);
+    sequenced_entry.set_sequence_number(it->first);
+    CHECK_EQ(Database<Logged>::OK, db_->CreateSequencedEntry(sequenced_entry));
   }
 
   VLOG(1) << "Sequenced " << num_sequenced << " entries.";
 
+  if (next_ready) {
+    *next_ready = next_ready_time;
+  }
+
   return util::Status::OK;
 }
 
 
+template <class Logged>
+void TreeSigner<Logged>::RunPipeline(
+    const PipelineOptions& options, SigningScheduler* scheduler,
+    const std::function<bool()>& is_master,
+    const std::function<void(const ct::SignedTreeHead&)>& new_sth) {
+  CHECK_NOTNULL(scheduler);
+  CHECK(is_master);
+  CHECK(new_sth);
+  CHECK_GT(options.max_idle_interval.count(), 0);
+  CHECK_GT(options.max_unsigned_entries, 0);
+  CHECK_GT(options.standby_interval.count(), 0);
+  typedef SigningScheduler::Clock Clock;
+  const Clock::duration max_idle(
+      std::chrono::duration_cast<Clock::duration>(options.max_idle_interval));
+
+  {
+    std::lock_guard<std::mutex> lock(pipeline_mutex_);
+    pipeline_signed_size_ = latest_tree_head_.tree_size();
+  }
+  std::thread sequencer(&TreeSigner<Logged>::RunSequencingStage, this,
+                        std::cref(options), std::cref(is_master));
+
+  std::unique_lock<std::mutex> lock(pipeline_mutex_);
+  while (!pipeline_stopping_) {
+    // Anything sequenced from now on will be seen below, or wake us
+    // up.
+    pipeline_sequenced_ = false;
+    lock.unlock();
+
+    // Entries can also get into the database by replication from the
+    // master, which we do not get notified of.
+    const int64_t leaf_count(cert_tree_->LeafCount());
+    const int64_t unsigned_entries(
+        std::max<int64_t>(0, db_->TreeSize() - leaf_count));
+    std::chrono::milliseconds oldest_unsigned_age(0);
+    Logged oldest_unsigned;
+    if (unsigned_entries > 0 &&
+        db_->LookupByIndex(leaf_count, &oldest_unsigned) ==
+            Database<Logged>::LOOKUP_OK) {
+      oldest_unsigned_age = std::max(
+          std::chrono::milliseconds::zero(),
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::system_clock::now().time_since_epoch()) -
+              std::chrono::milliseconds(oldest_unsigned.timestamp()));
+    }
+
+    const Clock::time_point now(Clock::now());
+    SigningScheduler::Reason reason;
+    const Clock::time_point next_signing(scheduler->NextSigning(
+        now, unsigned_entries, oldest_unsigned_age, &reason));
+    if (next_signing > now) {
+      lock.lock();
+      pipeline_cv_.wait_until(lock, std::min(next_signing, now + max_idle),
+                              [this]() {
+                                return pipeline_stopping_ ||
+                                       pipeline_sequenced_;
+                              });
+      continue;
+    }
+
+    VLOG(1) << "Signing " << unsigned_entries << " new entries, reason: "
+            << reason;
+    const UpdateResult result(UpdateTree());
+    scheduler->SigningDone(now, Clock::now() - now,
+                           latest_tree_head_.tree_size(), reason);
+    switch (result) {
+      case OK:
+        new_sth(latest_tree_head_);
+        break;
+      case INSUFFICIENT_DATA:
+        LOG(INFO) << "Can't update tree because we don't have all the "
+                  << "entries locally, will try again later.";
+        break;
+      default:
+        LOG(FATAL) << "Error updating tree: " << result;
+    }
+
+    lock.lock();
+    if (result == OK) {
+      pipeline_signed_size_ = latest_tree_head_.tree_size();
+      // Might let the sequencer go on.
+      pipeline_cv_.notify_all();
+    }
+  }
+  lock.unlock();
+
+  sequencer.join();
+}
+
+
+template <class Logged>
+void TreeSigner<Logged>::RunSequencingStage(
+    const PipelineOptions& options, const std::function<bool()>& is_master) {
+  typedef std::chrono::steady_clock Clock;
+  const Clock::duration max_idle(
+      std::chrono::duration_cast<Clock::duration>(options.max_idle_interval));
+  const Clock::duration standby(
+      std::chrono::duration_cast<Clock::duration>(options.standby_interval));
+
+  std::unique_lock<std::mutex> lock(pipeline_mutex_);
+  while (!pipeline_stopping_) {
+    const int64_t signed_size(pipeline_signed_size_);
+    lock.unlock();
+
+    Clock::time_point wake_up(Clock::now() + max_idle);
+    bool appended(false);
+    if (is_master()) {
+      const int64_t tree_size(db_->TreeSize());
+      const int64_t unsigned_entries(tree_size - signed_size);
+      if (unsigned_entries >= options.max_unsigned_entries) {
+        VLOG(1) << unsigned_entries << " entries waiting to be signed, "
+                << "holding off sequencing.";
+        lock.lock();
+        pipeline_cv_.wait_until(lock, wake_up, [this, signed_size]() {
+          return pipeline_stopping_ || pipeline_signed_size_ != signed_size;
+        });
+        continue;
+      }
+
+      std::chrono::system_clock::time_point next_ready;
+      const util::Status status(SequenceNewEntries(
+          options.max_unsigned_entries - unsigned_entries, &next_ready));
+      if (!status.ok()) {
+        LOG(WARNING) << "Problem sequencing new entries: " << status;
+      } else if (next_ready != std::chrono::system_clock::time_point::max()) {
+        const std::chrono::system_clock::duration ready_in(
+            std::max(next_ready - std::chrono::system_clock::now(),
+                     std::chrono::system_clock::duration::zero()));
+        if (ready_in < max_idle) {
+          wake_up = std::min(
+              wake_up,
+              Clock::now() +
+                  std::chrono::duration_cast<Clock::duration>(ready_in));
+        }
+      }
+
+      appended = db_->TreeSize() > tree_size;
+    } else {
+      // Be ready to take over quickly.
+      consistent_store_->PrepareToSequence();
+      wake_up = std::min(wake_up, Clock::now() + standby);
+    }
+
+    lock.lock();
+    if (appended) {
+      pipeline_sequenced_ = true;
+      pipeline_cv_.notify_all();
+    }
+    pipeline_cv_.wait_until(lock, wake_up,
+                            [this]() { return pipeline_stopping_; });
+  }
+}
+
+
+template <class Logged>
+void TreeSigner<Logged>::StopPipeline() {
+  std::lock_guard<std::mutex> lock(pipeline_mutex_);
+  pipeline_stopping_ = true;
+  pipeline_cv_.notify_all();
+}
+
+
 // DB_ERROR: the database is inconsistent with our inner self.
 // However, if the database itself is giving inconsistent answers, or failing
 // reads/writes, then we die.
@@ -257,6 +513,10 @@ typename TreeSigner<Logged>::UpdateResult TreeSigner<Logged>::UpdateTree() {
   // the sequence number is not allowed).
   ct::SignedTreeHead new_sth;
   TimestampAndSign(min_timestamp, &new_sth);
+  if (merge_delay_tracker_) {
+    merge_delay_tracker_->TreeSigned(new_sth.tree_size(),
+                                     util::TimeInMilliseconds());
+  }
 
   // We don't actually store this STH anywhere durable yet, but rather let the
   // caller decide what to do with it.  (In practice, this will mean that it's
@@ -322,8 +582,71 @@ void TreeSigner<Logged>::TimestampAndSign(uint64_t min_timestamp,
     abort();
 
   // Cosi-extension: ask for a collective signature on our STH
-  sth->set_cosi_signature(Cosi::SignTreeHead(sth));
-  VLOG(1) << "Signing cosi_signature done:" << sth->cosi_signature();
+  if (!cosi_batcher_) {
+    return;
+  }
+
+  if (!cosigned_) {
+    std::string cosignature;
+    ct::CosiBatchProof proof;
+    util::SyncTask task(cosi_executor_);
+    cosi_batcher_->Sign(sth->sha256_root_hash(), &cosignature, &proof,
+                        task.task());
+    task.Wait();
+    if (task.status().ok()) {
+      sth->set_cosi_signature(cosignature);
+      if (proof.has_batch_root()) {
+        sth->mutable_cosi_batch_proof()->Swap(&proof);
+      }
+      VLOG(1) << "Signing cosi_signature done:" << sth->cosi_signature();
+    } else {
+      LOG(WARNING) << "Going without a cosignature: " << task.status();
+    }
+    return;
+  }
+
+  std::string* const cosignature(new std::string);
+  ct::CosiBatchProof* const proof(new ct::CosiBatchProof);
+  util::Task* const task(cosign_task_->task()->AddChild(
+      std::bind(&TreeSigner<Logged>::CosignatureDone, this, *sth,
+                cosignature, proof, std::placeholders::_1)));
+  task->DeleteWhenDone(cosignature);
+  task->DeleteWhenDone(proof);
+  {
+    std::lock_guard<std::mutex> lock(cosign_mutex_);
+    cosign_latest_timestamp_ = sth->timestamp();
+  }
+  cosi_batcher_->Sign(sth->sha256_root_hash(), cosignature, proof, task);
+}
+
+
+template <class Logged>
+void TreeSigner<Logged>::CosignatureDone(const ct::SignedTreeHead& sth,
+                                         const std::string* cosignature,
+                                         const ct::CosiBatchProof* proof,
+                                         util::Task* task) {
+  if (!task->status().ok()) {
+    LOG(WARNING) << "Failed to get a cosignature for the STH @ "
+                 << sth.timestamp() << ": " << task->status();
+    return;
+  }
+
+  ct::SignedTreeHead cosigned_sth(sth);
+  cosigned_sth.set_cosi_signature(*cosignature);
+  if (proof->has_batch_root()) {
+    cosigned_sth.mutable_cosi_batch_proof()->CopyFrom(*proof);
+  }
+  VLOG(1) << "Signing cosi_signature done:" << cosigned_sth.cosi_signature();
+
+  // Keep holding the lock, so that the STH is not superseded while
+  // "cosigned_" runs.
+  std::lock_guard<std::mutex> lock(cosign_mutex_);
+  if (sth.timestamp() != cosign_latest_timestamp_) {
+    VLOG(1) << "Dropping the cosignature for the STH @ " << sth.timestamp()
+            << ", which is not the latest anymore.";
+    return;
+  }
+  cosigned_(cosigned_sth);
 }
 
 
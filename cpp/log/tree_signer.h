@@ -2,16 +2,23 @@
 #define TREE_SIGNER_H
 
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <stdint.h>
 
 #include "log/cluster_state_controller.h"
 #include "log/consistent_store.h"
+#include "log/signing_scheduler.h"
 #include "merkletree/compact_merkle_tree.h"
 #include "proto/ct.pb.h"
 
 
 namespace util {
+class Executor;
 class Status;
+class SyncTask;
+class Task;
 }  // namespace util
 
 template <class Logged>
@@ -21,6 +28,9 @@ class LogSigner;
 
 namespace cert_trans {
 
+class CosiBatcher;
+class MergeDelayTracker;
+
 
 // Signer for appending new entries to the log.
 // This is the single authority that assigns sequence numbers to new entries,
@@ -38,6 +48,7 @@ class TreeSigner {
              std::unique_ptr<CompactMerkleTree> merkle_tree,
              cert_trans::ConsistentStore<Logged>* consistent_store,
              LogSigner* signer);
+  ~TreeSigner();
 
   enum UpdateResult {
     OK,
@@ -47,11 +58,75 @@ class TreeSigner {
     INSUFFICIENT_DATA,
   };
 
+  // Settings for RunPipeline().
+  struct PipelineOptions {
+    PipelineOptions()
+        : max_idle_interval(std::chrono::seconds(10)),
+          max_unsigned_entries(10000),
+          standby_interval(std::chrono::seconds(1)) {
+    }
+
+    // Longest time the stages sleep between two looks at the pending
+    // entries and the local database, respectively (entries are
+    // usually picked up as soon as they clear the guard window, or
+    // get sequenced, this only matters for entries which show up
+    // late, with an older timestamp, or through replication).
+    std::chrono::duration<double> max_idle_interval;
+    // The sequencer stops sequencing while this many entries are in
+    // the local database without being covered by an STH.
+    int64_t max_unsigned_entries;
+    // While not the master, how often the sequencer checks whether it
+    // has become master, and keeps the consistent store ready for it.
+    std::chrono::duration<double> standby_interval;
+  };
+
+  // Asks "cosi_batcher" for a collective signature on every new STH
+  // (possibly covering a batch of them, in which case the STH gets a
+  // "cosi_batch_proof" too), using "executor" for the callbacks. If
+  // "cosigned" is empty, UpdateTree() waits for the cosignature (for
+  // as long as the batching window, timeouts and retries allow, after
+  // which the STH goes without). Otherwise, new STHs are not held
+  // back, and "cosigned" is called (on some other thread) with a copy
+  // of the STH including its cosignature once it arrives, provided
+  // the STH is still the latest one.
+  // Must be called before any signing.
+  void EnableCosigning(
+      CosiBatcher* cosi_batcher, util::Executor* executor,
+      const std::function<void(const ct::SignedTreeHead&)>& cosigned);
+
+  // Reports the progress of the entries sequenced and signed from
+  // now on to "tracker". Must be called before any sequencing or
+  // signing.
+  void SetMergeDelayTracker(MergeDelayTracker* tracker);
+
   // Latest Tree Head timestamp;
   uint64_t LastUpdateTime() const;
 
   util::Status SequenceNewEntries();
 
+  // Runs the sequencing (which includes appending to the local
+  // database) and the tree signing as two overlapping stages, until
+  // StopPipeline() is called. Rather than running on a fixed period,
+  // the sequencer runs as soon as pending entries clear the guard
+  // window, and the signer whenever "scheduler" says so, taking into
+  // account how many entries are waiting to be signed and for how
+  // long.
+  //
+  // The sequencer only runs while "is_master" returns true (until
+  // then, it calls ConsistentStore::PrepareToSequence()), and
+  // "new_sth" is called (on the signing thread) with every new STH.
+  // This blocks the calling thread, which is used for signing, and
+  // should be used instead of calling SequenceNewEntries() and
+  // UpdateTree() directly.
+  void RunPipeline(const PipelineOptions& options,
+                   SigningScheduler* scheduler,
+                   const std::function<bool()>& is_master,
+                   const std::function<void(const ct::SignedTreeHead&)>&
+                       new_sth);
+
+  // Makes RunPipeline() return. Thread-safe.
+  void StopPipeline();
+
   // Simplest update mechanism: take all pending entries and append
   // (in random order) to the tree. Checks that the update it writes
   // to the database is consistent with the latest STH.
@@ -67,6 +142,18 @@ class TreeSigner {
   bool Append(const Logged& logged);
   void AppendToTree(const Logged& logged_cert);
   void TimestampAndSign(uint64_t min_timestamp, ct::SignedTreeHead* sth);
+  // Sequences at most "max_new_entries" entries, and if
+  // "next_ready" is not NULL, sets it to when the next pending entry
+  // will clear the guard window (or to the maximum time point if
+  // there is none).
+  util::Status SequenceNewEntries(
+      int64_t max_new_entries,
+      std::chrono::system_clock::time_point* next_ready);
+  void RunSequencingStage(const PipelineOptions& options,
+                          const std::function<bool()>& is_master);
+  void CosignatureDone(const ct::SignedTreeHead& sth,
+                       const std::string* cosignature,
+                       const ct::CosiBatchProof* proof, util::Task* task);
 
   const std::chrono::duration<double> guard_window_;
   Database<Logged>* const db_;
@@ -75,6 +162,27 @@ class TreeSigner {
   const std::unique_ptr<CompactMerkleTree> cert_tree_;
   ct::SignedTreeHead latest_tree_head_;
 
+  CosiBatcher* cosi_batcher_;
+  util::Executor* cosi_executor_;
+  std::function<void(const ct::SignedTreeHead&)> cosigned_;
+  // Parent of the asynchronous cosigning requests.
+  std::unique_ptr<util::SyncTask> cosign_task_;
+  std::mutex cosign_mutex_;
+  // Timestamp of the latest STH, for which a late cosignature is
+  // still useful.
+  uint64_t cosign_latest_timestamp_;
+
+  MergeDelayTracker* merge_delay_tracker_;
+
+  std::mutex pipeline_mutex_;
+  std::condition_variable pipeline_cv_;
+  bool pipeline_stopping_;
+  // Set by the sequencing stage when it appended entries to the
+  // database, and cleared by the signing stage when it picks them up.
+  bool pipeline_sequenced_;
+  // Tree size of the latest STH signed by the signing stage.
+  int64_t pipeline_signed_size_;
+
   template <class T>
   friend class TreeSignerTest;
 };
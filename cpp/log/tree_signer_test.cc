@@ -1,8 +1,11 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <condition_variable>
 #include <gtest/gtest.h>
 #include <memory>
+#include <mutex>
 #include <stdint.h>
 #include <string>
+#include <thread>
 
 #include "log/etcd_consistent_store-inl.h"
 #include "log/file_db.h"
@@ -73,13 +76,6 @@ class TreeSignerTest : public ::testing::Test {
                               store_.get(), log_signer_.get()));
     // Set a default empty STH so that we can call UpdateTree() on the signer.
     store_->SetServingSTH(SignedTreeHead());
-    // Force an empty sequence mapping file:
-    {
-      util::SyncTask task(&pool_);
-      EtcdClient::Response r;
-      etcd_client_.ForceSet("/root/sequence_mapping", "", &r, task.task());
-      task.Wait();
-    }
   }
 
   void AddPendingEntry(LoggedCertificate* logged_cert) const {
@@ -328,6 +324,91 @@ TYPED_TEST(TreeSignerTest, SequenceNewEntriesCleansUpOldSequenceMappings) {
 }
 
 
+TYPED_TEST(TreeSignerTest, RunPipeline) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  vector<SignedTreeHead> sths;
+
+  SigningScheduler::Options scheduler_options;
+  scheduler_options.min_interval = std::chrono::milliseconds(10);
+  scheduler_options.merge_delay_target = std::chrono::milliseconds(10);
+  SigningScheduler scheduler(scheduler_options);
+  TS::PipelineOptions options;
+  options.max_idle_interval = std::chrono::milliseconds(10);
+  std::thread pipeline([this, &options, &scheduler, &mutex, &cv, &sths]() {
+    this->tree_signer_->RunPipeline(
+        options, &scheduler, []() { return true; },
+        [&mutex, &cv, &sths](const SignedTreeHead& sth) {
+          std::lock_guard<std::mutex> lock(mutex);
+          sths.push_back(sth);
+          cv.notify_all();
+        });
+  });
+
+  for (int i(0); i < 3; ++i) {
+    LoggedCertificate c;
+    this->test_signer_.CreateUnique(&c);
+    this->AddPendingEntry(&c);
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    EXPECT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&sths]() {
+      return !sths.empty() && sths.back().tree_size() == 3;
+    }));
+  }
+
+  this->tree_signer_->StopPipeline();
+  pipeline.join();
+
+  ASSERT_FALSE(sths.empty());
+  for (size_t i(1); i < sths.size(); ++i) {
+    EXPECT_LE(sths[i - 1].tree_size(), sths[i].tree_size());
+    EXPECT_LT(sths[i - 1].timestamp(), sths[i].timestamp());
+  }
+  EXPECT_EQ(3, this->db()->TreeSize());
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_->VerifySignedTreeHead(sths.back()));
+}
+
+
+TYPED_TEST(TreeSignerTest, RunPipelineHoldsOffSequencing) {
+  std::mutex mutex;
+  SignedTreeHead latest_sth;
+
+  SigningScheduler::Options scheduler_options;
+  // Past the first one or two, no more STHs get signed while the test
+  // runs, so the sequencer has to stop.
+  scheduler_options.min_interval = std::chrono::seconds(60);
+  scheduler_options.max_interval = std::chrono::seconds(60);
+  SigningScheduler scheduler(scheduler_options);
+  TS::PipelineOptions options;
+  options.max_idle_interval = std::chrono::milliseconds(10);
+  options.max_unsigned_entries = 2;
+
+  for (int i(0); i < 5; ++i) {
+    LoggedCertificate c;
+    this->test_signer_.CreateUnique(&c);
+    this->AddPendingEntry(&c);
+  }
+
+  std::thread pipeline([this, &options, &scheduler, &mutex, &latest_sth]() {
+    this->tree_signer_->RunPipeline(
+        options, &scheduler, []() { return true; },
+        [&mutex, &latest_sth](const SignedTreeHead& sth) {
+          std::lock_guard<std::mutex> lock(mutex);
+          latest_sth.CopyFrom(sth);
+        });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  this->tree_signer_->StopPipeline();
+  pipeline.join();
+
+  EXPECT_EQ(static_cast<int64_t>(latest_sth.tree_size()) + 2,
+            this->db()->TreeSize());
+}
+
+
 }  // namespace cert_trans
 
 
@@ -0,0 +1,105 @@
+#ifndef CERT_TRANS_MONITORING_HISTOGRAM_H_
+#define CERT_TRANS_MONITORING_HISTOGRAM_H_
+
+#include <glog/logging.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "monitoring/counter.h"
+#include "monitoring/event_metric.h"
+#include "monitoring/monitoring.h"
+
+namespace cert_trans {
+
+
+// A helper class for monitoring the distribution of values (such as
+// latencies), rather than just their average.
+//
+// Like EventMetric, this class creates the "|base_name|_overall_sum" and
+// "|base_name|_count" Counter metrics, broken down by labels. It also
+// creates a "|base_name|_bucket" Counter metric, with an additional "le"
+// label, which counts the values less than or equal to each of the
+// |bucket_bounds| (and to "+Inf"), in the manner of Prometheus histograms.
+//
+// Example usage:
+//
+//   static Histogram<std::string> delay_ms("delay_ms", "stage", "help",
+//                                          {10, 100, 1000});
+//   ...
+//   delay_ms.RecordValue("stage", 42);
+template <class... LabelTypes>
+class Histogram {
+ public:
+  Histogram(const std::string& base_name,
+            const typename NameType<LabelTypes>::name&... label_names,
+            const std::string& help, const std::vector<double>& bucket_bounds);
+
+  void RecordValue(const LabelTypes&... labels, double value);
+
+  // Returns the number of values recorded so far which were less than or
+  // equal to |bound| (which must be one of the bucket bounds).
+  double BucketCount(const LabelTypes&... labels, double bound) const;
+
+ private:
+  static std::string BoundLabel(double bound);
+
+  const std::vector<double> bounds_;
+  EventMetric<LabelTypes...> metric_;
+  std::unique_ptr<Counter<LabelTypes..., std::string>> buckets_;
+
+  DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+
+template <class... LabelTypes>
+Histogram<LabelTypes...>::Histogram(
+    const std::string& base_name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help, const std::vector<double>& bucket_bounds)
+    : bounds_(bucket_bounds),
+      metric_(base_name, label_names..., help),
+      buckets_(Counter<LabelTypes..., std::string>::New(
+          base_name + "_bucket", label_names..., "le",
+          help + " (cumulative buckets)")) {
+  for (size_t i = 1; i < bounds_.size(); ++i) {
+    CHECK_LT(bounds_[i - 1], bounds_[i]);
+  }
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::RecordValue(const LabelTypes&... labels,
+                                           double value) {
+  metric_.RecordEvent(labels..., value);
+  for (const auto& bound : bounds_) {
+    if (value <= bound) {
+      buckets_->Increment(labels..., BoundLabel(bound));
+    }
+  }
+  buckets_->Increment(labels..., "+Inf");
+}
+
+
+template <class... LabelTypes>
+double Histogram<LabelTypes...>::BucketCount(const LabelTypes&... labels,
+                                             double bound) const {
+  return buckets_->Get(labels..., BoundLabel(bound));
+}
+
+
+// static
+template <class... LabelTypes>
+std::string Histogram<LabelTypes...>::BoundLabel(double bound) {
+  std::ostringstream label;
+  label << bound;
+  return label.str();
+}
+
+
+}  // namespace cert_trans
+
+
+#endif  // CERT_TRANS_MONITORING_HISTOGRAM_H_
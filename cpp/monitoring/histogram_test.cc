@@ -0,0 +1,49 @@
+#include "monitoring/histogram.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+
+using std::string;
+
+
+TEST(HistogramTest, TestCumulativeBuckets) {
+  Histogram<> histogram("name", "help", {10, 100});
+  histogram.RecordValue(5);
+  histogram.RecordValue(10);
+  histogram.RecordValue(50);
+  histogram.RecordValue(500);
+  EXPECT_EQ(2, histogram.BucketCount(10));
+  EXPECT_EQ(3, histogram.BucketCount(100));
+}
+
+
+TEST(HistogramTest, TestWithLabels) {
+  Histogram<string> histogram("name", "stage", "help", {1, 2});
+  histogram.RecordValue("one", 1);
+  histogram.RecordValue("two", 2);
+  EXPECT_EQ(1, histogram.BucketCount("one", 1));
+  EXPECT_EQ(1, histogram.BucketCount("one", 2));
+  EXPECT_EQ(0, histogram.BucketCount("two", 1));
+  EXPECT_EQ(1, histogram.BucketCount("two", 2));
+}
+
+
+TEST(HistogramTest, TestFractionalBounds) {
+  Histogram<> histogram("name", "help", {0.5, 1.5});
+  histogram.RecordValue(1);
+  EXPECT_EQ(0, histogram.BucketCount(0.5));
+  EXPECT_EQ(1, histogram.BucketCount(1.5));
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -20,6 +20,8 @@
 #include "log/leveldb_db.h"
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
+#include "log/merge_delay_tracker.h"
+#include "log/signing_scheduler.h"
 #include "log/sqlite_db.h"
 #include "log/strict_consistent_store.h"
 #include "log/tree_signer.h"
@@ -30,12 +32,15 @@
 #include "server/handler.h"
 #include "server/metrics.h"
 #include "server/server.h"
+#include "third_party/cosi/cosi_batcher.h"
+#include "third_party/cosi/cosi_client.h"
 #include "util/etcd.h"
 #include "util/fake_etcd.h"
 #include "util/init.h"
 #include "util/libevent_wrapper.h"
 #include "util/read_key.h"
 #include "util/status.h"
+#include "util/sync_task.h"
 #include "util/thread_pool.h"
 #include "util/uuid.h"
 
@@ -67,6 +72,10 @@ DEFINE_int32(log_stats_frequency_seconds, 3600,
 DEFINE_int32(sequencing_frequency_seconds, 10,
              "How often should new entries be sequenced. The sequencing runs "
              "in parallel with the tree signing and cleanup.");
+DEFINE_double(standby_interval_seconds, 1,
+              "While this node is not the master, how often it checks "
+              "whether it has become master, and keeps its consistent store "
+              "ready to sequence.");
 DEFINE_int32(cleanup_frequency_seconds, 10,
              "How often should new entries be cleanedup. The cleanup runs in "
              "in parallel with the tree signing and sequencing.");
@@ -76,9 +85,59 @@ DEFINE_int32(tree_signing_frequency_seconds, 600,
              "server select loop, at least this period has elapsed since the "
              "last signing. Set this well below the MMD to ensure we sign in "
              "a timely manner. Must be greater than 0.");
+DEFINE_bool(streaming_sequencer, false,
+            "Sequence new entries as soon as they clear the guard window, and "
+            "sign a new tree head as soon as they are in the local database, "
+            "instead of doing both periodically. In this mode, tree heads "
+            "are signed depending on the number and age of the entries "
+            "waiting for it, --sequencing_frequency_seconds is only an upper "
+            "bound on how long the sequencer waits before looking for new "
+            "entries, and --tree_signing_frequency_seconds on how old the "
+            "tree head can get.");
+DEFINE_double(min_sth_interval_seconds, 1,
+              "With --streaming_sequencer, the minimum interval between two "
+              "signed tree heads.");
+DEFINE_double(merge_delay_target_seconds, 120,
+              "With --streaming_sequencer, how long after their submission "
+              "entries should be in the serving tree head. Should be well "
+              "below the MMD.");
+DEFINE_int32(signing_backlog_threshold, 1000,
+             "With --streaming_sequencer, sign a new tree head as soon as "
+             "possible when this many entries are waiting for it.");
+DEFINE_int32(max_unsigned_entries, 10000,
+             "With --streaming_sequencer, stop sequencing new entries while "
+             "this many sequenced entries have not been signed yet.");
 DEFINE_double(guard_window_seconds, 60,
               "Unsequenced entries newer than this "
               "number of seconds will not be sequenced.");
+DEFINE_string(cosi_servers, "78.46.227.60:2001",
+              "Comma separated list of 'hostname:port' of the CoSi stamp "
+              "servers of the witness cothority. Leave empty to not cosign "
+              "tree heads.");
+DEFINE_double(cosi_timeout_seconds, 5,
+              "Time allowed to connect to a CoSi stamp server, and for each "
+              "of its replies.");
+DEFINE_int32(cosi_max_attempts, 3,
+             "Number of attempts at getting a tree head cosigned, after "
+             "which it goes without.");
+DEFINE_double(cosi_retry_delay_seconds, 0.5,
+              "Delay before retrying a failed cosigning request.");
+DEFINE_bool(cosi_wait_for_signature, false,
+            "Hold new tree heads back until they are cosigned (or cosigning "
+            "failed). Otherwise, tree heads are published right away, and "
+            "published again with their cosignature once it arrives.");
+DEFINE_double(cosi_batch_window_seconds, 0,
+              "Collect the tree heads to be cosigned for this long, and ask "
+              "the cothority for a single collective signature on a Merkle "
+              "tree of their root hashes. Zero cosigns every tree head on "
+              "its own.");
+DEFINE_int32(cosi_max_batch_size, 64,
+             "Maximum number of tree heads covered by a single collective "
+             "signature.");
+DEFINE_double(merge_delay_sample_rate, 0.01,
+              "Fraction of the entries followed from their submission to "
+              "being covered by the serving STH, for the merge_delay_ms "
+              "histograms. Zero disables the tracking.");
 DEFINE_string(etcd_servers, "",
               "Comma separated list of 'hostname:port' of the etcd server(s)");
 DEFINE_string(etcd_root, "/root", "Root of cluster entries in etcd.");
@@ -87,10 +146,15 @@ DEFINE_int32(num_http_server_threads, 16,
 DEFINE_bool(i_know_stand_alone_mode_can_lose_data, false,
             "Set this to allow stand-alone mode, even though it will lost "
             "submissions in the case of a crash.");
+DEFINE_string(local_store_file, "",
+              "Write-ahead log file in which to keep the log's state in "
+              "stand-alone mode, which makes it durable.");
 
 namespace libevent = cert_trans::libevent;
 
 using cert_trans::CertChecker;
+using cert_trans::CosiBatcher;
+using cert_trans::CosiClient;
 using cert_trans::ClusterStateController;
 using cert_trans::ConsistentStore;
 using cert_trans::Counter;
@@ -102,9 +166,11 @@ using cert_trans::FileStorage;
 using cert_trans::HttpHandler;
 using cert_trans::Latency;
 using cert_trans::LoggedCertificate;
+using cert_trans::MergeDelayTracker;
 using cert_trans::ReadPrivateKey;
 using cert_trans::ScopedLatency;
 using cert_trans::Server;
+using cert_trans::SigningScheduler;
 using cert_trans::SplitHosts;
 using cert_trans::ThreadPool;
 using cert_trans::TreeSigner;
@@ -218,6 +284,39 @@ static const bool sign_dummy =
     RegisterFlagValidator(&FLAGS_tree_signing_frequency_seconds,
                           &ValidateIsPositive);
 
+static const bool unsigned_dummy =
+    RegisterFlagValidator(&FLAGS_max_unsigned_entries, &ValidateIsPositive);
+
+static const bool cosi_attempts_dummy =
+    RegisterFlagValidator(&FLAGS_cosi_max_attempts, &ValidateIsPositive);
+
+static const bool cosi_batch_dummy =
+    RegisterFlagValidator(&FLAGS_cosi_max_batch_size, &ValidateIsPositive);
+
+static const bool backlog_dummy =
+    RegisterFlagValidator(&FLAGS_signing_backlog_threshold,
+                          &ValidateIsPositive);
+
+// Both the tree signer and late cosignatures publish tree heads, make
+// sure they never go backwards, and that a cosigned tree head is not
+// replaced by the same one without its cosignature.
+void PublishTreeHead(ClusterStateController<LoggedCertificate>* controller,
+                     const SignedTreeHead& sth) {
+  static mutex published_mutex;
+  static SignedTreeHead published_sth;
+  std::lock_guard<mutex> lock(published_mutex);
+  if (sth.timestamp() < published_sth.timestamp() ||
+      (sth.timestamp() == published_sth.timestamp() &&
+       published_sth.has_cosi_signature() && !sth.has_cosi_signature())) {
+    VLOG(1) << "Not publishing tree head @ " << sth.timestamp()
+            << ", already published:\n" << published_sth.DebugString();
+    return;
+  }
+  published_sth.CopyFrom(sth);
+  latest_local_tree_size_gauge->Set(sth.tree_size());
+  controller->NewTreeHead(sth);
+}
+
 void CleanUpEntries(ConsistentStore<LoggedCertificate>* store,
                     const function<bool()>& is_master) {
   CHECK_NOTNULL(store);
@@ -254,15 +353,28 @@ void CleanUpEntries(ConsistentStore<LoggedCertificate>* store,
 }
 
 void SequenceEntries(TreeSigner<LoggedCertificate>* tree_signer,
+                     ConsistentStore<LoggedCertificate>* store,
                      const function<bool()>& is_master) {
   CHECK_NOTNULL(tree_signer);
+  CHECK_NOTNULL(store);
   CHECK(is_master);
+  CHECK_GT(FLAGS_standby_interval_seconds, 0);
   const steady_clock::duration period(
       (seconds(FLAGS_sequencing_frequency_seconds)));
+  const steady_clock::duration standby(duration_cast<steady_clock::duration>(
+      duration<double>(FLAGS_standby_interval_seconds)));
   steady_clock::time_point target_run_time(steady_clock::now());
 
   while (true) {
-    if (is_master()) {
+    if (!is_master()) {
+      // Keep the store ready, and start sequencing soon after
+      // becoming master, rather than at the next period.
+      store->PrepareToSequence();
+      std::this_thread::sleep_for(std::min(period, standby));
+      continue;
+    }
+
+    {
       const ScopedLatency sequencer_sequence_latency(
           sequencer_sequence_latency_ms.GetScopedLatency());
       util::Status status(tree_signer->SequenceNewEntries());
@@ -299,9 +411,7 @@ void SignMerkleTree(TreeSigner<LoggedCertificate>* tree_signer,
           tree_signer->UpdateTree());
       switch (result) {
         case TreeSigner<LoggedCertificate>::OK: {
-          const SignedTreeHead latest_sth(tree_signer->LatestSTH());
-          latest_local_tree_size_gauge->Set(latest_sth.tree_size());
-          controller->NewTreeHead(latest_sth);
+          PublishTreeHead(controller, tree_signer->LatestSTH());
           signer_total_runs->Increment(true /* successful */);
           break;
         }
@@ -323,6 +433,59 @@ void SignMerkleTree(TreeSigner<LoggedCertificate>* tree_signer,
   }
 }
 
+void RunSequencingPipeline(
+    TreeSigner<LoggedCertificate>* tree_signer,
+    ConsistentStore<LoggedCertificate>* store, util::Executor* executor,
+    const function<bool()>& is_master,
+    ClusterStateController<LoggedCertificate>* controller) {
+  CHECK_NOTNULL(tree_signer);
+  CHECK_NOTNULL(store);
+  CHECK_NOTNULL(executor);
+  CHECK(is_master);
+  CHECK_NOTNULL(controller);
+  SigningScheduler::Options scheduler_options;
+  scheduler_options.min_interval =
+      duration_cast<SigningScheduler::Clock::duration>(
+          duration<double>(FLAGS_min_sth_interval_seconds));
+  scheduler_options.max_interval =
+      std::max(scheduler_options.min_interval,
+               duration_cast<SigningScheduler::Clock::duration>(
+                   seconds(FLAGS_tree_signing_frequency_seconds)));
+  scheduler_options.merge_delay_target =
+      duration_cast<SigningScheduler::Clock::duration>(
+          duration<double>(FLAGS_merge_delay_target_seconds));
+  scheduler_options.backlog_threshold = FLAGS_signing_backlog_threshold;
+  SigningScheduler scheduler(scheduler_options);
+
+  // Let the scheduler know how long it takes for our tree heads to be
+  // served.
+  util::SyncTask watch_task(executor);
+  store->WatchServingSTH(
+      [&scheduler](const Update<SignedTreeHead>& update) {
+        if (update.exists_) {
+          scheduler.ServingTreeSizeUpdated(
+              SigningScheduler::Clock::now(),
+              update.handle_.Entry().tree_size());
+        }
+      },
+      watch_task.task());
+
+  TreeSigner<LoggedCertificate>::PipelineOptions options;
+  options.max_idle_interval = seconds(FLAGS_sequencing_frequency_seconds);
+  options.max_unsigned_entries = FLAGS_max_unsigned_entries;
+  options.standby_interval = duration<double>(FLAGS_standby_interval_seconds);
+
+  tree_signer->RunPipeline(options, &scheduler, is_master,
+                           [controller](const SignedTreeHead& sth) {
+                             PublishTreeHead(controller, sth);
+                             signer_total_runs->Increment(
+                                 true /* successful */);
+                           });
+
+  watch_task.Cancel();
+  watch_task.Wait();
+}
+
 }  // namespace
 
 
@@ -374,8 +537,13 @@ int main(int argc, char* argv[]) {
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const bool stand_alone_mode(FLAGS_etcd_servers.empty());
-  if (stand_alone_mode && !FLAGS_i_know_stand_alone_mode_can_lose_data) {
+  if (!stand_alone_mode && !FLAGS_local_store_file.empty()) {
+    LOG(FATAL) << "--local_store_file is only for stand-alone mode";
+  }
+  if (stand_alone_mode && FLAGS_local_store_file.empty() &&
+      !FLAGS_i_know_stand_alone_mode_can_lose_data) {
     LOG(FATAL) << "attempted to run in stand-alone mode without the "
+                  "--local_store_file or the "
                   "--i_know_stand_alone_mode_can_lose_data flag";
   }
   LOG(INFO) << "Running in "
@@ -394,8 +562,16 @@ int main(int argc, char* argv[]) {
   options.server = FLAGS_server;
   options.port = FLAGS_port;
   options.etcd_root = FLAGS_etcd_root;
+  options.local_store_file = FLAGS_local_store_file;
   options.num_http_server_threads = FLAGS_num_http_server_threads;
 
+  // Outlives the server and tree signer, which report to it.
+  unique_ptr<MergeDelayTracker> merge_delay_tracker;
+  if (FLAGS_merge_delay_sample_rate > 0) {
+    merge_delay_tracker.reset(
+        new MergeDelayTracker(std::min(FLAGS_merge_delay_sample_rate, 1.0)));
+  }
+
   Server<LoggedCertificate> server(options, event_base, &internal_pool, db,
                                    etcd_client.get(), &url_fetcher,
                                    &log_signer, &log_verifier, &checker);
@@ -406,10 +582,46 @@ int main(int argc, char* argv[]) {
       server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
       server.consistent_store(), &log_signer);
 
+  if (merge_delay_tracker) {
+    tree_signer.SetMergeDelayTracker(merge_delay_tracker.get());
+    server.cluster_state_controller()->SetMergeDelayTracker(
+        merge_delay_tracker.get());
+  }
+
+  unique_ptr<CosiClient> cosi_client;
+  unique_ptr<CosiBatcher> cosi_batcher;
+  if (!FLAGS_cosi_servers.empty()) {
+    CosiClient::Options cosi_options;
+    for (const auto& server : SplitHosts(FLAGS_cosi_servers)) {
+      cosi_options.servers.push_back(server);
+    }
+    cosi_options.timeout = duration<double>(FLAGS_cosi_timeout_seconds);
+    cosi_options.max_attempts = FLAGS_cosi_max_attempts;
+    cosi_options.retry_delay =
+        duration<double>(FLAGS_cosi_retry_delay_seconds);
+    cosi_client.reset(new CosiClient(event_base.get(), cosi_options));
+    CosiBatcher::Options batcher_options;
+    batcher_options.window =
+        duration<double>(FLAGS_cosi_batch_window_seconds);
+    batcher_options.max_batch_size = FLAGS_cosi_max_batch_size;
+    cosi_batcher.reset(new CosiBatcher(event_base.get(), cosi_client.get(),
+                                       batcher_options));
+
+    function<void(const SignedTreeHead&)> cosigned;
+    if (!FLAGS_cosi_wait_for_signature) {
+      ClusterStateController<LoggedCertificate>* const controller(
+          server.cluster_state_controller());
+      cosigned = [controller](const SignedTreeHead& sth) {
+        PublishTreeHead(controller, sth);
+      };
+    }
+    tree_signer.EnableCosigning(cosi_batcher.get(), &internal_pool, cosigned);
+  }
+
   if (stand_alone_mode) {
     // Set up a simple single-node environment.
     //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
+    // Put a sensible single-node config into the store. For a real clustered
     // log
     // we'd expect a ClusterConfig already to be present within etcd as part of
     // the provisioning of the log.
@@ -430,14 +642,6 @@ int main(int argc, char* argv[]) {
     server.election()->StartElection();
     server.election()->WaitToBecomeMaster();
 
-    {
-      EtcdClient::Response resp;
-      util::SyncTask task(event_base.get());
-      etcd_client->Create("/root/sequence_mapping", "", &resp, task.task());
-      task.Wait();
-      CHECK_EQ(util::Status::OK, task.status());
-    }
-
     // Do an initial signing run to get the initial STH, again this is
     // temporary until we re-populate FakeEtcd from the DB.
     CHECK_EQ(tree_signer.UpdateTree(), TreeSigner<LoggedCertificate>::OK);
@@ -457,10 +661,20 @@ int main(int argc, char* argv[]) {
   // server error) until we have an STH to serve.
   const function<bool()> is_master(
       bind(&Server<LoggedCertificate>::IsMaster, &server));
-  thread sequencer(&SequenceEntries, &tree_signer, is_master);
   thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
-  thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
-                server.cluster_state_controller());
+  unique_ptr<thread> sequencer;
+  unique_ptr<thread> signer;
+  if (FLAGS_streaming_sequencer) {
+    signer.reset(new thread(&RunSequencingPipeline, &tree_signer,
+                            server.consistent_store(), &internal_pool,
+                            is_master, server.cluster_state_controller()));
+  } else {
+    sequencer.reset(new thread(&SequenceEntries, &tree_signer,
+                                server.consistent_store(), is_master));
+    signer.reset(new thread(&SignMerkleTree, &tree_signer,
+                            server.consistent_store(),
+                            server.cluster_state_controller()));
+  }
 
   server.Run();
 
@@ -16,6 +16,7 @@
 #include "log/cert.h"
 #include "log/cert_checker.h"
 #include "log/cluster_state_controller.h"
+#include "log/database.h"
 #include "log/frontend.h"
 #include "log/log_lookup.h"
 #include "log/logged_certificate.h"
@@ -24,6 +25,7 @@
 #include "server/json_output.h"
 #include "server/proxy.h"
 #include "util/json_wrapper.h"
+#include "util/json_writer.h"
 #include "util/thread_pool.h"
 
 namespace libevent = cert_trans::libevent;
@@ -34,6 +36,7 @@ using cert_trans::CertChecker;
 using cert_trans::Counter;
 using cert_trans::HttpHandler;
 using cert_trans::JsonOutput;
+using cert_trans::JsonWriter;
 using cert_trans::Latency;
 using cert_trans::LoggedCertificate;
 using cert_trans::Proxy;
@@ -44,16 +47,20 @@ using ct::SignedTreeHead;
 using std::bind;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::function;
 using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
+using std::map;
 using std::multimap;
 using std::mutex;
+using std::pair;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 
@@ -62,6 +69,16 @@ DEFINE_int32(max_leaf_entries_per_response, 1000,
              "get-entries request");
 DEFINE_int32(staleness_check_delay_secs, 5,
              "number of seconds between node staleness checks");
+DEFINE_int32(get_sth_max_wait_seconds, 30,
+             "maximum number of seconds a get-sth request with a "
+             "\"wait_for_newer_than\" parameter is held waiting for a newer "
+             "STH, before the current one is returned");
+DEFINE_int32(get_sth_max_waiting_requests, 10000,
+             "maximum number of get-sth requests held waiting for a newer "
+             "STH, further ones are answered right away");
+DEFINE_int32(consistency_proof_cache_size, 16,
+             "number of previous STHs from which consistency proofs to the "
+             "current STH are prepared ahead of time");
 
 namespace {
 
@@ -70,6 +87,11 @@ static Latency<milliseconds, string> http_server_request_latency_ms(
     "total_http_server_request_latency_ms", "path",
     "Total request latency in ms broken down by path");
 
+static cert_trans::Gauge<>* get_sth_waiting_requests(
+    cert_trans::Gauge<>::New("get_sth_waiting_requests",
+                             "Number of get-sth requests waiting for a newer "
+                             "STH."));
+
 
 bool ExtractChain(JsonOutput* output, evhttp_request* req, CertChain* chain) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
@@ -129,14 +151,16 @@ void AddChainReply(JsonOutput* output, evhttp_request* req,
     return output->SendError(req, response_code, add_status.error_message());
   }
 
-  JsonObject json_reply;
+  JsonWriter json_reply;
+  json_reply.BeginObject();
   json_reply.Add("sct_version", static_cast<int64_t>(0));
   json_reply.AddBase64("id", sct.id().key_id());
   json_reply.Add("timestamp", sct.timestamp());
   json_reply.Add("extensions", "");
   json_reply.Add("signature", sct.signature());
+  json_reply.EndObject();
 
-  output->SendJsonReply(req, HTTP_OK, json_reply);
+  output->SendJsonReply(req, HTTP_OK, &json_reply);
 }
 
 
@@ -184,7 +208,7 @@ bool GetParam(const multimap<string, string>& query, const string& param,
 // parameters).
 int64_t GetIntParam(const multimap<string, string>& query,
                     const string& param) {
-  int retval(-1);
+  int64_t retval(-1);
   string value;
   if (GetParam(query, param, &value)) {
     errno = 0;
@@ -215,6 +239,61 @@ bool GetBoolParam(const multimap<string, string>& query, const string& param) {
 }
 
 
+void STHToJson(const SignedTreeHead& sth, JsonWriter* json_reply) {
+  VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
+
+  json_reply->BeginObject();
+  json_reply->Add("tree_size", sth.tree_size());
+  json_reply->Add("timestamp", sth.timestamp());
+  json_reply->AddBase64("sha256_root_hash", sth.sha256_root_hash());
+  json_reply->Add("tree_head_signature", sth.signature());
+  json_reply->Add("cosi_signature", sth.cosi_signature());
+  if (sth.has_cosi_batch_proof()) {
+    const ct::CosiBatchProof& proof(sth.cosi_batch_proof());
+    json_reply->BeginObject("cosi_batch_proof");
+    json_reply->AddBase64("batch_root", proof.batch_root());
+    json_reply->Add("leaf_index", proof.leaf_index());
+    json_reply->Add("batch_size", proof.batch_size());
+    json_reply->BeginArray("audit_path");
+    for (const auto& node : proof.audit_path()) {
+      json_reply->AddBase64(node);
+    }
+    json_reply->EndArray();
+    json_reply->EndObject();
+  }
+  json_reply->EndObject();
+
+  VLOG(2) << "GetSTH:\n" << json_reply->ToString();
+}
+
+
+void ConsistencyToJson(const vector<string>& consistency,
+                       JsonWriter* json_reply) {
+  json_reply->BeginObject();
+  json_reply->BeginArray("consistency");
+  for (vector<string>::const_iterator it = consistency.begin();
+       it != consistency.end(); ++it) {
+    json_reply->AddBase64(*it);
+  }
+  json_reply->EndArray();
+  json_reply->EndObject();
+}
+
+
+shared_ptr<const string> SerializeReply(const JsonWriter& json_reply) {
+  CHECK(json_reply.Complete());
+  return make_shared<const string>(json_reply.ToString());
+}
+
+
+// Stops telling the handler when the connection of a get-sth request
+// it held goes away, once it is about to answer it.
+void ClearCloseCallback(evhttp_request* req) {
+  evhttp_connection_set_closecb(evhttp_request_get_connection(req), nullptr,
+                                nullptr);
+}
+
+
 }  // namespace
 
 
@@ -234,15 +313,54 @@ HttpHandler::HttpHandler(
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
       task_(pool_),
-      node_is_stale_(controller_->NodeIsStale()) {
+      node_is_stale_(controller_->NodeIsStale()),
+      sth_updated_cb_(bind(&HttpHandler::STHUpdated, this, _1)) {
   event_base_->Delay(seconds(FLAGS_staleness_check_delay_secs),
                      task_.task()->AddChild(
                          bind(&HttpHandler::UpdateNodeStaleness, this)));
+  event_base_->Delay(seconds(1),
+                     task_.task()->AddChildWithExecutor(
+                         bind(&HttpHandler::ExpireSTHWaiters, this),
+                         event_base_));
+
+  // The roots don't change, if there was a problem encoding them,
+  // GetRoots() will report it.
+  if (cert_checker_) {
+    JsonWriter json_reply;
+    json_reply.BeginObject();
+    json_reply.BeginArray("certificates");
+    bool ok(true);
+    for (const auto& root : cert_checker_->GetTrustedCertificates()) {
+      string cert;
+      if (root.second->DerEncoding(&cert) != util::Status::OK) {
+        ok = false;
+        break;
+      }
+      json_reply.AddBase64(cert);
+    }
+    if (ok) {
+      json_reply.EndArray();
+      json_reply.EndObject();
+      roots_reply_ = SerializeReply(json_reply);
+    }
+  }
+
+  log_lookup_->AddNotifySTHCallback(&sth_updated_cb_);
 }
 
 
 HttpHandler::~HttpHandler() {
+  libevent::Base::CheckNotOnEventThread();
+  log_lookup_->RemoveNotifySTHCallback(&sth_updated_cb_);
   task_.task()->Return();
+
+  // GetSTH() doesn't hold requests anymore, answer the ones still
+  // waiting (on the event thread, like every other use of them).
+  util::SyncTask abort_task(pool_);
+  event_base_->Add(
+      bind(&HttpHandler::AbortSTHWaiters, this, abort_task.task()));
+  abort_task.Wait();
+
   task_.Wait();
 }
 
@@ -345,7 +463,14 @@ void HttpHandler::GetEntries(evhttp_request* req) const {
   // "following" nodes with more data.
   const bool include_scts(GetBoolParam(query, "include_scts"));
 
-  BlockingGetEntries(req, start, end, include_scts);
+  // The entries are read on the database's own threads, and the reply
+  // is built on the thread pool.
+  vector<LoggedCertificate>* const entries(new vector<LoggedCertificate>);
+  db_->AsyncScanEntries(start, end, entries,
+                        new util::Task(bind(&HttpHandler::GetEntriesDone,
+                                            this, req, include_scts, entries,
+                                            _1),
+                                       pool_));
 }
 
 
@@ -354,7 +479,13 @@ void HttpHandler::GetRoots(evhttp_request* req) const {
     return output_->SendError(req, HTTP_BADMETHOD, "Method not allowed.");
   }
 
-  JsonArray roots;
+  if (roots_reply_) {
+    return output_->SendJsonReply(req, HTTP_OK, roots_reply_);
+  }
+
+  JsonWriter json_reply;
+  json_reply.BeginObject();
+  json_reply.BeginArray("certificates");
   multimap<string, const Cert*>::const_iterator it;
   for (it = cert_checker_->GetTrustedCertificates().begin();
        it != cert_checker_->GetTrustedCertificates().end(); ++it) {
@@ -363,13 +494,12 @@ void HttpHandler::GetRoots(evhttp_request* req) const {
       LOG(ERROR) << "Cert encoding failed";
       return output_->SendError(req, HTTP_INTERNAL, "Serialisation failed.");
     }
-    roots.AddBase64(cert);
+    json_reply.AddBase64(cert);
   }
+  json_reply.EndArray();
+  json_reply.EndObject();
 
-  JsonObject json_reply;
-  json_reply.Add("certificates", roots);
-
-  output_->SendJsonReply(req, HTTP_OK, json_reply);
+  output_->SendJsonReply(req, HTTP_OK, &json_reply);
 }
 
 
@@ -405,38 +535,217 @@ void HttpHandler::GetProof(evhttp_request* req) const {
     return output_->SendError(req, HTTP_BADREQUEST, "Couldn't find hash.");
   }
 
-  JsonArray json_audit;
+  JsonWriter json_reply;
+  json_reply.BeginObject();
+  json_reply.Add("leaf_index", proof.leaf_index());
+  json_reply.BeginArray("audit_path");
   for (int i = 0; i < proof.path_node_size(); ++i) {
-    json_audit.AddBase64(proof.path_node(i));
+    json_reply.AddBase64(proof.path_node(i));
   }
+  json_reply.EndArray();
+  json_reply.EndObject();
 
-  JsonObject json_reply;
-  json_reply.Add("leaf_index", proof.leaf_index());
-  json_reply.Add("audit_path", json_audit);
-
-  output_->SendJsonReply(req, HTTP_OK, json_reply);
+  output_->SendJsonReply(req, HTTP_OK, &json_reply);
 }
 
 
-void HttpHandler::GetSTH(evhttp_request* req) const {
+void HttpHandler::GetSTH(evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return output_->SendError(req, HTTP_BADMETHOD, "Method not allowed.");
   }
 
-  const SignedTreeHead& sth(log_lookup_->GetSTH());
+  int64_t newer_than(-1);
+  const multimap<string, string> query(ParseQuery(req));
+  if (query.find("wait_for_newer_than") != query.end()) {
+    newer_than = GetIntParam(query, "wait_for_newer_than");
+    if (newer_than < 0) {
+      return output_->SendError(
+          req, HTTP_BADREQUEST,
+          "Invalid \"wait_for_newer_than\" parameter.");
+    }
+  }
 
-  VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
+  unique_lock<mutex> lock(mutex_);
+  if (newer_than >= 0 &&
+      (!latest_sth_ ||
+       latest_sth_->timestamp() <= static_cast<uint64_t>(newer_than)) &&
+      sth_waiters_.size() <
+          static_cast<size_t>(FLAGS_get_sth_max_waiting_requests) &&
+      task_.task()->IsActive()) {
+    // ReleaseSTHWaiters(), ExpireSTHWaiters() or AbortSTHWaiters()
+    // will answer it, unless the client goes away first.
+    const steady_clock::time_point deadline(
+        steady_clock::now() + seconds(FLAGS_get_sth_max_wait_seconds));
+    sth_waiters_.emplace(newer_than, make_pair(req, deadline));
+    get_sth_waiting_requests->Set(sth_waiters_.size());
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  &HttpHandler::STHWaiterClosed, this);
+    return;
+  }
+  const shared_ptr<const string> reply(sth_reply_);
+  lock.unlock();
 
-  JsonObject json_reply;
-  json_reply.Add("tree_size", sth.tree_size());
-  json_reply.Add("timestamp", sth.timestamp());
-  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
-  json_reply.Add("tree_head_signature", sth.signature());
-  json_reply.Add("cosi_signature", sth.cosi_signature());
+  if (reply) {
+    return output_->SendJsonReply(req, HTTP_OK, reply);
+  }
+
+  // We don't have an STH yet.
+  JsonWriter json_reply;
+  STHToJson(log_lookup_->GetSTH(), &json_reply);
+  output_->SendJsonReply(req, HTTP_OK, &json_reply);
+}
 
-  VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
 
-  output_->SendJsonReply(req, HTTP_OK, json_reply);
+void HttpHandler::STHUpdated(const SignedTreeHead& sth) {
+  // The log lookup calls us one STH at a time, and we're the only
+  // ones changing these, so we can prepare the replies without
+  // holding the lock.
+  vector<int64_t> tree_sizes;
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (latest_sth_ && sth.timestamp() <= latest_sth_->timestamp()) {
+      return;
+    }
+    tree_sizes.assign(recent_tree_sizes_.begin(), recent_tree_sizes_.end());
+  }
+
+  JsonWriter json_sth;
+  STHToJson(sth, &json_sth);
+  const shared_ptr<const string> sth_reply(SerializeReply(json_sth));
+
+  map<pair<int64_t, int64_t>, shared_ptr<const string>> consistency_replies;
+  for (const int64_t first : tree_sizes) {
+    if (first <= 0 || first >= sth.tree_size()) {
+      continue;
+    }
+    JsonWriter json_reply;
+    ConsistencyToJson(log_lookup_->ConsistencyProof(first, sth.tree_size()),
+                      &json_reply);
+    consistency_replies.emplace(make_pair(first, sth.tree_size()),
+                                SerializeReply(json_reply));
+  }
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    latest_sth_.reset(new SignedTreeHead(sth));
+    sth_reply_ = sth_reply;
+    consistency_replies_.swap(consistency_replies);
+    if (recent_tree_sizes_.empty() ||
+        recent_tree_sizes_.back() != sth.tree_size()) {
+      recent_tree_sizes_.push_back(sth.tree_size());
+    }
+    while (recent_tree_sizes_.size() >
+           static_cast<size_t>(
+               std::max(0, FLAGS_consistency_proof_cache_size))) {
+      recent_tree_sizes_.pop_front();
+    }
+  }
+
+  // We're called on the log lookup's thread, the held requests can
+  // only be used on the event thread.
+  task_.task()
+      ->AddChildWithExecutor(bind(&HttpHandler::ReleaseSTHWaiters, this),
+                             event_base_)
+      ->Return();
+}
+
+
+void HttpHandler::ReleaseSTHWaiters() {
+  vector<evhttp_request*> released;
+  shared_ptr<const string> reply;
+  {
+    lock_guard<mutex> lock(mutex_);
+    CHECK(latest_sth_);
+    reply = sth_reply_;
+    const auto end(sth_waiters_.lower_bound(latest_sth_->timestamp()));
+    for (auto it = sth_waiters_.begin(); it != end; ++it) {
+      released.push_back(it->second.first);
+    }
+    sth_waiters_.erase(sth_waiters_.begin(), end);
+    get_sth_waiting_requests->Set(sth_waiters_.size());
+  }
+
+  for (const auto& req : released) {
+    ClearCloseCallback(req);
+    output_->SendJsonReply(req, HTTP_OK, reply);
+  }
+}
+
+
+void HttpHandler::ExpireSTHWaiters() {
+  if (!task_.task()->IsActive()) {
+    // We're shutting down, just return.
+    return;
+  }
+
+  const steady_clock::time_point now(steady_clock::now());
+  vector<evhttp_request*> expired;
+  shared_ptr<const string> reply;
+  {
+    lock_guard<mutex> lock(mutex_);
+    reply = sth_reply_;
+    for (auto it = sth_waiters_.begin(); it != sth_waiters_.end();) {
+      if (it->second.second <= now) {
+        expired.push_back(it->second.first);
+        it = sth_waiters_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    get_sth_waiting_requests->Set(sth_waiters_.size());
+  }
+
+  if (!expired.empty() && !reply) {
+    // We don't have an STH yet.
+    JsonWriter json_reply;
+    STHToJson(log_lookup_->GetSTH(), &json_reply);
+    reply = SerializeReply(json_reply);
+  }
+  for (const auto& req : expired) {
+    ClearCloseCallback(req);
+    output_->SendJsonReply(req, HTTP_OK, reply);
+  }
+
+  event_base_->Delay(seconds(1),
+                     task_.task()->AddChildWithExecutor(
+                         bind(&HttpHandler::ExpireSTHWaiters, this),
+                         event_base_));
+}
+
+
+void HttpHandler::AbortSTHWaiters(util::Task* task) {
+  vector<evhttp_request*> aborted;
+  {
+    lock_guard<mutex> lock(mutex_);
+    for (const auto& waiter : sth_waiters_) {
+      aborted.push_back(waiter.second.first);
+    }
+    sth_waiters_.clear();
+    get_sth_waiting_requests->Set(0);
+  }
+
+  for (const auto& req : aborted) {
+    ClearCloseCallback(req);
+    output_->SendError(req, HTTP_SERVUNAVAIL, "Server is shutting down.");
+  }
+  task->Return();
+}
+
+
+// static
+void HttpHandler::STHWaiterClosed(evhttp_connection* conn, void* handler) {
+  HttpHandler* const self(static_cast<HttpHandler*>(handler));
+  lock_guard<mutex> lock(self->mutex_);
+  for (auto it = self->sth_waiters_.begin();
+       it != self->sth_waiters_.end();) {
+    if (evhttp_request_get_connection(it->second.first) == conn) {
+      // libevent frees the request once we return.
+      it = self->sth_waiters_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  get_sth_waiting_requests->Set(self->sth_waiters_.size());
 }
 
 
@@ -459,18 +768,22 @@ void HttpHandler::GetConsistency(evhttp_request* req) const {
                               "Missing or invalid \"second\" parameter.");
   }
 
-  const vector<string> consistency(
-      log_lookup_->ConsistencyProof(first, second));
-  JsonArray json_cons;
-  for (vector<string>::const_iterator it = consistency.begin();
-       it != consistency.end(); ++it) {
-    json_cons.AddBase64(*it);
+  shared_ptr<const string> reply;
+  {
+    lock_guard<mutex> lock(mutex_);
+    const auto it(consistency_replies_.find(make_pair(first, second)));
+    if (it != consistency_replies_.end()) {
+      reply = it->second;
+    }
+  }
+  if (reply) {
+    return output_->SendJsonReply(req, HTTP_OK, reply);
   }
 
-  JsonObject json_reply;
-  json_reply.Add("consistency", json_cons);
-
-  output_->SendJsonReply(req, HTTP_OK, json_reply);
+  JsonWriter json_reply;
+  ConsistencyToJson(log_lookup_->ConsistencyProof(first, second),
+                    &json_reply);
+  output_->SendJsonReply(req, HTTP_OK, &json_reply);
 }
 
 
@@ -480,7 +793,7 @@ void HttpHandler::AddChain(evhttp_request* req) {
     return;
   }
 
-  pool_->Add(bind(&HttpHandler::BlockingAddChain, this, req, chain));
+  pool_->Add(bind(&HttpHandler::ProcessAddChain, this, req, chain));
 }
 
 
@@ -490,21 +803,30 @@ void HttpHandler::AddPreChain(evhttp_request* req) {
     return;
   }
 
-  pool_->Add(bind(&HttpHandler::BlockingAddPreChain, this, req, chain));
+  pool_->Add(bind(&HttpHandler::ProcessAddPreChain, this, req, chain));
 }
 
 
-void HttpHandler::BlockingGetEntries(evhttp_request* req, int64_t start,
-                                     int64_t end, bool include_scts) const {
-  JsonArray json_entries;
-  auto it(db_->ScanEntries(start));
-  for (int64_t i = start; i <= end; ++i) {
-    LoggedCertificate cert;
+void HttpHandler::GetEntriesDone(evhttp_request* req, bool include_scts,
+                                 vector<LoggedCertificate>* entries,
+                                 util::Task* task) const {
+  const unique_ptr<vector<LoggedCertificate>> entries_deleter(entries);
+  const unique_ptr<util::Task> task_deleter(task);
+  if (!task->status().ok()) {
+    LOG(WARNING) << "Failed to read entries: " << task->status();
+    return output_->SendError(req, HTTP_INTERNAL, "Failed to read entries.");
+  }
 
-    if (!it->GetNextEntry(&cert) || cert.sequence_number() != i) {
-      break;
-    }
+  if (entries->empty()) {
+    return output_->SendError(req, HTTP_BADREQUEST, "Entry not found.");
+  }
 
+  // The entries are written (and base64 encoded) straight into the
+  // reply's buffer, there is no intermediate copy of the whole reply.
+  JsonWriter json_reply;
+  json_reply.BeginObject();
+  json_reply.BeginArray("entries");
+  for (const auto& cert : *entries) {
     string leaf_input;
     string extra_data;
     string sct_data;
@@ -512,54 +834,65 @@ void HttpHandler::BlockingGetEntries(evhttp_request* req, int64_t start,
         !cert.SerializeExtraData(&extra_data) ||
         (include_scts &&
          Serializer::SerializeSCT(cert.sct(), &sct_data) != Serializer::OK)) {
-      LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
+      LOG(WARNING) << "Failed to serialize entry @ "
+                   << cert.sequence_number() << ":\n"
                    << cert.DebugString();
       return output_->SendError(req, HTTP_INTERNAL, "Serialization failed.");
     }
 
-    JsonObject json_entry;
-    json_entry.AddBase64("leaf_input", leaf_input);
-    json_entry.AddBase64("extra_data", extra_data);
+    json_reply.BeginObject();
+    json_reply.AddBase64("leaf_input", leaf_input);
+    json_reply.AddBase64("extra_data", extra_data);
 
     if (include_scts) {
       // This is non-standard, and currently only used by other SuperDuper log
       // nodes when "following" to fetch data from each other:
-      json_entry.AddBase64("sct", sct_data);
+      json_reply.AddBase64("sct", sct_data);
     }
 
-    json_entries.Add(&json_entry);
+    json_reply.EndObject();
   }
+  json_reply.EndArray();
+  json_reply.EndObject();
 
-  if (json_entries.Length() < 1) {
-    return output_->SendError(req, HTTP_BADREQUEST, "Entry not found.");
-  }
+  output_->SendJsonReply(req, HTTP_OK, &json_reply);
+}
 
-  JsonObject json_reply;
-  json_reply.Add("entries", json_entries);
 
-  output_->SendJsonReply(req, HTTP_OK, json_reply);
+// Checking the chain is CPU bound, so it is done on the thread pool,
+// but the pool thread is released while the entry is looked up in the
+// database.
+void HttpHandler::ProcessAddChain(evhttp_request* req,
+                                  const shared_ptr<CertChain>& chain) const {
+  SignedCertificateTimestamp* const sct(new SignedCertificateTimestamp);
+
+  CHECK_NOTNULL(frontend_)
+      ->QueueX509Entry(CHECK_NOTNULL(chain.get()), sct,
+                       new util::Task(bind(&HttpHandler::AddChainDone, this,
+                                           req, sct, _1),
+                                      pool_));
 }
 
 
-void HttpHandler::BlockingAddChain(evhttp_request* req,
-                                   const shared_ptr<CertChain>& chain) const {
-  SignedCertificateTimestamp sct;
+void HttpHandler::ProcessAddPreChain(
+    evhttp_request* req, const shared_ptr<PreCertChain>& chain) const {
+  SignedCertificateTimestamp* const sct(new SignedCertificateTimestamp);
 
-  AddChainReply(output_, req,
-                CHECK_NOTNULL(frontend_)
-                    ->QueueX509Entry(CHECK_NOTNULL(chain.get()), &sct),
-                sct);
+  CHECK_NOTNULL(frontend_)
+      ->QueuePreCertEntry(CHECK_NOTNULL(chain.get()), sct,
+                          new util::Task(bind(&HttpHandler::AddChainDone,
+                                              this, req, sct, _1),
+                                         pool_));
 }
 
 
-void HttpHandler::BlockingAddPreChain(
-    evhttp_request* req, const shared_ptr<PreCertChain>& chain) const {
-  SignedCertificateTimestamp sct;
+void HttpHandler::AddChainDone(evhttp_request* req,
+                               SignedCertificateTimestamp* sct,
+                               util::Task* task) const {
+  const unique_ptr<SignedCertificateTimestamp> sct_deleter(sct);
+  const unique_ptr<util::Task> task_deleter(task);
 
-  AddChainReply(output_, req,
-                CHECK_NOTNULL(frontend_)
-                    ->QueuePreCertEntry(CHECK_NOTNULL(chain.get()), &sct),
-                sct);
+  AddChainReply(output_, req, task->status(), *sct);
 }
 
 
@@ -1,15 +1,25 @@
 #ifndef CERT_TRANS_SERVER_HANDLER_H_
 #define CERT_TRANS_SERVER_HANDLER_H_
 
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "util/libevent_wrapper.h"
 #include "util/sync_task.h"
 #include "util/task.h"
 
+namespace ct {
+class SignedCertificateTimestamp;
+class SignedTreeHead;
+}  // namespace ct
+
 class Frontend;
 template <class T>
 class LogLookup;
@@ -57,17 +67,38 @@ class HttpHandler {
   void GetEntries(evhttp_request* req) const;
   void GetRoots(evhttp_request* req) const;
   void GetProof(evhttp_request* req) const;
-  void GetSTH(evhttp_request* req) const;
+  // With a "wait_for_newer_than" parameter (a timestamp in
+  // milliseconds), the reply is held until there is a newer STH, for
+  // up to --get_sth_max_wait_seconds.
+  void GetSTH(evhttp_request* req);
   void GetConsistency(evhttp_request* req) const;
   void AddChain(evhttp_request* req);
   void AddPreChain(evhttp_request* req);
 
-  void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
-                          bool include_scts) const;
-  void BlockingAddChain(evhttp_request* req,
-                        const std::shared_ptr<CertChain>& chain) const;
-  void BlockingAddPreChain(evhttp_request* req,
-                           const std::shared_ptr<PreCertChain>& chain) const;
+  void GetEntriesDone(evhttp_request* req, bool include_scts,
+                      std::vector<LoggedCertificate>* entries,
+                      util::Task* task) const;
+  void ProcessAddChain(evhttp_request* req,
+                       const std::shared_ptr<CertChain>& chain) const;
+  void ProcessAddPreChain(evhttp_request* req,
+                          const std::shared_ptr<PreCertChain>& chain) const;
+  void AddChainDone(evhttp_request* req, ct::SignedCertificateTimestamp* sct,
+                    util::Task* task) const;
+
+  // Called by the log lookup with every new STH, updates the cached
+  // replies.
+  void STHUpdated(const ct::SignedTreeHead& sth);
+  // These answer the get-sth requests held by GetSTH(), and must be
+  // run on the event thread. ReleaseSTHWaiters() answers those which
+  // the latest STH satisfies, ExpireSTHWaiters() those which have
+  // waited long enough, and AbortSTHWaiters() all of them, before
+  // returning |task|.
+  void ReleaseSTHWaiters();
+  void ExpireSTHWaiters();
+  void AbortSTHWaiters(util::Task* task);
+  // Close callback of the connections of held get-sth requests,
+  // forgets about the request.
+  static void STHWaiterClosed(evhttp_connection* conn, void* handler);
 
   bool IsNodeStale() const;
   void UpdateNodeStaleness();
@@ -85,6 +116,21 @@ class HttpHandler {
   util::SyncTask task_;
   mutable std::mutex mutex_;
   bool node_is_stale_;
+  std::unique_ptr<ct::SignedTreeHead> latest_sth_;
+  // Replies which only change with the STH (or never), serialized
+  // ahead of time. The consistency proofs are from the tree sizes in
+  // |recent_tree_sizes_| to the latest STH's.
+  std::shared_ptr<const std::string> sth_reply_;
+  std::shared_ptr<const std::string> roots_reply_;
+  std::deque<int64_t> recent_tree_sizes_;
+  std::map<std::pair<int64_t, int64_t>, std::shared_ptr<const std::string>>
+      consistency_replies_;
+  // get-sth requests waiting for an STH newer than the key, with
+  // when they should be given the current one anyway.
+  std::multimap<uint64_t, std::pair<evhttp_request*,
+                                    std::chrono::steady_clock::time_point>>
+      sth_waiters_;
+  const std::function<void(const ct::SignedTreeHead&)> sth_updated_cb_;
 
   DISALLOW_COPY_AND_ASSIGN(HttpHandler);
 };
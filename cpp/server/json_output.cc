@@ -6,8 +6,10 @@
 #include "monitoring/monitoring.h"
 #include "monitoring/latency.h"
 #include "util/json_wrapper.h"
+#include "util/json_writer.h"
 #include "util/libevent_wrapper.h"
 
+using std::shared_ptr;
 using std::string;
 
 namespace cert_trans {
@@ -29,9 +31,13 @@ static const char kJsonContentType[] = "application/json; charset=utf-8";
 
 string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
   evhttp_connection* conn = evhttp_request_get_connection(req);
-  char* peer_addr;
+  // The connection is gone if the client closed it while we were
+  // working on the request (or holding on to it, for long polls).
+  char* peer_addr(nullptr);
   ev_uint16_t peer_port;
-  evhttp_connection_get_peer(conn, &peer_addr, &peer_port);
+  if (conn) {
+    evhttp_connection_get_peer(conn, &peer_addr, &peer_port);
+  }
 
   string http_verb;
   switch (evhttp_request_get_command(req)) {
@@ -60,11 +66,16 @@ string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
   total_http_server_response_codes->Increment(path, http_status);
 
   const string uri(evhttp_request_get_uri(req));
-  return string(peer_addr) + " \"" + http_verb + " " + uri + "\" " +
+  return string(peer_addr ? peer_addr : "-") + " \"" + http_verb + " " + uri + "\" " +
          std::to_string(http_status) + " " + std::to_string(resp_body_length);
 }
 
 
+void ReleaseBody(const void* /*data*/, size_t /*length*/, void* ref) {
+  delete static_cast<shared_ptr<const string>*>(ref);
+}
+
+
 }  // namespace
 
 
@@ -74,6 +85,43 @@ JsonOutput::JsonOutput(libevent::Base* base) : base_(CHECK_NOTNULL(base)) {
 
 void JsonOutput::SendJsonReply(evhttp_request* req, int http_status,
                                const JsonObject& json) {
+  const string resp_body(json.ToString());
+  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s",
+                               resp_body.c_str()),
+           0);
+
+  SendReply(req, http_status, resp_body.size());
+}
+
+
+void JsonOutput::SendJsonReply(evhttp_request* req, int http_status,
+                               JsonWriter* json) {
+  CHECK(CHECK_NOTNULL(json)->Complete());
+  const size_t body_length(json->Length());
+  CHECK_EQ(evbuffer_add_buffer(evhttp_request_get_output_buffer(req),
+                               json->buffer()),
+           0);
+
+  SendReply(req, http_status, body_length);
+}
+
+
+void JsonOutput::SendJsonReply(evhttp_request* req, int http_status,
+                               const shared_ptr<const string>& json_body) {
+  CHECK(json_body);
+  // The buffer keeps a reference to the body until it has been sent.
+  shared_ptr<const string>* const ref(new shared_ptr<const string>(json_body));
+  CHECK_EQ(evbuffer_add_reference(evhttp_request_get_output_buffer(req),
+                                  json_body->data(), json_body->size(),
+                                  &ReleaseBody, ref),
+           0);
+
+  SendReply(req, http_status, json_body->size());
+}
+
+
+void JsonOutput::SendReply(evhttp_request* req, int http_status,
+                           size_t body_length) {
   CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
                              "Content-Type", kJsonContentType),
            0);
@@ -82,12 +130,8 @@ void JsonOutput::SendJsonReply(evhttp_request* req, int http_status,
                                "Retry-After", "10"),
              0);
   }
-  const string resp_body(json.ToString());
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s",
-                               resp_body.c_str()),
-           0);
 
-  const string logstr(LogRequest(req, http_status, resp_body.size()));
+  const string logstr(LogRequest(req, http_status, body_length));
   const auto send_reply([req, http_status, logstr]() {
     evhttp_send_reply(req, http_status, /*reason*/ NULL, /*databuf*/ NULL);
 
@@ -104,11 +148,13 @@ void JsonOutput::SendJsonReply(evhttp_request* req, int http_status,
 
 void JsonOutput::SendError(evhttp_request* req, int http_status,
                            const string& error_msg) {
-  JsonObject json_reply;
+  JsonWriter json_reply;
+  json_reply.BeginObject();
   json_reply.Add("error_message", error_msg);
   json_reply.AddBoolean("success", false);
+  json_reply.EndObject();
 
-  SendJsonReply(req, http_status, json_reply);
+  SendJsonReply(req, http_status, &json_reply);
 }
 
 
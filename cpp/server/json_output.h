@@ -1,6 +1,7 @@
 #ifndef CERT_TRANS_SERVER_JSON_OUTPUT_H_
 #define CERT_TRANS_SERVER_JSON_OUTPUT_H_
 
+#include <memory>
 #include <string>
 
 #include "base/macros.h"
@@ -9,6 +10,7 @@ struct evhttp_request;
 class JsonObject;
 
 namespace cert_trans {
+class JsonWriter;
 namespace libevent {
 class Base;
 }  // namespace libevent
@@ -21,11 +23,21 @@ class JsonOutput {
   void SendJsonReply(evhttp_request* req, int http_status,
                      const JsonObject& json);
 
+  // Sends the JSON written so far, moving it out of "json" without
+  // copying it.
+  void SendJsonReply(evhttp_request* req, int http_status, JsonWriter* json);
+
+  // Sends an already serialized JSON body, without copying it.
+  void SendJsonReply(evhttp_request* req, int http_status,
+                     const std::shared_ptr<const std::string>& json_body);
 
   void SendError(evhttp_request* req, int http_status,
                  const std::string& error_msg);
 
  private:
+  // Sends the reply, once its body is in the output buffer.
+  void SendReply(evhttp_request* req, int http_status, size_t body_length);
+
   libevent::Base* const base_;
 
   DISALLOW_COPY_AND_ASSIGN(JsonOutput);
@@ -19,6 +19,7 @@
 #include "log/frontend.h"
 #include "log/frontend_signer.h"
 #include "log/leveldb_db.h"
+#include "log/local_consistent_store.h"
 #include "log/log_lookup.h"
 #include "log/log_signer.h"
 #include "log/sqlite_db.h"
@@ -65,6 +66,10 @@ class Server {
 
     std::string etcd_root;
 
+    // If set, the consistent store is kept in this file rather than
+    // in etcd (which is then only used for the master election).
+    std::string local_store_file;
+
     int num_http_server_threads;
   };
 
@@ -176,6 +181,22 @@ std::string GetNodeId(Database<Logged>* db) {
 }
 
 
+template <class Logged>
+ConsistentStore<Logged>* NewConsistentStore(
+    const typename Server<Logged>::Options& options, libevent::Base* base,
+    util::Executor* executor, EtcdClient* etcd_client,
+    const MasterElection* election, const std::string& node_id) {
+  if (!options.local_store_file.empty()) {
+    LOG(INFO) << "Using local consistent store " << options.local_store_file;
+    return new LocalConsistentStore<Logged>(options.local_store_file,
+                                            node_id);
+  }
+  return new EtcdConsistentStore<Logged>(base, executor, etcd_client,
+                                         election, options.etcd_root,
+                                         node_id);
+}
+
+
 }  // namespace
 
 
@@ -208,9 +229,11 @@ Server<Logged>::Server(const Options& opts,
       internal_pool_(CHECK_NOTNULL(internal_pool)),
       server_task_(internal_pool_),
       consistent_store_(&election_,
-                        new EtcdConsistentStore<LoggedCertificate>(
-                            event_base_.get(), internal_pool_, etcd_client_,
-                            &election_, options_.etcd_root, node_id_)),
+                        NewConsistentStore<Logged>(options_,
+                                                   event_base_.get(),
+                                                   internal_pool_,
+                                                   etcd_client_, &election_,
+                                                   node_id_)),
       frontend_((log_signer && cert_checker)
                     ? new Frontend(new CertSubmissionHandler(cert_checker),
                                    new FrontendSigner(db_, &consistent_store_,
@@ -0,0 +1,293 @@
+#include "third_party/cosi/cosi_batcher.h"
+
+#include <functional>
+#include <glog/logging.h>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/counter.h"
+#include "third_party/cosi/cosi_client.h"
+#include "util/sync_task.h"
+
+using ct::CosiBatchProof;
+using std::bind;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::string;
+using std::unique_lock;
+using std::vector;
+using util::Status;
+using util::SyncTask;
+using util::Task;
+
+namespace cert_trans {
+namespace {
+
+
+Counter<>* cosi_batcher_batches =
+    Counter<>::New("cosi_batcher_batches",
+                   "Number of collective signatures requested by the CoSi "
+                   "batcher.");
+
+Counter<>* cosi_batcher_messages =
+    Counter<>::New("cosi_batcher_messages",
+                   "Number of messages covered by the collective signatures "
+                   "requested by the CoSi batcher.");
+
+
+}  // namespace
+
+
+struct CosiBatcher::Item {
+  Item(const string& message, string* signature, CosiBatchProof* proof,
+       Task* task)
+      : message_(message), signature_(signature), proof_(proof), task_(task) {
+  }
+
+  const string message_;
+  string* const signature_;
+  CosiBatchProof* const proof_;
+  Task* const task_;
+};
+
+
+struct CosiBatcher::Batch {
+  explicit Batch(vector<Item*>&& items) : items_(move(items)) {
+  }
+
+  const vector<Item*> items_;
+  // What is actually sent to the cothority, and one proof per item
+  // (unless there is a single item, which is sent as is).
+  string message_;
+  vector<CosiBatchProof> proofs_;
+  string signature_;
+};
+
+
+CosiBatcher::CosiBatcher(libevent::Base* base, CosiClient* client,
+                         const Options& options)
+    : base_(CHECK_NOTNULL(base)),
+      client_(CHECK_NOTNULL(client)),
+      options_(options),
+      window_task_(nullptr),
+      outstanding_(0),
+      exiting_(false) {
+  CHECK_GE(options_.window.count(), 0);
+  CHECK_GT(options_.max_batch_size, 0U);
+}
+
+
+CosiBatcher::~CosiBatcher() {
+  libevent::Base::CheckNotOnEventThread();
+  {
+    lock_guard<mutex> lock(mutex_);
+    exiting_ = true;
+  }
+
+  SyncTask cancelled(base_);
+  base_->Add([this, &cancelled]() {
+    CancelAll();
+    cancelled.task()->Return();
+  });
+  cancelled.Wait();
+
+  unique_lock<mutex> lock(mutex_);
+  outstanding_cv_.wait(lock, [this]() { return outstanding_ == 0; });
+}
+
+
+void CosiBatcher::Sign(const string& message, string* signature,
+                       CosiBatchProof* proof, Task* task) {
+  CHECK_NOTNULL(signature);
+  CHECK_NOTNULL(proof);
+  CHECK_NOTNULL(task);
+
+  Item* const item(new Item(message, signature, proof, task));
+  task->DeleteWhenDone(item);
+  {
+    lock_guard<mutex> lock(mutex_);
+    CHECK(!exiting_);
+    ++outstanding_;
+  }
+  base_->Add(bind(&CosiBatcher::Add, this, item));
+}
+
+
+// static
+bool CosiBatcher::VerifyProof(const string& message,
+                              const CosiBatchProof& proof) {
+  if (proof.leaf_index() < 0 || proof.leaf_index() >= proof.batch_size()) {
+    return false;
+  }
+
+  MerkleVerifier verifier(new Sha256Hasher);
+  const vector<string> path(proof.audit_path().begin(),
+                            proof.audit_path().end());
+  return verifier.VerifyPath(proof.leaf_index() + 1, proof.batch_size(), path,
+                             proof.batch_root(), message);
+}
+
+
+void CosiBatcher::Add(Item* item) {
+  if (Exiting() || item->task_->CancelRequested()) {
+    Finish(item, Status::CANCELLED);
+    return;
+  }
+
+  pending_.push_back(item);
+  if (pending_.size() >= options_.max_batch_size ||
+      options_.window <= options_.window.zero()) {
+    Send();
+    return;
+  }
+
+  if (pending_.size() == 1) {
+    CHECK(!window_task_);
+    {
+      lock_guard<mutex> lock(mutex_);
+      ++outstanding_;
+    }
+    window_task_ = new Task(bind(&CosiBatcher::WindowDone, this, _1), base_);
+    base_->Delay(options_.window, window_task_);
+  }
+}
+
+
+void CosiBatcher::Send() {
+  if (window_task_) {
+    // WindowDone() still runs, and takes care of deleting it.
+    window_task_->Cancel();
+    window_task_ = nullptr;
+  }
+
+  vector<Item*> items;
+  for (const auto& item : pending_) {
+    if (item->task_->CancelRequested()) {
+      Finish(item, Status::CANCELLED);
+    } else {
+      items.push_back(item);
+    }
+  }
+  pending_.clear();
+  if (items.empty()) {
+    return;
+  }
+
+  Batch* const batch(new Batch(move(items)));
+  const size_t batch_size(batch->items_.size());
+  if (batch_size == 1) {
+    batch->message_ = batch->items_.front()->message_;
+  } else {
+    MerkleTree tree(new Sha256Hasher);
+    for (const auto& item : batch->items_) {
+      tree.AddLeaf(item->message_);
+    }
+    batch->message_ = tree.CurrentRoot();
+
+    for (size_t i = 0; i < batch_size; ++i) {
+      CosiBatchProof proof;
+      proof.set_batch_root(batch->message_);
+      proof.set_leaf_index(i);
+      proof.set_batch_size(batch_size);
+      for (const auto& node : tree.PathToCurrentRoot(i + 1)) {
+        proof.add_audit_path(node);
+      }
+      batch->proofs_.emplace_back(move(proof));
+    }
+  }
+
+  VLOG(1) << "Requesting a collective signature on a batch of " << batch_size
+          << " message" << (batch_size == 1 ? "" : "s");
+  cosi_batcher_batches->Increment();
+  cosi_batcher_messages->IncrementBy(batch_size);
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    ++outstanding_;
+  }
+  Task* const task(
+      new Task(bind(&CosiBatcher::BatchDone, this, batch, _1), base_));
+  batch_tasks_.insert(task);
+  client_->Sign(batch->message_, &batch->signature_, task);
+}
+
+
+void CosiBatcher::WindowDone(Task* task) {
+  // If the timer was cancelled, the batch has already been sent.
+  if (task == window_task_) {
+    CHECK_EQ(Status::OK, task->status());
+    window_task_ = nullptr;
+    Send();
+  }
+  delete task;
+  Done();
+}
+
+
+void CosiBatcher::BatchDone(Batch* batch, Task* task) {
+  CHECK_EQ(1U, batch_tasks_.erase(task));
+  const Status status(task->status());
+  if (!status.ok()) {
+    LOG(WARNING) << "Failed to cosign a batch of " << batch->items_.size()
+                 << " messages: " << status;
+  }
+
+  for (size_t i = 0; i < batch->items_.size(); ++i) {
+    Item* const item(batch->items_[i]);
+    if (status.ok()) {
+      item->signature_->assign(batch->signature_);
+      if (batch->proofs_.empty()) {
+        item->proof_->Clear();
+      } else {
+        item->proof_->CopyFrom(batch->proofs_[i]);
+      }
+    }
+    Finish(item, status);
+  }
+
+  delete batch;
+  delete task;
+  Done();
+}
+
+
+void CosiBatcher::CancelAll() {
+  if (window_task_) {
+    window_task_->Cancel();
+    window_task_ = nullptr;
+  }
+  for (const auto& item : pending_) {
+    Finish(item, Status::CANCELLED);
+  }
+  pending_.clear();
+  for (const auto& task : batch_tasks_) {
+    task->Cancel();
+  }
+}
+
+
+bool CosiBatcher::Exiting() {
+  lock_guard<mutex> lock(mutex_);
+  return exiting_;
+}
+
+
+void CosiBatcher::Finish(Item* item, const Status& status) {
+  // "item" is deleted along with its task.
+  item->task_->Return(status);
+  Done();
+}
+
+
+void CosiBatcher::Done() {
+  lock_guard<mutex> lock(mutex_);
+  CHECK_GT(outstanding_, 0);
+  --outstanding_;
+  outstanding_cv_.notify_all();
+}
+
+
+}  // namespace cert_trans
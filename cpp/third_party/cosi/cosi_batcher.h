@@ -0,0 +1,100 @@
+#ifndef CERT_TRANS_THIRD_PARTY_COSI_COSI_BATCHER_H_
+#define CERT_TRANS_THIRD_PARTY_COSI_COSI_BATCHER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "proto/ct.pb.h"
+#include "util/libevent_wrapper.h"
+#include "util/status.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+class CosiClient;
+
+
+// Amortises the witness rounds of a CosiClient over several messages
+// (the root hashes of our STHs): messages are collected for a short
+// while, and the cothority is asked for a single collective signature
+// on the root of a Merkle tree over all of them. Each message then
+// gets that signature, along with the audit path proving that it is
+// part of the signed batch.
+//
+// A message which ends up alone in its batch is signed directly, as
+// CosiClient would, and gets no proof.
+class CosiBatcher {
+ public:
+  struct Options {
+    Options()
+        : window(std::chrono::milliseconds(500)), max_batch_size(64) {
+    }
+
+    // How long the first message of a batch waits for more. If zero,
+    // every message is signed on its own.
+    std::chrono::duration<double> window;
+    // Batches are sent right away once they have this many messages.
+    size_t max_batch_size;
+  };
+
+  CosiBatcher(libevent::Base* base, CosiClient* client,
+              const Options& options);
+  // Messages still waiting for their batch to be sent are cancelled,
+  // and batches already sent are waited for.
+  ~CosiBatcher();
+
+  // Asks for a collective signature covering "message". On success,
+  // "signature" is set to the JSON reply of the cothority, and
+  // "proof" to the proof that "message" is part of the signed batch
+  // (or cleared, if it was signed directly). This can be called from
+  // any thread.
+  void Sign(const std::string& message, std::string* signature,
+            ct::CosiBatchProof* proof, util::Task* task);
+
+  // Returns true iff "proof" shows that "message" is part of the
+  // batch whose root is "proof.batch_root()".
+  static bool VerifyProof(const std::string& message,
+                          const ct::CosiBatchProof& proof);
+
+ private:
+  struct Item;
+  struct Batch;
+
+  // These run on the libevent thread.
+  void Add(Item* item);
+  void Send();
+  void WindowDone(util::Task* task);
+  void BatchDone(Batch* batch, util::Task* task);
+  void CancelAll();
+
+  bool Exiting();
+  void Finish(Item* item, const util::Status& status);
+  void Done();
+
+  libevent::Base* const base_;
+  CosiClient* const client_;
+  const Options options_;
+
+  // Only accessed on the libevent thread.
+  std::vector<Item*> pending_;
+  util::Task* window_task_;
+  std::set<util::Task*> batch_tasks_;
+
+  std::mutex mutex_;
+  std::condition_variable outstanding_cv_;
+  // Number of messages, window timers and batches in progress.
+  int outstanding_;
+  bool exiting_;
+
+  DISALLOW_COPY_AND_ASSIGN(CosiBatcher);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_THIRD_PARTY_COSI_COSI_BATCHER_H_
@@ -0,0 +1,157 @@
+#include "third_party/cosi/cosi_batcher.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "third_party/cosi/cosi_client.h"
+#include "third_party/cosi/fake_cothority.h"
+#include "util/libevent_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::CosiBatchProof;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using util::Status;
+using util::SyncTask;
+
+
+class CosiBatcherTest : public ::testing::Test {
+ protected:
+  CosiBatcherTest()
+      : base_(make_shared<libevent::Base>()),
+        event_pump_(base_),
+        server_(true) {
+    CosiClient::Options options;
+    options.servers.emplace_back("127.0.0.1", server_.port());
+    options.timeout = milliseconds(200);
+    options.retry_delay = milliseconds(10);
+    client_.reset(new CosiClient(base_.get(), options));
+  }
+
+  shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread event_pump_;
+  FakeCothority server_;
+  unique_ptr<CosiClient> client_;
+};
+
+
+TEST_F(CosiBatcherTest, SignsDirectlyWithoutWindow) {
+  CosiBatcher::Options options;
+  options.window = seconds(0);
+  CosiBatcher batcher(base_.get(), client_.get(), options);
+
+  string signature;
+  CosiBatchProof proof;
+  proof.set_batch_size(1);
+  SyncTask task(base_.get());
+  batcher.Sign("root hash", &signature, &proof, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_NE(string::npos, signature.find(util::ToBase64("root hash")));
+  EXPECT_FALSE(proof.has_batch_size());
+  EXPECT_EQ(1, server_.requests());
+}
+
+
+TEST_F(CosiBatcherTest, SignsFullBatchOnce) {
+  CosiBatcher::Options options;
+  options.window = seconds(60);
+  options.max_batch_size = 5;
+  CosiBatcher batcher(base_.get(), client_.get(), options);
+
+  const int kNumMessages(5);
+  string signatures[kNumMessages];
+  CosiBatchProof proofs[kNumMessages];
+  unique_ptr<SyncTask> tasks[kNumMessages];
+  for (int i = 0; i < kNumMessages; ++i) {
+    tasks[i].reset(new SyncTask(base_.get()));
+    batcher.Sign("root hash " + to_string(i), &signatures[i], &proofs[i],
+                 tasks[i]->task());
+  }
+  for (int i = 0; i < kNumMessages; ++i) {
+    tasks[i]->Wait();
+    EXPECT_OK(tasks[i]->status());
+    EXPECT_EQ(i, proofs[i].leaf_index());
+    EXPECT_EQ(kNumMessages, proofs[i].batch_size());
+    EXPECT_EQ(proofs[0].batch_root(), proofs[i].batch_root());
+    EXPECT_TRUE(
+        CosiBatcher::VerifyProof("root hash " + to_string(i), proofs[i]));
+    EXPECT_FALSE(CosiBatcher::VerifyProof("root hash", proofs[i]));
+    EXPECT_NE(string::npos,
+              signatures[i].find(util::ToBase64(proofs[i].batch_root())));
+  }
+  EXPECT_EQ(1, server_.requests());
+}
+
+
+TEST_F(CosiBatcherTest, SendsBatchAfterWindow) {
+  CosiBatcher::Options options;
+  options.window = milliseconds(50);
+  CosiBatcher batcher(base_.get(), client_.get(), options);
+
+  string signature1, signature2;
+  CosiBatchProof proof1, proof2;
+  SyncTask task1(base_.get());
+  SyncTask task2(base_.get());
+  batcher.Sign("root hash 1", &signature1, &proof1, task1.task());
+  batcher.Sign("root hash 2", &signature2, &proof2, task2.task());
+  task1.Wait();
+  task2.Wait();
+  EXPECT_OK(task1.status());
+  EXPECT_OK(task2.status());
+  EXPECT_TRUE(CosiBatcher::VerifyProof("root hash 1", proof1));
+  EXPECT_TRUE(CosiBatcher::VerifyProof("root hash 2", proof2));
+  EXPECT_EQ(signature1, signature2);
+  EXPECT_EQ(1, server_.requests());
+}
+
+
+TEST_F(CosiBatcherTest, RejectsBadProofs) {
+  CosiBatchProof proof;
+  EXPECT_FALSE(CosiBatcher::VerifyProof("root hash", proof));
+
+  proof.set_batch_root("root");
+  proof.set_leaf_index(2);
+  proof.set_batch_size(2);
+  proof.add_audit_path("sibling");
+  EXPECT_FALSE(CosiBatcher::VerifyProof("root hash", proof));
+}
+
+
+TEST_F(CosiBatcherTest, CancelsPendingOnDestruction) {
+  CosiBatcher::Options options;
+  options.window = seconds(60);
+  unique_ptr<CosiBatcher> batcher(
+      new CosiBatcher(base_.get(), client_.get(), options));
+
+  string signature;
+  CosiBatchProof proof;
+  SyncTask task(base_.get());
+  batcher->Sign("root hash", &signature, &proof, task.task());
+  batcher.reset();
+  task.Wait();
+  EXPECT_EQ(util::error::CANCELLED, task.status().CanonicalCode());
+  EXPECT_EQ(0, server_.requests());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
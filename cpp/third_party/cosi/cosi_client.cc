@@ -0,0 +1,355 @@
+#include "third_party/cosi/cosi_client.h"
+
+#include <deque>
+#include <event2/buffer.h>
+#include <functional>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "util/sync_task.h"
+#include "util/util.h"
+
+using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::deque;
+using std::lock_guard;
+using std::mutex;
+using std::placeholders::_1;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using util::Status;
+using util::SyncTask;
+using util::Task;
+
+namespace cert_trans {
+namespace {
+
+
+// Replies are a JSON object with a signature, a lot shorter than
+// this. Anything longer means we are not talking to a stamp server.
+const size_t kMaxReplyLength = 1 << 16;
+
+
+string StampRequest(int req_no, const string& message) {
+  return "{\"ReqNo\":" + to_string(req_no) +
+         ",\"Type\":1,\"Srep\":null,\"Sreq\":{\"Val\":\"" +
+         util::ToBase64(message) + "\"}}\n";
+}
+
+
+timeval ToTimeval(const duration<double>& d) {
+  timeval tv;
+  const seconds sec(duration_cast<seconds>(d));
+  tv.tv_sec = sec.count();
+  tv.tv_usec = duration_cast<microseconds>(d - sec).count();
+  return tv;
+}
+
+
+}  // namespace
+
+
+struct CosiClient::Request {
+  Request(const string& message, string* signature, Task* task)
+      : message_(message), signature_(signature), task_(task), attempts_(0) {
+  }
+
+  const string message_;
+  string* const signature_;
+  Task* const task_;
+  int attempts_;
+};
+
+
+class CosiClient::Connection {
+ public:
+  Connection(CosiClient* client, const HostPortPair& server)
+      : client_(client), server_(server), bev_(nullptr), next_req_no_(0) {
+  }
+
+  ~Connection() {
+    CHECK(in_flight_.empty());
+    if (bev_) {
+      bufferevent_free(bev_);
+    }
+  }
+
+  void Send(Request* req);
+
+  // Closes the connection, failing all the requests waiting for a
+  // reply with "status".
+  void Close(const Status& status);
+
+ private:
+  static void ReadCallback(bufferevent* bev, void* arg);
+  static void EventCallback(bufferevent* bev, short events, void* arg);
+
+  void Connect();
+  void UpdateTimeouts();
+
+  CosiClient* const client_;
+  const HostPortPair server_;
+  bufferevent* bev_;
+  int next_req_no_;
+  deque<Request*> in_flight_;
+
+  DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+
+void CosiClient::Connection::Send(Request* req) {
+  if (!bev_) {
+    Connect();
+  }
+  if (!bev_) {
+    client_->RequestFailed(req,
+                           Status(util::error::UNAVAILABLE,
+                                  "could not connect to " + server_.first +
+                                      ":" + to_string(server_.second)));
+    return;
+  }
+
+  const string request(StampRequest(next_req_no_++, req->message_));
+  VLOG(2) << "Sending to " << server_.first << ":" << server_.second << ": "
+          << request;
+  CHECK_EQ(bufferevent_write(bev_, request.data(), request.size()), 0);
+  in_flight_.push_back(req);
+  UpdateTimeouts();
+}
+
+
+void CosiClient::Connection::Close(const Status& status) {
+  if (bev_) {
+    bufferevent_free(bev_);
+    bev_ = nullptr;
+  }
+
+  deque<Request*> failed;
+  failed.swap(in_flight_);
+  for (const auto& req : failed) {
+    client_->RequestFailed(req, status);
+  }
+}
+
+
+// static
+void CosiClient::Connection::ReadCallback(bufferevent* bev, void* arg) {
+  Connection* const conn(static_cast<Connection*>(CHECK_NOTNULL(arg)));
+  evbuffer* const input(bufferevent_get_input(bev));
+
+  size_t length;
+  while (char* const line = evbuffer_readln(input, &length,
+                                            EVBUFFER_EOL_LF)) {
+    const string reply(line, length);
+    free(line);
+    if (conn->in_flight_.empty()) {
+      LOG(WARNING) << "Unexpected reply from " << conn->server_.first << ":"
+                   << conn->server_.second << ": " << reply;
+      continue;
+    }
+
+    VLOG(2) << "Reply from " << conn->server_.first << ":"
+            << conn->server_.second << ": " << reply;
+    Request* const req(conn->in_flight_.front());
+    conn->in_flight_.pop_front();
+    req->signature_->assign(reply);
+    conn->client_->Finish(req, Status::OK);
+  }
+
+  if (evbuffer_get_length(input) > kMaxReplyLength) {
+    conn->Close(Status(util::error::UNAVAILABLE, "reply too long"));
+    return;
+  }
+
+  conn->UpdateTimeouts();
+}
+
+
+// static
+void CosiClient::Connection::EventCallback(bufferevent* bev, short events,
+                                           void* arg) {
+  Connection* const conn(static_cast<Connection*>(CHECK_NOTNULL(arg)));
+  if (events & BEV_EVENT_CONNECTED) {
+    VLOG(1) << "Connected to " << conn->server_.first << ":"
+            << conn->server_.second;
+    return;
+  }
+
+  const string server(conn->server_.first + ":" +
+                      to_string(conn->server_.second));
+  Status status;
+  if (events & BEV_EVENT_TIMEOUT) {
+    status = Status(util::error::DEADLINE_EXCEEDED, server + " timed out");
+  } else if (events & BEV_EVENT_EOF) {
+    status =
+        Status(util::error::UNAVAILABLE, server + " closed the connection");
+  } else {
+    status = Status(util::error::UNAVAILABLE,
+                    server + ": " + evutil_socket_error_to_string(
+                                        EVUTIL_SOCKET_ERROR()));
+  }
+  conn->Close(status);
+}
+
+
+void CosiClient::Connection::Connect() {
+  CHECK(!bev_);
+  bev_ = client_->base_->BufferEventSocketNew();
+  next_req_no_ = 0;
+  bufferevent_setcb(bev_, &ReadCallback, nullptr, &EventCallback, this);
+  CHECK_EQ(bufferevent_enable(bev_, EV_READ | EV_WRITE), 0);
+  const timeval timeout(ToTimeval(client_->options_.timeout));
+  bufferevent_set_timeouts(bev_, &timeout, &timeout);
+
+  VLOG(1) << "Connecting to " << server_.first << ":" << server_.second;
+  if (bufferevent_socket_connect_hostname(bev_, client_->base_->GetDns(),
+                                          AF_UNSPEC, server_.first.c_str(),
+                                          server_.second) != 0) {
+    LOG(WARNING) << "Failed to connect to " << server_.first << ":"
+                 << server_.second;
+    // This might already have been closed by EventCallback().
+    Close(Status(util::error::UNAVAILABLE, "connection failed"));
+  }
+}
+
+
+void CosiClient::Connection::UpdateTimeouts() {
+  if (!bev_) {
+    return;
+  }
+
+  // Idle connections are kept open for as long as the server likes.
+  if (in_flight_.empty()) {
+    bufferevent_set_timeouts(bev_, nullptr, nullptr);
+  } else {
+    const timeval timeout(ToTimeval(client_->options_.timeout));
+    bufferevent_set_timeouts(bev_, &timeout, &timeout);
+  }
+}
+
+
+CosiClient::CosiClient(libevent::Base* base, const Options& options)
+    : base_(CHECK_NOTNULL(base)),
+      options_(options),
+      next_server_(0),
+      outstanding_(0),
+      exiting_(false) {
+  CHECK_GT(options_.timeout.count(), 0);
+  CHECK_GT(options_.max_attempts, 0);
+  CHECK_GT(options_.retry_delay.count(), 0);
+  for (const auto& server : options_.servers) {
+    connections_.emplace_back(new Connection(this, server));
+  }
+}
+
+
+CosiClient::~CosiClient() {
+  libevent::Base::CheckNotOnEventThread();
+  {
+    lock_guard<mutex> lock(mutex_);
+    exiting_ = true;
+  }
+
+  SyncTask closed(base_);
+  base_->Add([this, &closed]() {
+    CloseConnections();
+    closed.task()->Return();
+  });
+  closed.Wait();
+
+  unique_lock<mutex> lock(mutex_);
+  outstanding_cv_.wait(lock, [this]() { return outstanding_ == 0; });
+}
+
+
+void CosiClient::Sign(const string& message, string* signature,
+                      Task* task) {
+  CHECK_NOTNULL(signature);
+  CHECK_NOTNULL(task);
+  if (options_.servers.empty()) {
+    task->Return(
+        Status(util::error::FAILED_PRECONDITION, "no CoSi servers"));
+    return;
+  }
+
+  Request* const req(new Request(message, signature, task));
+  task->DeleteWhenDone(req);
+  {
+    lock_guard<mutex> lock(mutex_);
+    CHECK(!exiting_);
+    ++outstanding_;
+  }
+  base_->Add(bind(&CosiClient::StartRequest, this, req));
+}
+
+
+void CosiClient::StartRequest(Request* req) {
+  if (Exiting() || req->task_->CancelRequested()) {
+    Finish(req, Status::CANCELLED);
+    return;
+  }
+
+  ++req->attempts_;
+  Connection* const conn(connections_[next_server_].get());
+  next_server_ = (next_server_ + 1) % connections_.size();
+  conn->Send(req);
+}
+
+
+void CosiClient::RequestFailed(Request* req, const Status& status) {
+  LOG(WARNING) << "CoSi request failed (attempt " << req->attempts_ << " of "
+               << options_.max_attempts << "): " << status;
+
+  if (Exiting() || req->task_->CancelRequested()) {
+    Finish(req, Status::CANCELLED);
+    return;
+  }
+  if (req->attempts_ >= options_.max_attempts) {
+    Finish(req, status);
+    return;
+  }
+
+  base_->Delay(options_.retry_delay,
+               req->task_->AddChild(
+                   bind(&CosiClient::RetryDelayDone, this, req, _1)));
+}
+
+
+void CosiClient::CloseConnections() {
+  for (const auto& conn : connections_) {
+    conn->Close(Status(util::error::CANCELLED, "CosiClient is exiting"));
+  }
+}
+
+
+void CosiClient::RetryDelayDone(Request* req, Task* delay_task) {
+  // StartRequest() takes care of cancellations.
+  VLOG(1) << "Retrying CoSi request: " << delay_task->status();
+  base_->Add(bind(&CosiClient::StartRequest, this, req));
+}
+
+
+bool CosiClient::Exiting() {
+  lock_guard<mutex> lock(mutex_);
+  return exiting_;
+}
+
+
+void CosiClient::Finish(Request* req, const Status& status) {
+  Task* const task(req->task_);
+  {
+    lock_guard<mutex> lock(mutex_);
+    CHECK_GT(outstanding_, 0);
+    --outstanding_;
+    outstanding_cv_.notify_all();
+  }
+  task->Return(status);
+}
+
+
+}  // namespace cert_trans
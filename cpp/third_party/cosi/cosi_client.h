@@ -0,0 +1,91 @@
+#ifndef CERT_TRANS_THIRD_PARTY_COSI_COSI_CLIENT_H_
+#define CERT_TRANS_THIRD_PARTY_COSI_COSI_CLIENT_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/libevent_wrapper.h"
+#include "util/status.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+
+// Asynchronous client for the CoSi stamp servers of a witness
+// cothority, which collectively sign messages (such as the root hash
+// of our STHs).
+//
+// Connections to the servers are kept open and reused. Requests are
+// sent as one JSON object per line, and each reply (also one line)
+// is matched with the oldest outstanding request on its
+// connection. Requests which fail (because a server is unreachable,
+// closed the connection or did not reply in time) are retried, on
+// the next server in turn.
+class CosiClient {
+ public:
+  typedef std::pair<std::string, uint16_t> HostPortPair;
+
+  struct Options {
+    Options()
+        : timeout(std::chrono::seconds(5)),
+          max_attempts(3),
+          retry_delay(std::chrono::milliseconds(500)) {
+    }
+
+    std::vector<HostPortPair> servers;
+    // Time allowed to connect to a server, and then for each reply.
+    std::chrono::duration<double> timeout;
+    int max_attempts;
+    std::chrono::duration<double> retry_delay;
+  };
+
+  CosiClient(libevent::Base* base, const Options& options);
+  // Outstanding requests are cancelled, which might take as long as
+  // "retry_delay".
+  ~CosiClient();
+
+  // Asks for a collective signature on "message". On success,
+  // "signature" is set to the JSON reply of the cothority. This can
+  // be called from any thread.
+  void Sign(const std::string& message, std::string* signature,
+            util::Task* task);
+
+ private:
+  struct Request;
+  class Connection;
+
+  // These run on the libevent thread.
+  void StartRequest(Request* req);
+  void RequestFailed(Request* req, const util::Status& status);
+  void CloseConnections();
+
+  void RetryDelayDone(Request* req, util::Task* delay_task);
+  bool Exiting();
+  void Finish(Request* req, const util::Status& status);
+
+  libevent::Base* const base_;
+  const Options options_;
+
+  // Only accessed on the libevent thread.
+  std::vector<std::unique_ptr<Connection>> connections_;
+  size_t next_server_;
+
+  std::mutex mutex_;
+  std::condition_variable outstanding_cv_;
+  int outstanding_;
+  bool exiting_;
+
+  DISALLOW_COPY_AND_ASSIGN(CosiClient);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_THIRD_PARTY_COSI_COSI_CLIENT_H_
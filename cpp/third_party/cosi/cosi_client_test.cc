@@ -0,0 +1,143 @@
+#include "third_party/cosi/cosi_client.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "third_party/cosi/fake_cothority.h"
+#include "util/libevent_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using util::Status;
+using util::SyncTask;
+
+
+class CosiClientTest : public ::testing::Test {
+ protected:
+  CosiClientTest()
+      : base_(make_shared<libevent::Base>()), event_pump_(base_) {
+    options_.timeout = milliseconds(200);
+    options_.retry_delay = milliseconds(10);
+  }
+
+  Status Sign(CosiClient* client, const string& message, string* signature) {
+    SyncTask task(base_.get());
+    client->Sign(message, signature, task.task());
+    task.Wait();
+    return task.status();
+  }
+
+  shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread event_pump_;
+  CosiClient::Options options_;
+};
+
+
+TEST_F(CosiClientTest, SignsMessage) {
+  FakeCothority server(true);
+  options_.servers.emplace_back("127.0.0.1", server.port());
+  CosiClient client(base_.get(), options_);
+
+  string signature;
+  EXPECT_OK(Sign(&client, "root hash", &signature));
+  EXPECT_NE(string::npos, signature.find(util::ToBase64("root hash")));
+}
+
+
+TEST_F(CosiClientTest, ReusesConnection) {
+  FakeCothority server(true);
+  options_.servers.emplace_back("127.0.0.1", server.port());
+  CosiClient client(base_.get(), options_);
+
+  for (int i = 0; i < 3; ++i) {
+    const string message("root hash " + std::to_string(i));
+    string signature;
+    EXPECT_OK(Sign(&client, message, &signature));
+    EXPECT_NE(string::npos, signature.find(util::ToBase64(message)));
+  }
+  EXPECT_EQ(1, server.connections());
+}
+
+
+TEST_F(CosiClientTest, MatchesConcurrentReplies) {
+  FakeCothority server(true);
+  options_.servers.emplace_back("127.0.0.1", server.port());
+  CosiClient client(base_.get(), options_);
+
+  const int kNumRequests(10);
+  string signatures[kNumRequests];
+  std::unique_ptr<SyncTask> tasks[kNumRequests];
+  for (int i = 0; i < kNumRequests; ++i) {
+    tasks[i].reset(new SyncTask(base_.get()));
+    client.Sign("root hash " + std::to_string(i), &signatures[i],
+                tasks[i]->task());
+  }
+  for (int i = 0; i < kNumRequests; ++i) {
+    tasks[i]->Wait();
+    EXPECT_OK(tasks[i]->status());
+    EXPECT_NE(string::npos,
+              signatures[i].find(
+                  util::ToBase64("root hash " + std::to_string(i))));
+  }
+}
+
+
+TEST_F(CosiClientTest, RetriesOnNextServer) {
+  uint16_t closed_port;
+  {
+    FakeCothority closed(true);
+    closed_port = closed.port();
+  }
+  FakeCothority server(true);
+  options_.servers.emplace_back("127.0.0.1", closed_port);
+  options_.servers.emplace_back("127.0.0.1", server.port());
+  CosiClient client(base_.get(), options_);
+
+  string signature;
+  EXPECT_OK(Sign(&client, "root hash", &signature));
+  EXPECT_NE(string::npos, signature.find(util::ToBase64("root hash")));
+}
+
+
+TEST_F(CosiClientTest, TimesOut) {
+  FakeCothority server(false);
+  options_.servers.emplace_back("127.0.0.1", server.port());
+  options_.max_attempts = 2;
+  CosiClient client(base_.get(), options_);
+
+  string signature;
+  const Status status(Sign(&client, "root hash", &signature));
+  EXPECT_EQ(util::error::DEADLINE_EXCEEDED, status.CanonicalCode())
+      << status;
+  // Timed out connections are not reused.
+  EXPECT_EQ(2, server.connections());
+}
+
+
+TEST_F(CosiClientTest, NoServers) {
+  CosiClient client(base_.get(), options_);
+
+  string signature;
+  EXPECT_EQ(util::error::FAILED_PRECONDITION,
+            Sign(&client, "root hash", &signature).CanonicalCode());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,80 @@
+#include "third_party/cosi/fake_cothority.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using std::string;
+using std::thread;
+
+namespace cert_trans {
+
+
+FakeCothority::FakeCothority(bool reply)
+    : reply_(reply), connections_(0), requests_(0), client_fd_(-1) {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK_GE(listen_fd_, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  CHECK_EQ(0,
+           bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+  CHECK_EQ(0, listen(listen_fd_, 4));
+  socklen_t len(sizeof(addr));
+  CHECK_EQ(0, getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                          &len));
+  port_ = ntohs(addr.sin_port);
+  thread_ = thread(&FakeCothority::Serve, this);
+}
+
+
+FakeCothority::~FakeCothority() {
+  shutdown(listen_fd_, SHUT_RDWR);
+  const int client_fd(client_fd_);
+  if (client_fd >= 0) {
+    shutdown(client_fd, SHUT_RDWR);
+  }
+  thread_.join();
+  close(listen_fd_);
+}
+
+
+void FakeCothority::Serve() {
+  while (true) {
+    const int fd(accept(listen_fd_, nullptr, nullptr));
+    if (fd < 0) {
+      return;
+    }
+    ++connections_;
+    client_fd_ = fd;
+
+    string pending;
+    char buf[1024];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+      pending.append(buf, len);
+      size_t eol;
+      while ((eol = pending.find('\n')) != string::npos) {
+        ++requests_;
+        const string reply("{\"Signed\":" + pending.substr(0, eol) + "}\n");
+        pending.erase(0, eol + 1);
+        if (reply_) {
+          CHECK_EQ(static_cast<ssize_t>(reply.size()),
+                   write(fd, reply.data(), reply.size()));
+        }
+      }
+    }
+
+    client_fd_ = -1;
+    close(fd);
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,54 @@
+#ifndef CERT_TRANS_THIRD_PARTY_COSI_FAKE_COTHORITY_H_
+#define CERT_TRANS_THIRD_PARTY_COSI_FAKE_COTHORITY_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <thread>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Local stand-in for a stamp server of a witness cothority, for
+// tests. It listens on an ephemeral port of the loopback interface
+// and answers every request line with a line of its own, containing
+// the request (and so the base64 encoded message), or never answers
+// at all. Only one connection is served at a time.
+class FakeCothority {
+ public:
+  explicit FakeCothority(bool reply);
+  ~FakeCothority();
+
+  uint16_t port() const {
+    return port_;
+  }
+
+  // Number of connections accepted so far.
+  int connections() const {
+    return connections_;
+  }
+
+  // Number of requests received so far.
+  int requests() const {
+    return requests_;
+  }
+
+ private:
+  void Serve();
+
+  const bool reply_;
+  int listen_fd_;
+  uint16_t port_;
+  std::atomic<int> connections_;
+  std::atomic<int> requests_;
+  std::atomic<int> client_fd_;
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(FakeCothority);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_THIRD_PARTY_COSI_FAKE_COTHORITY_H_
@@ -40,12 +40,14 @@ namespace Cosi{
     return requestSignature(host, port, sth->sha256_root_hash());
   }
 
-  // Requests a signature from the stamp-server at host:port - returns NULL if
-  // not successful or the string with the JSON-representation of the signature
+  // Requests a signature from the stamp-server at host:port - returns an
+  // empty string if not successful or the string with the
+  // JSON-representation of the signature. This blocks, see CosiClient
+  // for an asynchronous version.
   std::string requestSignature(const std::string host, int port, const std::string msg2 ){
     int m_sock = connectTo(host, port);
     if ( m_sock < 0 ){
-      return NULL;
+      return string();
     }
 
     string msg = util::ToBase64(msg2);
@@ -54,18 +56,24 @@ namespace Cosi{
     VLOG(3) << "Request is: " << request << "\n";
     if ( writeString(m_sock, request) < 0 ){
       VLOG(1) << "Sending error\n";
-      return NULL;
+      close(m_sock);
+      return string();
     }
 
     VLOG(3) << "Waiting for string\n";
 
-    string signature = readString(m_sock);
+    char *reply = readString(m_sock);
+    if ( reply == NULL ){
+      close(m_sock);
+      return string();
+    }
+    string signature = reply;
+    free(reply);
     VLOG(2) << "Got signature " << signature << "\n";
 
     VLOG(3) << "Sending stop\n";
-    if ( writeString(m_sock, json_close) < 0 ){
-      return NULL;
-    }
+    writeString(m_sock, json_close);
+    close(m_sock);
 
     VLOG(2) << "Returning signature " << signature << "\n";
     return signature;
@@ -82,6 +90,7 @@ namespace Cosi{
     // TIME_WAIT - argh
     int on = 1;
     if ( setsockopt ( m_sock, SOL_SOCKET, SO_REUSEADDR, ( const char* ) &on, sizeof ( on ) ) == -1 ){
+      close(m_sock);
       return -1;
     }
 
@@ -98,6 +107,7 @@ namespace Cosi{
     VLOG(2) << "Connected\n";
 
     if ( status < 0 ){
+      close(m_sock);
       return -1;
     }
     return m_sock;
@@ -0,0 +1,536 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "log/etcd_consistent_store.h"
+#include "log/logged_certificate.h"
+#include "util/fake_etcd.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/masterelection.h"
+#include "util/sync_task.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DEFINE_string(backlogs, "1000,10000",
+              "comma-separated list of numbers of pending entries to run the "
+              "workloads with (up to 1000000 is reasonable)");
+DEFINE_string(workloads, "add_pending,get_pending,sequence,cleanup,watch",
+              "comma-separated list of workloads to run, in order, out of "
+              "\"add_pending\", \"get_pending\", \"sequence\", \"cleanup\" and "
+              "\"watch\" (the pending entries are always added first, even if "
+              "\"add_pending\" is not listed)");
+DEFINE_int32(etcd_latency_ms, 1,
+             "simulated latency added to every request made to etcd");
+DEFINE_int32(etcd_jitter_ms, 1,
+             "maximum random delay added to --etcd_latency_ms for each "
+             "request");
+DEFINE_int32(num_threads, 16,
+             "number of threads adding pending entries concurrently");
+DEFINE_int32(num_get_pending, 10,
+             "number of GetPendingEntries() calls for the get_pending "
+             "workload");
+DEFINE_int32(sequence_batch_size, 10000,
+             "maximum number of entries sequenced by each sequencing round");
+DEFINE_int32(num_watch_updates, 100,
+             "number of serving STH updates for the watch workload");
+DEFINE_int32(leaf_size, 1500, "size in bytes of the leaf certificates");
+
+using cert_trans::EtcdConsistentStore;
+using cert_trans::EntryHandle;
+using cert_trans::FakeEtcdClient;
+using cert_trans::LoggedCertificate;
+using cert_trans::MasterElection;
+using cert_trans::ThreadPool;
+using cert_trans::Update;
+using std::atomic;
+using std::condition_variable;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
+using std::mt19937;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::uniform_int_distribution;
+using std::unique_lock;
+using std::unique_ptr;
+using std::unordered_set;
+using std::vector;
+using util::InitCT;
+using util::Task;
+
+namespace {
+
+
+typedef EtcdConsistentStore<LoggedCertificate> Store;
+
+const char kRoot[] = "/bench";
+const char kNodeId[] = "bench_node";
+
+
+// Latencies of the operations of a workload, and how long it took
+// overall.
+class Results {
+ public:
+  Results() : elapsed_(0) {
+  }
+
+  void Add(const nanoseconds& latency) {
+    lock_guard<mutex> lock(mutex_);
+    latencies_.push_back(latency.count());
+  }
+
+  void set_elapsed(const nanoseconds& elapsed) {
+    elapsed_ = elapsed;
+  }
+
+  void Report(int64_t backlog, const string& workload) {
+    std::sort(latencies_.begin(), latencies_.end());
+    const double seconds(elapsed_.count() / 1e9);
+    cout << std::right << std::setw(9) << backlog << "  " << std::left
+         << std::setw(13) << workload << std::right << std::setw(9)
+         << latencies_.size() << std::fixed << std::setprecision(0)
+         << std::setw(11)
+         << (seconds > 0 ? latencies_.size() / seconds : 0)
+         << std::setprecision(2) << std::setw(10) << PercentileMs(0.5)
+         << std::setw(10) << PercentileMs(0.99) << std::setw(10)
+         << PercentileMs(0.999) << "\n";
+    cout.flush();
+  }
+
+ private:
+  // REQUIRES: latencies_ is sorted.
+  double PercentileMs(double percentile) const {
+    if (latencies_.empty()) {
+      return 0;
+    }
+    const size_t index(std::min<size_t>(latencies_.size() * percentile,
+                                        latencies_.size() - 1));
+    return latencies_[index] / 1e6;
+  }
+
+  mutex mutex_;
+  vector<int64_t> latencies_;
+  nanoseconds elapsed_;
+};
+
+
+nanoseconds TimeOp(const function<void()>& op) {
+  const steady_clock::time_point start(steady_clock::now());
+  op();
+  return duration_cast<nanoseconds>(steady_clock::now() - start);
+}
+
+
+// A FakeEtcdClient which delays every request by --etcd_latency_ms,
+// plus up to --etcd_jitter_ms, as if etcd was across a network. Watch
+// notifications are delivered without delay.
+class SlowEtcdClient : public FakeEtcdClient {
+ public:
+  explicit SlowEtcdClient(cert_trans::libevent::Base* base)
+      : FakeEtcdClient(base), base_(CHECK_NOTNULL(base)), rng_(0) {
+  }
+
+  void Get(const Request& req, GetResponse* resp, Task* task) override {
+    Delay(task, [this, req, resp, task]() {
+      FakeEtcdClient::Get(req, resp, task);
+    });
+  }
+
+  void Create(const string& key, const string& value, Response* resp,
+              Task* task) override {
+    Delay(task, [this, key, value, resp, task]() {
+      FakeEtcdClient::Create(key, value, resp, task);
+    });
+  }
+
+  void CreateWithTTL(const string& key, const string& value,
+                     const std::chrono::seconds& ttl, Response* resp,
+                     Task* task) override {
+    Delay(task, [this, key, value, ttl, resp, task]() {
+      FakeEtcdClient::CreateWithTTL(key, value, ttl, resp, task);
+    });
+  }
+
+  void Update(const string& key, const string& value,
+              const int64_t previous_index, Response* resp,
+              Task* task) override {
+    Delay(task, [this, key, value, previous_index, resp, task]() {
+      FakeEtcdClient::Update(key, value, previous_index, resp, task);
+    });
+  }
+
+  void UpdateWithTTL(const string& key, const string& value,
+                     const std::chrono::seconds& ttl,
+                     const int64_t previous_index, Response* resp,
+                     Task* task) override {
+    Delay(task, [this, key, value, ttl, previous_index, resp, task]() {
+      FakeEtcdClient::UpdateWithTTL(key, value, ttl, previous_index, resp,
+                                    task);
+    });
+  }
+
+  void ForceSet(const string& key, const string& value, Response* resp,
+                Task* task) override {
+    Delay(task, [this, key, value, resp, task]() {
+      FakeEtcdClient::ForceSet(key, value, resp, task);
+    });
+  }
+
+  void ForceSetWithTTL(const string& key, const string& value,
+                       const std::chrono::seconds& ttl, Response* resp,
+                       Task* task) override {
+    Delay(task, [this, key, value, ttl, resp, task]() {
+      FakeEtcdClient::ForceSetWithTTL(key, value, ttl, resp, task);
+    });
+  }
+
+  void Delete(const string& key, const int64_t current_index,
+              Task* task) override {
+    Delay(task, [this, key, current_index, task]() {
+      FakeEtcdClient::Delete(key, current_index, task);
+    });
+  }
+
+  void ForceDelete(const string& key, Task* task) override {
+    Delay(task,
+          [this, key, task]() { FakeEtcdClient::ForceDelete(key, task); });
+  }
+
+  void GetStoreStats(StatsResponse* resp, Task* task) override {
+    Delay(task, [this, resp, task]() {
+      FakeEtcdClient::GetStoreStats(resp, task);
+    });
+  }
+
+ private:
+  void Delay(Task* task, const function<void()>& request) {
+    milliseconds delay(FLAGS_etcd_latency_ms);
+    if (FLAGS_etcd_jitter_ms > 0) {
+      lock_guard<mutex> lock(mutex_);
+      delay += milliseconds(
+          uniform_int_distribution<int>(0, FLAGS_etcd_jitter_ms)(rng_));
+    }
+    base_->Delay(delay, task->AddChild([request](Task*) { request(); }));
+  }
+
+  cert_trans::libevent::Base* const base_;
+  mutex mutex_;
+  mt19937 rng_;
+};
+
+
+class Benchmark {
+ public:
+  explicit Benchmark(int64_t backlog);
+  ~Benchmark();
+
+  void Fill(bool report);
+  void Run(const string& workload);
+
+ private:
+  void AddPendingThread(int thread_num, atomic<int64_t>* next,
+                        Results* results);
+  void GetPending();
+  // Returns the number of entries newly sequenced.
+  int64_t SequenceRound();
+  void Sequence();
+  void Cleanup();
+  void Watch();
+  void OnServingSTH(const Update<ct::SignedTreeHead>& update);
+  void SetServingSTH(int64_t tree_size);
+
+  const int64_t backlog_;
+  const shared_ptr<cert_trans::libevent::Base> base_;
+  cert_trans::libevent::EventPumpThread pump_;
+  ThreadPool pool_;
+  SlowEtcdClient etcd_;
+  MasterElection election_;
+  unique_ptr<Store> store_;
+
+  int64_t sth_timestamp_;
+  int64_t tree_size_;
+
+  mutex watch_mutex_;
+  condition_variable watch_cv_;
+  // Timestamp of the latest serving STH seen by the watch.
+  int64_t watched_timestamp_;
+};
+
+
+Benchmark::Benchmark(int64_t backlog)
+    : backlog_(backlog),
+      base_(make_shared<cert_trans::libevent::Base>()),
+      pump_(base_),
+      etcd_(base_.get()),
+      election_(base_, &etcd_, string(kRoot) + "/election", kNodeId),
+      store_(new Store(base_.get(), &pool_, &etcd_, &election_, kRoot,
+                       kNodeId)),
+      sth_timestamp_(0),
+      tree_size_(0),
+      watched_timestamp_(-1) {
+  election_.StartElection();
+  CHECK(election_.WaitToBecomeMaster());
+  SetServingSTH(0);
+}
+
+
+Benchmark::~Benchmark() {
+  store_.reset();
+  election_.StopElection();
+}
+
+
+void Benchmark::SetServingSTH(int64_t tree_size) {
+  ct::SignedTreeHead sth;
+  sth.set_timestamp(++sth_timestamp_);
+  sth.set_tree_size(tree_size);
+  CHECK_EQ(util::Status::OK, store_->SetServingSTH(sth));
+  tree_size_ = tree_size;
+}
+
+
+void Benchmark::Fill(bool report) {
+  CHECK_GT(FLAGS_num_threads, 0);
+  atomic<int64_t> next(0);
+  Results results;
+  vector<thread> threads;
+  const steady_clock::time_point start(steady_clock::now());
+  for (int i = 0; i < FLAGS_num_threads; ++i) {
+    threads.emplace_back(
+        std::bind(&Benchmark::AddPendingThread, this, i, &next, &results));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+
+  if (report) {
+    results.Report(backlog_, "add_pending");
+  }
+}
+
+
+void Benchmark::AddPendingThread(int thread_num, atomic<int64_t>* next,
+                                 Results* results) {
+  mt19937 rng(thread_num);
+  uniform_int_distribution<int> byte(0, 255);
+  for (int64_t i = (*next)++; i < backlog_; i = (*next)++) {
+    LoggedCertificate logged;
+    logged.mutable_sct()->set_timestamp(util::TimeInMilliseconds());
+    logged.mutable_entry()->set_type(ct::X509_ENTRY);
+    string leaf(FLAGS_leaf_size, '\0');
+    for (auto& c : leaf) {
+      c = byte(rng);
+    }
+    logged.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(leaf);
+    results->Add(TimeOp([this, &logged]() {
+      CHECK_EQ(util::Status::OK, store_->AddPendingEntry(&logged));
+    }));
+  }
+}
+
+
+void Benchmark::Run(const string& workload) {
+  if (workload == "add_pending") {
+    // Done by Fill().
+  } else if (workload == "get_pending") {
+    GetPending();
+  } else if (workload == "sequence") {
+    Sequence();
+  } else if (workload == "cleanup") {
+    Cleanup();
+  } else if (workload == "watch") {
+    Watch();
+  } else {
+    LOG(FATAL) << "unknown workload: " << workload;
+  }
+}
+
+
+void Benchmark::GetPending() {
+  Results results;
+  const steady_clock::time_point start(steady_clock::now());
+  for (int i = 0; i < FLAGS_num_get_pending; ++i) {
+    vector<EntryHandle<LoggedCertificate>> entries;
+    results.Add(TimeOp([this, &entries]() {
+      CHECK_EQ(util::Status::OK, store_->GetPendingEntries(&entries));
+    }));
+  }
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  results.Report(backlog_, "get_pending");
+}
+
+
+// Does what TreeSigner::SequenceNewEntries() does with the consistent
+// store: keeps the mappings of the entries still pending, and maps up
+// to --sequence_batch_size new ones.
+int64_t Benchmark::SequenceRound() {
+  const util::StatusOr<int64_t> next_sequence_number(
+      store_->NextAvailableSequenceNumber());
+  CHECK_EQ(util::Status::OK, next_sequence_number.status());
+  int64_t next(next_sequence_number.ValueOrDie());
+
+  EntryHandle<ct::SequenceMapping> mapping;
+  CHECK_EQ(util::Status::OK, store_->GetSequenceMapping(&mapping));
+  unordered_set<string> sequenced_hashes;
+  for (const auto& m : mapping.Entry().mapping()) {
+    sequenced_hashes.insert(m.entry_hash());
+  }
+
+  vector<EntryHandle<LoggedCertificate>> pending_entries;
+  CHECK_EQ(util::Status::OK, store_->GetPendingEntries(&pending_entries));
+  unordered_set<string> pending_hashes;
+  for (const auto& entry : pending_entries) {
+    pending_hashes.insert(entry.Entry().Hash());
+  }
+
+  // Entries which are no longer pending have been cleaned up.
+  google::protobuf::RepeatedPtrField<ct::SequenceMapping::Mapping> kept;
+  for (const auto& m : mapping.Entry().mapping()) {
+    if (pending_hashes.count(m.entry_hash()) > 0) {
+      *kept.Add() = m;
+    }
+  }
+
+  int64_t num_sequenced(0);
+  for (const auto& entry : pending_entries) {
+    if (num_sequenced >= FLAGS_sequence_batch_size) {
+      break;
+    }
+    if (sequenced_hashes.count(entry.Entry().Hash()) > 0) {
+      continue;
+    }
+    ct::SequenceMapping::Mapping* const m(kept.Add());
+    m->set_entry_hash(entry.Entry().Hash());
+    m->set_sequence_number(next++);
+    ++num_sequenced;
+  }
+
+  mapping.MutableEntry()->mutable_mapping()->Swap(&kept);
+  CHECK_EQ(util::Status::OK, store_->UpdateSequenceMapping(&mapping));
+
+  // "Sign" the new entries, so that they can be cleaned up.
+  if (num_sequenced > 0) {
+    SetServingSTH(next);
+  }
+  return num_sequenced;
+}
+
+
+void Benchmark::Sequence() {
+  CHECK_GT(FLAGS_sequence_batch_size, 0);
+  Results results;
+  const steady_clock::time_point start(steady_clock::now());
+  int64_t num_sequenced(0);
+  do {
+    results.Add(
+        TimeOp([this, &num_sequenced]() { num_sequenced = SequenceRound(); }));
+  } while (num_sequenced > 0);
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  results.Report(backlog_, "sequence");
+}
+
+
+void Benchmark::Cleanup() {
+  Results results;
+  const steady_clock::time_point start(steady_clock::now());
+  int64_t num_cleaned(0);
+  do {
+    results.Add(TimeOp([this, &num_cleaned]() {
+      const util::StatusOr<int64_t> cleaned(store_->CleanupOldEntries());
+      CHECK_EQ(util::Status::OK, cleaned.status());
+      num_cleaned = cleaned.ValueOrDie();
+    }));
+  } while (num_cleaned > 0);
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  results.Report(backlog_, "cleanup");
+}
+
+
+void Benchmark::OnServingSTH(const Update<ct::SignedTreeHead>& update) {
+  if (!update.exists_) {
+    return;
+  }
+  lock_guard<mutex> lock(watch_mutex_);
+  watched_timestamp_ =
+      std::max<int64_t>(watched_timestamp_, update.handle_.Entry().timestamp());
+  watch_cv_.notify_all();
+}
+
+
+// Measures how long it takes for a new serving STH to be written and
+// seen by a watcher.
+void Benchmark::Watch() {
+  util::SyncTask watch_task(&pool_);
+  store_->WatchServingSTH(std::bind(&Benchmark::OnServingSTH, this,
+                                    std::placeholders::_1),
+                          watch_task.task());
+
+  Results results;
+  const steady_clock::time_point start(steady_clock::now());
+  for (int i = 0; i < FLAGS_num_watch_updates; ++i) {
+    results.Add(TimeOp([this]() {
+      SetServingSTH(tree_size_);
+      unique_lock<mutex> lock(watch_mutex_);
+      watch_cv_.wait(lock,
+                     [this]() { return watched_timestamp_ >= sth_timestamp_; });
+    }));
+  }
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  results.Report(backlog_, "watch");
+
+  watch_task.Cancel();
+  watch_task.Wait();
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  InitCT(&argc, &argv);
+  CHECK_GE(FLAGS_etcd_latency_ms, 0);
+  CHECK_GE(FLAGS_etcd_jitter_ms, 0);
+
+  const vector<string> workloads(util::split(FLAGS_workloads));
+  const bool report_add(std::find(workloads.begin(), workloads.end(),
+                                  "add_pending") != workloads.end());
+
+  cout << std::right << std::setw(9) << "backlog"
+       << "  " << std::left << std::setw(13) << "workload" << std::right
+       << std::setw(9) << "ops" << std::setw(11) << "ops/s" << std::setw(10)
+       << "p50 ms" << std::setw(10) << "p99 ms" << std::setw(10)
+       << "p999 ms\n";
+
+  for (const auto& backlog : util::split(FLAGS_backlogs)) {
+    Benchmark benchmark(std::stoll(backlog));
+    benchmark.Fill(report_add);
+    for (const auto& workload : workloads) {
+      benchmark.Run(workload);
+    }
+  }
+
+  return 0;
+}
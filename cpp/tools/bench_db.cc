@@ -0,0 +1,448 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ftw.h>
+#include <functional>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#include "log/database.h"
+#include "log/file_db.h"
+#include "log/file_storage.h"
+#include "log/leveldb_db.h"
+#include "log/logged_certificate.h"
+#include "log/sqlite_db.h"
+#include "util/init.h"
+#include "util/util.h"
+
+DEFINE_string(backends, "file,sqlite,leveldb",
+              "comma-separated list of database backends to benchmark, out "
+              "of \"file\", \"sqlite\" and \"leveldb\"");
+DEFINE_string(workloads,
+              "append,lookup_index,lookup_hash_hit,lookup_hash_miss,scan,"
+              "mixed",
+              "comma-separated list of workloads to run, in order, out of "
+              "\"append\", \"lookup_index\", \"lookup_hash_hit\", "
+              "\"lookup_hash_miss\", \"scan\" and \"mixed\" (the database is "
+              "always filled first, even if \"append\" is not listed)");
+DEFINE_string(db_dir, "",
+              "directory in which to create the databases, a temporary "
+              "directory is used (and removed afterward) if empty");
+DEFINE_int32(num_entries, 10000,
+             "number of entries appended to each database, which the read "
+             "workloads then use");
+DEFINE_int32(num_ops, 10000, "number of operations per read workload");
+DEFINE_int32(num_threads, 4, "number of threads for the mixed workload");
+DEFINE_double(write_fraction, 0.1,
+              "fraction of the operations of the mixed workload that are "
+              "appends, the rest being LookupByIndex");
+DEFINE_int32(scan_length, 100, "number of entries read by each scan");
+DEFINE_int32(leaf_size, 1500, "size in bytes of the leaf certificates");
+DEFINE_int32(chain_length, 2, "number of certificates in each chain");
+DEFINE_int32(distinct_chain_certs, 50,
+             "number of distinct chain certificates the chains are made of");
+DEFINE_int32(chain_cert_size, 1200,
+             "size in bytes of the chain certificates");
+
+using cert_trans::FileStorage;
+using cert_trans::LoggedCertificate;
+using std::atomic;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::function;
+using std::mt19937;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::uniform_int_distribution;
+using std::unique_ptr;
+using std::vector;
+using util::InitCT;
+
+namespace {
+
+
+typedef Database<LoggedCertificate> DB;
+
+const unsigned kCertStorageDepth = 3;
+const unsigned kTreeStorageDepth = 8;
+
+
+// Latencies of the operations of a workload, and how long it took
+// overall.
+class Results {
+ public:
+  Results() : elapsed_(0) {
+  }
+
+  void Add(const nanoseconds& latency) {
+    latencies_.push_back(latency.count());
+  }
+
+  void Merge(const Results& other) {
+    latencies_.insert(latencies_.end(), other.latencies_.begin(),
+                      other.latencies_.end());
+  }
+
+  void set_elapsed(const nanoseconds& elapsed) {
+    elapsed_ = elapsed;
+  }
+
+  void Report(const string& backend, const string& workload) {
+    std::sort(latencies_.begin(), latencies_.end());
+    const double seconds(elapsed_.count() / 1e9);
+    cout << std::left << std::setw(8) << backend << std::setw(18) << workload
+         << std::right << std::setw(10) << latencies_.size() << std::fixed
+         << std::setprecision(0) << std::setw(12)
+         << (seconds > 0 ? latencies_.size() / seconds : 0)
+         << std::setprecision(1) << std::setw(10) << PercentileUs(0.5)
+         << std::setw(10) << PercentileUs(0.99) << std::setw(10)
+         << PercentileUs(0.999) << "\n";
+  }
+
+ private:
+  // REQUIRES: latencies_ is sorted.
+  double PercentileUs(double percentile) const {
+    if (latencies_.empty()) {
+      return 0;
+    }
+    const size_t index(std::min<size_t>(latencies_.size() * percentile,
+                                        latencies_.size() - 1));
+    return latencies_[index] / 1e3;
+  }
+
+  vector<int64_t> latencies_;
+  nanoseconds elapsed_;
+};
+
+
+nanoseconds TimeOp(const function<void()>& op) {
+  const steady_clock::time_point start(steady_clock::now());
+  op();
+  return duration_cast<nanoseconds>(steady_clock::now() - start);
+}
+
+
+string RandomBytes(mt19937* rng, size_t size) {
+  uniform_int_distribution<int> byte(0, 255);
+  string retval(size, '\0');
+  for (size_t i = 0; i < size; ++i) {
+    retval[i] = byte(*rng);
+  }
+  return retval;
+}
+
+
+// Creates entries that look a bit like real ones: a unique leaf
+// certificate, and a chain made of a few widely shared certificates.
+class EntryFactory {
+ public:
+  EntryFactory() {
+    mt19937 rng(0);
+    for (int i = 0; i < FLAGS_distinct_chain_certs; ++i) {
+      chain_certs_.push_back(RandomBytes(&rng, FLAGS_chain_cert_size));
+    }
+  }
+
+  void Create(int64_t sequence_number, mt19937* rng,
+              LoggedCertificate* logged) const {
+    logged->Clear();
+    logged->set_sequence_number(sequence_number);
+    logged->mutable_sct()->set_version(ct::V1);
+    logged->mutable_sct()->set_timestamp(util::TimeInMilliseconds());
+    logged->mutable_sct()->mutable_signature()->set_signature(
+        RandomBytes(rng, 72));
+    logged->mutable_entry()->set_type(ct::X509_ENTRY);
+    ct::X509ChainEntry* const x509_entry(
+        logged->mutable_entry()->mutable_x509_entry());
+    x509_entry->set_leaf_certificate(RandomBytes(rng, FLAGS_leaf_size));
+    if (!chain_certs_.empty()) {
+      uniform_int_distribution<size_t> pick(0, chain_certs_.size() - 1);
+      for (int i = 0; i < FLAGS_chain_length; ++i) {
+        x509_entry->add_certificate_chain(chain_certs_[pick(*rng)]);
+      }
+    }
+  }
+
+ private:
+  vector<string> chain_certs_;
+};
+
+
+int64_t total_size;
+
+
+int AddFileSize(const char* path, const struct stat* sb, int typeflag,
+                struct FTW* ftwbuf) {
+  if (typeflag == FTW_F) {
+    total_size += sb->st_size;
+  }
+  return 0;
+}
+
+
+int64_t DiskUsage(const string& path) {
+  total_size = 0;
+  CHECK_EQ(0, nftw(path.c_str(), AddFileSize, 16, FTW_PHYS));
+  return total_size;
+}
+
+
+int RemoveFile(const char* path, const struct stat* sb, int typeflag,
+               struct FTW* ftwbuf) {
+  return remove(path);
+}
+
+
+void RemoveDirectory(const string& path) {
+  CHECK_EQ(0, nftw(path.c_str(), RemoveFile, 16, FTW_DEPTH | FTW_PHYS));
+}
+
+
+unique_ptr<DB> OpenDatabase(const string& backend, const string& dir) {
+  if (backend == "file") {
+    const string certs_dir(dir + "/certs");
+    const string tree_dir(dir + "/tree");
+    const string meta_dir(dir + "/meta");
+    CHECK_ERR(mkdir(certs_dir.c_str(), 0700));
+    CHECK_ERR(mkdir(tree_dir.c_str(), 0700));
+    CHECK_ERR(mkdir(meta_dir.c_str(), 0700));
+    return unique_ptr<DB>(new FileDB<LoggedCertificate>(
+        new FileStorage(certs_dir, kCertStorageDepth),
+        new FileStorage(tree_dir, kTreeStorageDepth),
+        new FileStorage(meta_dir, 0)));
+  } else if (backend == "sqlite") {
+    return unique_ptr<DB>(new SQLiteDB<LoggedCertificate>(dir + "/sqlite"));
+  } else if (backend == "leveldb") {
+    return unique_ptr<DB>(new LevelDB<LoggedCertificate>(dir + "/leveldb"));
+  }
+
+  LOG(FATAL) << "unknown backend: " << backend;
+  return nullptr;
+}
+
+
+class Benchmark {
+ public:
+  Benchmark(const string& backend, DB* db)
+      : backend_(backend), db_(CHECK_NOTNULL(db)), rng_(1) {
+  }
+
+  void Fill(bool report);
+  void Run(const string& workload);
+
+ private:
+  void LookupByIndex();
+  void LookupByHash(bool hit);
+  void Scan();
+  void Mixed();
+  void MixedThread(int thread_num, int num_ops, atomic<int64_t>* next_seq,
+                   Results* results);
+
+  const string backend_;
+  DB* const db_;
+  const EntryFactory factory_;
+  mt19937 rng_;
+  vector<string> hashes_;
+};
+
+
+void Benchmark::Fill(bool report) {
+  Results results;
+  LoggedCertificate logged;
+  const steady_clock::time_point start(steady_clock::now());
+  for (int64_t i = 0; i < FLAGS_num_entries; ++i) {
+    factory_.Create(i, &rng_, &logged);
+    hashes_.push_back(logged.Hash());
+    results.Add(TimeOp([this, &logged]() {
+      CHECK_EQ(DB::OK, db_->CreateSequencedEntry(logged));
+    }));
+  }
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+
+  if (report) {
+    results.Report(backend_, "append");
+  }
+}
+
+
+void Benchmark::Run(const string& workload) {
+  if (workload == "append") {
+    // Done by Fill().
+  } else if (workload == "lookup_index") {
+    LookupByIndex();
+  } else if (workload == "lookup_hash_hit") {
+    LookupByHash(true);
+  } else if (workload == "lookup_hash_miss") {
+    LookupByHash(false);
+  } else if (workload == "scan") {
+    Scan();
+  } else if (workload == "mixed") {
+    Mixed();
+  } else {
+    LOG(FATAL) << "unknown workload: " << workload;
+  }
+}
+
+
+void Benchmark::LookupByIndex() {
+  uniform_int_distribution<int64_t> index(0, FLAGS_num_entries - 1);
+  Results results;
+  LoggedCertificate logged;
+  const steady_clock::time_point start(steady_clock::now());
+  for (int i = 0; i < FLAGS_num_ops; ++i) {
+    const int64_t seq(index(rng_));
+    results.Add(TimeOp([this, seq, &logged]() {
+      CHECK_EQ(DB::LOOKUP_OK, db_->LookupByIndex(seq, &logged));
+    }));
+  }
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  results.Report(backend_, "lookup_index");
+}
+
+
+void Benchmark::LookupByHash(bool hit) {
+  uniform_int_distribution<size_t> index(0, hashes_.size() - 1);
+  Results results;
+  LoggedCertificate logged;
+  const steady_clock::time_point start(steady_clock::now());
+  for (int i = 0; i < FLAGS_num_ops; ++i) {
+    const string hash(hit ? hashes_[index(rng_)] : RandomBytes(&rng_, 32));
+    const DB::LookupResult expected(hit ? DB::LOOKUP_OK : DB::NOT_FOUND);
+    results.Add(TimeOp([this, &hash, expected, &logged]() {
+      CHECK_EQ(expected, db_->LookupByHash(hash, &logged));
+    }));
+  }
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  results.Report(backend_, hit ? "lookup_hash_hit" : "lookup_hash_miss");
+}
+
+
+void Benchmark::Scan() {
+  const int64_t max_start(
+      std::max<int64_t>(0, FLAGS_num_entries - FLAGS_scan_length));
+  uniform_int_distribution<int64_t> index(0, max_start);
+  Results results;
+  const int num_scans(std::max(1, FLAGS_num_ops / FLAGS_scan_length));
+  const steady_clock::time_point start(steady_clock::now());
+  for (int i = 0; i < num_scans; ++i) {
+    const int64_t first(index(rng_));
+    results.Add(TimeOp([this, first]() {
+      unique_ptr<DB::Iterator> it(db_->ScanEntries(first));
+      LoggedCertificate logged;
+      for (int j = 0; j < FLAGS_scan_length && it->GetNextEntry(&logged);
+           ++j) {
+      }
+    }));
+  }
+  results.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  results.Report(backend_, "scan");
+}
+
+
+void Benchmark::Mixed() {
+  CHECK_GT(FLAGS_num_threads, 0);
+  // Appends continue where the last ones left off.
+  atomic<int64_t> next_seq(db_->TreeSize());
+  vector<Results> results(FLAGS_num_threads);
+  vector<thread> threads;
+  const steady_clock::time_point start(steady_clock::now());
+  for (int i = 0; i < FLAGS_num_threads; ++i) {
+    threads.emplace_back(std::bind(&Benchmark::MixedThread, this, i,
+                                   FLAGS_num_ops / FLAGS_num_threads,
+                                   &next_seq, &results[i]));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  Results total;
+  total.set_elapsed(duration_cast<nanoseconds>(steady_clock::now() - start));
+  for (const auto& r : results) {
+    total.Merge(r);
+  }
+  total.Report(backend_, "mixed/" + to_string(FLAGS_num_threads));
+}
+
+
+void Benchmark::MixedThread(int thread_num, int num_ops,
+                            atomic<int64_t>* next_seq, Results* results) {
+  mt19937 rng(thread_num + 100);
+  std::bernoulli_distribution write(FLAGS_write_fraction);
+  uniform_int_distribution<int64_t> index(0, FLAGS_num_entries - 1);
+  LoggedCertificate logged;
+  for (int i = 0; i < num_ops; ++i) {
+    if (write(rng)) {
+      factory_.Create((*next_seq)++, &rng, &logged);
+      results->Add(TimeOp([this, &logged]() {
+        CHECK_EQ(DB::OK, db_->CreateSequencedEntry(logged));
+      }));
+    } else {
+      const int64_t seq(index(rng));
+      results->Add(TimeOp([this, seq, &logged]() {
+        CHECK_EQ(DB::LOOKUP_OK, db_->LookupByIndex(seq, &logged));
+      }));
+    }
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  InitCT(&argc, &argv);
+  CHECK_GT(FLAGS_num_entries, 0);
+  CHECK_GT(FLAGS_num_ops, 0);
+  CHECK_GT(FLAGS_scan_length, 0);
+
+  const bool temporary_dir(FLAGS_db_dir.empty());
+  const string base_dir(
+      temporary_dir ? util::CreateTemporaryDirectory("/tmp/bench_dbXXXXXX")
+                    : FLAGS_db_dir);
+  CHECK(!base_dir.empty()) << "could not create a temporary directory";
+
+  const vector<string> workloads(util::split(FLAGS_workloads));
+  const bool report_append(std::find(workloads.begin(), workloads.end(),
+                                     "append") != workloads.end());
+
+  cout << std::left << std::setw(8) << "backend" << std::setw(18)
+       << "workload" << std::right << std::setw(10) << "ops" << std::setw(12)
+       << "ops/s" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+       << std::setw(10) << "p999 us\n";
+
+  for (const auto& backend : util::split(FLAGS_backends)) {
+    const string dir(base_dir + "/" + backend);
+    CHECK_ERR(mkdir(dir.c_str(), 0700));
+    {
+      unique_ptr<DB> db(OpenDatabase(backend, dir));
+      Benchmark benchmark(backend, db.get());
+      benchmark.Fill(report_append);
+      for (const auto& workload : workloads) {
+        benchmark.Run(workload);
+      }
+    }
+
+    // Measured once the database is closed, so everything is flushed.
+    cout << backend << " disk usage: " << DiskUsage(dir) << " bytes\n";
+    cout.flush();
+  }
+
+  if (temporary_dir) {
+    RemoveDirectory(base_dir);
+  }
+
+  return 0;
+}
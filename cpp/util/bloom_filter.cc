@@ -0,0 +1,74 @@
+#include "util/bloom_filter.h"
+
+#include <algorithm>
+#include <functional>
+#include <glog/logging.h>
+
+using std::atomic;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+// From the analysis of Bloom filters, the optimal number of probes is
+// bits_per_key * ln(2). More probes make for slower lookups, for
+// little benefit.
+int NumProbes(int bits_per_key) {
+  return std::min(16, std::max(1, static_cast<int>(bits_per_key * 0.69)));
+}
+
+
+}  // namespace
+
+
+const size_t BloomFilter::kBitsPerBlock;
+const size_t BloomFilter::kWordsPerBlock;
+
+
+BloomFilter::BloomFilter(size_t num_keys, int bits_per_key)
+    : num_keys_(num_keys),
+      num_probes_(NumProbes(bits_per_key)),
+      num_blocks_(std::max<size_t>(
+          1, (num_keys * bits_per_key + kBitsPerBlock - 1) / kBitsPerBlock)),
+      words_(new atomic<uint64_t>[num_blocks_ * kWordsPerBlock]) {
+  CHECK_GT(bits_per_key, 0);
+  for (size_t i = 0; i < num_blocks_ * kWordsPerBlock; ++i) {
+    words_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+
+void BloomFilter::Insert(const string& key) {
+  const uint64_t hash(std::hash<string>()(key));
+  atomic<uint64_t>* const block(&words_[(hash % num_blocks_) *
+                                        kWordsPerBlock]);
+  // Derive the probes from a second hash, with double hashing.
+  uint64_t probe(hash * 0x9e3779b97f4a7c15ULL);
+  const uint64_t delta((probe >> 33) | 1);
+  for (int i = 0; i < num_probes_; ++i, probe += delta) {
+    const size_t bit(probe % kBitsPerBlock);
+    block[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_relaxed);
+  }
+}
+
+
+bool BloomFilter::MayContain(const string& key) const {
+  const uint64_t hash(std::hash<string>()(key));
+  const atomic<uint64_t>* const block(&words_[(hash % num_blocks_) *
+                                              kWordsPerBlock]);
+  uint64_t probe(hash * 0x9e3779b97f4a7c15ULL);
+  const uint64_t delta((probe >> 33) | 1);
+  for (int i = 0; i < num_probes_; ++i, probe += delta) {
+    const size_t bit(probe % kBitsPerBlock);
+    if (!(block[bit / 64].load(std::memory_order_relaxed) &
+          (1ULL << (bit % 64)))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,50 @@
+#ifndef CERT_TRANS_UTIL_BLOOM_FILTER_H_
+#define CERT_TRANS_UTIL_BLOOM_FILTER_H_
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// A blocked Bloom filter: all the bits for a given key are in the
+// same 64-byte block, so that a lookup costs at most one cache miss.
+// This is a bit less accurate than a classic Bloom filter with the
+// same number of bits per key.
+//
+// Insert() and MayContain() can be called concurrently.
+class BloomFilter {
+ public:
+  // Sizes the filter for "num_keys" keys. More can be inserted, at the
+  // cost of more false positives.
+  BloomFilter(size_t num_keys, int bits_per_key);
+
+  void Insert(const std::string& key);
+
+  // Returns false if "key" was definitely never inserted.
+  bool MayContain(const std::string& key) const;
+
+  size_t num_keys() const {
+    return num_keys_;
+  }
+
+ private:
+  static const size_t kBitsPerBlock = 512;
+  static const size_t kWordsPerBlock = kBitsPerBlock / 64;
+
+  const size_t num_keys_;
+  const int num_probes_;
+  const size_t num_blocks_;
+  const std::unique_ptr<std::atomic<uint64_t>[]> words_;
+
+  DISALLOW_COPY_AND_ASSIGN(BloomFilter);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_BLOOM_FILTER_H_
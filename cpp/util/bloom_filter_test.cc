@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "util/bloom_filter.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+using cert_trans::BloomFilter;
+using std::string;
+using std::vector;
+
+namespace {
+
+
+const int kNumKeys = 10000;
+const int kBitsPerKey = 10;
+
+
+TEST(BloomFilterTest, NoFalseNegatives) {
+  BloomFilter filter(kNumKeys, kBitsPerKey);
+  vector<string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back(util::RandomString(32, 32));
+    filter.Insert(keys.back());
+  }
+
+  for (const auto& key : keys) {
+    EXPECT_TRUE(filter.MayContain(key));
+  }
+}
+
+
+TEST(BloomFilterTest, FalsePositiveRate) {
+  BloomFilter filter(kNumKeys, kBitsPerKey);
+  for (int i = 0; i < kNumKeys; ++i) {
+    filter.Insert(util::RandomString(32, 32));
+  }
+
+  int false_positives(0);
+  for (int i = 0; i < kNumKeys; ++i) {
+    if (filter.MayContain(util::RandomString(33, 33))) {
+      ++false_positives;
+    }
+  }
+  // About 1% is expected with 10 bits per key, leave some slack for
+  // the blocking.
+  EXPECT_LT(false_positives, kNumKeys * 3 / 100);
+}
+
+
+TEST(BloomFilterTest, Empty) {
+  BloomFilter filter(0, kBitsPerKey);
+  EXPECT_FALSE(filter.MayContain("foo"));
+  filter.Insert("foo");
+  EXPECT_TRUE(filter.MayContain("foo"));
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
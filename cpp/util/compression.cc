@@ -0,0 +1,224 @@
+#include "util/compression.h"
+
+#include <algorithm>
+#include <cstring>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <zlib.h>
+
+using std::make_pair;
+using std::min;
+using std::pair;
+using std::string;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+// Negative window bits select raw DEFLATE, without the zlib header
+// and checksum, which would be a significant overhead on small
+// records.
+const int kWindowBits = -15;
+const int kMemLevel = 8;
+const size_t kInflateChunkSize = 4096;
+
+// Length of the substrings counted when training a dictionary.
+const size_t kGramSize = 8;
+
+
+uint64_t GramAt(const string& sample, size_t pos) {
+  uint64_t gram;
+  static_assert(sizeof(gram) == kGramSize, "unexpected gram size");
+  memcpy(&gram, sample.data() + pos, sizeof(gram));
+  return gram;
+}
+
+
+}  // namespace
+
+
+const size_t DictionaryCompressor::kMaxDictionarySize = 32768;
+
+
+DictionaryCompressor::DictionaryCompressor(const string& dictionary)
+    : dictionary_(dictionary.size() > kMaxDictionarySize
+                      ? dictionary.substr(dictionary.size() -
+                                          kMaxDictionarySize)
+                      : dictionary) {
+}
+
+
+bool DictionaryCompressor::Compress(const string& data,
+                                    string* compressed) const {
+  CHECK_NOTNULL(compressed);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, kWindowBits,
+                   kMemLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+    LOG(WARNING) << "deflateInit2 failed: "
+                 << (stream.msg ? stream.msg : "unknown error");
+    return false;
+  }
+
+  bool ok(true);
+  if (!dictionary_.empty() &&
+      deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(
+                                        dictionary_.data()),
+                           dictionary_.size()) != Z_OK) {
+    LOG(WARNING) << "deflateSetDictionary failed";
+    ok = false;
+  }
+
+  if (ok) {
+    compressed->resize(deflateBound(&stream, data.size()));
+    stream.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&(*compressed)[0]);
+    stream.avail_out = compressed->size();
+    // deflateBound() guarantees that a single call is enough.
+    if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+      compressed->resize(stream.total_out);
+    } else {
+      LOG(WARNING) << "deflate failed: "
+                   << (stream.msg ? stream.msg : "unknown error");
+      ok = false;
+    }
+  }
+
+  deflateEnd(&stream);
+  return ok;
+}
+
+
+bool DictionaryCompressor::Decompress(const string& compressed,
+                                      string* data) const {
+  CHECK_NOTNULL(data);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, kWindowBits) != Z_OK) {
+    LOG(WARNING) << "inflateInit2 failed: "
+                 << (stream.msg ? stream.msg : "unknown error");
+    return false;
+  }
+
+  // For raw DEFLATE, the dictionary has to be set up front, there is
+  // no Z_NEED_DICT to tell us about it.
+  if (!dictionary_.empty() &&
+      inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(
+                                        dictionary_.data()),
+                           dictionary_.size()) != Z_OK) {
+    LOG(WARNING) << "inflateSetDictionary failed";
+    inflateEnd(&stream);
+    return false;
+  }
+
+  data->clear();
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+  stream.avail_in = compressed.size();
+  int ret(Z_OK);
+  while (ret == Z_OK) {
+    const size_t offset(data->size());
+    data->resize(offset + kInflateChunkSize);
+    stream.next_out = reinterpret_cast<Bytef*>(&(*data)[offset]);
+    stream.avail_out = kInflateChunkSize;
+    ret = inflate(&stream, Z_NO_FLUSH);
+    data->resize(offset + kInflateChunkSize - stream.avail_out);
+  }
+  inflateEnd(&stream);
+
+  // Running out of input before the end of the stream shows up as
+  // Z_BUF_ERROR, which means the data was truncated.
+  if (ret != Z_STREAM_END || stream.avail_in != 0) {
+    VLOG(1) << "inflate failed: " << ret;
+    return false;
+  }
+
+  return true;
+}
+
+
+string TrainCompressionDictionary(const vector<string>& samples,
+                                  size_t max_size) {
+  max_size = min(max_size, DictionaryCompressor::kMaxDictionarySize);
+
+  // Count in how many samples each gram appears.
+  unordered_map<uint64_t, int> sample_count;
+  for (const auto& sample : samples) {
+    unordered_set<uint64_t> seen;
+    for (size_t i = 0; i + kGramSize <= sample.size(); ++i) {
+      const uint64_t gram(GramAt(sample, i));
+      if (seen.insert(gram).second) {
+        ++sample_count[gram];
+      }
+    }
+  }
+
+  // Keep the longest runs of grams found in at least a quarter of the
+  // samples, along with how many samples they are (at least) found in.
+  const int threshold(std::max<int>(2, samples.size() / 4));
+  unordered_map<string, int> segments;
+  for (const auto& sample : samples) {
+    size_t i(0);
+    while (i + kGramSize <= sample.size()) {
+      int count(sample_count[GramAt(sample, i)]);
+      if (count < threshold) {
+        ++i;
+        continue;
+      }
+      const size_t start(i);
+      int run_count(count);
+      while (i + kGramSize <= sample.size() &&
+             (count = sample_count[GramAt(sample, i)]) >= threshold) {
+        run_count = min(run_count, count);
+        ++i;
+      }
+      int& segment_count(
+          segments[sample.substr(start, i - start + kGramSize - 1)]);
+      segment_count = std::max(segment_count, run_count);
+    }
+  }
+
+  // Most common (and then longest) first.
+  vector<pair<int, string>> sorted;
+  sorted.reserve(segments.size());
+  for (const auto& segment : segments) {
+    sorted.emplace_back(make_pair(segment.second, segment.first));
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const pair<int, string>& a, const pair<int, string>& b) {
+              if (a.first != b.first) {
+                return a.first > b.first;
+              }
+              if (a.second.size() != b.second.size()) {
+                return a.second.size() > b.second.size();
+              }
+              return a.second < b.second;
+            });
+
+  vector<const string*> selected;
+  size_t size(0);
+  for (const auto& segment : sorted) {
+    if (size + segment.second.size() <= max_size) {
+      selected.push_back(&segment.second);
+      size += segment.second.size();
+    }
+  }
+
+  string dictionary;
+  dictionary.reserve(size);
+  for (auto it = selected.rbegin(); it != selected.rend(); ++it) {
+    dictionary.append(**it);
+  }
+
+  return dictionary;
+}
+
+
+}  // namespace cert_trans
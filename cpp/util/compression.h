@@ -0,0 +1,51 @@
+#ifndef CERT_TRANS_UTIL_COMPRESSION_H_
+#define CERT_TRANS_UTIL_COMPRESSION_H_
+
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Compresses small records (such as serialized log entries) one at a
+// time with raw DEFLATE, using a preset dictionary. On its own, each
+// record is too short to compress well, but records of the same kind
+// share a lot of content with a good dictionary.
+class DictionaryCompressor {
+ public:
+  // DEFLATE cannot refer back further than this, so larger
+  // dictionaries are pointless.
+  static const size_t kMaxDictionarySize;
+
+  explicit DictionaryCompressor(const std::string& dictionary);
+
+  const std::string& dictionary() const {
+    return dictionary_;
+  }
+
+  bool Compress(const std::string& data, std::string* compressed) const;
+
+  // Fails if "compressed" is corrupt, or was compressed with a
+  // different dictionary.
+  bool Decompress(const std::string& compressed, std::string* data) const;
+
+ private:
+  const std::string dictionary_;
+
+  DISALLOW_COPY_AND_ASSIGN(DictionaryCompressor);
+};
+
+
+// Builds a dictionary of at most "max_size" bytes out of the byte
+// strings found in a good proportion of the "samples". The most
+// common ones are placed at the end of the dictionary, where they are
+// the cheapest to refer to.
+std::string TrainCompressionDictionary(const std::vector<std::string>& samples,
+                                       size_t max_size);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_COMPRESSION_H_
@@ -0,0 +1,109 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "util/compression.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+using cert_trans::DictionaryCompressor;
+using cert_trans::TrainCompressionDictionary;
+using std::string;
+using std::vector;
+
+namespace {
+
+
+const char kCommon[] =
+    "CN=Example Intermediate CA,O=Example Org,C=US,"
+    "http://crl.example.com/intermediate.crl";
+
+
+vector<string> Samples(int count) {
+  vector<string> samples;
+  for (int i = 0; i < count; ++i) {
+    samples.push_back(kCommon + util::RandomString(20, 40) + kCommon);
+  }
+  return samples;
+}
+
+
+TEST(CompressionTest, RoundTrip) {
+  const DictionaryCompressor compressor(kCommon);
+  for (const auto& sample : Samples(10)) {
+    string compressed, decompressed;
+    ASSERT_TRUE(compressor.Compress(sample, &compressed));
+    EXPECT_LT(compressed.size(), sample.size());
+    ASSERT_TRUE(compressor.Decompress(compressed, &decompressed));
+    EXPECT_EQ(sample, decompressed);
+  }
+}
+
+
+TEST(CompressionTest, RoundTripWithoutDictionary) {
+  const DictionaryCompressor compressor("");
+  const string data(util::RandomString(10000, 20000));
+  string compressed, decompressed;
+  ASSERT_TRUE(compressor.Compress(data, &compressed));
+  ASSERT_TRUE(compressor.Decompress(compressed, &decompressed));
+  EXPECT_EQ(data, decompressed);
+}
+
+
+TEST(CompressionTest, DictionaryHelps) {
+  const string sample(Samples(1)[0]);
+  string with_dictionary, without_dictionary;
+  ASSERT_TRUE(DictionaryCompressor(kCommon).Compress(sample, &with_dictionary));
+  ASSERT_TRUE(DictionaryCompressor("").Compress(sample, &without_dictionary));
+  EXPECT_LT(with_dictionary.size(), without_dictionary.size());
+}
+
+
+TEST(CompressionTest, WrongDictionary) {
+  const string sample(Samples(1)[0]);
+  string compressed, decompressed;
+  ASSERT_TRUE(DictionaryCompressor(kCommon).Compress(sample, &compressed));
+  EXPECT_FALSE(DictionaryCompressor("").Decompress(compressed, &decompressed));
+}
+
+
+TEST(CompressionTest, Truncated) {
+  const DictionaryCompressor compressor(kCommon);
+  string compressed, decompressed;
+  ASSERT_TRUE(compressor.Compress(Samples(1)[0], &compressed));
+  compressed.resize(compressed.size() - 1);
+  EXPECT_FALSE(compressor.Decompress(compressed, &decompressed));
+}
+
+
+TEST(CompressionTest, TrainDictionary) {
+  const string dictionary(TrainCompressionDictionary(Samples(100), 1024));
+  EXPECT_LE(dictionary.size(), 1024U);
+  EXPECT_NE(string::npos, dictionary.find("Example Intermediate CA"));
+
+  const DictionaryCompressor compressor(dictionary);
+  const string sample(Samples(1)[0]);
+  string compressed, decompressed;
+  ASSERT_TRUE(compressor.Compress(sample, &compressed));
+  EXPECT_LT(compressed.size(), sample.size() / 2);
+  ASSERT_TRUE(compressor.Decompress(compressed, &decompressed));
+  EXPECT_EQ(sample, decompressed);
+}
+
+
+TEST(CompressionTest, TrainDictionaryNothingInCommon) {
+  vector<string> samples;
+  for (int i = 0; i < 10; ++i) {
+    samples.push_back(string(100, 'a' + i));
+  }
+  EXPECT_EQ("", TrainCompressionDictionary(samples, 1024));
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -5,6 +5,8 @@
 #include <glog/logging.h>
 #include <utility>
 
+#include "monitoring/gauge.h"
+#include "monitoring/latency.h"
 #include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
 #include "util/statusor.h"
@@ -13,7 +15,9 @@ namespace libevent = cert_trans::libevent;
 
 using std::atoll;
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::ctime;
 using std::list;
@@ -31,6 +35,7 @@ using std::stoi;
 using std::string;
 using std::time_t;
 using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::Executor;
@@ -47,6 +52,10 @@ DEFINE_bool(etcd_quorum, true, "Add quorum=true param to all requests. "
             "Do not turn this off unless you *know* what you're doing.");
 DEFINE_int32(etcd_connection_timeout_seconds, 10,
              "Number of seconds after which to timeout etcd connections.");
+DEFINE_int32(etcd_max_inflight_requests, 64,
+             "Maximum number of requests (other than the long polls of "
+             "watches) sent to etcd at the same time, the others wait in a "
+             "queue. Zero means no limit.");
 
 namespace cert_trans {
 
@@ -66,6 +75,21 @@ const char kStatsSpace[] = "/v2/stats";
 const char kStoreStatsKey[] = "/store";
 
 
+static Gauge<>* etcd_inflight_requests =
+    Gauge<>::New("etcd_inflight_requests",
+                 "Number of requests to etcd in flight, excluding watches.");
+
+static Gauge<>* etcd_queued_requests =
+    Gauge<>::New("etcd_queued_requests",
+                 "Number of requests to etcd waiting for room in the "
+                 "in-flight window.");
+
+static Latency<milliseconds> etcd_request_queue_delay_ms(
+    "etcd_request_queue_delay_ms",
+    "Time spent by requests to etcd waiting for room in the in-flight "
+    "window, for those which had to wait.");
+
+
 util::error::Code ErrorCodeForHttpResponseCode(int response_code) {
   switch (response_code) {
     case 200:
@@ -397,7 +421,9 @@ struct EtcdClient::RequestState {
                const HostPortPair& host_port, GenericResponse* gen_resp,
                Task* parent_task)
       : gen_resp_(CHECK_NOTNULL(gen_resp)),
-        parent_task_(CHECK_NOTNULL(parent_task)) {
+        parent_task_(CHECK_NOTNULL(parent_task)),
+        long_poll_(params.find("wait") != params.end()),
+        holds_slot_(false) {
     CHECK(!key.empty());
     CHECK_EQ(key[0], '/');
 
@@ -433,6 +459,7 @@ struct EtcdClient::RequestState {
   void SetHostPort(const HostPortPair& host_port) {
     CHECK(!host_port.first.empty());
     CHECK_GT(host_port.second, 0);
+    host_port_ = host_port;
     req_.url.SetProtocol("http");
     req_.url.SetHost(host_port.first);
     req_.url.SetPort(host_port.second);
@@ -440,6 +467,14 @@ struct EtcdClient::RequestState {
 
   GenericResponse* const gen_resp_;
   Task* const parent_task_;
+  // Watches can wait for changes for a long time, they do not count
+  // against the in-flight window.
+  const bool long_poll_;
+
+  HostPortPair host_port_;
+  // Whether this request takes up room in the in-flight window.
+  bool holds_slot_;
+  steady_clock::time_point queued_at_;
 
   UrlFetcher::Request req_;
   UrlFetcher::Response resp_;
@@ -680,7 +715,8 @@ EtcdClient::EtcdClient(Executor* executor, UrlFetcher* fetcher, const list<HostP
       log_version_task_(new SyncTask(executor_)),
       fetcher_(CHECK_NOTNULL(fetcher)),
       etcds_(etcds),
-      logged_version_(false) {
+      logged_version_(false),
+      num_inflight_(0) {
   CHECK(!etcds_.empty()) << "No etcd hosts provided.";
   VLOG(1) << "EtcdClient: " << this;
 
@@ -691,8 +727,14 @@ EtcdClient::EtcdClient(Executor* executor, UrlFetcher* fetcher, const list<HostP
 }
 
 
-EtcdClient::HostPortPair EtcdClient::ChooseNextServer() {
+EtcdClient::HostPortPair EtcdClient::ChooseNextServer(
+    const HostPortPair& failed) {
   lock_guard<mutex> lock(lock_);
+  if (etcds_.front() != failed) {
+    // All the requests which were in flight to the failed server get
+    // here, only the first one moves on.
+    return etcds_.front();
+  }
 
   etcds_.emplace_back(etcds_.front());
   etcds_.pop_front();
@@ -704,12 +746,23 @@ EtcdClient::HostPortPair EtcdClient::ChooseNextServer() {
 
 
 EtcdClient::EtcdClient()
-    : executor_(nullptr), log_version_task_(nullptr), fetcher_(nullptr) {
+    : executor_(nullptr),
+      log_version_task_(nullptr),
+      fetcher_(nullptr),
+      num_inflight_(0) {
 }
 
 
 EtcdClient::~EtcdClient() {
   VLOG(1) << "~EtcdClient: " << this;
+  std::deque<RequestState*> queued;
+  {
+    lock_guard<mutex> lock(lock_);
+    queued.swap(queued_requests_);
+  }
+  for (const auto& etcd_req : queued) {
+    etcd_req->parent_task_->Return(Status::CANCELLED);
+  }
   if (log_version_task_) {
     log_version_task_->task()->Return();
     log_version_task_->Wait();
@@ -725,14 +778,12 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
       // Seems etcd wasn't available; pick a new etcd server and retry
       LOG(WARNING) << "Etcd fetch failed: " << task->status() << ", retrying "
                    << "on next etcd server.";
-      etcd_req->SetHostPort(ChooseNextServer());
-      fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                      etcd_req->parent_task_->AddChild(
-                          bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+      etcd_req->SetHostPort(ChooseNextServer(etcd_req->host_port_));
+      SendRequest(etcd_req);
       return;
     }
     // Otherwise just let the requestor know.
-    etcd_req->parent_task_->Return(task->status());
+    RequestDone(etcd_req, task->status());
     return;
   }
 
@@ -743,28 +794,29 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
         etcd_req->resp_.headers.find("location"));
 
     if (it == etcd_req->resp_.headers.end()) {
-      etcd_req->parent_task_->Return(
-          Status(util::error::INTERNAL,
-                 "etcd returned a redirect without a Location header?"));
+      RequestDone(etcd_req,
+                  Status(util::error::INTERNAL,
+                         "etcd returned a redirect without a Location "
+                         "header?"));
       return;
     }
 
     const URL url(it->second);
     if (url.Host().empty() || url.Port() == 0) {
-      etcd_req->parent_task_->Return(
-          Status(util::error::INTERNAL,
-                 "could not parse Location header from etcd: " + it->second));
+      RequestDone(etcd_req,
+                  Status(util::error::INTERNAL,
+                         "could not parse Location header from etcd: " +
+                             it->second));
       return;
     }
 
+    // The new leader is used by every request sent from now on.
     etcd_req->SetHostPort(
         UpdateEndpoint(HostPortPair(url.Host(), url.Port())));
 
     MaybeLogEtcdVersion();
 
-    fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                    etcd_req->parent_task_->AddChild(
-                        bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+    SendRequest(etcd_req);
     return;
   }
 
@@ -783,9 +835,76 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
     etcd_req->gen_resp_->etcd_index = atoll(it->second.c_str());
   }
 
-  etcd_req->parent_task_->Return(
-      StatusFromResponse(etcd_req->resp_.status_code,
-                         *etcd_req->gen_resp_->json_body));
+  RequestDone(etcd_req, StatusFromResponse(etcd_req->resp_.status_code,
+                                           *etcd_req->gen_resp_->json_body));
+}
+
+
+void EtcdClient::StartRequest(RequestState* etcd_req) {
+  if (etcd_req->long_poll_ || FLAGS_etcd_max_inflight_requests <= 0) {
+    SendRequest(etcd_req);
+    return;
+  }
+
+  unique_lock<mutex> lock(lock_);
+  if (num_inflight_ >= FLAGS_etcd_max_inflight_requests) {
+    etcd_req->queued_at_ = steady_clock::now();
+    queued_requests_.push_back(etcd_req);
+    etcd_queued_requests->Set(queued_requests_.size());
+    return;
+  }
+  ++num_inflight_;
+  etcd_inflight_requests->Set(num_inflight_);
+  etcd_req->holds_slot_ = true;
+  lock.unlock();
+
+  SendRequest(etcd_req);
+}
+
+
+void EtcdClient::SendRequest(RequestState* etcd_req) {
+  fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
+                  etcd_req->parent_task_->AddChild(
+                      bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+}
+
+
+void EtcdClient::RequestDone(RequestState* etcd_req, const Status& status) {
+  RequestState* next(nullptr);
+  vector<RequestState*> cancelled;
+  if (etcd_req->holds_slot_) {
+    lock_guard<mutex> lock(lock_);
+    // Those cancelled while they were waiting are not sent at all.
+    while (!queued_requests_.empty() &&
+           queued_requests_.front()->parent_task_->CancelRequested()) {
+      cancelled.push_back(queued_requests_.front());
+      queued_requests_.pop_front();
+    }
+    if (queued_requests_.empty()) {
+      --num_inflight_;
+      etcd_inflight_requests->Set(num_inflight_);
+    } else {
+      // Hand our room in the window over to the next request.
+      next = queued_requests_.front();
+      queued_requests_.pop_front();
+      next->holds_slot_ = true;
+    }
+    etcd_queued_requests->Set(queued_requests_.size());
+  }
+
+  // This deletes |etcd_req|.
+  etcd_req->parent_task_->Return(status);
+  for (const auto& cancelled_req : cancelled) {
+    cancelled_req->parent_task_->Return(Status::CANCELLED);
+  }
+
+  if (next) {
+    etcd_request_queue_delay_ms.RecordLatency(steady_clock::now() -
+                                              next->queued_at_);
+    // The leader might have changed while it was waiting.
+    next->SetHostPort(GetEndpoint());
+    SendRequest(next);
+  }
 }
 
 
@@ -969,9 +1088,7 @@ void EtcdClient::Generic(const string& key, const string& key_space,
                                                 GetEndpoint(), resp, task));
   task->DeleteWhenDone(etcd_req);
 
-  fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                  etcd_req->parent_task_->AddChild(
-                      bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+  StartRequest(etcd_req);
 }
 
 list<EtcdClient::HostPortPair> SplitHosts(const string& hosts_string) {
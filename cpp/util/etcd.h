@@ -2,6 +2,7 @@
 #define CERT_TRANS_UTIL_ETCD_H_
 
 #include <chrono>
+#include <deque>
 #include <list>
 #include <map>
 #include <memory>
@@ -136,10 +137,21 @@ class EtcdClient {
   struct RequestState;
   struct WatchState;
 
-  HostPortPair ChooseNextServer();
+  // Moves on to the next server, unless another request already did
+  // since |failed| was tried. That way, when several requests in
+  // flight to the same server fail together, they all move on to the
+  // same next server, instead of each skipping one more.
+  HostPortPair ChooseNextServer(const HostPortPair& failed);
   HostPortPair GetEndpoint() const;
   HostPortPair UpdateEndpoint(HostPortPair&& new_endpoint);
+  // Sends |etcd_req| if there is room in the in-flight window,
+  // otherwise queues it until there is. Queued requests which get
+  // cancelled are returned CANCELLED when they reach the front of the
+  // queue, without being sent.
+  void StartRequest(RequestState* etcd_req);
+  void SendRequest(RequestState* etcd_req);
   void FetchDone(RequestState* etcd_req, util::Task* task);
+  void RequestDone(RequestState* etcd_req, const util::Status& status);
   void Generic(const std::string& key, const std::string& key_space,
                const std::map<std::string, std::string>& params,
                UrlFetcher::Verb verb, GenericResponse* resp, util::Task* task);
@@ -160,6 +172,8 @@ class EtcdClient {
   mutable std::mutex lock_;
   std::list<HostPortPair> etcds_;
   bool logged_version_;
+  int num_inflight_;
+  std::deque<RequestState*> queued_requests_;
 
   DISALLOW_COPY_AND_ASSIGN(EtcdClient);
 };
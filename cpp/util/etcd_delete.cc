@@ -1,11 +1,15 @@
 #include "util/etcd_delete.h"
 
+#include <chrono>
 #include <functional>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <mutex>
 
 using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
@@ -18,6 +22,10 @@ using util::TaskHold;
 
 DEFINE_int32(etcd_delete_concurrency, 4,
              "number of etcd keys to delete at a time");
+DEFINE_int32(etcd_delete_max_qps, 1000,
+             "maximum number of etcd keys to delete per second, so that "
+             "bulk deletions leave room for other requests; zero means no "
+             "limit");
 
 namespace cert_trans {
 namespace {
@@ -29,6 +37,8 @@ class DeleteState {
       : client_(CHECK_NOTNULL(client)),
         task_(CHECK_NOTNULL(task)),
         outstanding_(0),
+        delay_pending_(false),
+        next_request_time_(steady_clock::now()),
         keys_(move(keys)),
         it_(keys_.begin()) {
     CHECK_GT(FLAGS_etcd_delete_concurrency, 0);
@@ -47,12 +57,15 @@ class DeleteState {
 
  private:
   void RequestDone(Task* child_task);
+  void DelayDone(Task* child_task);
   void StartNextRequest(unique_lock<mutex>&& lock);
 
   EtcdClient* const client_;
   Task* const task_;
   mutex mutex_;
   int outstanding_;
+  bool delay_pending_;
+  steady_clock::time_point next_request_time_;
   const vector<string> keys_;
   vector<string>::const_iterator it_;
 };
@@ -84,6 +97,13 @@ void DeleteState::RequestDone(Task* child_task) {
 }
 
 
+void DeleteState::DelayDone(Task* child_task) {
+  unique_lock<mutex> lock(mutex_);
+  delay_pending_ = false;
+  StartNextRequest(move(lock));
+}
+
+
 void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
   CHECK(lock.owns_lock());
 
@@ -97,6 +117,24 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
   while (outstanding_ < FLAGS_etcd_delete_concurrency && it_ != keys_.end() &&
          task_->IsActive()) {
     CHECK(lock.owns_lock());
+    if (FLAGS_etcd_delete_max_qps > 0) {
+      const steady_clock::time_point now(steady_clock::now());
+      if (now < next_request_time_) {
+        if (!delay_pending_) {
+          delay_pending_ = true;
+          const steady_clock::duration delay(next_request_time_ - now);
+          lock.unlock();
+          task_->executor()->Delay(
+              delay,
+              task_->AddChild(bind(&DeleteState::DelayDone, this, _1)));
+        }
+        return;
+      }
+      next_request_time_ =
+          now + duration_cast<steady_clock::duration>(
+                    duration<double>(1.0 / FLAGS_etcd_delete_max_qps));
+    }
+
     const string& key(*it_);
     ++it_;
     ++outstanding_;
@@ -9,7 +9,9 @@
 #include "util/thread_pool.h"
 
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::move;
 using std::placeholders::_2;
 using std::placeholders::_3;
@@ -32,6 +34,7 @@ using util::Task;
 using util::testing::StatusIs;
 
 DECLARE_int32(etcd_delete_concurrency);
+DECLARE_int32(etcd_delete_max_qps);
 
 namespace cert_trans {
 namespace {
@@ -179,6 +182,26 @@ TEST_F(EtcdDeleteTest, WithinConcurrency) {
 }
 
 
+TEST_F(EtcdDeleteTest, RateLimited) {
+  FLAGS_etcd_delete_max_qps = 10;
+  vector<string> keys{"/one", "/two", "/three"};
+  SyncTask sync(&pool_);
+
+  EXPECT_CALL(client_, ForceDelete(_, _))
+      .Times(3)
+      .WillRepeatedly(
+          Invoke([](const string& key, Task* task) { task->Return(); }));
+  const steady_clock::time_point start(steady_clock::now());
+  EtcdForceDeleteKeys(&client_, move(keys), sync.task());
+
+  sync.Wait();
+  EXPECT_OK(sync.status());
+  // The second and third deletions each had to wait for 100ms.
+  EXPECT_LE(milliseconds(150), steady_clock::now() - start);
+  FLAGS_etcd_delete_max_qps = 1000;
+}
+
+
 TEST_F(EtcdDeleteTest, ErrorHandling) {
   vector<string> keys{"/one", "/two", "/three"};
   ASSERT_LT(static_cast<size_t>(FLAGS_etcd_delete_concurrency), keys.size());
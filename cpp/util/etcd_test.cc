@@ -1,3 +1,4 @@
+#include <gflags/gflags.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <list>
@@ -12,6 +13,7 @@
 #include "util/sync_task.h"
 #include "util/testing.h"
 
+DECLARE_int32(etcd_max_inflight_requests);
 DECLARE_int32(etcd_watch_error_retry_delay_seconds);
 
 namespace cert_trans {
@@ -1030,6 +1032,142 @@ TEST_F(EtcdTest, GetStoreStats) {
 }
 
 
+TEST_F(EtcdTest, QueuesRequestsBeyondInflightLimit) {
+  google::FlagSaver flag_saver;
+  FLAGS_etcd_max_inflight_requests = 1;
+  UrlFetcher::Response* first_resp(nullptr);
+  Task* first_fetch(nullptr);
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey) +
+                                          "?consistent=true&quorum=true"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .WillOnce(Invoke([&first_resp, &first_fetch](
+          const FetchRequest& req, UrlFetcher::Response* resp, Task* task) {
+        first_resp = resp;
+        first_fetch = task;
+      }))
+      .WillOnce(
+          Invoke(bind(HandleFetch, Status::OK, 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "11")},
+                      kGetJson, _1, _2, _3)));
+
+  SyncTask task1(base_.get());
+  EtcdClient::GetResponse resp1;
+  client_.Get(string(kEntryKey), &resp1, task1.task());
+  SyncTask task2(base_.get());
+  EtcdClient::GetResponse resp2;
+  client_.Get(string(kEntryKey), &resp2, task2.task());
+
+  // The second request is only sent once the first one is done.
+  ASSERT_NE(nullptr, first_fetch);
+  EXPECT_FALSE(task2.IsDone());
+  HandleFetch(Status::OK, 200,
+              UrlFetcher::Headers{make_pair("x-etcd-index", "11")}, kGetJson,
+              FetchRequest(), first_resp, first_fetch);
+
+  task1.Wait();
+  EXPECT_OK(task1);
+  task2.Wait();
+  EXPECT_OK(task2);
+  EXPECT_EQ("123", resp2.node.value_);
+}
+
+
+TEST_F(EtcdTest, DoesNotSendRequestsCancelledWhileQueued) {
+  google::FlagSaver flag_saver;
+  FLAGS_etcd_max_inflight_requests = 1;
+  UrlFetcher::Response* first_resp(nullptr);
+  Task* first_fetch(nullptr);
+  // Only the first request is ever sent.
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey) +
+                                          "?consistent=true&quorum=true"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .WillOnce(Invoke([&first_resp, &first_fetch](
+          const FetchRequest& req, UrlFetcher::Response* resp, Task* task) {
+        first_resp = resp;
+        first_fetch = task;
+      }));
+
+  SyncTask task1(base_.get());
+  EtcdClient::GetResponse resp1;
+  client_.Get(string(kEntryKey), &resp1, task1.task());
+  SyncTask task2(base_.get());
+  EtcdClient::GetResponse resp2;
+  client_.Get(string(kEntryKey), &resp2, task2.task());
+
+  ASSERT_NE(nullptr, first_fetch);
+  task2.Cancel();
+  EXPECT_FALSE(task2.IsDone());
+  HandleFetch(Status::OK, 200,
+              UrlFetcher::Headers{make_pair("x-etcd-index", "11")}, kGetJson,
+              FetchRequest(), first_resp, first_fetch);
+
+  task1.Wait();
+  EXPECT_OK(task1);
+  task2.Wait();
+  EXPECT_THAT(task2.status(), StatusIs(util::error::CANCELLED));
+}
+
+
+TEST_F(EtcdTest, ConcurrentFailuresMoveToTheSameServer) {
+  EtcdClient multi_client(base_.get(), &url_fetcher_,
+                          {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort),
+                           EtcdClient::HostPortPair(kEtcdHost2, kEtcdPort2),
+                           EtcdClient::HostPortPair(kEtcdHost3, kEtcdPort3)});
+  vector<UrlFetcher::Response*> failed_resps;
+  vector<Task*> failed_fetches;
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey) +
+                                          "?consistent=true&quorum=true"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .Times(2)
+      .WillRepeatedly(Invoke([&failed_resps, &failed_fetches](
+          const FetchRequest& req, UrlFetcher::Response* resp, Task* task) {
+        failed_resps.push_back(resp);
+        failed_fetches.push_back(task);
+      }));
+  // Both are retried on the second server, none on the third.
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey, kDefaultSpace,
+                                                     kEtcdHost2, kEtcdPort2) +
+                                          "?consistent=true&quorum=true"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .Times(2)
+      .WillRepeatedly(
+          Invoke(bind(HandleFetch, Status::OK, 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "11")},
+                      kGetJson, _1, _2, _3)));
+
+  SyncTask task1(base_.get());
+  EtcdClient::GetResponse resp1;
+  multi_client.Get(string(kEntryKey), &resp1, task1.task());
+  SyncTask task2(base_.get());
+  EtcdClient::GetResponse resp2;
+  multi_client.Get(string(kEntryKey), &resp2, task2.task());
+
+  ASSERT_EQ(static_cast<size_t>(2), failed_fetches.size());
+  for (size_t i = 0; i < failed_fetches.size(); ++i) {
+    HandleFetch(Status(util::error::UNAVAILABLE, ""), 0,
+                UrlFetcher::Headers{}, "", FetchRequest(), failed_resps[i],
+                failed_fetches[i]);
+  }
+
+  task1.Wait();
+  EXPECT_OK(task1);
+  task2.Wait();
+  EXPECT_OK(task2);
+}
+
+
 TEST_F(EtcdTest, SplitHosts) {
   const string hosts(string(kEtcdHost) + ":" + to_string(kEtcdPort) + "," +
                      kEtcdHost2 + ":" + to_string(kEtcdPort2));
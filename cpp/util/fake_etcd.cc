@@ -1,5 +1,6 @@
 #include "util/fake_etcd.h"
 
+#include <algorithm>
 #include <glog/logging.h>
 
 #include "util/json_wrapper.h"
@@ -67,18 +68,16 @@ string NormalizeKey(const string& input) {
 }
 
 
-bool WatchMatchesKey(const string& watch_key, const string& notify_key,
-                     bool recursive) {
-  if (watch_key == notify_key) {
-    return true;
+// Returns |key| and all its parent directories, starting with "/".
+vector<string> KeyAndParents(const string& key) {
+  vector<string> retval{key};
+  while (retval.back() != "/") {
+    const string::size_type slash(retval.back().find_last_of('/'));
+    CHECK_NE(slash, string::npos);
+    retval.emplace_back(slash == 0 ? "/" : retval.back().substr(0, slash));
   }
-
-  if (!recursive) {
-    return false;
-  }
-
-  const string dir(watch_key + "/");
-  return watch_key == "/" || notify_key.compare(0, dir.size(), dir) == 0;
+  std::reverse(retval.begin(), retval.end());
+  return retval;
 }
 
 
@@ -112,6 +111,9 @@ FakeEtcdClient::~FakeEtcdClient() {
 
 void FakeEtcdClient::DumpEntries(const unique_lock<mutex>& lock) const {
   CHECK(lock.owns_lock());
+  if (!VLOG_IS_ON(1)) {
+    return;
+  }
   for (const auto& pair : entries_) {
     VLOG(1) << pair.second.ToString();
   }
@@ -148,16 +150,19 @@ void FakeEtcdClient::Watch(const string& rawkey, const WatchCallback& cb,
 void FakeEtcdClient::PurgeExpiredEntriesWithLock(
     const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
-  for (auto it = entries_.begin(); it != entries_.end();) {
-    if (it->second.expires_ < system_clock::now()) {
+  const system_clock::time_point now(system_clock::now());
+  while (!expirations_.empty() && expirations_.begin()->first < now) {
+    const auto expiration(expirations_.begin());
+    const map<string, Node>::iterator it(entries_.find(expiration->second));
+    // The entry might have been deleted or replaced since.
+    if (it != entries_.end() && it->second.expires_ == expiration->first) {
       VLOG(1) << "Deleting expired entry " << it->first;
       it->second.deleted_ = true;
       NotifyForPath(lock, it->first);
-      it = entries_.erase(it);
+      entries_.erase(it);
       ++stats_["expireCount"];
-    } else {
-      ++it;
     }
+    expirations_.erase(expiration);
   }
 }
 
@@ -176,22 +181,25 @@ void FakeEtcdClient::NotifyForPath(const unique_lock<mutex>& lock,
   CHECK(node_it != entries_.end());
   const Node& node(node_it->second);
 
-  const multimap<string, tuple<bool, GetResponse*, Task*>>::iterator last(
-      waiting_gets_.upper_bound(path));
-  multimap<string, tuple<bool, GetResponse*, Task*>>::iterator it;
-  for (it = waiting_gets_.begin(); it != last;) {
-    if (WatchMatchesKey(it->first, node.key_, get<0>(it->second))) {
-      get<1>(it->second)->node = node;
-      get<2>(it->second)->Return();
-      it = waiting_gets_.erase(it);
-    } else {
-      ++it;
+  // Only waiting gets and watches on |path| itself or one of its
+  // parent directories need to be looked at.
+  for (const auto& key : KeyAndParents(path)) {
+    const bool exact(key == path);
+    const auto gets(waiting_gets_.equal_range(key));
+    for (auto it = gets.first; it != gets.second;) {
+      // Waiting gets on a parent directory must be recursive.
+      if (exact || get<0>(it->second)) {
+        get<1>(it->second)->node = node;
+        get<2>(it->second)->Return();
+        it = waiting_gets_.erase(it);
+      } else {
+        ++it;
+      }
     }
-  }
 
-  for (const auto& pair : watches_) {
-    if (path.find(pair.first) == 0) {
-      for (const auto& cb_cookie : pair.second) {
+    const auto watches(watches_.find(key));
+    if (watches != watches_.end()) {
+      for (const auto& cb_cookie : watches->second) {
         ScheduleWatchCallback(lock, cb_cookie.second,
                               bind(cb_cookie.first, vector<Node>{node}));
       }
@@ -253,8 +261,17 @@ void FakeEtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
         parent_nodes.push_back(&parent_nodes.back()->nodes_.back());
       }
     } else {
-      if (it->first.find_first_of('/', key_prefix.size()) == string::npos) {
+      const string::size_type slash(
+          it->first.find_first_of('/', key_prefix.size()));
+      if (slash == string::npos) {
         resp->node.nodes_.emplace_back(it->second);
+      } else {
+        // Skip over the rest of the contents of that sub-directory
+        // ('0' sorts right after '/'). Its siblings sharing its name as
+        // a prefix, like "a-b" for "a", sort before its contents, and
+        // have been seen already.
+        it = entries_.lower_bound(it->first.substr(0, slash) + "0");
+        continue;
       }
     }
 
@@ -334,6 +351,9 @@ void FakeEtcdClient::InternalPut(const string& rawkey, const string& value,
   }
 
   entries_[key] = node;
+  if (expires < system_clock::time_point::max()) {
+    expirations_.emplace(expires, key);
+  }
   resp->etcd_index = new_index;
   index_ = new_index;
   task->Return();
@@ -465,7 +485,10 @@ void FakeEtcdClient::ForceDelete(const string& key, Task* task) {
 void FakeEtcdClient::GetStoreStats(StatsResponse* resp, Task* task) {
   CHECK_NOTNULL(resp);
   CHECK_NOTNULL(task);
-  resp->stats = stats_;
+  {
+    lock_guard<mutex> lock(mutex_);
+    resp->stats = stats_;
+  }
   task->Return();
 }
 
@@ -94,6 +94,10 @@ class FakeEtcdClient : public EtcdClient {
   std::mutex mutex_;
   int64_t index_;
   std::map<std::string, Node> entries_;
+  // The keys of the entries with a TTL, by expiration time. Entries
+  // deleted or replaced since are not removed from here.
+  std::multimap<std::chrono::system_clock::time_point, std::string>
+      expirations_;
   std::multimap<std::string, std::tuple<bool, GetResponse*, util::Task*>>
       waiting_gets_;
   std::map<std::string, std::vector<std::pair<WatchCallback, util::Task*>>>
@@ -49,6 +49,7 @@ using testing::MockFunction;
 using testing::StrictMock;
 using testing::TestInfo;
 using testing::UnitTest;
+using testing::UnorderedElementsAre;
 using testing::_;
 using util::Status;
 using util::SyncTask;
@@ -682,6 +683,58 @@ TEST_F(FakeEtcdTest, WatcherWithTTLExpires) {
 }
 
 
+TEST_F(FakeEtcdTest, WatcherIgnoresKeysWithSamePrefix) {
+  const string kDir(key_prefix_ + "/a");
+  const string kSibling(key_prefix_ + "/ab");
+  const string kPath(kDir + "/1");
+
+  StrictMock<MockFunction<void(const vector<EtcdClient::Node>&)>> watcher;
+  Notification initial;
+  EXPECT_CALL(watcher, Call(ElementsAre()))
+      .WillOnce(InvokeWithoutArgs(&initial, &Notification::Notify));
+
+  util::SyncTask watch_task(base_.get());
+  client_->Watch(
+      kDir, bind(&MockFunction<void(const vector<EtcdClient::Node>&)>::Call,
+                 &watcher, _1),
+      watch_task.task());
+
+  ASSERT_TRUE(initial.WaitForNotificationWithTimeout(seconds(1)));
+  Mock::VerifyAndClearExpectations(&watcher);
+
+  // Notifications are delivered in order, so if the one for
+  // |kSibling| was sent, it would arrive first.
+  Notification second;
+  EXPECT_CALL(watcher,
+              Call(ElementsAre(EtcdClientNodeIs(kPath, "value", false))))
+      .WillOnce(InvokeWithoutArgs(&second, &Notification::Notify));
+
+  int64_t created_index;
+  EXPECT_OK(BlockingCreate(kSibling, kValue, &created_index));
+  EXPECT_OK(BlockingCreate(kPath, kValue, &created_index));
+
+  EXPECT_TRUE(second.WaitForNotificationWithTimeout(seconds(1)));
+
+  watch_task.Cancel();
+  watch_task.Wait();
+  EXPECT_THAT(watch_task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
+TEST_F(FakeEtcdTest, ForceSetRemovesTTL) {
+  const seconds kTtl(1);
+  int64_t index;
+  EXPECT_OK(BlockingCreateWithTTL(key_prefix_, kValue, kTtl, &index));
+  EXPECT_OK(BlockingForceSet(key_prefix_, kValue2, &index));
+
+  sleep_for(kTtl + seconds(1));
+
+  EtcdClient::Node node;
+  EXPECT_OK(BlockingGet(key_prefix_, &node));
+  EXPECT_EQ(kValue2, node.value_);
+}
+
+
 TEST_F(FakeEtcdTest, PutUnderNonDir) {
   const string kPath1(key_prefix_);
   const string kPath2(kPath1 + "/subkey");
@@ -721,6 +774,32 @@ TEST_F(FakeEtcdTest, GetDir) {
 }
 
 
+TEST_F(FakeEtcdTest, GetDirWithSiblingsSharingAPrefix) {
+  const string kDir(key_prefix_);
+  const string kSubDir(kDir + "/a");
+
+  int64_t created_index;
+  EXPECT_OK(BlockingCreate(kSubDir + "/x", kValue, &created_index));
+  EXPECT_OK(BlockingCreate(kSubDir + "/y", kValue, &created_index));
+  EXPECT_OK(BlockingCreate(kSubDir + "-b", kValue, &created_index));
+  EXPECT_OK(BlockingCreate(kSubDir + ".b", kValue, &created_index));
+  EXPECT_OK(BlockingCreate(kSubDir + "b", kValue, &created_index));
+
+  SyncTask task(base_.get());
+  EtcdClient::Request req(kDir);
+  EtcdClient::GetResponse resp;
+  client_->Get(req, &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  vector<string> keys;
+  for (const auto& node : resp.node.nodes_) {
+    keys.push_back(node.key_);
+  }
+  EXPECT_THAT(keys, UnorderedElementsAre(kSubDir, kSubDir + "-b",
+                                         kSubDir + ".b", kSubDir + "b"));
+}
+
+
 TEST_F(FakeEtcdTest, GetDirRecursive) {
   const string kDir(key_prefix_);
   const string kPath1(kDir + "/sub");
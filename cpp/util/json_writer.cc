@@ -0,0 +1,242 @@
+#include "util/json_writer.h"
+
+#include <cstring>
+#include <glog/logging.h>
+#include <inttypes.h>
+#include <netinet/in.h>  // for resolv.h
+#include <resolv.h>      // for b64_ntop
+#include <stdio.h>
+
+#include "proto/serializer.h"
+
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+// Characters which can be copied into a JSON string as they are.
+bool IsPlain(unsigned char c) {
+  return c >= 0x20 && c != '"' && c != '\\';
+}
+
+
+}  // namespace
+
+
+JsonWriter::JsonWriter() : buffer_(CHECK_NOTNULL(evbuffer_new())) {
+}
+
+
+JsonWriter::~JsonWriter() {
+  evbuffer_free(buffer_);
+}
+
+
+void JsonWriter::BeginObject() {
+  StartElement();
+  StartContainer(true);
+}
+
+
+void JsonWriter::BeginObject(const char* name) {
+  StartMember(name);
+  StartContainer(true);
+}
+
+
+void JsonWriter::EndObject() {
+  EndContainer(true);
+}
+
+
+void JsonWriter::BeginArray() {
+  StartElement();
+  StartContainer(false);
+}
+
+
+void JsonWriter::BeginArray(const char* name) {
+  StartMember(name);
+  StartContainer(false);
+}
+
+
+void JsonWriter::EndArray() {
+  EndContainer(false);
+}
+
+
+void JsonWriter::Add(const char* name, int64_t value) {
+  StartMember(name);
+  WriteInt(value);
+}
+
+
+void JsonWriter::Add(const char* name, const string& value) {
+  StartMember(name);
+  WriteString(value.data(), value.size());
+}
+
+
+void JsonWriter::Add(const char* name, const ct::DigitallySigned& ds) {
+  string signature;
+  CHECK_EQ(Serializer::SerializeDigitallySigned(ds, &signature),
+           Serializer::OK);
+  AddBase64(name, signature);
+}
+
+
+void JsonWriter::AddBase64(const char* name, const string& value) {
+  StartMember(name);
+  WriteBase64(value);
+}
+
+
+void JsonWriter::AddBoolean(const char* name, bool value) {
+  StartMember(name);
+  CHECK_EQ(evbuffer_add_printf(buffer_, "%s", value ? "true" : "false"),
+           value ? 4 : 5);
+}
+
+
+void JsonWriter::Add(int64_t value) {
+  StartElement();
+  WriteInt(value);
+}
+
+
+void JsonWriter::Add(const string& value) {
+  StartElement();
+  WriteString(value.data(), value.size());
+}
+
+
+void JsonWriter::AddBase64(const string& value) {
+  StartElement();
+  WriteBase64(value);
+}
+
+
+string JsonWriter::ToString() const {
+  string retval(evbuffer_get_length(buffer_), '\0');
+  CHECK_EQ(evbuffer_copyout(buffer_, &retval[0], retval.size()),
+           static_cast<ev_ssize_t>(retval.size()));
+  return retval;
+}
+
+
+void JsonWriter::StartMember(const char* name) {
+  CHECK_NOTNULL(name);
+  CHECK(!containers_.empty() && containers_.back().is_object)
+      << "named value outside of an object";
+  if (containers_.back().has_elements) {
+    CHECK_EQ(evbuffer_add(buffer_, ",", 1), 0);
+  }
+  containers_.back().has_elements = true;
+  WriteString(name, strlen(name));
+  CHECK_EQ(evbuffer_add(buffer_, ":", 1), 0);
+}
+
+
+void JsonWriter::StartElement() {
+  if (containers_.empty()) {
+    CHECK_EQ(evbuffer_get_length(buffer_), static_cast<size_t>(0))
+        << "more than one top-level value";
+    return;
+  }
+  CHECK(!containers_.back().is_object) << "unnamed value in an object";
+  if (containers_.back().has_elements) {
+    CHECK_EQ(evbuffer_add(buffer_, ",", 1), 0);
+  }
+  containers_.back().has_elements = true;
+}
+
+
+void JsonWriter::StartContainer(bool is_object) {
+  CHECK_EQ(evbuffer_add(buffer_, is_object ? "{" : "[", 1), 0);
+  containers_.emplace_back(is_object);
+}
+
+
+void JsonWriter::EndContainer(bool is_object) {
+  CHECK(!containers_.empty() && containers_.back().is_object == is_object)
+      << "mismatched end of " << (is_object ? "object" : "array");
+  containers_.pop_back();
+  CHECK_EQ(evbuffer_add(buffer_, is_object ? "}" : "]", 1), 0);
+}
+
+
+void JsonWriter::WriteString(const char* data, size_t length) {
+  CHECK_EQ(evbuffer_add(buffer_, "\"", 1), 0);
+
+  // Copy runs of plain characters in one go, and escape the rest.
+  size_t start(0);
+  for (size_t i = 0; i < length; ++i) {
+    const unsigned char c(data[i]);
+    if (IsPlain(c)) {
+      continue;
+    }
+    CHECK_EQ(evbuffer_add(buffer_, data + start, i - start), 0);
+    start = i + 1;
+
+    switch (c) {
+      case '"':
+        CHECK_EQ(evbuffer_add(buffer_, "\\\"", 2), 0);
+        break;
+      case '\\':
+        CHECK_EQ(evbuffer_add(buffer_, "\\\\", 2), 0);
+        break;
+      case '\b':
+        CHECK_EQ(evbuffer_add(buffer_, "\\b", 2), 0);
+        break;
+      case '\f':
+        CHECK_EQ(evbuffer_add(buffer_, "\\f", 2), 0);
+        break;
+      case '\n':
+        CHECK_EQ(evbuffer_add(buffer_, "\\n", 2), 0);
+        break;
+      case '\r':
+        CHECK_EQ(evbuffer_add(buffer_, "\\r", 2), 0);
+        break;
+      case '\t':
+        CHECK_EQ(evbuffer_add(buffer_, "\\t", 2), 0);
+        break;
+      default:
+        CHECK_EQ(evbuffer_add_printf(buffer_, "\\u%04x", c), 6);
+        break;
+    }
+  }
+  CHECK_EQ(evbuffer_add(buffer_, data + start, length - start), 0);
+
+  CHECK_EQ(evbuffer_add(buffer_, "\"", 1), 0);
+}
+
+
+void JsonWriter::WriteBase64(const string& value) {
+  CHECK_EQ(evbuffer_add(buffer_, "\"", 1), 0);
+
+  // base 64 is 4 output bytes for every 3 input bytes (rounded up),
+  // and b64_ntop() wants room for a terminating NUL too. Encode
+  // straight into the buffer's own memory.
+  const size_t length(((value.size() + 2) / 3) * 4);
+  evbuffer_iovec space;
+  CHECK_EQ(evbuffer_reserve_space(buffer_, length + 1, &space, 1), 1);
+  CHECK_GE(space.iov_len, length + 1);
+  const int written(
+      b64_ntop(reinterpret_cast<const u_char*>(value.data()), value.size(),
+               static_cast<char*>(space.iov_base), length + 1));
+  CHECK_EQ(written, static_cast<int>(length));
+  space.iov_len = length;
+  CHECK_EQ(evbuffer_commit_space(buffer_, &space, 1), 0);
+
+  CHECK_EQ(evbuffer_add(buffer_, "\"", 1), 0);
+}
+
+
+void JsonWriter::WriteInt(int64_t value) {
+  CHECK_GT(evbuffer_add_printf(buffer_, "%" PRId64, value), 0);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,98 @@
+#ifndef CERT_TRANS_UTIL_JSON_WRITER_H_
+#define CERT_TRANS_UTIL_JSON_WRITER_H_
+
+#include <event2/buffer.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// Writes JSON straight into an evbuffer, as it goes, instead of
+// building a json-c object and serializing it afterwards. Binary
+// values are base64 encoded directly into the buffer.
+//
+// Members are added to objects with the methods taking a name, and
+// elements to arrays (or the single top-level value) with the ones
+// that don't. Using them the wrong way around, or closing the wrong
+// kind of container, is a programming error.
+//
+// This class is not thread-safe.
+class JsonWriter {
+ public:
+  JsonWriter();
+  ~JsonWriter();
+
+  void BeginObject();
+  void BeginObject(const char* name);
+  void EndObject();
+
+  void BeginArray();
+  void BeginArray(const char* name);
+  void EndArray();
+
+  void Add(const char* name, int64_t value);
+  void Add(const char* name, const std::string& value);
+  void Add(const char* name, const ct::DigitallySigned& ds);
+  void AddBase64(const char* name, const std::string& value);
+  void AddBoolean(const char* name, bool value);
+
+  void Add(int64_t value);
+  void Add(const std::string& value);
+  void AddBase64(const std::string& value);
+
+  // Whether all the objects and arrays have been closed.
+  bool Complete() const {
+    return containers_.empty() && evbuffer_get_length(buffer_) > 0;
+  }
+
+  // The JSON written so far. It can be moved out of the buffer with
+  // evbuffer_add_buffer(), which does not copy it.
+  evbuffer* buffer() {
+    return buffer_;
+  }
+
+  size_t Length() const {
+    return evbuffer_get_length(buffer_);
+  }
+
+  // Returns a copy of the JSON written so far.
+  std::string ToString() const;
+
+ private:
+  struct Container {
+    explicit Container(bool is_object)
+        : is_object(is_object), has_elements(false) {
+    }
+
+    const bool is_object;
+    bool has_elements;
+  };
+
+  // Writes what has to come before an object member, including its
+  // name.
+  void StartMember(const char* name);
+  // Writes what has to come before an array element (or the
+  // top-level value).
+  void StartElement();
+  void StartContainer(bool is_object);
+  void EndContainer(bool is_object);
+
+  void WriteString(const char* data, size_t length);
+  void WriteBase64(const std::string& value);
+  void WriteInt(int64_t value);
+
+  evbuffer* const buffer_;
+  std::vector<Container> containers_;
+
+  DISALLOW_COPY_AND_ASSIGN(JsonWriter);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_JSON_WRITER_H_
@@ -0,0 +1,146 @@
+#include "util/json_writer.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/json_wrapper.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+TEST(JsonWriterTest, Object) {
+  JsonWriter json;
+  json.BeginObject();
+  json.Add("int", 42);
+  json.Add("negative", -0x123456789aLL);
+  json.Add("string", "foo");
+  json.AddBoolean("bool", true);
+  json.BeginArray("array");
+  json.Add(1);
+  json.Add("two");
+  json.BeginObject();
+  json.EndObject();
+  json.EndArray();
+  json.BeginObject("object");
+  json.AddBoolean("nested", false);
+  json.EndObject();
+  EXPECT_FALSE(json.Complete());
+  json.EndObject();
+  EXPECT_TRUE(json.Complete());
+
+  const string expected(
+      "{\"int\":42,\"negative\":-78187493530,\"string\":\"foo\","
+      "\"bool\":true,\"array\":[1,\"two\",{}],"
+      "\"object\":{\"nested\":false}}");
+  EXPECT_EQ(expected, json.ToString());
+  EXPECT_EQ(expected.size(), json.Length());
+}
+
+
+TEST(JsonWriterTest, EmptyContainers) {
+  JsonWriter json;
+  json.BeginArray();
+  json.BeginArray();
+  json.EndArray();
+  json.EndArray();
+  EXPECT_EQ("[[]]", json.ToString());
+}
+
+
+TEST(JsonWriterTest, Escaping) {
+  const string value(string("quote\" backslash\\ tab\t nul") + '\0' +
+                     " high\xc3\xa9");
+  JsonWriter json;
+  json.BeginObject();
+  json.Add("a\nb", value);
+  json.EndObject();
+  EXPECT_EQ(
+      "{\"a\\nb\":\"quote\\\" backslash\\\\ tab\\t nul\\u0000 "
+      "high\xc3\xa9\"}",
+      json.ToString());
+
+  // And json-c reads it back the same.
+  JsonObject parsed(json.ToString());
+  ASSERT_TRUE(parsed.Ok());
+  JsonString parsed_value(parsed, "a\nb");
+  ASSERT_TRUE(parsed_value.Ok());
+  EXPECT_EQ(value, string(parsed_value.Value(), value.size()));
+}
+
+
+TEST(JsonWriterTest, Base64) {
+  JsonWriter json;
+  json.BeginObject();
+  json.BeginArray("values");
+  for (const string value : {"", "f", "fo", "foo", "foob", "fooba"}) {
+    json.AddBase64(value);
+  }
+  const string large(100000, '\xff');
+  json.AddBase64(large);
+  json.EndArray();
+  json.EndObject();
+
+  JsonObject parsed_object(json.ToString());
+  ASSERT_TRUE(parsed_object.Ok());
+  JsonArray parsed(parsed_object, "values");
+  ASSERT_TRUE(parsed.Ok());
+  ASSERT_EQ(7, parsed.Length());
+  EXPECT_EQ("", JsonString(parsed, 0).FromBase64());
+  EXPECT_STREQ("Zg==", JsonString(parsed, 1).Value());
+  EXPECT_STREQ("Zm8=", JsonString(parsed, 2).Value());
+  EXPECT_STREQ("Zm9v", JsonString(parsed, 3).Value());
+  EXPECT_STREQ("Zm9vYg==", JsonString(parsed, 4).Value());
+  EXPECT_STREQ("Zm9vYmE=", JsonString(parsed, 5).Value());
+  EXPECT_EQ(large, JsonString(parsed, 6).FromBase64());
+}
+
+
+TEST(JsonWriterTest, MovesOutWithoutCopying) {
+  JsonWriter json;
+  json.BeginObject();
+  json.AddBase64("data", string(10000, 'x'));
+  json.EndObject();
+  const string expected(json.ToString());
+
+  evbuffer* const out(CHECK_NOTNULL(evbuffer_new()));
+  CHECK_EQ(evbuffer_add_buffer(out, json.buffer()), 0);
+  EXPECT_EQ(0U, json.Length());
+  EXPECT_EQ(expected.size(), evbuffer_get_length(out));
+  evbuffer_free(out);
+}
+
+
+TEST(JsonWriterDeathTest, Misuse) {
+  {
+    JsonWriter json;
+    json.BeginObject();
+    EXPECT_DEATH(json.Add(1), "unnamed value in an object");
+    EXPECT_DEATH(json.EndArray(), "mismatched end of array");
+  }
+  {
+    JsonWriter json;
+    json.BeginArray();
+    EXPECT_DEATH(json.Add("name", 1), "named value outside of an object");
+  }
+  {
+    JsonWriter json;
+    json.Add(1);
+    EXPECT_DEATH(json.Add(2), "more than one top-level value");
+  }
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
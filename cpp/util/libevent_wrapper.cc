@@ -273,6 +273,12 @@ evhttp* Base::HttpNew() const {
 }
 
 
+bufferevent* Base::BufferEventSocketNew() const {
+  return CHECK_NOTNULL(
+      bufferevent_socket_new(base_.get(), -1, BEV_OPT_CLOSE_ON_FREE));
+}
+
+
 evdns_base* Base::GetDns() {
   lock_guard<mutex> lock(dns_lock_);
 
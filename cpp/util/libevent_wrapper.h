@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <chrono>
+#include <event2/bufferevent.h>
 #include <event2/dns.h>
 #include <event2/event.h>
 // TODO(alcutter): Use evhtp for the HttpServer too.
@@ -51,6 +52,9 @@ class Base : public util::Executor {
 
   event* EventNew(evutil_socket_t& sock, short events, Event* event) const;
   evhttp* HttpNew() const;
+  // Returns a socket-based bufferevent, which still needs to be
+  // connected (and which closes its socket when freed).
+  bufferevent* BufferEventSocketNew() const;
   evdns_base* GetDns();
   evhtp_connection_t* HttpConnectionNew(const std::string& host,
                                         unsigned short port);
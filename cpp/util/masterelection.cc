@@ -13,6 +13,7 @@ namespace cert_trans {
 using cert_trans::Gauge;
 using std::bind;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::mutex;
 using std::placeholders::_1;
 using std::placeholders::_2;
@@ -23,9 +24,11 @@ using std::unique_ptr;
 using std::vector;
 using util::Task;
 
-DEFINE_int32(master_keepalive_interval_seconds, 60,
-             "Interval between refreshing mastership proposal.");
-DEFINE_int32(masterelection_retry_delay_seconds, 5,
+DEFINE_int32(master_keepalive_interval_seconds, 5,
+             "Interval between refreshing mastership proposal. Proposals "
+             "expire after twice this, which bounds how long it takes to "
+             "replace a master which went away without resigning.");
+DEFINE_int32(masterelection_retry_delay_seconds, 1,
              "Seconds to delay before retrying a failed attempt to create a "
              "proposal file.");
 
@@ -106,6 +109,7 @@ MasterElection::MasterElection(const shared_ptr<libevent::Base>& base,
       proposal_state_(ProposalState::NONE),
       running_(false),
       backed_proposal_(kNoBacking),
+      lease_expiry_(0),
       is_master_(false) {
   CHECK_NE(kNoBacking, node_id);
   is_master_gauge->Set(0);
@@ -115,7 +119,10 @@ MasterElection::MasterElection(const shared_ptr<libevent::Base>& base,
 
 // Testing only c'tor
 MasterElection::MasterElection()
-    : client_(nullptr), proposal_state_(ProposalState::NONE) {
+    : client_(nullptr),
+      proposal_state_(ProposalState::NONE),
+      lease_expiry_(0),
+      is_master_(false) {
 }
 
 
@@ -203,14 +210,25 @@ bool MasterElection::WaitToBecomeMaster() const {
 
 
 bool MasterElection::IsMaster() const {
-  unique_lock<mutex> lock(mutex_);
-  return IsMaster(lock);
+  return is_master_ &&
+         steady_clock::now().time_since_epoch().count() < lease_expiry_;
 }
 
 
 bool MasterElection::IsMaster(const unique_lock<mutex>& lock) const {
   CHECK(lock.owns_lock());
-  return is_master_;
+  return IsMaster();
+}
+
+
+void MasterElection::RenewLease(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  lease_expiry_ = (proposal_request_time_ +
+                   seconds(FLAGS_master_keepalive_interval_seconds * 2))
+                      .time_since_epoch()
+                      .count();
+  // In case the lease had run out while we were master.
+  is_master_cv_.notify_all();
 }
 
 
@@ -240,7 +258,9 @@ void MasterElection::Transition(const unique_lock<mutex>& lock,
       CHECK_EQ(to, ProposalState::UPDATING);
       break;
     case ProposalState::UPDATING:
-      CHECK_EQ(to, ProposalState::UP_TO_DATE);
+      CHECK(to == ProposalState::UP_TO_DATE ||
+            to == ProposalState::AWAITING_CREATION)
+          << "proposal_state_: " << proposal_state_ << " to: " << to;
       break;
     case ProposalState::AWAITING_DELETE:
       CHECK_EQ(to, ProposalState::DELETING);
@@ -265,6 +285,7 @@ void MasterElection::CreateProposal() {
   // Technically this could already exist if we had mastership before, crashed,
   // and then restarted before the TTL expired.
   EtcdClient::Response* const resp(new EtcdClient::Response);
+  proposal_request_time_ = steady_clock::now();
   client_->CreateWithTTL(
       my_proposal_path_, kNoBacking,
       seconds(FLAGS_master_keepalive_interval_seconds * 2), resp,
@@ -291,27 +312,39 @@ void MasterElection::ProposalCreateDone(EtcdClient::Response* resp,
   }
 
   Transition(lock, ProposalState::UP_TO_DATE);
+  // If this is a replacement for a proposal we lost, the watch may
+  // not have told us about the old one going away yet, so we must
+  // not carry its mastership over to this one.
+  is_master_ = false;
+  is_master_gauge->Set(0);
+  RenewLease(lock);
 
   VLOG(1) << my_proposal_path_ << ": Mastership proposal created at index "
           << resp->etcd_index;
 
   my_proposal_modified_index_ = my_proposal_create_index_ = resp->etcd_index;
+  backed_proposal_ = kNoBacking;
+
   // Start a periodic callback to keep our proposal from being garbage
-  // collected
-  CHECK(!proposal_refresh_callback_);
-  VLOG(1) << my_proposal_path_ << ": Creating refresh Callback";
-  proposal_refresh_callback_.reset(new PeriodicClosure(
-      base_, seconds(FLAGS_master_keepalive_interval_seconds),
-      bind(&MasterElection::ProposalKeepAliveCallback, this)));
+  // collected, unless we're replacing a lost proposal and already
+  // have one.
+  if (!proposal_refresh_callback_) {
+    VLOG(1) << my_proposal_path_ << ": Creating refresh Callback";
+    proposal_refresh_callback_.reset(new PeriodicClosure(
+        base_, seconds(FLAGS_master_keepalive_interval_seconds),
+        bind(&MasterElection::ProposalKeepAliveCallback, this)));
+  }
 
   // Watch the proposal directory so we're aware of other proposals
-  // coming and going
-  VLOG(1) << my_proposal_path_ << ": Watching proposals";
-  CHECK(!proposal_watch_);
-  proposal_watch_.reset(new util::SyncTask(base_.get()));
-  client_->Watch(proposal_dir_,
-                 bind(&MasterElection::OnProposalUpdate, this, _1),
-                 proposal_watch_->task());
+  // coming and going (StopElection() may already have cancelled the
+  // watch if we were replacing a lost proposal).
+  if (running_ && !proposal_watch_) {
+    VLOG(1) << my_proposal_path_ << ": Watching proposals";
+    proposal_watch_.reset(new util::SyncTask(base_.get()));
+    client_->Watch(proposal_dir_,
+                   bind(&MasterElection::OnProposalUpdate, this, _1),
+                   proposal_watch_->task());
+  }
   VLOG(1) << my_proposal_path_ << ": Joined election";
 }
 
@@ -319,16 +352,15 @@ void MasterElection::ProposalCreateDone(EtcdClient::Response* resp,
 bool MasterElection::MaybeUpdateProposal(const unique_lock<mutex>& lock,
                                          const string& backed) {
   CHECK(lock.owns_lock());
-  if (proposal_state_ == ProposalState::UPDATING ||
-      proposal_state_ == ProposalState::AWAITING_UPDATE) {
+  if (proposal_state_ != ProposalState::UP_TO_DATE) {
     // Don't want to have more than one proposal update happening at
     // the same time so we'll just bail this one.  It's ok, though,
-    // because the currently in-flight update will cause a call to
-    // ProposalUpdate() via the watch which should prompt another
-    // update attempt if it turns out to still be necessary.
+    // because the currently in-flight update (or the re-creation of a
+    // lost proposal) will cause a call to ProposalUpdate() via the
+    // watch which should prompt another update attempt if it turns
+    // out to still be necessary.
     VLOG(1) << my_proposal_path_ << ": Dropping proposal update backing "
-            << backed << " because already have a proposal update in "
-            << "flight.";
+            << backed << " because proposal is " << proposal_state_;
     return false;
   }
   Transition(lock, ProposalState::AWAITING_UPDATE);
@@ -345,6 +377,7 @@ void MasterElection::UpdateProposal(const string& backed) {
 
   // TODO(alcutter): Set the HTTP timeout inside here to something sensible.
   EtcdClient::Response* const resp(new EtcdClient::Response);
+  proposal_request_time_ = steady_clock::now();
   client_->UpdateWithTTL(my_proposal_path_, backed,
                          seconds(FLAGS_master_keepalive_interval_seconds * 2),
                          my_proposal_modified_index_, resp,
@@ -357,10 +390,29 @@ void MasterElection::UpdateProposal(const string& backed) {
 void MasterElection::ProposalUpdateDone(EtcdClient::Response* resp,
                                         Task* task) {
   unique_ptr<EtcdClient::Response> resp_deleter(resp);
+  unique_ptr<Task> task_deleter(task);
   unique_lock<mutex> lock(mutex_);
-  // TODO(alcutter): Handle this
-  CHECK(task->status().ok()) << my_proposal_path_ << ": " << task->status();
+
+  if (!task->status().ok()) {
+    // We can't tell whether our proposal is still there (it might
+    // have expired, or been changed behind our back), so stop being
+    // master right away and join the election again with a new
+    // proposal. Creating it will keep failing until the old one has
+    // expired, if it still exists.
+    LOG(WARNING) << my_proposal_path_ << ": Problem refreshing proposal: "
+                 << task->status() << " will rejoin the election.";
+    is_master_ = false;
+    is_master_gauge->Set(0);
+    lease_expiry_ = 0;
+    Transition(lock, ProposalState::AWAITING_CREATION);
+    base_->Delay(seconds(FLAGS_masterelection_retry_delay_seconds),
+                 new Task(bind(&MasterElection::CreateProposal, this),
+                          base_.get()));
+    return;
+  }
+
   Transition(lock, ProposalState::UP_TO_DATE);
+  RenewLease(lock);
 
   // Keep a note of the current modification index of our proposal since
   // we'll need it in order to update or delete the proposal
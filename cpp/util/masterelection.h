@@ -1,6 +1,8 @@
 #ifndef CERT_TRANS_UTIL_MASTERELECTION_H_
 #define CERT_TRANS_UTIL_MASTERELECTION_H_
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
@@ -37,6 +39,17 @@ class PeriodicClosure;
 // maintains a periodic callback whose sole job is to update the TTL on its
 // proposal file.
 //
+// Since the proposal of the master is the oldest one, nobody else can
+// become master while it exists. The master therefore knows it is
+// still master until the TTL of the latest successful refresh of its
+// proposal runs out (counting from when the refresh was sent), even if
+// it hasn't heard from etcd since, and stops considering itself master
+// after that, before anybody else can take over.
+//
+// If refreshing the proposal fails, we can no longer tell whether it
+// still exists, so we stop being master and join the election again
+// with a new proposal.
+//
 // TODO(alcutter): Some enhancements:
 //   - Recover gracefully from a crash where an old proposal exists for this
 //     node (e.g. recover and continue, or delete it, or wait, ...)
@@ -62,7 +75,8 @@ class MasterElection {
   virtual bool WaitToBecomeMaster() const;
 
   // Returns true iff this instance is currently master at the time of the
-  // call.
+  // call. This does not take any lock, so it can be called before
+  // every change made by the master.
   virtual bool IsMaster() const;
 
  protected:
@@ -132,6 +146,10 @@ class MasterElection {
   // Internal non-locking accessor for is_master_
   bool IsMaster(const std::unique_lock<std::mutex>& lock) const;
 
+  // Extends the lease to the TTL of the proposal create or update
+  // request sent at |proposal_request_time_|.
+  void RenewLease(const std::unique_lock<std::mutex>& lock);
+
   const std::shared_ptr<libevent::Base> base_;
   EtcdClient* const client_;  // Not owned by us.
   const std::string proposal_dir_;
@@ -156,7 +174,13 @@ class MasterElection {
 
   std::string backed_proposal_;
 
-  bool is_master_;
+  // When the latest proposal create or update request was sent.
+  std::chrono::steady_clock::time_point proposal_request_time_;
+  // Until when our proposal is known to exist, in
+  // std::chrono::steady_clock ticks.
+  std::atomic<int64_t> lease_expiry_;
+
+  std::atomic<bool> is_master_;
   EtcdClient::Node current_master_;
 
   friend class ElectionTest;
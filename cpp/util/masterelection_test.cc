@@ -26,7 +26,9 @@ namespace cert_trans {
 using cert_trans::Notification;
 using std::atomic;
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::function;
 using std::make_shared;
 using std::map;
@@ -168,6 +170,19 @@ class ElectionTest : public ::testing::Test {
     p->election_->proposal_refresh_callback_.reset();
   }
 
+  // Returns true once |p| is no longer master, or false if it still is
+  // after |timeout|.
+  bool WaitForNotMaster(Participant* p, const seconds& timeout) {
+    const steady_clock::time_point deadline(steady_clock::now() + timeout);
+    while (p->IsMaster()) {
+      if (steady_clock::now() >= deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(milliseconds(10));
+    }
+    return true;
+  }
+
 
   shared_ptr<libevent::Base> base_;
   libevent::EventPumpThread event_pump_;
@@ -193,6 +208,47 @@ TEST_F(ElectionTest, SingleInstanceBecomesMaster) {
 }
 
 
+TEST_F(ElectionTest, MasterWithoutRefreshStopsBeingMaster) {
+  google::FlagSaver flag_saver;
+  FLAGS_master_keepalive_interval_seconds = 1;
+  Participant one(kProposalDir, "1", base_, client_.get());
+  one.ElectLikeABoss();
+  EXPECT_TRUE(one.IsMaster());
+
+  // The proposal (and so the lease) lasts for twice the keepalive
+  // interval.
+  KillProposalRefresh(&one);
+  EXPECT_TRUE(WaitForNotMaster(&one, seconds(10)));
+
+  one.StopElection();
+}
+
+
+TEST_F(ElectionTest, MasterRejoinsAfterFailedRefresh) {
+  google::FlagSaver flag_saver;
+  FLAGS_master_keepalive_interval_seconds = 1;
+  FLAGS_masterelection_retry_delay_seconds = 1;
+  Participant one(kProposalDir, "1", base_, client_.get());
+  one.ElectLikeABoss();
+  EXPECT_TRUE(one.IsMaster());
+
+  // Make the next refresh of the proposal fail.
+  {
+    SyncTask task(base_.get());
+    client_->ForceDelete(string(kProposalDir) + "1", task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+
+  EXPECT_TRUE(WaitForNotMaster(&one, seconds(10)));
+
+  // It should then create a new proposal and become master again.
+  EXPECT_TRUE(one.WaitToBecomeMaster());
+
+  one.StopElection();
+}
+
+
 TEST_F(ElectionTest, MultiInstanceElection) {
   Participant one(kProposalDir, "1", base_, client_.get());
   one.ElectLikeABoss();